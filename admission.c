@@ -0,0 +1,240 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * admission.c
+ *
+ * Admission control of the proxy sessions
+ *
+ * The waiting connections are kept without a thread, in arrival order. They
+ *    are started from the main loop: by a timer, which also expires them and
+ *    adapts the cap, and by an idle callback added when a session ends. A
+ *    rejected connection has its request read before the answer, so closing
+ *    it does not reset the connection before the client reads the answer.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "options.h"
+#include "admission.h"
+
+// Connection waiting for a slot
+typedef struct waiting_conn {
+	int sock;					// Client socket
+	struct sockaddr_in6 addr;	// Client address
+	gboolean cli_ipv6;			// Received on the IPv6 clients' socket
+	gint64 since;				// Arrival time
+} waiting_conn;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GQueue waiting = G_QUEUE_INIT;	// Connections waiting, oldest first
+static int running = 0;					// Sessions running
+static int cap = 0;						// Current cap (0 - no limit)
+static guint timer_id = 0;				// Admission timer
+static gboolean idle_pending = FALSE;	// Idle callback starting the waiting connections added
+static unsigned long new_samples = 0;	// Latency samples since the last cap change
+static admission_stats stats;
+
+
+// Answer a connection with file length 0 and close it
+static void reject_connection(int sock) {
+	unsigned long long flen = 0;
+	char buf[512];
+
+	while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;	// Request discarded
+	if (send(sock, &flen, sizeof(flen), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(flen))
+		perror("Failed rejecting a connection");
+	shutdown(sock, SHUT_WR);
+	close(sock);
+}
+
+
+// Start the waiting connections that fit in the cap, and reject the ones waiting too long;
+// called in the main loop
+static void admit_waiting(void) {
+	gint64 now = g_get_monotonic_time();
+	GQueue start = G_QUEUE_INIT, reject = G_QUEUE_INIT;
+	waiting_conn *w;
+
+	pthread_mutex_lock(&admission_mutex);
+	while ((w = (waiting_conn *) g_queue_peek_head(&waiting)) != NULL) {
+		if ((cap == 0) || (running < cap)) {
+			running++;
+			stats.admitted++;
+			g_queue_push_tail(&start, g_queue_pop_head(&waiting));
+		} else if (now - w->since > 1000LL * options.admit_wait) {
+			stats.expired++;
+			g_queue_push_tail(&reject, g_queue_pop_head(&waiting));
+		} else
+			break;	// The next ones arrived later
+	}
+	pthread_mutex_unlock(&admission_mutex);
+
+	while ((w = (waiting_conn *) g_queue_pop_head(&reject)) != NULL) {
+		reject_connection(w->sock);
+		free(w);
+	}
+	while ((w = (waiting_conn *) g_queue_pop_head(&start)) != NULL) {
+		start_proxy_session(w->sock, &w->addr, w->cli_ipv6);
+		free(w);
+	}
+}
+
+
+// Idle callback started when a session ends with connections waiting
+static gboolean callback_admit(gpointer data) {
+	pthread_mutex_lock(&admission_mutex);
+	idle_pending = FALSE;
+	pthread_mutex_unlock(&admission_mutex);
+	if (active)
+		admit_waiting();
+	return FALSE;	// Runs once
+}
+
+
+// Admission timer: adapts the cap to the latency target, and starts or expires the waiting connections
+static gboolean callback_admission_timer(gpointer data) {
+	if (!active) {
+		timer_id = 0;
+		return FALSE;
+	}
+	pthread_mutex_lock(&admission_mutex);
+	if ((options.admit_target > 0) && (new_samples > 0)) {
+		if (stats.ttfb_ms > options.admit_target) {
+			// Multiplicative decrease
+			cap = MIN((int) options.max_sessions, MAX(ADMISSION_MIN_SESSIONS, (int) (cap * ADMISSION_DECREASE)));
+			new_samples = 0;
+		} else if (!g_queue_is_empty(&waiting) && (running >= cap)) {
+			// Additive increase, while there are connections waiting
+			cap = MIN(cap + 1, (int) options.max_sessions);
+			new_samples = 0;
+		}
+	}
+	pthread_mutex_unlock(&admission_mutex);
+	admit_waiting();
+	return TRUE;
+}
+
+
+// Start the admission control with the options; no limit if options.max_sessions is 0
+void admission_init(void) {
+	pthread_mutex_lock(&admission_mutex);
+	cap = (options.max_sessions > 0) ? (int) options.max_sessions : 0;
+	stats.ttfb_ms = 0;
+	new_samples = 0;
+	pthread_mutex_unlock(&admission_mutex);
+	if ((cap > 0) && (timer_id == 0))
+		timer_id = g_timeout_add(ADMISSION_PERIOD, callback_admission_timer, NULL);
+}
+
+
+// Stop the admission control, rejecting the connections waiting
+void admission_close(void) {
+	waiting_conn *w;
+
+	if (timer_id > 0) {
+		g_source_remove(timer_id);
+		timer_id = 0;
+	}
+	pthread_mutex_lock(&admission_mutex);
+	while ((w = (waiting_conn *) g_queue_pop_head(&waiting)) != NULL) {
+		reject_connection(w->sock);
+		free(w);
+	}
+	cap = 0;
+	pthread_mutex_unlock(&admission_mutex);
+}
+
+
+// Decide what to do with a new connection: start it now (a slot was taken), keep it waiting
+// (it is started later with start_proxy_session) or reject it (already answered and closed)
+AdmitResult admission_request(int sock, struct sockaddr_in6 *cli_addr, gboolean cli_ipv6) {
+	AdmitResult result = ADMIT_NOW;
+	waiting_conn *w;
+
+	pthread_mutex_lock(&admission_mutex);
+	if ((cap == 0) || ((running < cap) && g_queue_is_empty(&waiting))) {
+		running++;
+		stats.admitted++;
+	} else if ((g_queue_get_length(&waiting) < (guint) options.admit_queue) &&
+			((w = (waiting_conn *) malloc(sizeof(waiting_conn))) != NULL)) {
+		w->sock = sock;
+		memcpy(&w->addr, cli_addr, sizeof(struct sockaddr_in6));
+		w->cli_ipv6 = cli_ipv6;
+		w->since = g_get_monotonic_time();
+		g_queue_push_tail(&waiting, w);
+		stats.queued++;
+		result = ADMIT_WAIT;
+	} else {
+		stats.rejected++;
+		result = ADMIT_REJECT;
+	}
+	pthread_mutex_unlock(&admission_mutex);
+	if (result == ADMIT_REJECT)
+		reject_connection(sock);
+	return result;
+}
+
+
+// Release the slot of a session that ended
+void admission_release(void) {
+	pthread_mutex_lock(&admission_mutex);
+	running--;
+	if (!g_queue_is_empty(&waiting) && !idle_pending) {
+		idle_pending = TRUE;
+		g_idle_add(callback_admit, NULL);	// Started in the main loop
+	}
+	pthread_mutex_unlock(&admission_mutex);
+}
+
+
+// Account the time from the admission to the first byte sent to the client (us)
+void admission_sample(gint64 usec) {
+	pthread_mutex_lock(&admission_mutex);
+	if (stats.ttfb_ms == 0)
+		stats.ttfb_ms = usec / 1000.0;
+	else
+		stats.ttfb_ms += ADMISSION_EWMA * (usec / 1000.0 - stats.ttfb_ms);
+	new_samples++;
+	pthread_mutex_unlock(&admission_mutex);
+}
+
+
+// Current statistics
+void admission_get_stats(admission_stats *st) {
+	pthread_mutex_lock(&admission_mutex);
+	memcpy(st, &stats, sizeof(admission_stats));
+	st->running = running;
+	st->waiting = g_queue_get_length(&waiting);
+	st->cap = cap;
+	pthread_mutex_unlock(&admission_mutex);
+}
+
+
+// Log the statistics
+void admission_report(void) {
+	admission_stats st;
+	char tmp[200];
+
+	admission_get_stats(&st);
+	if (st.cap == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Admission: %d/%d sessions, %d waiting; %lu admitted, %lu waited, %lu rejected "
+			"(%lu after waiting); first byte after %.1f ms\n", st.running, st.cap, st.waiting, st.admitted,
+			st.queued, st.rejected + st.expired, st.expired, st.ttfb_ms);
+	Log(tmp);
+}
@@ -0,0 +1,64 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * admission.h
+ *
+ * Header file of the admission control of the proxy sessions: at most a cap
+ *    of sessions run at a time; the next connections wait in a bounded queue
+ *    for a free slot, and the ones that do not fit, or wait too long, are
+ *    answered with file length 0 ("file doesn't exist") and closed. With a
+ *    latency target, the cap follows the time to the first byte of the
+ *    sessions (additive increase, multiplicative decrease).
+\*****************************************************************************/
+
+#ifndef INCL_ADMISSION_H
+#define INCL_ADMISSION_H
+
+#include <gtk/gtk.h>
+#include <netinet/in.h>
+
+#define ADMISSION_DEFAULT_QUEUE		64		// Default length of the wait queue
+#define ADMISSION_DEFAULT_WAIT		2000	// Default maximum time in the wait queue (ms)
+#define ADMISSION_MIN_SESSIONS		4		// Minimum cap, with a latency target
+#define ADMISSION_PERIOD			100		// Period expiring the waiting connections and adapting the cap (ms)
+#define ADMISSION_DECREASE			0.8		// Cap decrease factor when the latency is above the target
+#define ADMISSION_EWMA				0.2		// Weight of a new sample in the latency average
+
+// Admission decisions
+typedef enum { ADMIT_NOW, ADMIT_WAIT, ADMIT_REJECT } AdmitResult;
+
+// Admission statistics
+typedef struct admission_stats {
+	unsigned long admitted;		// Sessions started
+	unsigned long queued;		// Connections that waited for a slot
+	unsigned long rejected;		// Connections rejected with the wait queue full
+	unsigned long expired;		// Connections rejected after waiting too long
+	int running;				// Sessions running
+	int waiting;				// Connections waiting
+	int cap;					// Current cap
+	double ttfb_ms;				// Average time to the first byte of the sessions (ms)
+} admission_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Start the admission control with the options; no limit if options.max_sessions is 0
+void admission_init(void);
+// Stop the admission control, rejecting the connections waiting
+void admission_close(void);
+// Decide what to do with a new connection: start it now (a slot was taken), keep it waiting
+// (it is started later with start_proxy_session) or reject it (already answered and closed)
+AdmitResult admission_request(int sock, struct sockaddr_in6 *cli_addr, gboolean cli_ipv6);
+// Release the slot of a session that ended
+void admission_release(void);
+// Account the time from the admission to the first byte sent to the client (us)
+void admission_sample(gint64 usec);
+// Current statistics
+void admission_get_stats(admission_stats *st);
+// Log the statistics
+void admission_report(void);
+
+#endif
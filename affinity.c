@@ -0,0 +1,270 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * affinity.c
+ *
+ * CPU and NUMA placement of the gateway threads
+ *
+ * The topology comes from /sys/devices/system/node (one node with all the
+ *    CPUs if it is missing), and memory is bound with the mbind system call,
+ *    so no NUMA library is needed. The socket's receiving core is known once
+ *    data arrived on it, which TCP_DEFER_ACCEPT guarantees when accepted.
+\*****************************************************************************/
+
+#define _GNU_SOURCE		// CPU_SET, sched_getcpu, pthread_attr_setaffinity_np
+#include <pthread.h>
+#include <sched.h>
+#include <gtk/gtk.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "sock.h"
+#include "gui.h"
+#include "affinity.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU	49
+#endif
+#define MPOL_PREFERRED_	1	// Memory policy preferring one node (numaif.h)
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t affinity_mutex = PTHREAD_MUTEX_INITIALIZER;
+static AffinityMode mode = AFFINITY_OFF;
+static int n_nodes = 1;
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];	// CPUs of each node, without the control ones
+static short cpu_node[CPU_SETSIZE];				// Node of each CPU
+static cpu_set_t control_set;					// CPUs of the control-plane threads
+static cpu_set_t session_set;					// CPUs of the session threads
+static affinity_stats stats;
+
+
+// Parse a CPU list ("0-3,8,10-11") into 'set'; returns FALSE if it is invalid
+static gboolean parse_cpu_list(const char *str, cpu_set_t *set) {
+	const char *p = str;
+
+	CPU_ZERO(set);
+	while (*p != '\0') {
+		char *end;
+		long first = strtol(p, &end, 10), last;
+		if ((end == p) || (first < 0) || (first >= CPU_SETSIZE))
+			return FALSE;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if ((end == p) || (last < first) || (last >= CPU_SETSIZE))
+				return FALSE;
+		}
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		p = end;
+		while ((*p == ',') || isspace((unsigned char) *p))
+			p++;
+	}
+	return TRUE;
+}
+
+
+// Read the CPUs of each NUMA node, limited to the CPUs the process may use
+static void load_topology(const cpu_set_t *allowed) {
+	DIR *dir = opendir("/sys/devices/system/node");
+	struct dirent *de;
+	int i;
+
+	n_nodes = 0;
+	while ((dir != NULL) && ((de = readdir(dir)) != NULL)) {
+		char path[300], list[4096];
+		int node;
+		FILE *f;
+
+		if ((sscanf(de->d_name, "node%d", &node) != 1) || (node < 0) || (node >= AFFINITY_MAX_NODES))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", de->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if ((fgets(list, sizeof(list), f) != NULL) && parse_cpu_list(list, &node_cpus[node])) {
+			CPU_AND(&node_cpus[node], &node_cpus[node], allowed);
+			n_nodes = MAX(n_nodes, node + 1);
+		}
+		fclose(f);
+	}
+	if (dir != NULL)
+		closedir(dir);
+	if (n_nodes == 0) {
+		// No NUMA information: one node
+		n_nodes = 1;
+		memcpy(&node_cpus[0], allowed, sizeof(cpu_set_t));
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		int node;
+		cpu_node[i] = 0;
+		for (node = 0; node < n_nodes; node++)
+			if (CPU_ISSET(i, &node_cpus[node]))
+				cpu_node[i] = node;
+	}
+}
+
+
+// Read the CPU and NUMA topology and set the placement mode ("off", "cpu" or "node"); with a
+// list of 'control_cpus' ("0-1,4"), the calling thread (main loop) is placed on them and the
+// sessions on the other CPUs. Returns FALSE if the arguments are invalid
+gboolean affinity_init(const char *mode_str, const char *control_cpus) {
+	cpu_set_t allowed;
+	char tmp[160];
+	int node;
+
+	if ((mode_str == NULL) || (strcmp(mode_str, "off") == 0))
+		mode = AFFINITY_OFF;
+	else if (strcmp(mode_str, "cpu") == 0)
+		mode = AFFINITY_CPU;
+	else if (strcmp(mode_str, "node") == 0)
+		mode = AFFINITY_NODE;
+	else {
+		Log("Invalid GW_AFFINITY (off, cpu or node)\n");
+		return FALSE;
+	}
+	memset(&stats, 0, sizeof(stats));
+	n_nodes = 1;
+	if (mode == AFFINITY_OFF)
+		return TRUE;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		perror("sched_getaffinity");
+		mode = AFFINITY_OFF;
+		return TRUE;
+	}
+	CPU_ZERO(&control_set);
+	if ((control_cpus != NULL) && !parse_cpu_list(control_cpus, &control_set)) {
+		Log("Invalid GW_CONTROL_CPUS\n");
+		mode = AFFINITY_OFF;
+		return FALSE;
+	}
+	CPU_AND(&control_set, &control_set, &allowed);
+	load_topology(&allowed);
+
+	// The sessions use the CPUs not reserved to the control plane
+	CPU_XOR(&session_set, &allowed, &control_set);
+	if (CPU_COUNT(&session_set) == 0) {
+		Log("GW_CONTROL_CPUS leaves no CPU for the sessions\n");
+		mode = AFFINITY_OFF;
+		n_nodes = 1;
+		return FALSE;
+	}
+	for (node = 0; node < n_nodes; node++)
+		CPU_AND(&node_cpus[node], &node_cpus[node], &session_set);
+	stats.nodes = n_nodes;
+	stats.cpus = CPU_COUNT(&allowed);
+	stats.control_cpus = CPU_COUNT(&control_set);
+
+	// The main loop runs on the control-plane CPUs
+	if ((stats.control_cpus > 0) && (sched_setaffinity(0, sizeof(control_set), &control_set) < 0))
+		perror("Failed placing the main loop");
+
+	snprintf(tmp, sizeof(tmp), "Affinity: sessions placed by %s, %d NUMA nodes, %d CPUs (%d for the control plane)\n",
+			(mode == AFFINITY_CPU) ? "core" : "node", n_nodes, stats.cpus, stats.control_cpus);
+	Log(tmp);
+	return TRUE;
+}
+
+
+// Number of NUMA nodes used to place threads and memory (1 if the placement is off)
+int affinity_node_count(void) {
+	return (mode == AFFINITY_OFF) ? 1 : n_nodes;
+}
+
+
+// NUMA node of the CPU running the calling thread (0 if the placement is off)
+int affinity_current_node(void) {
+	int cpu;
+
+	if ((mode == AFFINITY_OFF) || (n_nodes == 1))
+		return 0;
+	cpu = sched_getcpu();
+	return ((cpu >= 0) && (cpu < CPU_SETSIZE)) ? cpu_node[cpu] : 0;
+}
+
+
+// Prefer memory of 'node' for the 'len' bytes at 'addr' (page aligned), before they are used
+void affinity_bind_memory(void *addr, size_t len, int node) {
+	unsigned long mask[(AFFINITY_MAX_NODES + 63) / 64];
+
+	if ((mode == AFFINITY_OFF) || (n_nodes == 1) || (node < 0) || (node >= n_nodes) || (len == 0))
+		return;
+	memset(mask, 0, sizeof(mask));
+	mask[node / 64] = 1UL << (node % 64);
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED_, mask, sizeof(mask) * 8 + 1, 0) < 0)
+		perror("mbind");	// The memory is used anyway
+}
+
+
+// Start a thread placed for the session with the client socket 'sock', or for the control plane
+// if 'sock' is negative; returns the pthread_create error code
+int affinity_thread_create(pthread_t *tid, int sock, void *(*func)(void *), void *arg) {
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int cpu = -1, err;
+	socklen_t len = sizeof(cpu);
+
+	if (mode == AFFINITY_OFF)
+		return pthread_create(tid, NULL, func, arg);
+
+	pthread_mutex_lock(&affinity_mutex);
+	if (sock < 0) {
+		// Control plane
+		memcpy(&set, (stats.control_cpus > 0) ? &control_set : &session_set, sizeof(cpu_set_t));
+		stats.control++;
+	} else if ((getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) || (cpu < 0) ||
+			(cpu >= CPU_SETSIZE) || (CPU_COUNT(&node_cpus[cpu_node[cpu]]) == 0)) {
+		// No data received yet, or no session CPU on its node
+		memcpy(&set, &session_set, sizeof(cpu_set_t));
+		stats.unplaced++;
+	} else if ((mode == AFFINITY_CPU) && CPU_ISSET(cpu, &session_set)) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		stats.on_cpu++;
+	} else {
+		// Its node, also when its core is reserved to the control plane
+		memcpy(&set, &node_cpus[cpu_node[cpu]], sizeof(cpu_set_t));
+		stats.on_node++;
+	}
+	pthread_mutex_unlock(&affinity_mutex);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	err = pthread_create(tid, &attr, func, arg);
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+
+// Current statistics
+void affinity_get_stats(affinity_stats *st) {
+	pthread_mutex_lock(&affinity_mutex);
+	memcpy(st, &stats, sizeof(affinity_stats));
+	pthread_mutex_unlock(&affinity_mutex);
+}
+
+
+// Log the statistics
+void affinity_report(void) {
+	affinity_stats st;
+	char tmp[200];
+
+	affinity_get_stats(&st);
+	if (mode == AFFINITY_OFF)
+		return;
+	snprintf(tmp, sizeof(tmp), "Affinity: %lu sessions on their socket's core, %lu on its node, %lu unplaced, "
+			"%lu control-plane threads\n", st.on_cpu, st.on_node, st.unplaced, st.control);
+	Log(tmp);
+}
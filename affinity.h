@@ -0,0 +1,58 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * affinity.h
+ *
+ * Header file of the CPU and NUMA placement of the gateway threads: each
+ *    session thread runs on the core that services its client socket
+ *    (SO_INCOMING_CPU), or on the NUMA node of that core, and the main loop
+ *    and the other control-plane threads run on their own cores.
+\*****************************************************************************/
+
+#ifndef INCL_AFFINITY_H
+#define INCL_AFFINITY_H
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+
+#define AFFINITY_MAX_NODES	64		// Maximum number of NUMA nodes used
+
+// Placement modes (GW_AFFINITY)
+typedef enum { AFFINITY_OFF, AFFINITY_CPU, AFFINITY_NODE } AffinityMode;
+
+// Placement statistics
+typedef struct affinity_stats {
+	int nodes;					// NUMA nodes
+	int cpus;					// CPUs available
+	int control_cpus;			// CPUs reserved to the control-plane threads
+	unsigned long on_cpu;		// Sessions placed on the core of their socket
+	unsigned long on_node;		// Sessions placed on the node of their socket
+	unsigned long unplaced;		// Sessions whose socket had no receiving core
+	unsigned long control;		// Control-plane threads placed
+} affinity_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Read the CPU and NUMA topology and set the placement mode ("off", "cpu" or "node"); with a
+// list of 'control_cpus' ("0-1,4"), the calling thread (main loop) is placed on them and the
+// sessions on the other CPUs. Returns FALSE if the arguments are invalid
+gboolean affinity_init(const char *mode, const char *control_cpus);
+// Number of NUMA nodes used to place threads and memory (1 if the placement is off)
+int affinity_node_count(void);
+// NUMA node of the CPU running the calling thread (0 if the placement is off)
+int affinity_current_node(void);
+// Prefer memory of 'node' for the 'len' bytes at 'addr' (page aligned), before they are used
+void affinity_bind_memory(void *addr, size_t len, int node);
+// Start a thread placed for the session with the client socket 'sock', or for the control plane
+// if 'sock' is negative; returns the pthread_create error code
+int affinity_thread_create(pthread_t *tid, int sock, void *(*func)(void *), void *arg);
+// Current statistics
+void affinity_get_stats(affinity_stats *st);
+// Log the statistics
+void affinity_report(void);
+
+#endif
@@ -0,0 +1,615 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * bench_gateway.c
+ *
+ * Microbenchmarks of the gateway hot functions: message codec, relay hash
+ *    verification, Query and thread list lookups, Query creation/removal and
+ *    timer churn, measured at table sizes from 10 to 1M entries, and the heap
+ *    bytes used per live Query and thread state. The serial and pipelined
+ *    relays are timed between an emulated server and client, each sending or
+ *    taking one window per round trip. Results are written in JSON, one
+ *    result per line, and can be compared against a stored baseline.
+ *
+ * Build it with the objects of the gateway modules (all but main.o), replacing
+ *    gui_g3.o by gui_stub.o:
+ *    gcc -O2 -o bench_gateway bench_gateway.c $(GATEWAY_OBJS) gui_stub.o \
+ *        `pkg-config --libs gtk+-3.0` -lpthread -lm
+ *
+ * Usage: bench_gateway [-s max_size] [-t min_time_ms] [-o result.json]
+ *                      [-b baseline.json] [-r max_regression_%]
+\*****************************************************************************/
+
+#include <gtk/gtk.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <time.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "callbacks_socket.h"
+#include "proxy_thread.h"
+#include "fhash.h"
+#include "slab.h"
+#include "buffer_pool.h"
+#include "options.h"
+#include "pipeline.h"
+
+
+#define BENCH_MAX_SIZE		1000000	// Default largest table size
+#define BENCH_MIN_TIME		200		// Default minimum measuring time per benchmark (ms)
+#define BENCH_MAX_RESULTS	256		// Maximum number of results (and baseline entries)
+#define BENCH_REGRESSION	10.0	// Default tolerated slowdown against the baseline (%)
+#define BENCH_HASH_BLOCK	(64 << 10)	// Block hashed per operation (relay buffer size)
+#define BENCH_RELAY_BYTES	(4L << 20)	// File relayed per operation by the relay benchmarks
+#define BENCH_SERVER_RTT	10			// Round-trip time emulated to the server (ms)
+#define BENCH_SERVER_WINDOW	(64L << 10)	// Bytes sent by the server per round trip
+#define BENCH_CLIENT_RTT	80			// Round-trip time emulated to the client (ms)
+#define BENCH_CLIENT_WINDOW	(512L << 10)	// Bytes taken by the client per round trip
+#define BENCH_RELAY_SOCKBUF	(32 << 10)	// Socket buffers of the emulated connections
+
+
+// One benchmark result
+typedef struct bench_result {
+	char name[64];			// Function(s) measured
+	long size;				// Table size (0 if not applicable)
+	long iterations;		// Number of operations measured
+	double ns_per_op;		// Mean time per operation
+} bench_result;
+
+// One memory measurement
+typedef struct mem_result {
+	char name[64];			// Objects measured
+	long size;				// Number of live objects
+	double bytes_per_obj;	// Heap bytes per object
+} mem_result;
+
+// Benchmark body: runs 'iterations' operations over the context 'ctx'
+typedef void (*bench_fn)(void *ctx, long iterations);
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static bench_result results[BENCH_MAX_RESULTS];
+static int n_results = 0;
+static mem_result mem_results[BENCH_MAX_RESULTS];
+static int n_mem_results = 0;
+static long min_time_ns = BENCH_MIN_TIME * 1000000L;
+
+static char msg_buf[MESSAGE_MAX_LENGTH];	// Encoded message buffer
+static int msg_len;							// Encoded message length
+static char hash_block[BENCH_HASH_BLOCK];	// Block hashed by the verification benchmarks
+static volatile uint32_t hash_sink;			// Keeps the hash from being optimized away
+
+static Query **queries = NULL;				// Queries in the table
+static thread_state **threads = NULL;		// Thread states in the table
+static long table_size = 0;					// Current table size
+static unsigned int lcg_state = 12345;		// Pseudo-random key generator
+
+
+/************************\
+|*  Auxiliary functions  *|
+\************************/
+
+// Current monotonic time in ns
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Pseudo-random index in [0, n)
+static long next_index(long n) {
+	lcg_state = lcg_state * 1103515245u + 12345u;
+	return (long) (((unsigned long long) lcg_state * (unsigned long long) n) >> 32);
+}
+
+// Name of the i-th file in the tables
+static const char *file_name(long i, char *buf, size_t len) {
+	snprintf(buf, len, "file%07ld.dat", i);
+	return buf;
+}
+
+// Runs a benchmark, doubling the number of iterations until it lasts at least min_time_ns
+static void run_bench(const char *name, long size, bench_fn fn, void *ctx) {
+	long iterations = 1;
+	long long t;
+
+	for (;;) {
+		long long t0 = now_ns();
+		fn(ctx, iterations);
+		t = now_ns() - t0;
+		if ((t >= min_time_ns) || (iterations >= (1L << 40)))
+			break;
+		// Estimate the number of iterations needed, growing at most 100 times per round
+		long next = (t > 0) ? (long) (1.2 * iterations * min_time_ns / t) : iterations * 100;
+		iterations = CLAMP(next, iterations * 2, iterations * 100);
+	}
+
+	assert(n_results < BENCH_MAX_RESULTS);
+	bench_result *r = &results[n_results++];
+	strncpy(r->name, name, sizeof(r->name) - 1);
+	r->size = size;
+	r->iterations = iterations;
+	r->ns_per_op = (double) t / iterations;
+	fprintf(stderr, "%-36s size=%-8ld %12.1f ns/op (%ld ops)\n", r->name, r->size,
+			r->ns_per_op, r->iterations);
+}
+
+
+// Heap bytes in use (malloc'ed blocks, including the mmap'ed ones, and the slabs)
+static size_t heap_in_use(void) {
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd + slab_mapped_bytes();
+}
+
+// Measures the heap bytes per object used by the 'size' objects created by 'fill', not
+// counting the 'tables' tables of pointers to them
+static void measure_memory(const char *name, long size, int tables, void (*fill)(long),
+		void (*clear)(void)) {
+	size_t before = heap_in_use();
+	fill(size);
+	long used = (long) (heap_in_use() - before) - tables * size * (long) sizeof(void *);
+	clear();
+
+	assert(n_mem_results < BENCH_MAX_RESULTS);
+	mem_result *r = &mem_results[n_mem_results++];
+	strncpy(r->name, name, sizeof(r->name) - 1);
+	r->size = size;
+	r->bytes_per_obj = (double) used / size;
+	fprintf(stderr, "%-36s size=%-8ld %12.1f bytes/object\n", r->name, r->size, r->bytes_per_obj);
+}
+
+
+/****************************\
+|*  Message codec benchmarks *|
+\****************************/
+
+static void bench_write_query(void *ctx, long iterations) {
+	long i;
+	for (i = 0; i < iterations; i++)
+		write_query_message(msg_buf, &msg_len, (uint16_t) i, "some_shared_file_name.mp4");
+}
+
+static void bench_read_query(void *ctx, long iterations) {
+	uint16_t seq;
+	const char *fname;
+	long i;
+	for (i = 0; i < iterations; i++) {
+		if (read_query_message(msg_buf, msg_len, &seq, &fname))
+			free((char *) fname);
+	}
+}
+
+static void bench_write_hit(void *ctx, long iterations) {
+	long i;
+	for (i = 0; i < iterations; i++)
+		write_hit_message(msg_buf, &msg_len, (uint16_t) i, "some_shared_file_name.mp4",
+				0x12345678, 1234567890ULL, 20000, "2001:690:2005:10:33::10");
+}
+
+static void bench_read_hit(void *ctx, long iterations) {
+	uint16_t seq;
+	const char *fname, *serverIP;
+	uint32_t fhash;
+	unsigned long long flen;
+	unsigned short sTCP_port;
+	long i;
+	for (i = 0; i < iterations; i++) {
+		if (read_hit_message(msg_buf, msg_len, &seq, &fname, &fhash, &flen,
+				&sTCP_port, &serverIP)) {
+			free((char *) fname);
+			free((char *) serverIP);
+		}
+	}
+}
+
+
+/*********************************\
+|*  Hash verification benchmarks  *|
+\*********************************/
+
+static void bench_fhash(void *ctx, long iterations) {
+	uint32_t h = 0;
+	long i;
+	for (i = 0; i < iterations; i++)
+		h = fhash_update(h, hash_block, BENCH_HASH_BLOCK);
+	hash_sink = h;
+}
+
+static void bench_fhash_scalar(void *ctx, long iterations) {
+	uint32_t h = 0;
+	long i;
+	for (i = 0; i < iterations; i++)
+		h = fhash_update_scalar(h, hash_block, BENCH_HASH_BLOCK);
+	hash_sink = h;
+}
+
+
+/*****************************\
+|*  Query table benchmarks   *|
+\*****************************/
+
+// Fills the Query list with 'size' queries, coming from IPv4 clients
+static void fill_query_table(long size) {
+	struct in_addr ipv4;
+	char name[32];
+	long i;
+
+	inet_pton(AF_INET, "192.168.1.10", &ipv4);
+	queries = (Query **) malloc(size * sizeof(Query *));
+	for (i = 0; i < size; i++) {
+		file_name(i, name, sizeof(name));
+		queries[i] = new_Query(name, (uint16_t) i, FALSE, NULL, &ipv4, 20000);
+	}
+	table_size = size;
+}
+
+// Removes all queries from the list, cancelling their timers
+static void clear_query_table(void) {
+	long i;
+	for (i = 0; i < table_size; i++) {
+		stop_query_timer(queries[i]);
+		del_Query(queries[i], FALSE);
+	}
+	free(queries);
+	queries = NULL;
+	table_size = 0;
+}
+
+static void bench_locate_query(void *ctx, long iterations) {
+	char name[32];
+	long i;
+	for (i = 0; i < iterations; i++) {
+		long k = next_index(table_size);
+		Query *q = locate_in_QueryList_IP(file_name(k, name, sizeof(name)), (uint16_t) k, FALSE);
+		assert(q == queries[k]);
+	}
+}
+
+static void bench_new_del_query(void *ctx, long iterations) {
+	struct in_addr ipv4;
+	long i;
+
+	inet_pton(AF_INET, "192.168.1.11", &ipv4);
+	for (i = 0; i < iterations; i++) {
+		Query *q = new_Query("not_in_table.dat", (uint16_t) i, FALSE, NULL, &ipv4, 20001);
+		del_Query(q, FALSE);
+	}
+}
+
+// Arms the Hit timer of every Query in the table
+static void arm_query_timers(void) {
+	long i;
+	for (i = 0; i < table_size; i++) {
+		queries[i]->state = S_IDLE;
+		start_query_timer(queries[i], QUERY_TIMEOUT);
+	}
+}
+
+static void bench_timer_churn(void *ctx, long iterations) {
+	long i;
+	for (i = 0; i < iterations; i++) {
+		Query *q = queries[next_index(table_size)];
+		stop_query_timer(q);
+		q->state = S_IDLE;
+		start_query_timer(q, QUERY_TIMEOUT);
+	}
+}
+
+
+/*************************************\
+|*  Thread state table benchmarks    *|
+\*************************************/
+
+// Fills the thread list with 'size' thread states
+static void fill_thread_table(long size) {
+	struct sockaddr_in6 cli_addr;
+	char name[32];
+	long i;
+
+	memset(&cli_addr, 0, sizeof(cli_addr));
+	cli_addr.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "::ffff:192.168.1.10", &cli_addr.sin6_addr);
+	threads = (thread_state **) malloc(size * sizeof(thread_state *));
+	for (i = 0; i < size; i++) {
+		cli_addr.sin6_port = htons((u_short) (1024 + (i % 60000)));
+		threads[i] = new_thread_state(0, &cli_addr);
+		threads[i]->sock4 = -1;		// There is no client socket to close
+		update_thread_state(threads[i], -1, file_name(i, name, sizeof(name)), (uint16_t) i);
+	}
+	table_size = size;
+}
+
+// Removes all thread states from the list
+static void clear_thread_table(void) {
+	long i;
+	for (i = 0; i < table_size; i++)
+		free_thread_state(threads[i], FALSE);
+	free(threads);
+	threads = NULL;
+	table_size = 0;
+}
+
+// Creates 'size' sessions: a Query from an IPv4 client and the thread state relaying its
+// file, sharing the filename
+static void fill_session_table(long size) {
+	fill_query_table(size);
+	fill_thread_table(size);
+}
+
+// Removes the sessions; freeing a thread state also removes its Query
+static void clear_session_table(void) {
+	clear_thread_table();
+	free(queries);
+	queries = NULL;
+}
+
+/****************************\
+|*  Relay benchmarks        *|
+\****************************/
+
+// End of an emulated connection
+typedef struct relay_end {
+	int sock;				// Socket of the end
+	gboolean sender;		// Server (sends the file) or client (takes it)
+	long window;			// Bytes sent or taken per round trip
+	int rtt;				// Round-trip time (ms)
+} relay_end;
+
+// Emulated server or client: sends or takes one window, and waits a round trip for the
+// acknowledgement before the next one, like a TCP connection limited by its window on a
+// high-RTT path. The relay gets no data (or cannot send) while it waits
+static void *relay_end_thread(void *ptr) {
+	relay_end *e = (relay_end *) ptr;
+	char *buf = (char *) calloc(1, e->window);
+	long long done = 0;
+	ssize_t k = 1;
+
+	while ((buf != NULL) && (k > 0) && (done < BENCH_RELAY_BYTES)) {
+		long window = MIN(e->window, BENCH_RELAY_BYTES - done), n = 0;
+		while ((n < window) && (k > 0)) {
+			k = e->sender ? write(e->sock, buf + n, window - n) : read(e->sock, buf + n, window - n);
+			if (k > 0)
+				n += k;
+		}
+		done += n;
+		usleep(e->rtt * 1000);
+	}
+	free(buf);
+	return NULL;
+}
+
+// Connected sockets with small buffers, so the relay blocks as it would on a slow path
+static void relay_socketpair(int sv[2]) {
+	int size = BENCH_RELAY_SOCKBUF, i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(2);
+	}
+	for (i = 0; i < 2; i++) {
+		setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+}
+
+// Relays BENCH_RELAY_BYTES per iteration; ctx points to the pipeline depth (0 - serial relay)
+static void bench_relay(void *ctx, long iterations) {
+	struct sockaddr_in6 cli_addr;
+	relay_end server, client;
+	pthread_t tid_server, tid_client;
+	int up[2], down[2];
+	long i;
+
+	memset(&cli_addr, 0, sizeof(cli_addr));
+	cli_addr.sin6_family = AF_INET6;
+	options.pipeline_depth = *(long *) ctx;
+	for (i = 0; i < iterations; i++) {
+		relay_socketpair(up);
+		relay_socketpair(down);
+		thread_state *pt = new_thread_state(down[0], &cli_addr);
+		pt->sock6 = up[0];
+		pt->flen = BENCH_RELAY_BYTES;
+		server.sock = up[1];
+		server.sender = TRUE;
+		server.window = BENCH_SERVER_WINDOW;
+		server.rtt = BENCH_SERVER_RTT;
+		client.sock = down[1];
+		client.sender = FALSE;
+		client.window = BENCH_CLIENT_WINDOW;
+		client.rtt = BENCH_CLIENT_RTT;
+		pthread_create(&tid_server, NULL, relay_end_thread, &server);
+		pthread_create(&tid_client, NULL, relay_end_thread, &client);
+		if (options.pipeline_depth > 0)
+			pipelined_relay(pt);
+		else
+			serial_relay(pt);
+		if (pt->sent != BENCH_RELAY_BYTES)
+			fprintf(stderr, "Relay benchmark: only %llu bytes relayed\n", pt->sent);
+		free_thread_state(pt, FALSE);	// Closes the relay's ends
+		pthread_join(tid_server, NULL);
+		pthread_join(tid_client, NULL);
+		close(up[1]);
+		close(down[1]);
+	}
+}
+
+
+static void bench_locate_state(void *ctx, long iterations) {
+	char name[32];
+	long i;
+	for (i = 0; i < iterations; i++) {
+		long k = next_index(table_size);
+		thread_state *pt = locate_state_in_plist(file_name(k, name, sizeof(name)), (uint16_t) k);
+		// The sequence number wraps at 64K, so only the first match is checked
+		assert(pt != NULL);
+	}
+}
+
+
+/*************************\
+|*  Results and baseline  *|
+\*************************/
+
+// Writes the results in JSON, one result per line
+static void write_results(FILE *f) {
+	int i;
+	fprintf(f, "{\n\"benchmark\": \"gateway\",\n\"timestamp\": %ld,\n\"results\": [\n",
+			(long) time(NULL));
+	for (i = 0; i < n_results; i++)
+		fprintf(f, "{\"name\": \"%s\", \"size\": %ld, \"iterations\": %ld, \"ns_per_op\": %.3f}%s\n",
+				results[i].name, results[i].size, results[i].iterations,
+				results[i].ns_per_op, (i < n_results - 1) ? "," : "");
+	fprintf(f, "],\n\"memory\": [\n");
+	for (i = 0; i < n_mem_results; i++)
+		fprintf(f, "{\"name\": \"%s\", \"size\": %ld, \"bytes_per_object\": %.1f}%s\n",
+				mem_results[i].name, mem_results[i].size, mem_results[i].bytes_per_obj,
+				(i < n_mem_results - 1) ? "," : "");
+	fprintf(f, "]\n}\n");
+}
+
+// Compares the results with a baseline file written by write_results
+// Returns the number of results slower than the baseline by more than max_regression %
+static int compare_baseline(const char *path, double max_regression) {
+	bench_result base;
+	char line[512];
+	int regressions = 0, i;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror("Failed opening baseline");
+		return -1;
+	}
+	fprintf(stderr, "\nComparison with baseline '%s':\n", path);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "{\"name\": \"%63[^\"]\", \"size\": %ld, \"iterations\": %ld, \"ns_per_op\": %lf",
+				base.name, &base.size, &base.iterations, &base.ns_per_op) != 4)
+			continue;
+		for (i = 0; i < n_results; i++) {
+			if (strcmp(results[i].name, base.name) || (results[i].size != base.size))
+				continue;
+			double delta = 100.0 * (results[i].ns_per_op - base.ns_per_op) / base.ns_per_op;
+			gboolean regressed = (delta > max_regression);
+			fprintf(stderr, "%-36s size=%-8ld %12.1f -> %12.1f ns/op (%+.1f%%)%s\n",
+					base.name, base.size, base.ns_per_op, results[i].ns_per_op, delta,
+					regressed ? "  REGRESSION" : "");
+			if (regressed)
+				regressions++;
+		}
+	}
+	fclose(f);
+	return regressions;
+}
+
+
+int main(int argc, char *argv[]) {
+	long max_size = BENCH_MAX_SIZE;
+	double max_regression = BENCH_REGRESSION;
+	const char *out_path = NULL, *baseline_path = NULL;
+	long size;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:t:o:b:r:")) != -1) {
+		switch (c) {
+		case 's':
+			max_size = atol(optarg);
+			break;
+		case 't':
+			min_time_ns = atol(optarg) * 1000000L;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 'r':
+			max_regression = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s max_size] [-t min_time_ms] [-o result.json] "
+					"[-b baseline.json] [-r max_regression_%%]\n", argv[0]);
+			return 2;
+		}
+	}
+	active = TRUE;
+
+	// Message codec
+	write_query_message(msg_buf, &msg_len, 1, "some_shared_file_name.mp4");
+	run_bench("write_query_message", 0, bench_write_query, NULL);
+	run_bench("read_query_message", 0, bench_read_query, NULL);
+	write_hit_message(msg_buf, &msg_len, 1, "some_shared_file_name.mp4", 0x12345678,
+			1234567890ULL, 20000, "2001:690:2005:10:33::10");
+	run_bench("write_hit_message", 0, bench_write_hit, NULL);
+	run_bench("read_hit_message", 0, bench_read_hit, NULL);
+
+	// Relay hash verification, one relay buffer per operation
+	for (c = 0; c < BENCH_HASH_BLOCK; c++)
+		hash_block[c] = (char) c;
+	if (fhash_update(0, hash_block, BENCH_HASH_BLOCK) != fhash_update_scalar(0, hash_block, BENCH_HASH_BLOCK)) {
+		fprintf(stderr, "fhash_update (%s) differs from the scalar version\n", fhash_impl());
+		return 2;
+	}
+	run_bench("fhash_update_64K", 0, bench_fhash, NULL);
+	fprintf(stderr, "fhash_update (%s): %.1f GB/s\n", fhash_impl(),
+			BENCH_HASH_BLOCK / results[n_results - 1].ns_per_op);
+	run_bench("fhash_update_scalar_64K", 0, bench_fhash_scalar, NULL);
+
+	// Serial and pipelined relay of a file on high-RTT paths (size - pipeline depth)
+	options.pool_session_chunks = POOL_DEFAULT_SESSION;
+	if (!pool_init(POOL_DEFAULT_BYTES, POOL_DEFAULT_CHUNK, POOL_DEFAULT_SESSION, FALSE))
+		return 2;
+	for (size = 0; size <= POOL_DEFAULT_SESSION; size = (size == 0) ? 2 : size * 2) {
+		run_bench((size == 0) ? "serial_relay_rtt" : "pipelined_relay_rtt", size, bench_relay, &size);
+		fprintf(stderr, "%s (depth %ld): %.1f MB/s\n", (size == 0) ? "serial_relay" : "pipelined_relay",
+				size, 1e9 * BENCH_RELAY_BYTES / results[n_results - 1].ns_per_op / (1 << 20));
+	}
+
+	// Tables
+	for (size = 10; size <= max_size; size *= 10) {
+		measure_memory("memory_per_query", size, 1, fill_query_table, clear_query_table);
+		measure_memory("memory_per_thread_state", size, 1, fill_thread_table, clear_thread_table);
+		measure_memory("memory_per_session", size, 2, fill_session_table, clear_session_table);
+
+		fill_query_table(size);
+		run_bench("locate_in_QueryList_IP", size, bench_locate_query, NULL);
+		run_bench("new_Query+del_Query", size, bench_new_del_query, NULL);
+		arm_query_timers();
+		run_bench("start_query_timer+stop_query_timer", size, bench_timer_churn, NULL);
+		clear_query_table();
+
+		fill_thread_table(size);
+		run_bench("locate_state_in_plist", size, bench_locate_state, NULL);
+		clear_thread_table();
+	}
+
+	// Results
+	if (out_path != NULL) {
+		FILE *f = fopen(out_path, "w");
+		if (f == NULL) {
+			perror("Failed opening result file");
+			return 2;
+		}
+		write_results(f);
+		fclose(f);
+	} else
+		write_results(stdout);
+
+	if (baseline_path != NULL) {
+		int regressions = compare_baseline(baseline_path, max_regression);
+		if (regressions != 0)
+			return 1;
+	}
+	return 0;
+}
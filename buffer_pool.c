@@ -0,0 +1,255 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * buffer_pool.c
+ *
+ * Relay buffer pool, shared by the proxy threads
+ *
+ * The region is mapped once, with MAP_HUGETLB when hugepages are reserved, or
+ *    else with transparent hugepages requested through madvise. Free chunks are
+ *    kept in a stack, so the most recently used (cache warm) chunk is reused
+ *    first. The pool is kept while the gateway is turned off/on.
+ *
+ * With NUMA placement, the region is split in one slice per node, bound to
+ *    the node's memory, with its own stack; a thread takes chunks from the
+ *    slice of the node it runs on, and from the others when it is empty.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "buffer_pool.h"
+#include "affinity.h"
+
+#define HUGEPAGE_SIZE	(2L << 20)	// Size of a hugepage
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static char *region = NULL;		// Memory region
+static size_t region_size = 0;	// Size of the mapping
+static int *free_stack = NULL;	// Indexes of the free chunks: one stack per node, in its slice
+static int n_free = 0;			// Number of free chunks
+static int n_nodes = 1;			// Number of slices (NUMA nodes)
+static int node_first[AFFINITY_MAX_NODES + 1];	// First chunk of each slice
+static int node_free[AFFINITY_MAX_NODES];		// Number of free chunks in each slice
+static int session_cap = 0;		// Maximum number of chunks per session
+static pool_stats stats;		// Occupancy
+
+
+// Create the pool with 'budget' bytes split in chunks of 'chunk_size' bytes;
+// a session holds at most 'session_chunks' chunks. Returns FALSE if it fails
+gboolean pool_init(size_t budget, size_t chunk_size, int session_chunks, gboolean use_hugepages) {
+	char tmp[128];
+	int i, k, n, align;
+
+	if (region != NULL)
+		return TRUE;	// Already created
+	chunk_size = (chunk_size + 4095) & ~(size_t) 4095;	// Page aligned chunks
+	if ((chunk_size == 0) || (budget < chunk_size) || (session_chunks <= 0)) {
+		Log("Invalid buffer pool configuration\n");
+		return FALSE;
+	}
+	n = budget / chunk_size;
+	region_size = (size_t) n * chunk_size;
+
+	memset(&stats, 0, sizeof(stats));
+	if (use_hugepages) {
+		size_t huge_size = (region_size + HUGEPAGE_SIZE - 1) & ~(size_t) (HUGEPAGE_SIZE - 1);
+		region = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (region == MAP_FAILED)
+			region = NULL;	// No hugepages reserved
+		else {
+			region_size = huge_size;
+			stats.hugepages = TRUE;
+		}
+	}
+	if (region == NULL) {
+		region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED) {
+			perror("Failed mapping the buffer pool");
+			region = NULL;
+			return FALSE;
+		}
+#ifdef MADV_HUGEPAGE
+		if (use_hugepages)
+			madvise(region, region_size, MADV_HUGEPAGE);
+#endif
+	}
+
+	free_stack = (int *) malloc(n * sizeof(int));
+	if (free_stack == NULL) {
+		munmap(region, region_size);
+		region = NULL;
+		return FALSE;
+	}
+	// One slice per node, bound to it before being used (hugepage aligned, for hugepages)
+	n_nodes = CLAMP(affinity_node_count(), 1, MIN(n, AFFINITY_MAX_NODES));
+	align = (stats.hugepages && (HUGEPAGE_SIZE % chunk_size == 0)) ? HUGEPAGE_SIZE / chunk_size : 1;
+	for (k = 0; k < n_nodes; k++)
+		node_first[k] = (int) ((long) k * n / n_nodes / align * align);
+	node_first[n_nodes] = n;
+	for (k = 0; k < n_nodes; k++) {
+		int first = node_first[k], end = node_first[k + 1];
+		for (i = first; i < end; i++)
+			free_stack[i] = end - 1 - (i - first);	// First chunk of the slice on top
+		node_free[k] = end - first;
+		if (n_nodes > 1)
+			affinity_bind_memory(region + (size_t) first * chunk_size, (size_t) (end - first) * chunk_size, k);
+	}
+	n_free = n;
+	session_cap = session_chunks;
+	stats.chunk_size = chunk_size;
+	stats.n_chunks = n;
+	stats.nodes = n_nodes;
+
+	snprintf(tmp, sizeof(tmp), "Buffer pool: %d chunks of %lu bytes%s, %d per session, %d node(s)\n", n,
+			(unsigned long) chunk_size, stats.hugepages ? " (hugepages)" : "", session_cap, n_nodes);
+	Log(tmp);
+	return TRUE;
+}
+
+
+// Free the pool; it must not have chunks borrowed
+void pool_destroy(void) {
+	pthread_mutex_lock(&pool_mutex);
+	if ((region != NULL) && (stats.in_use == 0)) {
+		munmap(region, region_size);
+		free(free_stack);
+		region = NULL;
+		free_stack = NULL;
+		n_free = 0;
+		memset(&stats, 0, sizeof(stats));
+	}
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+
+// Take a free chunk from the slice of the caller's node, or else from the fullest one;
+// called with pool_mutex locked and n_free > 0
+static char *take_chunk(int *held) {
+	int node = 0, k;
+
+	if (n_nodes > 1) {
+		node = MIN(affinity_current_node(), n_nodes - 1);
+		if (node_free[node] == 0) {
+			for (k = 0; k < n_nodes; k++)
+				if (node_free[k] > node_free[node])
+					node = k;
+			stats.remote++;
+		}
+	}
+	n_free--;
+	(*held)++;
+	stats.in_use++;
+	if (stats.in_use > stats.peak)
+		stats.peak = stats.in_use;
+	return region + (size_t) free_stack[node_first[node] + --node_free[node]] * stats.chunk_size;
+}
+
+
+// Borrow a chunk; 'held' counts the chunks of the session. Waits while the pool is empty
+// or the session is at its cap; returns NULL if the gateway stops meanwhile
+char *pool_get(int *held) {
+	char *chunk = NULL;
+	gboolean waited = FALSE;
+
+	pthread_mutex_lock(&pool_mutex);
+	while (active && (region != NULL) && ((n_free == 0) || (*held >= session_cap))) {
+		// Backpressure: the caller does not read from the server while waiting
+		struct timespec deadline;
+		if (!waited) {
+			waited = TRUE;
+			stats.waits++;
+			stats.waiting++;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += POOL_WAIT_PERIOD * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pool_cond, &pool_mutex, &deadline);
+	}
+	if (waited)
+		stats.waiting--;
+	if (active && (region != NULL))
+		chunk = take_chunk(held);
+	pthread_mutex_unlock(&pool_mutex);
+	return chunk;
+}
+
+
+// Borrow a chunk without waiting; returns NULL if the pool is empty or the session is at its cap
+char *pool_try_get(int *held) {
+	char *chunk = NULL;
+
+	pthread_mutex_lock(&pool_mutex);
+	if (active && (region != NULL) && (n_free > 0) && (*held < session_cap))
+		chunk = take_chunk(held);
+	pthread_mutex_unlock(&pool_mutex);
+	return chunk;
+}
+
+
+// Return a chunk borrowed with pool_get or pool_try_get
+void pool_put(char *chunk, int *held) {
+	int i, node = 0;
+
+	if (chunk == NULL)
+		return;
+	i = (chunk - region) / stats.chunk_size;
+	pthread_mutex_lock(&pool_mutex);
+	while (i >= node_first[node + 1])
+		node++;		// Back to the slice it came from
+	free_stack[node_first[node] + node_free[node]++] = i;
+	n_free++;
+	(*held)--;
+	stats.in_use--;
+	if (stats.waiting > 0)
+		pthread_cond_broadcast(&pool_cond);	// Waiters may be blocked by the pool or by their cap
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+
+// Chunk size (bytes)
+size_t pool_chunk_size(void) {
+	return stats.chunk_size;
+}
+
+
+// Current occupancy
+void pool_get_stats(pool_stats *st) {
+	pthread_mutex_lock(&pool_mutex);
+	memcpy(st, &stats, sizeof(pool_stats));
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+
+// Log the occupancy
+void pool_report(void) {
+	pool_stats st;
+	char tmp[160];
+
+	pool_get_stats(&st);
+	if (st.n_chunks == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Buffer pool: %d/%d chunks in use (%d%%), peak %d, %d waiting, %lu waits, "
+			"%lu from another node\n", st.in_use, st.n_chunks, 100 * st.in_use / st.n_chunks, st.peak,
+			st.waiting, st.waits, st.remote);
+	Log(tmp);
+}
@@ -0,0 +1,62 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * buffer_pool.h
+ *
+ * Header file of the relay buffer pool: fixed size chunks carved from one
+ *    (hugepage backed, when available) memory region, shared by all the proxy
+ *    threads. The region size is the global memory budget, and each session
+ *    may hold a limited number of chunks. A thread asking for a chunk when
+ *    none is available waits, which stops it reading from the server.
+\*****************************************************************************/
+
+#ifndef INCL_BUFFER_POOL_H
+#define INCL_BUFFER_POOL_H
+
+#include <gtk/gtk.h>
+#include <stddef.h>
+
+#define POOL_DEFAULT_BYTES		(32L << 20)	// Default global budget - 32 MiB
+#define POOL_DEFAULT_CHUNK		(64L << 10)	// Default chunk size - 64 KiB
+#define POOL_DEFAULT_SESSION	8			// Default maximum number of chunks per session
+#define POOL_WAIT_PERIOD		100			// Period checking if the gateway stopped while waiting (ms)
+
+// Pool occupancy
+typedef struct pool_stats {
+	size_t chunk_size;		// Chunk size (bytes)
+	int n_chunks;			// Total number of chunks
+	int in_use;				// Chunks borrowed
+	int peak;				// Maximum number of chunks borrowed
+	int waiting;			// Threads waiting for a chunk
+	unsigned long waits;	// Number of times a thread had to wait
+	gboolean hugepages;		// Region backed by hugepages
+	int nodes;				// Slices bound to NUMA nodes
+	unsigned long remote;	// Chunks taken from another node's slice
+} pool_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Create the pool with 'budget' bytes split in chunks of 'chunk_size' bytes;
+// a session holds at most 'session_chunks' chunks. Returns FALSE if it fails
+gboolean pool_init(size_t budget, size_t chunk_size, int session_chunks, gboolean use_hugepages);
+// Free the pool; it must not have chunks borrowed
+void pool_destroy(void);
+// Borrow a chunk; 'held' counts the chunks of the session. Waits while the pool is empty
+// or the session is at its cap; returns NULL if the gateway stops meanwhile
+char *pool_get(int *held);
+// Borrow a chunk without waiting; returns NULL if the pool is empty or the session is at its cap
+char *pool_try_get(int *held);
+// Return a chunk borrowed with pool_get or pool_try_get
+void pool_put(char *chunk, int *held);
+// Chunk size (bytes)
+size_t pool_chunk_size(void);
+// Current occupancy
+void pool_get_stats(pool_stats *st);
+// Log the occupancy
+void pool_report(void);
+
+#endif
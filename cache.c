@@ -0,0 +1,546 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * cache.c
+ *
+ * Content cache of the relayed files, with W-TinyLFU admission and eviction
+ *
+ * A file is written to a temporary file while it is relayed; when complete, it
+ *    enters the window segment. Files evicted from the window are candidates to
+ *    the main segment: a candidate is admitted if its estimated frequency is
+ *    higher than the frequency of each main segment file it displaces, or else
+ *    it is dropped. Frequencies are estimated with a count-min sketch of 4-bit
+ *    saturating counters, halved every CACHE_SKETCH_WIDTH * 10 accesses so old
+ *    popularity fades away.
+ *
+ * The cache is used by the proxy threads and is protected by one mutex; files
+ *    are read and written outside it. Evicting a file being served only
+ *    unlinks it, so the reader keeps its copy until it closes the descriptor.
+ *
+ * The index and the sketch are saved in the warm state snapshot. When the
+ *    cache starts, the files it lists are kept without reading them; a file
+ *    missing or with another length is dropped when it is first requested.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "gui.h"
+#include "cache.h"
+#include "warmstate.h"
+
+// Segments
+typedef enum { SEG_WINDOW, SEG_MAIN } cache_segment;
+
+// Cached file
+typedef struct cache_entry {
+	char *key;						// Key (name, fhash and flen)
+	char *name;						// File name
+	unsigned long long flen;		// File length
+	uint64_t hash;					// Hash of the key, for the sketch
+	unsigned int id;				// File number in the cache directory
+	cache_segment segment;			// Segment holding the file
+	gboolean verified;				// Hash checked against the Hit (may answer Queries locally)
+	GList link;						// Link in the segment LRU list (data = entry)
+} cache_entry;
+
+// File being stored in the cache
+struct cache_fill {
+	char *key;						// Key (name, fhash and flen)
+	unsigned long long flen;		// File length
+	uint64_t hash;					// Hash of the key
+	unsigned int id;				// File number in the cache directory
+	int fd;							// Temporary file
+	unsigned long long written;		// Bytes written
+	gboolean failed;				// Write error
+};
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *cache_dir = NULL;		// Cache directory (NULL - cache off)
+static GHashTable *entries = NULL;	// Cached files, by key
+static GHashTable *names = NULL;	// Last cached file of each name
+static GHashTable *filling = NULL;	// Keys of the files being stored
+static GQueue window = G_QUEUE_INIT;	// Window segment, MRU first
+static GQueue main_seg = G_QUEUE_INIT;	// Main segment, MRU first
+static unsigned long long window_used = 0, window_capacity = 0;
+static unsigned long long main_used = 0, main_capacity = 0;
+static unsigned int last_id = 0;	// Last file number
+static cache_stats stats;
+
+static uint8_t *sketch = NULL;		// Frequency sketch: CACHE_SKETCH_ROWS x CACHE_SKETCH_WIDTH
+static unsigned long sketch_additions = 0;	// Increments since the last halving
+
+
+/*********************\
+|*  Frequency sketch *|
+\*********************/
+
+// 64-bit FNV-1a hash of a key
+static uint64_t key_hash(const char *key) {
+	uint64_t h = 14695981039346656037ULL;
+	for (; *key; key++) {
+		h ^= (unsigned char) *key;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Counter of 'row' for a key hash
+static uint8_t *sketch_counter(uint64_t hash, int row) {
+	uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32);
+	return &sketch[row * CACHE_SKETCH_WIDTH + ((h1 + row * h2) & (CACHE_SKETCH_WIDTH - 1))];
+}
+
+// Record one access to a key
+static void sketch_increment(uint64_t hash) {
+	int r, i;
+	for (r = 0; r < CACHE_SKETCH_ROWS; r++) {
+		uint8_t *c = sketch_counter(hash, r);
+		if (*c < 15)
+			(*c)++;
+	}
+	if (++sketch_additions >= 10L * CACHE_SKETCH_WIDTH) {
+		// Aging
+		for (i = 0; i < CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH; i++)
+			sketch[i] >>= 1;
+		sketch_additions /= 2;
+	}
+}
+
+// Estimated number of accesses to a key
+static int sketch_frequency(uint64_t hash) {
+	int r, f = 15;
+	for (r = 0; r < CACHE_SKETCH_ROWS; r++)
+		f = MIN(f, *sketch_counter(hash, r));
+	return f;
+}
+
+
+/*********************\
+|*  Cache entries    *|
+\*********************/
+
+// Key of a file
+static char *make_key(const char *name, uint32_t fhash, unsigned long long flen) {
+	char *key = (char *) malloc(strlen(name) + 32);
+	sprintf(key, "%s/%08x/%llu", name, fhash, flen);
+	return key;
+}
+
+// File name of a key
+static char *key_name(const char *key) {
+	const char *end = strrchr(key, '/');
+	while ((end != NULL) && (end > key) && (*--end != '/'))
+		;
+	return (end == NULL) ? strdup(key) : strndup(key, end - key);
+}
+
+// Add an entry to the tables; called with cache_mutex locked
+static void insert_entry(cache_entry *e) {
+	e->name = key_name(e->key);
+	e->link.data = e;
+	g_hash_table_insert(entries, e->key, e);
+	g_hash_table_replace(names, e->name, e);	// Its key is the name of the latest entry
+	stats.used += e->flen;
+	stats.entries++;
+}
+
+// Path of a file in the cache directory
+static void make_path(char *path, size_t size, unsigned int id) {
+	snprintf(path, size, "%s/%u%s", cache_dir, id, CACHE_FILE_SUFFIX);
+}
+
+// Remove a file from its segment and from the cache, deleting it from disk
+static void remove_entry(cache_entry *e) {
+	char path[512];
+
+	if (e->segment == SEG_WINDOW) {
+		g_queue_unlink(&window, &e->link);
+		window_used -= e->flen;
+	} else {
+		g_queue_unlink(&main_seg, &e->link);
+		main_used -= e->flen;
+	}
+	make_path(path, sizeof(path), e->id);
+	unlink(path);
+	stats.used -= e->flen;
+	stats.entries--;
+	if (g_hash_table_lookup(names, e->name) == e)
+		g_hash_table_remove(names, e->name);
+	g_hash_table_remove(entries, e->key);	// Frees e
+}
+
+// Frees an entry (hash table value destructor)
+static void free_entry(gpointer data) {
+	cache_entry *e = (cache_entry *) data;
+	free(e->key);
+	free(e->name);
+	free(e);
+}
+
+// Offer a candidate evicted from the window to the main segment
+static void admit_to_main(cache_entry *c) {
+	int freq = sketch_frequency(c->hash);
+	GList *l;
+
+	g_queue_unlink(&window, &c->link);
+	window_used -= c->flen;
+
+	// Check if the candidate wins against all the victims it displaces
+	unsigned long long freed = 0;
+	for (l = g_queue_peek_tail_link(&main_seg); (l != NULL) && (main_used - freed + c->flen > main_capacity);
+			l = l->prev) {
+		cache_entry *v = (cache_entry *) l->data;
+		if (freq <= sketch_frequency(v->hash))
+			break;
+		freed += v->flen;
+	}
+	if (main_used - freed + c->flen > main_capacity) {
+		// Rejected: put it back in the window so remove_entry finds it there
+		stats.rejected++;
+		g_queue_push_head_link(&window, &c->link);
+		window_used += c->flen;
+		remove_entry(c);
+		return;
+	}
+	while (main_used + c->flen > main_capacity) {
+		remove_entry((cache_entry *) g_queue_peek_tail(&main_seg));
+		stats.evicted++;
+	}
+	c->segment = SEG_MAIN;
+	g_queue_push_head_link(&main_seg, &c->link);
+	main_used += c->flen;
+	stats.admitted++;
+}
+
+// Move files from the window to the main segment while the window is over its capacity
+static void balance_window(void) {
+	while ((window_used > window_capacity) && (window.tail != NULL))
+		admit_to_main((cache_entry *) g_queue_peek_tail(&window));
+}
+
+// Add a file of the index saved in the warm state, after the ones already added (they come
+// most recently used first); warm_cache_restore callback. 'data' is the set of file numbers
+static void restore_entry(const char *key, unsigned long long flen, unsigned int id, gboolean in_main,
+		gboolean verified, void *data) {
+	GHashTable *ids = (GHashTable *) data;
+	cache_entry *e;
+
+	if ((id == 0) || (flen == 0) || g_hash_table_contains(entries, key) ||
+			g_hash_table_contains(ids, GUINT_TO_POINTER(id)) ||
+			((e = (cache_entry *) calloc(1, sizeof(cache_entry))) == NULL))
+		return;
+	e->key = strdup(key);
+	e->flen = flen;
+	e->hash = key_hash(key);
+	e->id = id;
+	e->segment = in_main ? SEG_MAIN : SEG_WINDOW;
+	e->verified = verified;
+	insert_entry(e);
+	g_hash_table_insert(ids, GUINT_TO_POINTER(id), e);
+	if (in_main) {
+		g_queue_push_tail_link(&main_seg, &e->link);
+		main_used += flen;
+	} else {
+		g_queue_push_tail_link(&window, &e->link);
+		window_used += flen;
+	}
+	last_id = MAX(last_id, id);
+}
+
+
+/*********************\
+|*  Functions        *|
+\*********************/
+
+// Create the cache in directory 'dir', with 'capacity' bytes; dir == NULL turns it off
+// Files left by a previous run are kept if the warm state lists them, and removed otherwise
+gboolean cache_init(const char *dir, unsigned long long capacity) {
+	char tmp[512];
+	DIR *d;
+	struct dirent *de;
+	GHashTable *ids;
+
+	if ((dir == NULL) || (cache_dir != NULL))
+		return TRUE;	// Off or already created (the cache is kept while the gateway is turned off/on)
+	if ((mkdir(dir, 0700) < 0) && (errno != EEXIST)) {
+		perror("Failed creating the cache directory");
+		return FALSE;
+	}
+	d = opendir(dir);
+	if (d == NULL) {
+		perror("Failed opening the cache directory");
+		return FALSE;
+	}
+	sketch = (uint8_t *) calloc(CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH, 1);
+	if (sketch == NULL) {
+		closedir(d);
+		return FALSE;
+	}
+	entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_entry);
+	names = g_hash_table_new(g_str_hash, g_str_equal);
+	filling = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	memset(&stats, 0, sizeof(stats));
+	stats.capacity = capacity;
+	window_capacity = MAX(capacity * CACHE_WINDOW_PERCENT / 100, 1);
+	main_capacity = capacity - window_capacity;
+	cache_dir = strdup(dir);
+
+	// Keep the files of the index saved in the warm state, and remove the other ones
+	ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	warm_cache_restore(dir, restore_entry, ids, sketch, CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH, &sketch_additions);
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+		if ((len > strlen(CACHE_FILE_SUFFIX)) &&
+				!strcmp(de->d_name + len - strlen(CACHE_FILE_SUFFIX), CACHE_FILE_SUFFIX) &&
+				!g_hash_table_contains(ids, GUINT_TO_POINTER(strtoul(de->d_name, NULL, 10)))) {
+			snprintf(tmp, sizeof(tmp), "%s/%s", dir, de->d_name);
+			unlink(tmp);
+		}
+	}
+	closedir(d);
+	g_hash_table_destroy(ids);
+	// The capacity may be lower than in the previous run
+	while (main_used > main_capacity) {
+		remove_entry((cache_entry *) g_queue_peek_tail(&main_seg));
+		stats.evicted++;
+	}
+	balance_window();
+
+	snprintf(tmp, sizeof(tmp), "Content cache at %s with %llu MB (%d files kept)\n", dir, capacity >> 20,
+			stats.entries);
+	Log(tmp);
+	return TRUE;
+}
+
+
+// Remove all the cached files
+void cache_destroy(void) {
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir != NULL) {
+		while (window.head != NULL)
+			remove_entry((cache_entry *) window.head->data);
+		while (main_seg.head != NULL)
+			remove_entry((cache_entry *) main_seg.head->data);
+		// Files being stored are deleted by cache_end
+		g_hash_table_destroy(names);
+		names = NULL;
+		g_hash_table_destroy(entries);
+		entries = NULL;
+		g_hash_table_destroy(filling);
+		filling = NULL;
+		free(sketch);
+		sketch = NULL;
+		free(cache_dir);
+		cache_dir = NULL;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+// Open the cached copy of a file; returns a file descriptor or -1 if it is not cached
+int cache_open(const char *name, uint32_t fhash, unsigned long long flen) {
+	char path[512];
+	int fd = -1;
+
+	if (cache_dir == NULL)
+		return -1;
+	char *key = make_key(name, fhash, flen);
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir != NULL) {
+		stats.lookups++;
+		sketch_increment(key_hash(key));
+		cache_entry *e = (cache_entry *) g_hash_table_lookup(entries, key);
+		if (e != NULL) {
+			struct stat st;
+			make_path(path, sizeof(path), e->id);
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+			if ((fd >= 0) && ((fstat(fd, &st) < 0) || ((unsigned long long) st.st_size != e->flen))) {
+				close(fd);	// Changed since it was stored (e.g. listed by an old warm state)
+				fd = -1;
+			}
+			if (fd >= 0) {
+				stats.hits++;
+				// Move to the MRU position of its segment
+				GQueue *seg = (e->segment == SEG_WINDOW) ? &window : &main_seg;
+				g_queue_unlink(seg, &e->link);
+				g_queue_push_head_link(seg, &e->link);
+			} else
+				remove_entry(e);	// Deleted from disk
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	free(key);
+	return fd;
+}
+
+
+// Look up the last file cached with 'name', setting its 'fhash' and 'flen'; returns FALSE if
+// there is none or its hash was not verified. It is not counted as a request (see cache_open)
+gboolean cache_find(const char *name, uint32_t *fhash, unsigned long long *flen) {
+	gboolean found = FALSE;
+
+	if (cache_dir == NULL)
+		return FALSE;
+	pthread_mutex_lock(&cache_mutex);
+	cache_entry *e = (names != NULL) ? (cache_entry *) g_hash_table_lookup(names, name) : NULL;
+	if ((e != NULL) && e->verified) {
+		const char *p = e->key + strlen(e->name);	// "/fhash/flen"
+		found = (sscanf(p, "/%08x/%llu", fhash, flen) == 2);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return found;
+}
+
+
+// Count 'bytes' served from the cache
+void cache_served(unsigned long long bytes) {
+	pthread_mutex_lock(&cache_mutex);
+	stats.bytes_saved += bytes;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+// Start storing a file being relayed; returns NULL if it is not going to be cached
+cache_fill *cache_begin(const char *name, uint32_t fhash, unsigned long long flen) {
+	char path[512];
+	cache_fill *f = NULL;
+
+	if ((cache_dir == NULL) || (flen == 0))
+		return NULL;
+	char *key = make_key(name, fhash, flen);
+	pthread_mutex_lock(&cache_mutex);
+	if ((cache_dir != NULL) && (flen <= main_capacity) &&
+			!g_hash_table_contains(entries, key) && !g_hash_table_contains(filling, key)) {
+		f = (cache_fill *) calloc(1, sizeof(cache_fill));
+		f->key = key;
+		f->flen = flen;
+		f->hash = key_hash(key);
+		f->id = ++last_id;
+		make_path(path, sizeof(path), f->id);
+		f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (f->fd < 0) {
+			perror("Failed creating cache file");
+			free(f);
+			f = NULL;
+		} else {
+			g_hash_table_insert(filling, strdup(key), GINT_TO_POINTER(1));
+			key = NULL;	// Owned by f
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	free(key);
+	return f;
+}
+
+
+// Append 'n' bytes to a file being stored
+void cache_write(cache_fill *f, const char *buf, int n) {
+	if ((f == NULL) || f->failed)
+		return;
+	if (write(f->fd, buf, n) != n)
+		f->failed = TRUE;	// e.g. disk full: the file is not cached
+	else
+		f->written += n;
+}
+
+
+// Finish storing a file; complete - all the bytes were written; verified - they matched the hash
+// announced in the Hit. Frees 'f'
+void cache_end(cache_fill *f, gboolean complete, gboolean verified) {
+	char path[512];
+
+	if (f == NULL)
+		return;
+	close(f->fd);
+	pthread_mutex_lock(&cache_mutex);
+	if (filling != NULL)
+		g_hash_table_remove(filling, f->key);
+	if ((cache_dir != NULL) && complete && !f->failed && (f->written == f->flen)) {
+		cache_entry *e = (cache_entry *) calloc(1, sizeof(cache_entry));
+		e->key = f->key;
+		e->flen = f->flen;
+		e->hash = f->hash;
+		e->id = f->id;
+		e->segment = SEG_WINDOW;
+		e->verified = verified;
+		insert_entry(e);
+		g_queue_push_head_link(&window, &e->link);
+		window_used += e->flen;
+		balance_window();
+		f->key = NULL;	// Owned by e
+	} else {
+		if (cache_dir != NULL) {
+			make_path(path, sizeof(path), f->id);
+			unlink(path);
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	free(f->key);
+	free(f);
+}
+
+
+// Call 'fn' for each cached file, window then main segment, most recently used first, and copy
+// the frequency sketch (CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH bytes) to 'sketch'. Returns the
+// cache directory (to free), or NULL if the cache is off
+char *cache_export(cache_visit_fn fn, void *data, uint8_t *sketch_copy, unsigned long *additions) {
+	char *dir = NULL;
+	GList *l;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir != NULL) {
+		for (l = window.head; l != NULL; l = g_list_next(l)) {
+			cache_entry *e = (cache_entry *) l->data;
+			fn(e->key, e->flen, e->id, FALSE, e->verified, data);
+		}
+		for (l = main_seg.head; l != NULL; l = g_list_next(l)) {
+			cache_entry *e = (cache_entry *) l->data;
+			fn(e->key, e->flen, e->id, TRUE, e->verified, data);
+		}
+		memcpy(sketch_copy, sketch, CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH);
+		*additions = sketch_additions;
+		dir = strdup(cache_dir);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return dir;
+}
+
+
+// Current statistics
+void cache_get_stats(cache_stats *st) {
+	pthread_mutex_lock(&cache_mutex);
+	memcpy(st, &stats, sizeof(cache_stats));
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+// Log the hit ratio and the bytes saved
+void cache_report(void) {
+	cache_stats st;
+	char tmp[256];
+
+	if (cache_dir == NULL)
+		return;
+	cache_get_stats(&st);
+	snprintf(tmp, sizeof(tmp), "Content cache: %lu/%lu hits (%.1f%%), %llu KB saved, "
+			"%d files (%llu/%llu MB), %lu admitted, %lu rejected, %lu evicted\n",
+			st.hits, st.lookups, st.lookups ? 100.0 * st.hits / st.lookups : 0.0,
+			st.bytes_saved >> 10, st.entries, st.used >> 20, st.capacity >> 20,
+			st.admitted, st.rejected, st.evicted);
+	Log(tmp);
+}
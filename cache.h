@@ -0,0 +1,80 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * cache.h
+ *
+ * Header file of the content cache: files relayed by the proxy threads are
+ *    stored on disk, keyed by (filename, fhash, flen) from the Hit, and later
+ *    requests for the same content are served from disk without connecting to
+ *    the IPv6 server. Admission and eviction follow W-TinyLFU: a small LRU
+ *    window, and a main LRU segment that only admits a file if it was requested
+ *    more often than the file it would evict.
+\*****************************************************************************/
+
+#ifndef INCL_CACHE_H
+#define INCL_CACHE_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+#define CACHE_DEFAULT_BYTES		(1LL << 30)	// Default capacity - 1 GiB
+#define CACHE_WINDOW_PERCENT	1			// Size of the window segment (% of the capacity)
+#define CACHE_SKETCH_WIDTH		(1 << 16)	// Counters per row of the frequency sketch
+#define CACHE_SKETCH_ROWS		4			// Rows of the frequency sketch
+#define CACHE_FILE_SUFFIX		".gwc"		// Suffix of the cached files
+
+// File being stored in the cache
+typedef struct cache_fill cache_fill;
+
+// Function called for each cached file by cache_export (and by the warm state to restore them)
+typedef void (*cache_visit_fn)(const char *key, unsigned long long flen, unsigned int id, gboolean main_seg,
+		gboolean verified, void *data);
+
+// Cache statistics
+typedef struct cache_stats {
+	unsigned long lookups;			// Requests checked against the cache
+	unsigned long hits;				// Requests served from the cache
+	unsigned long long bytes_saved;	// Bytes served without fetching them from a server
+	unsigned long admitted;			// Files admitted to the main segment
+	unsigned long rejected;			// Files not admitted (less frequent than the victim)
+	unsigned long evicted;			// Files evicted
+	int entries;					// Files in the cache
+	unsigned long long used;		// Bytes in the cache
+	unsigned long long capacity;	// Capacity (bytes)
+} cache_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Create the cache in directory 'dir', with 'capacity' bytes; dir == NULL turns it off
+// Files left by a previous run are kept if the warm state lists them, and removed otherwise
+gboolean cache_init(const char *dir, unsigned long long capacity);
+// Remove all the cached files
+void cache_destroy(void);
+// Open the cached copy of a file; returns a file descriptor or -1 if it is not cached
+int cache_open(const char *name, uint32_t fhash, unsigned long long flen);
+// Look up the last file cached with 'name', setting its 'fhash' and 'flen'; returns FALSE if
+// there is none or its hash was not verified. It is not counted as a request (see cache_open)
+gboolean cache_find(const char *name, uint32_t *fhash, unsigned long long *flen);
+// Count 'bytes' served from the cache
+void cache_served(unsigned long long bytes);
+// Start storing a file being relayed; returns NULL if it is not going to be cached
+cache_fill *cache_begin(const char *name, uint32_t fhash, unsigned long long flen);
+// Append 'n' bytes to a file being stored
+void cache_write(cache_fill *f, const char *buf, int n);
+// Finish storing a file; complete - all the bytes were written; verified - they matched the hash
+// announced in the Hit. Frees 'f'
+void cache_end(cache_fill *f, gboolean complete, gboolean verified);
+// Call 'fn' for each cached file, window then main segment, most recently used first, and copy
+// the frequency sketch (CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH bytes) to 'sketch'. Returns the
+// cache directory (to free), or NULL if the cache is off
+char *cache_export(cache_visit_fn fn, void *data, uint8_t *sketch, unsigned long *additions);
+// Current statistics
+void cache_get_stats(cache_stats *st);
+// Log the hit ratio and the bytes saved
+void cache_report(void);
+
+#endif
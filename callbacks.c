@@ -10,6 +10,7 @@
  * @author  Luis Bernardo
  \*****************************************************************************/
 
+#include <pthread.h>
 #include <gtk/gtk.h>
 #include <arpa/inet.h>
 #include <assert.h>
@@ -23,6 +24,26 @@
 #include "callbacks.h"
 #include "callbacks_socket.h"
 #include "proxy_thread.h"
+#include "options.h"
+#include "trace.h"
+#include "hotrestart.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "coalesce.h"
+#include "fhash.h"
+#include "spool.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "affinity.h"
+#include "srpt.h"
+#include "admission.h"
+#include "warmstate.h"
+#include "localindex.h"
+#include "slab.h"
+#include "intern.h"
+#include "groups.h"
+#include "reaper.h"
+#include "workers.h"
 
 #ifdef DEBUG
 #define debugstr(x)     g_print(x)
@@ -36,7 +57,7 @@
 
 gboolean active = FALSE; 	// TRUE if server is active
 
-GList *qlist = NULL;			// List of active queries
+GQueue qlist = G_QUEUE_INIT;	// List of active queries (queue keeps appends O(1))
 
 /*********************\
 |*  Local variables  *|
@@ -45,6 +66,10 @@ GList *qlist = NULL;			// List of active queries
 // Temporary buffer used for writing, logging, etc.
 static char tmp_buf[8000];
 
+static slab_cache *query_slab = NULL;	// Query descriptors
+// Protects the hits of the Queries, read by the proxy threads while Hits arrive
+static pthread_mutex_t hits_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // Local functions
 gboolean callback_query_timeout(gpointer data);
 
@@ -54,54 +79,72 @@ gboolean callback_query_timeout(gpointer data);
 \*****************************************/
 
 // Create a Query descriptor and put it in qlist; starts the timer
-Query *new_Query(const char *filename, uint16_t seq, gboolean is_ipv6, struct in6_addr *ipv6,struct in_addr *ipv4, u_short porto, char* buf, int bufLen) {
+Query *new_Query(const char *filename, uint16_t seq, gboolean is_ipv6, struct in6_addr *ipv6,struct in_addr *ipv4, u_short porto) {
 	Query *pt;
+	char qname[CNAME_LENGTH+41];
 	assert((filename!=NULL));
-	pt = (Query *) malloc(sizeof(Query));
-	strncpy(pt->name, filename, sizeof(pt->name));
+	if (query_slab == NULL)
+		query_slab = slab_create("Query", sizeof(Query));
+	pt = (Query *) slab_alloc(query_slab);
+	if (pt == NULL)
+		return NULL;
+	pt->name = intern_get(filename);
 	pt->seq = seq;
 	pt->thread = NULL;
 	pt->is_ipv6 = is_ipv6;
-	sprintf(pt->qname, "'%s'(%d)%s", filename, seq, is_ipv6 ? "v6" : "v4");
 
 	// ############ part of TASK 2  ############
 	// Complete add code to store the extra parameters in the Query structure
 	//
+	pt->timer_jitter = 0;
 	pt->timer_id = 0;
 	pt->timer_id2 = 0;
-
-	if(is_ipv6){
-		pt->ipv6 = (struct in6_addr*) malloc(sizeof(struct in6_addr));
-		memcpy(pt->ipv6, ipv6, sizeof(struct in6_addr));
-		pt->ipv4 = NULL;
-	}
-	else{
-		pt->ipv4 = (struct in_addr*) malloc(sizeof(struct in_addr));
-		memcpy(pt->ipv4, ipv4, sizeof(struct in_addr));
-		pt->ipv6 = NULL;
-	}
+	pt->timer_deadline = 0;
+	pt->hit_fhash = 0;
+	pt->hit_flen = 0;
+	pt->hits = NULL;
+	pt->n_hits = 0;
+	pt->max_hits = 0;
+	pt->prefetch = NULL;
+	pt->group = 0;
+	group_query_added(0);
+
+	if(is_ipv6)
+		memcpy(&pt->addr.ipv6, ipv6, sizeof(struct in6_addr));
+	else
+		memcpy(&pt->addr.ipv4, ipv4, sizeof(struct in_addr));
 
 	pt->port = porto;
 
-	pt->state=S_JITTER;
-
-	pt->buf_temp = (char*) malloc(bufLen + 1);
-	memcpy(pt->buf_temp, buf, (bufLen + 1));
-	pt->tmp_buflen = bufLen;
+	snprintf(qname, sizeof(qname), QUERY_FMT, QUERY_ARGS(pt));
+	pt->trace_id = trace_new_object(TRACE_QUERY, qname);
+	set_query_state(pt, S_JITTER);
 
 	pt->self_ = pt;
-	qlist = g_list_append(qlist, pt);
+	pt->link.data = pt;
+	g_queue_push_tail_link(&qlist, &pt->link);
 
 	return pt;
 }
 
+// Move the Query to group pair 'group', which forwards it and answers its client
+void set_Query_group(Query *q, int group) {
+	group_query_removed(q->group);
+	group_query_added(group);
+	q->group = (uint16_t) group;
+}
+
 // Search for Query descriptor in qlist
+// The names are interned: they are compared by pointer
 Query *locate_in_QueryList(const char *filename, uint16_t seq) {
 	assert(filename != NULL);
+	const char *iname = intern_find(filename);
 	GList *list;
-	for (list = qlist; list != NULL; list = g_list_next(list)) {
+	if (iname == NULL)
+		return NULL;	// No Query has this name
+	for (list = qlist.head; list != NULL; list = g_list_next(list)) {
 		if (((Query *) list->data)->seq == seq)
-			if (!strcmp(filename, ((Query *) list->data)->name))
+			if (((Query *) list->data)->name == iname)
 				return (Query *) list->data;
 	}
 
@@ -111,11 +154,14 @@ Query *locate_in_QueryList(const char *filename, uint16_t seq) {
 // Search for Query descriptor in qlist
 Query *locate_in_QueryList_IP(const char *filename, uint16_t seq, gboolean is_ipv6) {
 	assert(filename != NULL);
+	const char *iname = intern_find(filename);
 	GList *list;
-	for (list = qlist; list != NULL; list = g_list_next(list)) {
+	if (iname == NULL)
+		return NULL;	// No Query has this name
+	for (list = qlist.head; list != NULL; list = g_list_next(list)) {
 		Query *q = (Query *) list->data;
 		if (q->seq == seq)
-			if (!strcmp(filename, q->name))
+			if (q->name == iname)
 				if (q->is_ipv6 == is_ipv6)
 					if (q->self_ == q)
 						return (Query *) list->data;
@@ -123,6 +169,73 @@ Query *locate_in_QueryList_IP(const char *filename, uint16_t seq, gboolean is_ip
 	return NULL;
 }
 
+// Remove the pending timers of the Query
+static void remove_query_timers(Query *q) {
+	if (q->timer_jitter > 0)
+		g_source_remove(q->timer_jitter);
+	if (q->timer_id > 0)
+		g_source_remove(q->timer_id);
+	if (q->timer_id2 > 0)
+		g_source_remove(q->timer_id2);
+	q->timer_jitter = q->timer_id = q->timer_id2 = 0;
+}
+
+// Search for the Query descriptor of group pair 'group' in qlist
+Query *locate_in_QueryList_group(const char *filename, uint16_t seq, gboolean is_ipv6, int group) {
+	assert(filename != NULL);
+	const char *iname = intern_find(filename);
+	GList *list;
+	if (iname == NULL)
+		return NULL;	// No Query has this name
+	for (list = qlist.head; list != NULL; list = g_list_next(list)) {
+		Query *q = (Query *) list->data;
+		if ((q->seq == seq) && (q->name == iname) && (q->is_ipv6 == is_ipv6) && (q->group == group) &&
+				(q->self_ == q))
+			return q;
+	}
+	return NULL;
+}
+
+// Address of the Query's sender (IPv4-mapped for IPv4)
+void get_Query_sender(const Query *q, struct in6_addr *addr) {
+	if (q->is_ipv6) {
+		memcpy(addr, &q->addr.ipv6, sizeof(struct in6_addr));
+	} else {
+		memset(addr, 0, sizeof(struct in6_addr));
+		addr->s6_addr[10] = addr->s6_addr[11] = 0xFF;
+		memcpy(&addr->s6_addr[12], &q->addr.ipv4, sizeof(struct in_addr));
+	}
+}
+
+// Search for the Query of a TCP client from 'client' in qlist: when it is pending in several group
+// pairs, the one sent from the client's address; NULL if none or several of them match
+Query *locate_in_QueryList_client(const char *filename, uint16_t seq, gboolean is_ipv6,
+		const struct in6_addr *client) {
+	assert(filename != NULL);
+	const char *iname = intern_find(filename);
+	Query *any = NULL, *from = NULL;
+	int n_any = 0, n_from = 0;
+	struct in6_addr sender;
+	GList *list;
+	if (iname == NULL)
+		return NULL;	// No Query has this name
+	for (list = qlist.head; list != NULL; list = g_list_next(list)) {
+		Query *q = (Query *) list->data;
+		if ((q->seq != seq) || (q->name != iname) || (q->is_ipv6 != is_ipv6) || (q->self_ != q))
+			continue;
+		any = q;
+		n_any++;
+		get_Query_sender(q, &sender);
+		if (IN6_ARE_ADDR_EQUAL(&sender, client)) {
+			from = q;
+			n_from++;
+		}
+	}
+	if (n_any == 1)
+		return any;		// In one pair only (the client may connect from another address)
+	return (n_from == 1) ? from : NULL;
+}
+
 // Free Query descriptor and all pending memory
 // called_from_GUI - use TRUE if called from a GUI event; FALSE otherwise (i.e. from socket, thread or timer event)
 void del_Query(Query *q, gboolean called_from_GUI) {
@@ -131,8 +244,10 @@ void del_Query(Query *q, gboolean called_from_GUI) {
 
 
 	q->self_ = NULL;	// It is being freed
+	remove_query_timers(q);	// Its slot may be reused while they are pending
+	trace_event(TRACE_QUERY, q->trace_id, TRACE_END);
 
-	qlist = g_list_remove(qlist, q);
+	g_queue_unlink(&qlist, &q->link);
 
 	// ############ part of TASKs 2 to 6 ############
 	// Complete putting here the code to stop and free everything
@@ -141,25 +256,76 @@ void del_Query(Query *q, gboolean called_from_GUI) {
 	// Delete from GUI
 	GUI_del_Query(q->name, q->seq, q->is_ipv6, called_from_GUI);
 
-	free(q->buf_temp);
-	free(q->ipv4);
-	free(q->ipv6);
-
-	free(q);
+	group_query_removed(q->group);
+	prefetch_drop(q);
+	pthread_mutex_lock(&hits_mutex);
+	free(q->hits);
+	q->hits = NULL;
+	q->n_hits = 0;
+	pthread_mutex_unlock(&hits_mutex);
+	intern_put(q->name);
+	slab_free(query_slab, q);
 }
 
 // Abort and free all active queries
 void del_query_list(gboolean called_from_GUI) {
-	while (qlist != NULL) {
-		Query *pt = (Query *) qlist->data;
+	while (qlist.head != NULL) {
+		Query *pt = (Query *) qlist.head->data;
 		del_Query(pt, called_from_GUI);
-		if ((qlist!=NULL) && (pt == qlist->data)) {
+		if ((qlist.head!=NULL) && (pt == qlist.head->data)) {
 			fprintf(stderr, "Internal error in del_query_list()\n");
 			break;
 		}
 	}
 }
 
+// Add a server that announced the file in a Hit to the Query (IPv4 servers as IPv4-mapped)
+// Returns FALSE if it was already listed or there is no space for it
+gboolean add_Query_hit(Query *q, const struct in6_addr *ip, u_short port, uint32_t fhash,
+		unsigned long long flen) {
+	hit_server *hs;
+	int i;
+
+	pthread_mutex_lock(&hits_mutex);
+	for (i = 0; i < q->n_hits; i++)
+		if ((q->hits[i].addr.sin6_port == htons(port)) &&
+				IN6_ARE_ADDR_EQUAL(&q->hits[i].addr.sin6_addr, ip)) {
+			pthread_mutex_unlock(&hits_mutex);
+			return FALSE;
+		}
+	if (q->n_hits == q->max_hits) {
+		int max = (q->max_hits == 0) ? 2 : 2 * q->max_hits;
+		hs = (max <= QUERY_MAX_HITS) ? (hit_server *) realloc(q->hits, max * sizeof(hit_server)) : NULL;
+		if (hs == NULL) {
+			pthread_mutex_unlock(&hits_mutex);
+			return FALSE;
+		}
+		q->hits = hs;
+		q->max_hits = max;
+	}
+	hs = &q->hits[q->n_hits++];
+	memset(&hs->addr, 0, sizeof(hs->addr));
+	hs->addr.sin6_family = AF_INET6;
+	hs->addr.sin6_port = htons(port);
+	memcpy(&hs->addr.sin6_addr, ip, sizeof(struct in6_addr));
+	hs->fhash = fhash;
+	hs->flen = flen;
+	pthread_mutex_unlock(&hits_mutex);
+	return TRUE;
+}
+
+// Copy up to 'max' servers in the Hits received for the Query to 'servers'; returns their number
+int get_Query_hits(Query *q, hit_server *servers, int max) {
+	int n;
+
+	pthread_mutex_lock(&hits_mutex);
+	n = MIN(q->n_hits, max);
+	if (n > 0)
+		memcpy(servers, q->hits, n * sizeof(hit_server));
+	pthread_mutex_unlock(&hits_mutex);
+	return n;
+}
+
 
 /*******************************************************\
 |* Functions to control the state of the application   *|
@@ -174,14 +340,21 @@ static const char *get_trunc_filename(const char *FileName) {
 		return FileName;
 }
 
+// Change the Query state, recording the transition in the lifecycle trace
+void set_query_state(Query *q, QueryState state) {
+	q->state = state;
+	trace_event(TRACE_QUERY, q->trace_id, state);
+}
+
 // Start timer
 void start_query_timer(Query *q, long int timeout) {
 	if ((q == NULL) || (q->self_ != q))
 		return;
+	q->timer_deadline = g_get_monotonic_time() + 1000 * timeout;
 
 	// ############ part of TASK 5 ############
 	if(q->state == S_JITTER){
-		g_timeout_add(timeout,                    //Numero de milisegundos
+		q->timer_jitter = g_timeout_add(timeout,  //Numero de milisegundos
 	                  callback_query_timeout,    //Funcao invocada
 					  q);                        //Argumento passado a funcao
 
@@ -201,7 +374,7 @@ void start_query_timer(Query *q, long int timeout) {
 			return;
 		}
 
-		q->state=S_TIMER;
+		set_query_state(q, S_TIMER);
 	}
 
 	if(q->state == S_TRY_TCP){
@@ -219,7 +392,7 @@ void start_query_timer(Query *q, long int timeout) {
 
 
 	#ifdef DEBUG
-		fprintf(stderr, "%s started timer %u : %ld ms\n", q->qname, q->timer_id, timeout);
+		fprintf(stderr, QUERY_FMT " started timer %u : %ld ms\n", QUERY_ARGS(q), q->timer_id, timeout);
 	#endif
 }
 
@@ -236,7 +409,7 @@ void stop_query_timer(Query *q) {
 		 Log("HIT Timer canceled \n");
 
 		#ifdef DEBUG
-				fprintf(stderr, "%s stopped timer %u\n", q->qname, q->timer_id);
+				fprintf(stderr, QUERY_FMT " stopped timer %u\n", QUERY_ARGS(q), q->timer_id);
 		#endif
 	}
 
@@ -247,7 +420,7 @@ void stop_query_timer(Query *q) {
 		Log("Connection Timer canceled\n");
 
 		#ifdef DEBUG
-				fprintf(stderr, "%s stopped timer %u\n", q->qname, q->timer_id2);
+				fprintf(stderr, QUERY_FMT " stopped timer %u\n", QUERY_ARGS(q), q->timer_id2);
 		#endif
 	}
 }
@@ -261,28 +434,36 @@ gboolean callback_query_timeout(gpointer data) {
 		return FALSE; // stop timer
 	}
 
-	if (q->qname != NULL)
-		g_print("Callback query_timeout (%s)\n", q->qname);
-	else
-		g_print("Callback query_timeout (NULL)\n");
+	g_print("Callback query_timeout (" QUERY_FMT ")\n", QUERY_ARGS(q));
+
+	// The timer that fired ends with this call: it must not be removed again
+	guint id = g_source_get_id(g_main_current_source());
+	if (q->timer_jitter == id)
+		q->timer_jitter = 0;
+	if (q->timer_id == id)
+		q->timer_id = 0;
+	if (q->timer_id2 == id)
+		q->timer_id2 = 0;
 
 	if(q->state == S_JITTER){
+			char qbuf[MESSAGE_MAX_LENGTH];	// Query message, rebuilt from the Query fields
+			int qlen;
 
 			Log("End of Jitter timer.\n");
 
 			//gboolean write_query_message(char *buf, int *len, uint16_t seq, const char* filename)
-			if(!write_query_message(q->buf_temp, &q->tmp_buflen, q->seq, q->name)){
+			if(!write_query_message(qbuf, &qlen, q->seq, q->name)){
 				del_Query(q, FALSE);
 				return FALSE;
 			}
-			//gboolean send_multicast(const char *buf, int n, gboolean use_IPv6)
-			if(!send_multicast(q->buf_temp, q->tmp_buflen, !(q->is_ipv6))){
+			// Sent to the other group of the Query's pair
+			if(!group_multicast(q->group, qbuf, qlen, !(q->is_ipv6))){
 				del_Query(q, FALSE);
 				return FALSE;
 			}
 
-	        send_multicast(q->buf_temp, q->tmp_buflen, !(q->is_ipv6));
-	        q->state=S_IDLE;
+	        group_multicast(q->group, qbuf, qlen, !(q->is_ipv6));
+	        set_query_state(q, S_IDLE);
 
 	        //Task 4 - start the Query timer to limit the waiting time for an HIT message
 	        start_query_timer(q, QUERY_TIMEOUT);
@@ -317,9 +498,148 @@ gboolean callback_query_timeout(gpointer data) {
 }
 
 
+// Answer the Query with a Hit pointing to the gateway's TCP port of the client's domain, and wait
+// for the client's connection; returns FALSE if the Hit was not sent
+static gboolean relay_Hit(Query *q, uint32_t fhash, unsigned long long flen) {
+	char hbuf[MSG_BUFFER_SIZE];		// sending HIT buffer
+	int hlen;						// sending HIT message length
+	uint16_t seq = q->seq;
+	const char *fname = q->name;
+
+	if ((q->is_ipv6) /* HIT comes from IPv4 fileexchange == QUERY came from IPv6 */ ) {
+		/***********************************************/
+		/**** HIT received from an IPv4 fileexchange ***/
+		/***********************************************/
+
+		Log("--> HIT IPV4\n");
+
+		// Send the HIT message to the client
+		// You should get the client information from your Query list.
+		// You may also get the client's information from the graphical table calling
+		// gboolean GUI_get_Query_details(const char *filename, uint16_t seq, gboolean is_ipv6, const char **str_ip, unsigned int *port, const char **hits);
+		//	   str_ip has the IP address and port has the port number of the client.
+		// The client connects to the gateway's TCP port for IPv6 clients, which relays
+		// the file from the IPv4 server (see proxy_function)
+		if(!write_hit_message(hbuf, &hlen, seq, fname, fhash, flen, portTCP6, addr_ipv6(&local_ipv6))){
+			Log("ERROR - The Hit message couldn't be created.\n");
+			return FALSE;
+		}
+
+		// With worker processes, the worker that accepts the client's connection relays it
+		if (workers_running() && !workers_offer(q))
+			return FALSE;
+		// Send the HIT packet to the client
+		if(!group_reply6(q->group, &q->addr.ipv6, q->port, hbuf, hlen)){
+			Log("ERROR - The Hit was not sended.\n");
+			return FALSE;
+		}
+		if(!GUI_add_Proxy(fname, seq)){
+			Log("ERROR - Failed to add Hit to GUI interface.\n");
+			return FALSE;
+		}
+
+		// Wait for the client's connection
+		set_query_state(q, S_TRY_TCP);
+		start_query_timer(q, HIT_CONNECTION_TIMEOUT);
+		if (options.preconnect && !workers_running())
+			prefetch_start(q);
+		return TRUE;
+
+	}
+
+	/***********************************************/
+	/**** HIT received from an IPv6 fileexchange => Query came from IPV4***/
+	/***********************************************/
+	// ############ TASK 6 ############
+
+	if(!(q->is_ipv6)){
+
+		Log("--> HIT IPV6\n");
+
+		// Test if a thread is already active ...
+		if(locate_state_in_plist(fname, seq) != NULL){
+			Log("NULL Hit.\n");
+			return FALSE;
+		}
+
+		//gboolean write_hit_message(char *buf, int *len, uint16_t seq, const char* filename, uint32_t fhash,
+		//		unsigned long long flen, unsigned short sTCP_port, const char *serverIP);
+		if(!write_hit_message(hbuf, &hlen, seq, fname, fhash, flen, portTCP, addr_ipv4(&local_ipv4))){
+			Log("ERROR - IPv4 write Hit failed.\n");
+			return FALSE;
+		}
+
+		if (workers_running() && !workers_offer(q))
+			return FALSE;
+		if(!group_reply4(q->group, &q->addr.ipv4, q->port, hbuf, hlen)){
+			Log("ERROR - IPv4 Hit failed to send.\n");
+			return FALSE;
+		}
+		if(!GUI_add_Proxy(fname, seq)){
+			Log("ERROR - Failed to add Hit to GUI interface.\n");
+			return FALSE;
+		}
+
+		set_query_state(q, S_TRY_TCP);
+		//Task 8
+		start_query_timer(q, HIT_CONNECTION_TIMEOUT);
+		// Open the server connection while the client connects
+		if (options.preconnect && !workers_running())
+			prefetch_start(q);
+
+		return TRUE;
+
+	// Prepare a new HIT message with the proxy information and send it to the client.
+	// Use  write_hit_message(...) and
+	//		send_message4(&client_ipv4_address, client_port, HIT_buffer, HIT_buflen)
+	// where client_ipv4_address and client_port should be in the Query structure
+	//
+	// Remember that you need to send a valid IPv4 address to the IPv4 fileexchange, identifying
+	//  the gateway TCP port, and later, when you receive the TCP communication, this
+	//  thread will be associated with the Query.
+	// You may add the proxy information to the GUI, just to inform that you are expecting a connection using
+//	GUI_add_Proxy(filename, seq);
+	// where filename and seq are stored in the Query structure
+
+	// Restart the timer, to wait for up to QUERY_TIMEOUT microseconds for a connection
+	// In this case you need to create a new proxy object and add it to the GUI
+	}
+	return FALSE;
+}
+
+
+// Answer a new Query at once, for a file the gateway holds or with the 'n' servers of a recent
+// Hit for it; returns FALSE (the Query was deleted) if the Hit was not sent
+static gboolean answer_Query(Query *q, hit_server *servers, int n, uint32_t fhash, unsigned long long flen) {
+	char str[HIT_SERVER_STRLEN];
+	int i;
+
+	set_query_state(q, S_HIT);
+	q->hit_fhash = fhash;
+	q->hit_flen = flen;
+	for (i = 0; i < n; i++)
+		if (add_Query_hit(q, &servers[i].addr.sin6_addr, ntohs(servers[i].addr.sin6_port), fhash, flen))
+			GUI_add_hit_to_Query(q->name, q->seq, q->is_ipv6, hit_server_str(&servers[i], str));
+	if (!relay_Hit(q, fhash, flen)) {
+		del_Query(q, FALSE);	// No timer runs for it
+		return FALSE;
+	}
+	sprintf(tmp_buf, "Answered " QUERY_FMT " with %s\n", QUERY_ARGS(q), (n > 0) ? "a known Hit" : "local content");
+	Log(tmp_buf);
+	return TRUE;
+}
+
+
 // Handle the reception of a Query packet  (is_ipv6, ipv6, ipv4 and port contain the sender's address)
 void handle_Query(char *buf, int buflen, gboolean is_ipv6,
 		struct in6_addr *ipv6, struct in_addr *ipv4, u_short port) {
+	handle_group_Query(buf, buflen, 0, is_ipv6, ipv6, ipv4, port);
+}
+
+
+// Handle the reception of a Query packet from the groups of pair 'group'
+void handle_group_Query(char *buf, int buflen, int group, gboolean is_ipv6,
+		struct in6_addr *ipv6, struct in_addr *ipv4, u_short port) {
 	uint16_t seq;
 	const char *fname;
 
@@ -335,18 +655,22 @@ void handle_Query(char *buf, int buflen, gboolean is_ipv6,
 		return;
 	}
 
-	char tmp_ip[100];
+	struct in6_addr sender;
 	if (is_ipv6)
-		strcpy(tmp_ip, addr_ipv6(ipv6));
+		memcpy(&sender, ipv6, sizeof(sender));
 	else
-		strcpy(tmp_ip, addr_ipv4(ipv4));
-	if (is_local_ip(tmp_ip) && (port == portUDPq)) {
+		ipv4_to_mapped(ipv4, &sender);
+	if ((port == group_query_port(group)) && is_local_address(&sender)) {
 		// Ignore local loopback
 		return;
 	}
 
-	sprintf(tmp_buf, "Received Query '%s'(%d) from [%s]:%hu\n", fname, seq,
-			(is_ipv6 ? addr_ipv6(ipv6) : addr_ipv4(ipv4)), port);
+	if (group == 0)
+		sprintf(tmp_buf, "Received Query '%s'(%d) from [%s]:%hu\n", fname, seq,
+				(is_ipv6 ? addr_ipv6(ipv6) : addr_ipv4(ipv4)), port);
+	else
+		sprintf(tmp_buf, "Received Query '%s'(%d) from [%s]:%hu in group pair %d\n", fname, seq,
+				(is_ipv6 ? addr_ipv6(ipv6) : addr_ipv4(ipv4)), port, group);
 	Log(tmp_buf);
 
 	// ############ part of TASKs 2,4,5 ############
@@ -355,14 +679,40 @@ void handle_Query(char *buf, int buflen, gboolean is_ipv6,
 	// Check if the query has appeared in the !is_ipv6 domain - if it has, ignore it because someone else send it before.
 	// Use the GUI or qlist  ...
 	Query * q= NULL;
-	q= (Query*) locate_in_QueryList_IP(fname,seq,is_ipv6);
+	q= locate_in_QueryList_group(fname, seq, is_ipv6, group);	// The same Query may be in several pairs
+	Query* new_query = NULL;
+	hit_server known[MAX_HIT_SERVERS];	// Servers of a recent Hit for the file
+	uint32_t known_fhash = 0;
+	unsigned long long known_flen = 0;
+	int n_known = 0;
+	gboolean local = FALSE, from_cache = FALSE;
 
 	if(q==NULL){
 
-		Query* new_query = new_Query(fname, seq, is_ipv6 , ipv6, ipv4, port, buf, buflen);
-
-		long int jitter_time=(long)floor(1.0*random())/RAND_MAX*QUERY_JITTER;
-		start_query_timer(new_query,jitter_time);
+		// Each pair has its own limit of pending Queries
+		if (!group_accepts_query(group)) {
+			sprintf(tmp_buf, "Query '%s'(%d) dropped - group pair %d has too many pending Queries\n",
+					fname, seq, group);
+			Log(tmp_buf);
+			return;
+		}
+		new_query = new_Query(fname, seq, is_ipv6 , ipv6, ipv4, port);
+		if (new_query == NULL) {
+			Log("ERROR - No memory for the Query\n");
+			return;
+		}
+		if (group != 0)
+			set_Query_group(new_query, group);
+
+		// A file the gateway holds, or found recently, is answered at once, without forwarding the Query
+		// (not with worker processes, which only relay from file servers)
+		local = options.local_answer && !workers_running() && local_lookup(fname, &known_fhash, &known_flen, &from_cache);
+		if (!local)
+			n_known = warm_hit_lookup(fname, is_ipv6, group, &known_fhash, &known_flen, known, MAX_HIT_SERVERS);
+		if (!local && (n_known == 0)) {
+			long int jitter_time=(long)floor(1.0*random())/RAND_MAX*QUERY_JITTER;
+			start_query_timer(new_query,jitter_time);
+		}
 	}
 
 	// If it is new, create a new Query struct and store it in your list
@@ -378,16 +728,29 @@ void handle_Query(char *buf, int buflen, gboolean is_ipv6,
 	//This helps when there are more than one gateway connecting two multicast groups!
 
 	// Add the query to the graphical Query list
-	 GUI_add_Query(fname, seq, is_ipv6, strdup(tmp_ip), port);
+	 GUI_add_Query(fname, seq, is_ipv6, (is_ipv6 ? addr_ipv6(ipv6) : addr_ipv4(ipv4)), port);
 	 Log("Query added to GUI\n");
+
+	if (local) {
+		if (answer_Query(new_query, known, 0, known_fhash, known_flen))
+			local_answered(from_cache);
+	} else if (n_known > 0) {
+		if (answer_Query(new_query, known, n_known, known_fhash, known_flen))
+			warm_hit_used();
+	}
 }
 
 
 // Handle the reception of an Hit packet
 void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port,
 		gboolean is_ipv6) {
-	char hbuf[MSG_BUFFER_SIZE];		// sending HIT buffer
-	int hlen;						// sending HIT message length
+	handle_group_Hit(buf, buflen, 0, ip, port, is_ipv6);
+}
+
+
+// Handle the reception of an Hit packet at the query socket of pair 'group'
+void handle_group_Hit(char *buf, int buflen, int group, struct in6_addr *ip, u_short port,
+		gboolean is_ipv6) {
 	uint16_t seq;
 	const char *fname;
 	unsigned long long flen;
@@ -411,146 +774,80 @@ void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port,
 	// Test here if this HIT matches one of the pending Query contents
 	// If not, ignore the Hit received
 	Query * query_hit= NULL;
-	query_hit=locate_in_QueryList(fname, seq);
+	query_hit=locate_in_QueryList_group(fname, seq, !is_ipv6, group);	// Query from the other domain
 
-	if(query_hit==NULL || (query_hit->state!=S_TIMER) ){
+	if(query_hit==NULL){
+		return;
+	}
+	if (query_hit->state != S_TIMER) {
+		// Another server with the same file, for a Query already answered:
+		// it is listed for the segmented download
+		if ((query_hit->state >= S_HIT) && (query_hit->hit_flen == flen) &&
+				(query_hit->hit_fhash == fhash) &&
+				add_Query_hit(query_hit, ip, sTCP_port, fhash, flen)) {
+			sprintf(tmp_buf, "%s-%hu", addr_ipv6(ip), sTCP_port);
+			GUI_add_hit_to_Query(fname, seq, !is_ipv6, tmp_buf);
+			warm_hit_add(fname, !is_ipv6, group, fhash, flen, ip, sTCP_port);
+		}
 		return;
 	}
 
+	// Stored first: if it fails, the Query keeps waiting for a Hit, with its timer
+	if (!add_Query_hit(query_hit, ip, sTCP_port, fhash, flen)) {
+		Log("ERROR - No memory for the Hit\n");
+		return;
+	}
 	Log("Stopping Timer an HIT has arrived.\n");
 	stop_query_timer(query_hit);
-	query_hit->state=S_HIT;
-	sprintf(tmp_buf, "%s-%hu", addr_ipv6(ip), sTCP_port);
+	set_query_state(query_hit, S_HIT);
+	query_hit->hit_fhash = fhash;
+	query_hit->hit_flen = flen;
+	warm_hit_add(fname, !is_ipv6, group, fhash, flen, ip, sTCP_port);	// Remembered to answer the next Queries
 
 	// Add HIT to GUI list
+	sprintf(tmp_buf, "%s-%hu", addr_ipv6(ip), sTCP_port);
 	if(!GUI_add_hit_to_Query(fname, seq, !is_ipv6, tmp_buf)){
 		Log("ERROR - The received Hit was not added to the GUI.\n");
 		return;
 	}
 
-	if ((query_hit->is_ipv6) /* HIT comes from IPv4 fileexchange == QUERY came from IPv6 */ ) {
-		/***********************************************/
-		/**** HIT received from an IPv4 fileexchange ***/
-		/***********************************************/
-
-		Log("--> HIT IPV4\n");
-
-		// Send the HIT message to the client
-		// You should get the client information from your Query list.
-		// You may also get the client's information from the graphical table calling
-		// gboolean GUI_get_Query_details(const char *filename, uint16_t seq, gboolean is_ipv6, const char **str_ip, unsigned int *port, const char **hits);
-		//	   str_ip has the IP address and port has the port number of the client.
-		//write_hit_message(hbuf, &hlen, seq, fname, fhash, flen, sTCP_port, serverIP);
-		if(!write_hit_message(hbuf, &hlen, seq, fname, fhash, flen, sTCP_port, addr_ipv6(&local_ipv6))){
-			Log("ERROR - The Hit message couldn't be created.\n");
-			return;
-		}
-
-		//(char *buf, int *len, uint16_t seq, const char* filename, uint32_t fhash,
-		//							unsigned long long flen, unsigned short sTCP_port, const char *serverIP)
-		//{
-		// Use the function write_hit_message(hbuf, &hlen, seq, fname, fhash, flen, sTCP_port, ...) to prepare the Hit message
-		//     in buffer hbuf, where the missing parameter is a string with the server's IP address converted from IPv4 to IPv6 in string format
-
-		// Send the HIT packet to the client
-		//    use the function send_M6reply(... , ... , hbuf, hlen) to send the Hit
-		//gboolean send_M6reply(struct in6_addr *ip, u_short port, const char *buf, int n)
-		if(!send_M6reply(query_hit->ipv6, query_hit->port, hbuf, hlen)){
-			Log("ERROR - The Hit was not sended.\n");
-			return;
-		}
-		// In order to avoid not seeing the Query in the graphical table, I recommend that you wait for timeout to clear the GUI entry
-		// Otherwise, you can clear it from the GUI table here using:
-		//GUI_del_Query(fname, seq, !is_ipv6, FALSE);
-
-
-//#ifdef DEBUG
-//		sprintf(tmp_buf,
-//				"Sent Hit '%s' (IP= %s, port= %hu; Len=%llu; Hash=%u) to %s:%hu\n",
-//				fname, /*server_ipv6*/, portTCP, flen, fhash, addr_ipv6(&local_ipv6), q->snd_port);
-//		Log(tmp_buf);
-//#endif
-
-		// Wait for timeout to clear the GUI entry
-		return;
-
-	}
-
-	/***********************************************/
-	/**** HIT received from an IPv6 fileexchange => Query came from IPV4***/
-	/***********************************************/
-	// ############ TASK 6 ############
-
-	if(!(query_hit->is_ipv6)){
-
-		Log("--> HIT IPV6\n");
-
-		const char *hits;
-		//gboolean GUI_get_Query_hits(const char *filename, uint16_t seq, gboolean is_ipv6, const char **hits)
-		GUI_get_Query_hits(fname, seq, is_ipv6, &hits);
-
-		// Test if an HIT was previously received and a thread is already active ...
-		if((hits != NULL) && (locate_state_in_plist(fname, seq) != NULL)){
-			Log("NULL Hit.\n");
-			return;
-		}
-
-		//gboolean write_hit_message(char *buf, int *len, uint16_t seq, const char* filename, uint32_t fhash,
-		//		unsigned long long flen, unsigned short sTCP_port, const char *serverIP);
-		if(!write_hit_message(hbuf, &hlen, seq, fname, fhash, flen, portTCP, addr_ipv4(&local_ipv4))){
-			Log("ERROR - IPv4 write Hit failed.\n");
-			return;
-		}
-
-		if(!send_message4(query_hit->ipv4, query_hit->port, hbuf, hlen)){
-			Log("ERROR - IPv4 Hit failed to send.\n");
-			return;
-		}
-		if(!GUI_add_Proxy(fname, seq)){
-			Log("ERROR - Failed to add Hit to GUI interface.\n");
-			return;
-		}
-
-		query_hit->state = S_TRY_TCP;
-		//Task 8
-		start_query_timer(query_hit, HIT_CONNECTION_TIMEOUT);
-
-		return;
-
-	// Prepare a new HIT message with the proxy information and send it to the client.
-	// Use  write_hit_message(...) and
-	//		send_message4(&client_ipv4_address, client_port, HIT_buffer, HIT_buflen)
-	// where client_ipv4_address and client_port should be in the Query structure
-	//
-	// Remember that you need to send a valid IPv4 address to the IPv4 fileexchange, identifying
-	//  the gateway TCP port, and later, when you receive the TCP communication, this
-	//  thread will be associated with the Query.
-	// You may add the proxy information to the GUI, just to inform that you are expecting a connection using
-//	GUI_add_Proxy(filename, seq);
-	// where filename and seq are stored in the Query structure
-
-	// Restart the timer, to wait for up to QUERY_TIMEOUT microseconds for a connection
-	// In this case you need to create a new proxy object and add it to the GUI
-	}
+	relay_Hit(query_hit, fhash, flen);
 }
 
 
 // Handle the reception of a new connection on the TCP server socket
 // Return TRUE if it should accept more connections; FALSE otherwise
-gboolean handle_new_connection(int sock, struct sockaddr_in6 *cli_addr) {
+gboolean handle_new_connection(int sock, struct sockaddr_in6 *cli_addr, gboolean cli_ipv6) {
 	assert(sock >= 0);
 	assert(cli_addr != NULL);
 
+	// Start it now if there is a free slot; otherwise it waits for one, or it is rejected
+	if (admission_request(sock, cli_addr, cli_ipv6) == ADMIT_NOW)
+		start_proxy_session(sock, cli_addr, cli_ipv6);
+	return TRUE;	// Keep accepting more connections
+}
+
+
+// Start the proxy thread of a connection admitted by the admission control
+void start_proxy_session(int sock, struct sockaddr_in6 *cli_addr, gboolean cli_ipv6) {
 	// Create a new thread state object - you will need it to pass it to the thread!
 	thread_state *state = new_thread_state(sock, cli_addr);
+	if (state == NULL) {
+		Log("ERROR - No memory for the thread state\n");
+		close(sock);
+		admission_release();
+		return;
+	}
+	state->cli_ipv6 = cli_ipv6;
+	state->admitted = g_get_monotonic_time();	// Its slot is released with the state
 
-	// Start a new thread
-	int err = pthread_create(&state->tid, NULL, proxy_function, (void *) state);
+	// Start a new thread, placed near the core that receives the client's packets
+	int err = affinity_thread_create(&state->tid, sock, proxy_function, (void *) state);
 	if (err) {
 		fprintf(stderr, "Error starting thread: return code %d\n", err);
+		Log("ERROR - Failed starting the session's thread\n");
+		free_thread_state(state, FALSE);	// Closes the socket and releases its admission slot
 	}
-
-	return TRUE;	// Keep accepting more connections
 }
 
 
@@ -590,7 +887,33 @@ void on_buttonStop_clicked(GtkButton *button, gpointer user_data) {
 		Query* q = locate_in_QueryList(fname, seq);
 
 		del_Query(q, TRUE);
-	}
+	} else
+		workers_stop_session(fname, seq);	// Its worker ends it, and the Query with it
+}
+
+
+// Timer callback that logs the buffer pool occupancy, the cache, the coalescing and the
+// verification statistics while the gateway is active
+static gboolean callback_report(gpointer data) {
+	if (!active)
+		return FALSE;
+	pool_report();
+	cache_report();
+	coalesce_report();
+	spool_report();
+	pipeline_report();
+	prefetch_report();
+	accept_report();
+	affinity_report();
+	srpt_report();
+	admission_report();
+	reaper_report();
+	workers_report();
+	warm_report();
+	local_report();
+	groups_report();
+	fhash_report();
+	return TRUE;
 }
 
 
@@ -600,9 +923,37 @@ void close_all(gboolean called_from_GUI) {
 	del_query_list(called_from_GUI);
 	// Close all sockets
 	close_sockTCP();
+	workers_stop(called_from_GUI);
 	close_sockUDP();
+	groups_close();
+	// Reject the connections waiting for a session slot
+	admission_close();
 	// Stop threads
 	close_all_threads(called_from_GUI);
+	reaper_close();
+	// Stop accepting hot restart requests
+	handoff_close(TRUE);
+	// Save what was learned for the next start
+	warm_close();
+	// Final cache, coalescing and verification statistics
+	cache_report();
+	coalesce_report();
+	spool_report();
+	pipeline_report();
+	prefetch_report();
+	accept_report();
+	affinity_report();
+	srpt_report();
+	admission_report();
+	reaper_report();
+	workers_report();
+	warm_report();
+	local_report();
+	groups_report();
+	fhash_report();
+	// Save the lifecycle trace
+	if (options.trace_file != NULL)
+		trace_export(options.trace_file);
 }
 
 
@@ -616,6 +967,16 @@ void on_togglebuttonActive_toggled(GtkToggleButton *togglebutton,
 		const gchar *addr4_str, *addr6_str;
 		int n4, n6;
 
+		load_options();
+		trace_init(options.trace_events);
+		warm_init(options.warm_file, options.warm_period);	// Before the cache, which reads its index
+		if (!affinity_init(options.affinity, options.control_cpus) || !pool_init(options.pool_bytes, options.pool_chunk, options.pool_session_chunks,
+				options.pool_hugepages) || !cache_init(options.cache_dir, options.cache_bytes)) {
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		local_init(options.local_dir);
+
 		n4 = get_PortIPv4Multicast();
 		n6 = get_PortIPv6Multicast();
 		if ((n4 < 0) || (n6 < 0)) {
@@ -632,15 +993,29 @@ void on_togglebuttonActive_toggled(GtkToggleButton *togglebutton,
 			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
 			return;
 		}
-		if (!init_sockets(port_MCast4, addr4_str, port_MCast6, addr6_str)) {
+		// Join the other group pairs, before the handoff restores their Queries
+		groups_init(options.groups, options.group_max_queries);
+		// Take over from a running gateway, if there is one; otherwise, start from scratch
+		// (worker processes hold sessions that cannot be handed over)
+		if (((options.workers > 0) || !handoff_receive(options.handoff_socket)) &&
+				!init_sockets(port_MCast4, addr4_str, port_MCast6, addr6_str)) {
 			Log("Failed configuration of server\n");
+			groups_close();
 			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
 			return;
 		}
+		if ((options.handoff_socket != NULL) && (options.workers <= 0))
+			handoff_listen(options.handoff_socket);
+		if (options.workers > 0)
+			workers_start(options.workers);
 		set_PID(getpid());
 		//
 		block_entrys(TRUE);
+		admission_init();
+		reaper_init();
 		active = TRUE;
+		if (options.report_period > 0)
+			g_timeout_add(options.report_period, callback_report, NULL);
 		Log("gateway active\n");
 
 	} else {
@@ -27,6 +27,7 @@
 #define QUERY_JITTER			100		/* Jitter time for Query retransmission - 100 mseconds */
 #define QUERY_TIMEOUT			10000	/* Query timeout - 10 seconds */
 #define HIT_CONNECTION_TIMEOUT	10000	/* Wait for connection timeout - 10 seconds */
+#define QUERY_MAX_HITS			256		// Maximum number of servers kept for one Query
 
 
 struct Hit;
@@ -53,39 +54,44 @@ typedef enum {S_JITTER,					//Waiting the JITTER time to send the query
 } QueryState;
 
 // Query information
+// Allocated from a slab; the fields are ordered by size to avoid padding
 typedef struct Query {
-	char			qname[CNAME_LENGTH+41];	// Query string (for logging)
-    int				seq;					// Sequence number
-    char			name[CNAME_LENGTH+1]; 	// Name looked up
+	GList			link;					// Link in qlist (data points to the Query)
+	const char		*name;					// Name looked up (interned)
 
-    // Sender information
-    gboolean		is_ipv6;				// Sender domain: TRUE - IPv6 ; FALSE - IPv4
+	// State information
+	thread_state	*thread;				// Thread state, when a thread is active
+	struct Query	*self_;
+	hit_server		*hits;					// Servers in the Hits received, the first one first
+	struct prefetch	*prefetch;				// Connection opened when the Hit was relayed (NULL - none)
 
-    // State information
-    thread_state   *thread;
-    // Thread state, when a thread is active
+	unsigned long long hit_flen;			//File length from the first Hit (0 - no Hit)
+	gint64 timer_deadline;					//Monotonic time (us) when the running timer ends
 
-    struct in6_addr *ipv6;					//IPv6
-	struct in_addr *ipv4;					//IPv4
-    u_short port;							//Port
+	// Sender information, tagged by is_ipv6
+	union {
+		struct in6_addr ipv6;				//IPv6
+		struct in_addr ipv4;				//IPv4
+	} addr;
 
-    QueryState state;						//Status of Query
+	guint timer_jitter;						//ID timer of the jitter before forwarding the Query
 	guint timer_id;							//ID timer that limits the waiting time for a HIT message
 	guint timer_id2;						//ID timer for connection time out
-
-	char *buf_temp;							//Buffer used to store query information
-	int tmp_buflen;							//Length of buffer used to store query information
-
-    /*
-     * 	To complete during TASKs 2, 3, 4, 5
-     * 	...
-     * 	Put here everything you need to store about a Query, including the information about
-     * 	the Hit, the server socket, the QUERY sender's IP and port, buffers, etc.
-     */
-
-    struct Query   *self_;
+	uint32_t trace_id;						//Identifier in the lifecycle trace
+	uint32_t hit_fhash;						//File hash from the first Hit
+	int n_hits;								//Number of hits
+	int max_hits;							//Size of 'hits'
+	QueryState state;						//Status of Query
+	uint16_t seq;							// Sequence number
+	uint16_t group;							// Group pair that received it (0 - the window's)
+	u_short port;							//Port
+	gboolean		is_ipv6;				// Sender domain: TRUE - IPv6 ; FALSE - IPv4
 } Query;
 
+// Query string (for logging): printf("..." QUERY_FMT "...", QUERY_ARGS(q))
+#define QUERY_FMT		"'%s'(%d)%s"
+#define QUERY_ARGS(q)	(q)->name, (q)->seq, ((q)->is_ipv6 ? "v6" : "v4")
+
 
 
 /**********************\
@@ -94,6 +100,8 @@ typedef struct Query {
 
 extern gboolean active; // TRUE if server is active
 
+extern GQueue qlist;	// List of active queries
+
 // Main window
 extern WindowElements *main_window;
 
@@ -103,33 +111,58 @@ extern WindowElements *main_window;
 \*****************************************/
 
 // Create a Query descriptor and put it in qlist
-//Query *new_Query(const char *filename, uint16_t seq, gboolean is_ipv6 ,struct in6_addr *ipv6, struct in_addr *ipv4, u_short porto);
 Query *new_Query(const char *filename, uint16_t seq, gboolean is_ipv6 ,struct in6_addr *ipv6,
-		struct in_addr *ipv4, u_short porto, char* buf, int bufLen);
+		struct in_addr *ipv4, u_short porto);
+// Move the Query to group pair 'group', which forwards it and answers its client
+void set_Query_group(Query *q, int group);
 // Search for Query descriptor in qlist
 Query *locate_in_QueryList(const char *filename, uint16_t seq);
 Query *locate_in_QueryList_IP(const char *filename, uint16_t seq, gboolean is_ipv6);
+// Search for the Query descriptor of group pair 'group' in qlist
+Query *locate_in_QueryList_group(const char *filename, uint16_t seq, gboolean is_ipv6, int group);
+// Search for the Query of a TCP client from 'client' in qlist: when it is pending in several group
+// pairs, the one sent from the client's address; NULL if none or several of them match
+Query *locate_in_QueryList_client(const char *filename, uint16_t seq, gboolean is_ipv6,
+		const struct in6_addr *client);
+// Address of the Query's sender (IPv4-mapped for IPv4)
+void get_Query_sender(const Query *q, struct in6_addr *addr);
 // Free qlist descriptor and all pending memory
 // called_from_GUI - use TRUE if called from a GUI event; FALSE otherwise (i.e. from socket, thread or timer event)
 void del_Query(Query *ppt, gboolean called_from_GUI);
 // Abort and free all active queries
 void del_query_list(gboolean called_from_GUI);
+// Add a server that announced the file in a Hit to the Query (IPv4 servers as IPv4-mapped)
+// Returns FALSE if it was already listed or there is no space for it
+gboolean add_Query_hit(Query *q, const struct in6_addr *ip, u_short port, uint32_t fhash,
+		unsigned long long flen);
+// Copy up to 'max' servers in the Hits received for the Query to 'servers'; returns their number
+int get_Query_hits(Query *q, hit_server *servers, int max);
 
 
 /*******************************************************\
 |* Functions to control the state of the application   *|
 \*******************************************************/
 
+// Change the Query state, recording the transition in the lifecycle trace
+void set_query_state(Query *q, QueryState state);
 // Start timer
 void start_query_timer(Query *q, long int timeout);
 // Stop timer
 void stop_query_timer(Query *q);
 // Handle the reception of a Query packet (is_ipv6, ipv6, ipv4 and port contain the sender's address)
 void handle_Query(char *buf, int buflen, gboolean is_ipv6, struct in6_addr *ipv6, struct in_addr *ipv4, u_short port);
+// Handle the reception of a Query packet from the groups of pair 'group' (0 - the window's)
+void handle_group_Query(char *buf, int buflen, int group, gboolean is_ipv6, struct in6_addr *ipv6,
+		struct in_addr *ipv4, u_short port);
 // Handle the reception of an Hit packet
 void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port, gboolean is_ipv6);
+// Handle the reception of an Hit packet at the query socket of pair 'group' (0 - the window's)
+void handle_group_Hit(char *buf, int buflen, int group, struct in6_addr *ip, u_short port, gboolean is_ipv6);
 // Handle the reception of a new connection on a server socket
-gboolean handle_new_connection(int sock, struct sockaddr_in6 *cli_addr);
+//   cli_ipv6 - TRUE if it was received on the IPv6 clients' socket
+gboolean handle_new_connection(int sock, struct sockaddr_in6 *cli_addr, gboolean cli_ipv6);
+// Start the proxy thread of a connection admitted by the admission control
+void start_proxy_session(int sock, struct sockaddr_in6 *cli_addr, gboolean cli_ipv6);
 
 // Close everything
 void close_all(gboolean called_from_GU);
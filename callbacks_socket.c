@@ -10,6 +10,7 @@
  * @author  Luis Bernardo
 \*****************************************************************************/
 
+#define _GNU_SOURCE		// accept4
 #include <gtk/gtk.h>
 #include <arpa/inet.h>
 #include <assert.h>
@@ -17,11 +18,16 @@
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ifaddrs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include "sock.h"
 #include "gui.h"
 #include "callbacks.h"
 #include "callbacks_socket.h"
 #include "proxy_thread.h"
+#include "options.h"
 #include <netinet/in.h>
 
 #ifdef DEBUG
@@ -61,9 +67,76 @@ GIOChannel *chanTCP= NULL;	// GIO descriptor of TCP IPv4 socket
 guint chanTCP_id= 0;	// GIO channel number of TCP IPV4 socket
 u_short portTCP= 0;		// TCP IPv4 port
 
+int sockTCP6= -1;		// TCP socket for IPv6 clients (relayed to IPv4 servers)
+GIOChannel *chanTCP6= NULL;	// GIO descriptor of TCP socket for IPv6 clients
+guint chanTCP6_id= 0;	// GIO channel number of TCP socket for IPv6 clients
+u_short portTCP6= 0;	// TCP port for IPv6 clients
+
 
 /* Local variables */
 static char tmp_buf[8000];
+static const int number4 = 4;	// Callback data of the IPv4 multicast socket
+static const int number6 = 6;	// Callback data of the IPv6 multicast and IPv6 clients' TCP sockets
+static struct in6_addr *local_addrs = NULL;	// Addresses of this host, sorted (IPv4 as IPv4-mapped)
+static int n_local_addrs = 0;
+
+/**********************\
+|* Address functions  *|
+ \**********************/
+
+// Write the IPv4-mapped IPv6 address of 'ipv4' in 'ipv6'
+void ipv4_to_mapped(const struct in_addr *ipv4, struct in6_addr *ipv6) {
+	memset(ipv6, 0, sizeof(struct in6_addr));
+	ipv6->s6_addr[10] = 0xff;
+	ipv6->s6_addr[11] = 0xff;
+	memcpy(&ipv6->s6_addr[12], ipv4, sizeof(struct in_addr));
+}
+
+static int compare_addr(const void *a, const void *b) {
+	return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+// Load the set of addresses of this host, from its network interfaces and the local
+// addresses in use (local_ipv6 and local_ipv4)
+void load_local_addresses(void) {
+	struct ifaddrs *ifa_list = NULL, *ifa;
+	int n = 2, i, j;
+
+	if (getifaddrs(&ifa_list) < 0)
+		perror("Failed reading the interface addresses");
+	for (ifa = ifa_list; ifa != NULL; ifa = ifa->ifa_next)
+		n++;
+	free(local_addrs);
+	local_addrs = (struct in6_addr *) malloc(n * sizeof(struct in6_addr));
+	n = 0;
+	memcpy(&local_addrs[n++], &local_ipv6, sizeof(struct in6_addr));
+	ipv4_to_mapped(&local_ipv4, &local_addrs[n++]);
+	for (ifa = ifa_list; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL)
+			continue;
+		if (ifa->ifa_addr->sa_family == AF_INET6)
+			memcpy(&local_addrs[n++], &((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr,
+					sizeof(struct in6_addr));
+		else if (ifa->ifa_addr->sa_family == AF_INET)
+			ipv4_to_mapped(&((struct sockaddr_in *) ifa->ifa_addr)->sin_addr, &local_addrs[n++]);
+	}
+	if (ifa_list != NULL)
+		freeifaddrs(ifa_list);
+
+	// Sorted, without repetitions
+	qsort(local_addrs, n, sizeof(struct in6_addr), compare_addr);
+	for (i = j = 0; i < n; i++)
+		if ((j == 0) || compare_addr(&local_addrs[j - 1], &local_addrs[i]))
+			local_addrs[j++] = local_addrs[i];
+	n_local_addrs = j;
+}
+
+// TRUE if 'addr' is an address of this host (IPv4 as IPv4-mapped)
+gboolean is_local_address(const struct in6_addr *addr) {
+	return (local_addrs != NULL) &&
+			(bsearch(addr, local_addrs, n_local_addrs, sizeof(struct in6_addr), compare_addr) != NULL);
+}
+
 
 /*****************************************\
 |* Functions to write and read messages  *|
@@ -256,33 +329,166 @@ gboolean send_multicast(const char *buf, int n, gboolean use_IPv6) {
 	return TRUE;
 }
 
-// Callback to receive connections at TCP socket
+/******************\
+|*  Accept path   *|
+\******************/
+
+static accept_stats acc_stats;		// Accept statistics (only changed in the main loop)
+static guint acc_retry_id[2] = {0, 0};	// Timers adding back the watch of a paused server socket (IPv4, IPv6 clients)
+static unsigned long acc_overflows0 = 0;	// Accept queue overflows counted when the sockets were created
+static unsigned long acc_last = 0;		// Connections accepted at the last report
+static gint64 acc_last_time = 0;		// Time of the last report
+
+
+// Host-wide number of connections dropped by full accept queues (ListenOverflows in
+// /proc/net/netstat); returns 0 if it is not available
+static unsigned long read_listen_overflows(void) {
+	char names[2048], values[2048];
+	unsigned long v = 0;
+	FILE *f = fopen("/proc/net/netstat", "r");
+
+	if (f == NULL)
+		return 0;
+	while ((fgets(names, sizeof(names), f) != NULL) && (fgets(values, sizeof(values), f) != NULL)) {
+		if (strncmp(names, "TcpExt:", 7) == 0) {
+			char *sn, *sv, *n = strtok_r(names, " \n", &sn), *val = strtok_r(values, " \n", &sv);
+			for (; (n != NULL) && (val != NULL); n = strtok_r(NULL, " \n", &sn), val = strtok_r(NULL, " \n", &sv))
+				if (strcmp(n, "ListenOverflows") == 0)
+					v = strtoul(val, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return v;
+}
+
+
+// Prepare a TCP server socket to receive connections: non-blocking, with the accept
+// queue length and the deferred accept and Fast Open options
+gboolean listen_server_socket_tcp(int sock) {
+	int v;
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);	// Accepts until the queue is empty
+	if (listen(sock, (options.accept_backlog > 0) ? (int) options.accept_backlog : SOMAXCONN) < 0) {
+		perror("Listen failed\n");
+		Log("Listen failed\n");
+		return FALSE;
+	}
+	// Only wake up when the request arrives
+	v = (int) options.defer_accept;
+	if ((v > 0) && (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &v, sizeof(v)) < 0))
+		perror("Failed setting TCP_DEFER_ACCEPT");
+	// Accept the request in the SYN of clients with a Fast Open cookie
+	v = (int) options.fastopen;
+	if ((v > 0) && (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &v, sizeof(v)) < 0))
+		perror("Failed setting TCP_FASTOPEN");
+	if (acc_last_time == 0) {
+		acc_overflows0 = read_listen_overflows();
+		acc_last_time = g_get_monotonic_time();
+	}
+	return TRUE;
+}
+
+
+// Length of the accept queue of a server socket (0 if not available)
+static unsigned long accept_queue_length(int sock) {
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	// For listening sockets, tcpi_unacked is the number of connections waiting to be accepted
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return 0;
+	return ti.tcpi_unacked;
+}
+
+
+// Add the watch of the server socket of the IPv4 ('cli_ipv6' FALSE) or IPv6 clients again, after a pause
+static void add_accept_watch(gboolean cli_ipv6) {
+	GIOChannel *chan = cli_ipv6 ? chanTCP6 : chanTCP;
+
+	if (chan != NULL)
+		*(cli_ipv6 ? &chanTCP6_id : &chanTCP_id) = g_io_add_watch(chan, G_IO_IN | G_IO_ERR | G_IO_NVAL,
+				callback_connections_TCP, cli_ipv6 ? (gpointer) &number6 : NULL);
+}
+
+// Timer callback ending the pause of a server socket; data is NULL for the IPv4 clients' socket
+static gboolean callback_accept_retry(gpointer data) {
+	gboolean cli_ipv6 = (data != NULL);
+
+	acc_retry_id[cli_ipv6] = 0;
+	add_accept_watch(cli_ipv6);
+	return FALSE;
+}
+
+// End the pause of a server socket at once (before it is closed)
+static void resume_accept(gboolean cli_ipv6) {
+	if (acc_retry_id[cli_ipv6] == 0)
+		return;
+	g_source_remove(acc_retry_id[cli_ipv6]);
+	acc_retry_id[cli_ipv6] = 0;
+	add_accept_watch(cli_ipv6);
+}
+
+// Callback to receive connections at TCP sockets: accepts all the connections pending,
+// up to ACCEPT_MAX_BATCH per call
+//   data is NULL for the IPv4 clients' socket, and not NULL for the IPv6 clients' socket
 gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 		gpointer data) {
+	gboolean cli_ipv6 = (data != NULL);
+	int sock = cli_ipv6 ? sockTCP6 : sockTCP;
 
-	if (!active || (sockTCP<0))
+	if (!active || (sock<0))
 		return FALSE;
 
 	if (condition & G_IO_IN) {
-		// Received a new connection
-		struct sockaddr_in6 server;
-		int msgsock;
-		socklen_t length = sizeof(server);
-
-		msgsock = accept(sockTCP, (struct sockaddr *) &server, &length);
-		if (msgsock == -1) {
-			perror("accept");
-			Log("accept failed - aborting\nPlease turn off the application!\n");
-
-			return FALSE; // Turns callback off
-		} else {
-			sprintf(tmp_buf, "Received connection from %s - %d\n",
-					addr_ipv6(&server.sin6_addr), ntohs(server.sin6_port));
+		// Received new connections
+		unsigned long queued = accept_queue_length(sock);
+		unsigned long n = 0;
+		gboolean paused = FALSE;
+
+		while (n < ACCEPT_MAX_BATCH) {
+			struct sockaddr_in6 server;
+			int msgsock;
+			socklen_t length = sizeof(server);
+
+			// The sessions' threads use blocking sockets
+			msgsock = accept4(sock, (struct sockaddr *) &server, &length, SOCK_CLOEXEC);
+			if (msgsock == -1) {
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					break;		// No more connections
+				if ((errno == EINTR) || (errno == ECONNABORTED))
+					continue;	// The next one may be valid
+				acc_stats.failures++;
+				perror("accept");
+				if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM)) {
+					// The connection stays in the queue, and the watch would fire again at once:
+					// it is removed, and added back by a timer
+					Log("accept failed - out of resources; accepting paused\n");
+					*(cli_ipv6 ? &chanTCP6_id : &chanTCP_id) = 0;
+					acc_retry_id[cli_ipv6] = g_timeout_add(ACCEPT_RETRY_PERIOD, callback_accept_retry, data);
+					acc_stats.pauses++;
+					paused = TRUE;
+					break;
+				}
+				Log("accept failed - aborting\nPlease turn off the application!\n");
+				return FALSE; // Turns callback off
+			}
+			n++;
+			sprintf(tmp_buf, "Received connection from %s - %d%s\n",
+					addr_ipv6(&server.sin6_addr), ntohs(server.sin6_port),
+					cli_ipv6 ? " (IPv6 client)" : "");
 			Log(tmp_buf);
 
 			// Starts a thread to read the data from the socket
-			return handle_new_connection(msgsock, &server);
+			handle_new_connection(msgsock, &server, cli_ipv6);
 		}
+		if (n > 0) {
+			acc_stats.wakeups++;
+			acc_stats.accepted += n;
+			acc_stats.max_batch = MAX(acc_stats.max_batch, n);
+			acc_stats.queue_peak = MAX(acc_stats.queue_peak, queued);
+		}
+		return !paused;	// Keep accepting more connections, unless paused
 
 	} else if ((condition & G_IO_NVAL) || (condition & G_IO_ERR)) {
 		Log("Detected error in a TCP server socket\nPlease, turn off the application\n");
@@ -293,12 +499,38 @@ gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 	}
 }
 
+
+// Current accept statistics
+void accept_get_stats(accept_stats *st) {
+	memcpy(st, &acc_stats, sizeof(accept_stats));
+	st->overflows = read_listen_overflows() - acc_overflows0;
+}
+
+
+// Log the accept statistics, with the accept rate since the last report
+void accept_report(void) {
+	accept_stats st;
+	char tmp[200];
+	gint64 now = g_get_monotonic_time();
+	double secs = (now - acc_last_time) / 1e6;
+
+	accept_get_stats(&st);
+	if (st.accepted == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Accept: %lu connections (%.1f/s), %.1f per wakeup (max %lu), queue peak %lu, "
+			"%lu overflows in the host, %lu failures, %lu pauses\n", st.accepted,
+			(secs > 0) ? (st.accepted - acc_last) / secs : 0.0, (double) st.accepted / st.wakeups,
+			st.max_batch, st.queue_peak, st.overflows, st.failures, st.pauses);
+	Log(tmp);
+	acc_last = st.accepted;
+	acc_last_time = now;
+}
+
 // Callback to receive data from UDP IPv6 unicast socket
 gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
 		gpointer data) {
 	static char buf[MESSAGE_MAX_LENGTH]; // buffer for reading data
 	struct in6_addr ipv6;
-	char ip_str[81];
 	u_short port;
 	int n;
 
@@ -310,7 +542,6 @@ gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
 	if (condition & G_IO_IN) {
 		// Receive packet //
 		n = read_data_ipv6(sockUDPq, buf, MESSAGE_MAX_LENGTH, &ipv6, &port);
-		strncpy(ip_str, addr_ipv6(&ipv6), sizeof(ip_str));
 		if (n <= 0) {
 			Log("Failed reading packet from unicast socket\n");
 			return TRUE; // Continue waiting for more events
@@ -318,7 +549,7 @@ gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
 			time_t tbuf;
 			unsigned char m;
 			char *pt;
-			gboolean is_ipv4 = (strstr(ip_str, "::ffff:") != NULL);
+			gboolean is_ipv4 = IN6_IS_ADDR_V4MAPPED(&ipv6);
 
 			// Read data //
 			pt = buf;
@@ -326,7 +557,7 @@ gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
 			// Writes date and sender's data //
 			time(&tbuf);
 			g_print("%sReceived %d bytes (unicast) from %s#%hu - type %hhd\n",
-					ctime(&tbuf), n, ip_str, port, m);
+					ctime(&tbuf), n, addr_ipv6(&ipv6), port, m);
 			switch (m) {
 			case MSG_HIT:
 				handle_Hit(buf, n, &ipv6, port, !is_ipv4);
@@ -360,7 +591,6 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 	static char buf[MESSAGE_MAX_LENGTH]; // buffer for reading data
 	struct in6_addr ipv6;
 	struct in_addr ipv4;
-	char ip_str[81];
 	u_short port;
 	int n;
 	gboolean from_v6 = (*(int *) data == 6); // if TRUE comes from IPv6, else from IPv4
@@ -373,15 +603,9 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 		// Receive packet //
 		if (from_v6 && active6) {
 			n = read_data_ipv6(sockUDP6, buf, MESSAGE_MAX_LENGTH, &ipv6, &port);
-			strncpy(ip_str, addr_ipv6(&ipv6), sizeof(ip_str));
 		} else if (!from_v6 && active4) {
 			n = read_data_ipv4(sockUDP4, buf, MESSAGE_MAX_LENGTH, &ipv4, &port);
-			strncpy(ip_str, addr_ipv4(&ipv4), sizeof(ip_str));
-			if (!translate_ipv4_to_ipv6(ip_str, &ipv6)) {
-				debugstr(
-						"Error in callback_UDPMulticast_data: converting ipv4 to ipv6\n");
-				return FALSE;
-			}
+			ipv4_to_mapped(&ipv4, &ipv6);
 		} else {
 			debugstr("Error in callback_UDPMulticast_data: no read");
 			return FALSE;
@@ -401,7 +625,7 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 			// Writes date and sender's data //
 			time(&tbuf);
 			g_print("%sReceived %d bytes (multicast) from %s#%hu - type %hhd\n",
-					ctime(&tbuf), n, ip_str, port, m);
+					ctime(&tbuf), n, addr_ipv6(&ipv6), port, m);
 			switch (m) {
 			case MSG_QUERY:
 				handle_Query(buf, n, from_v6, &ipv6, &ipv4, port);
@@ -505,8 +729,11 @@ void close_sockUDP(void) {
 	portUDPq = 0;
 }
 
-// Close TCP socket and free GIO resources
+// Close the TCP server sockets and free GIO resources
 void close_sockTCP(void) {
+	// A paused socket gets its watch back, to be removed with it
+	resume_accept(FALSE);
+	resume_accept(TRUE);
 	if (sockTCP > 0) {
 		if (chanTCP != NULL) {
 			remove_socket_from_mainloop(sockTCP, chanTCP_id, chanTCP);
@@ -517,15 +744,20 @@ void close_sockTCP(void) {
 		sockTCP = -1;
 	}
 	portTCP= 0;
+	if (sockTCP6 > 0) {
+		if (chanTCP6 != NULL) {
+			remove_socket_from_mainloop(sockTCP6, chanTCP6_id, chanTCP6);
+			chanTCP6_id = 0;
+			chanTCP6= NULL;
+		}
+		close(sockTCP6);
+		sockTCP6 = -1;
+	}
+	portTCP6= 0;
 }
 
-// Create IPv4 UDP multicast socket, configure it, and register its callback
-gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast) {
-	static const int number4 = 4;
-
-	if (active4 || !addr_multicast)
-		return TRUE;
-
+// Prepare the IPv4 multicast group data structures (imr_MCast4, addr_MCast4)
+static gboolean prepare_group_udp4(u_short port_multicast, const char *addr_multicast) {
 	// Prepares the multicast association data structure
 	if (!get_IPv4(addr_multicast, &imr_MCast4.imr_multiaddr)) {
 		return FALSE;
@@ -538,6 +770,16 @@ gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast) {
 	addr_MCast4.sin6_flowinfo = 0;
 	if (!translate_ipv4_to_ipv6(addr_multicast, &addr_MCast4.sin6_addr))
 		return FALSE;
+	return TRUE;
+}
+
+// Create IPv4 UDP multicast socket, configure it, and register its callback
+gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast) {
+	if (active4 || !addr_multicast)
+		return TRUE;
+
+	if (!prepare_group_udp4(port_multicast, addr_multicast))
+		return FALSE;
 
 	// Creates the IPV4 UDP socket
 	sockUDP4 = init_socket_ipv4(SOCK_DGRAM, port_multicast, TRUE); // Share port
@@ -566,13 +808,8 @@ gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast) {
 	return TRUE;
 }
 
-// Create IPv6 UDP multicast socket, configure it, and register its callback
-gboolean init_socket_udp6(u_short port_multicast, const char *addr_multicast) {
-	static const int number6 = 6;
-
-	if (active6 || !addr_multicast)
-		return TRUE;
-
+// Prepare the IPv6 multicast group data structures (imr_MCast6, addr_MCast6)
+static gboolean prepare_group_udp6(u_short port_multicast, const char *addr_multicast) {
 	// Prepares the data structures
 	if (!get_IPv6(addr_multicast, &addr_MCast6.sin6_addr)) {
 		return FALSE;
@@ -583,6 +820,16 @@ gboolean init_socket_udp6(u_short port_multicast, const char *addr_multicast) {
 	bcopy(&addr_MCast6.sin6_addr, &imr_MCast6.ipv6mr_multiaddr,
 			sizeof(addr_MCast6.sin6_addr));
 	imr_MCast6.ipv6mr_interface = 0;
+	return TRUE;
+}
+
+// Create IPv6 UDP multicast socket, configure it, and register its callback
+gboolean init_socket_udp6(u_short port_multicast, const char *addr_multicast) {
+	if (active6 || !addr_multicast)
+		return TRUE;
+
+	if (!prepare_group_udp6(port_multicast, addr_multicast))
+		return FALSE;
 
 	// Creates the IPV4 UDP socket
 	sockUDP6 = init_socket_ipv6(SOCK_DGRAM, port_multicast, TRUE);
@@ -618,7 +865,43 @@ gboolean init_socket_udp6(u_short port_multicast, const char *addr_multicast) {
 	return TRUE;
 }
 
-// Create IPv6 TCP socket, configure it, and register its callback
+// Register a TCP server socket in the main loop; data - callback data (NULL for IPv4 clients)
+static gboolean register_server_socket_tcp(int sock, GIOChannel **chan, guint *chan_id,
+		gpointer data) {
+	if (!put_socket_in_mainloop(sock, data, chan_id, chan, G_IO_IN,
+			callback_connections_TCP)) {
+		Log("Failed registration of TCPv6 server socket at Gnome\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Create the IPv6 TCP server socket for the IPv6 clients, and register its callback
+static gboolean init_server_socket_tcp6_clients(void) {
+	sockTCP6 = init_socket_ipv6(SOCK_STREAM, 0, FALSE);
+	if (sockTCP6 < 0) {
+		Log("Failed opening IPv6 TCP server socket for IPv6 clients\n");
+		return FALSE;
+	}
+	if (!listen_server_socket_tcp(sockTCP6)) {
+		close(sockTCP6);
+		sockTCP6= -1;
+		return FALSE;
+	}
+	portTCP6= get_portnumber(sockTCP6);
+	if (!register_server_socket_tcp(sockTCP6, &chanTCP6, &chanTCP6_id, (void *) &number6)) {
+		close(sockTCP6);
+		sockTCP6= -1;
+		portTCP6= 0;
+		return FALSE;
+	}
+	sprintf(tmp_buf, "TCP port for IPv6 clients: %hu\n", portTCP6);
+	Log(tmp_buf);
+	return TRUE;
+}
+
+// Create the IPv6 TCP server sockets (for IPv4 and for IPv6 clients), configure them,
+// and register their callback
 gboolean init_server_socket_tcp6(void) {
 
 	// Creates TCP socket
@@ -628,9 +911,7 @@ gboolean init_server_socket_tcp6(void) {
 		return FALSE;
 	}
 	// Prepares the socket to receive connections
-	if (listen(sockTCP, 0) < 0) {
-		perror("Listen failed\n");
-		Log("Listen failed\n");
+	if (!listen_server_socket_tcp(sockTCP)) {
 		close(sockTCP);
 		sockTCP= -1;
 		return FALSE;
@@ -639,13 +920,17 @@ gboolean init_server_socket_tcp6(void) {
 	set_PortTCP(portTCP);
 
 	// Regists the TCP socket in Gtk+ main loop
-	if (!put_socket_in_mainloop(sockTCP, NULL, &chanTCP_id, &chanTCP, G_IO_IN,
-			callback_connections_TCP)) {
-		Log("Failed registration of TCPv6 server socket at Gnome\n");
+	if (!register_server_socket_tcp(sockTCP, &chanTCP, &chanTCP_id, NULL)) {
 		close(sockTCP);
 		sockTCP= -1;
 		return FALSE;
 	}
+
+	// Socket of the IPv6 clients, whose files come from IPv4 servers
+	if (!init_server_socket_tcp6_clients()) {
+		close_sockTCP();
+		return FALSE;
+	}
 	return TRUE;
 }
 
@@ -658,6 +943,7 @@ gboolean init_server_socket_tcp6(void) {
 gboolean init_sockets(u_short port4_multicast, const char *addr4_multicast,
 		u_short port6_multicast, const char *addr6_multicast) {
 
+	load_local_addresses();
 	gboolean ok = init_socket_udp4(port4_multicast, addr4_multicast);
 	ok |= init_socket_udp6(port6_multicast, addr6_multicast);
 	if (!ok)
@@ -690,3 +976,92 @@ gboolean init_sockets(u_short port4_multicast, const char *addr4_multicast,
 	return TRUE;
 }
 
+
+
+// Register the sockets received from another gateway process (hot restart), instead of
+// creating them; a negative descriptor means that the socket is not used (a negative tcp6
+// creates a new socket for the IPv6 clients)
+// It configures the same global variables as init_sockets
+gboolean adopt_sockets(int tcp, int tcp6, int udp4, int udp6, int udpq, u_short port4_multicast,
+		const char *addr4_multicast, u_short port6_multicast, const char *addr6_multicast) {
+
+	if ((tcp < 0) || (udpq < 0))
+		return FALSE;
+	load_local_addresses();
+
+	// IPv4 group - already joined by the previous process
+	if ((udp4 >= 0) && (addr4_multicast != NULL)) {
+		if (!prepare_group_udp4(port4_multicast, addr4_multicast))
+			return FALSE;
+		sockUDP4 = udp4;
+		port_MCast4 = port4_multicast;
+		str_addr_MCast4 = addr4_multicast;
+		if (!put_socket_in_mainloop(sockUDP4, (void *) &number4, &chanUDP4_id,
+				&chanUDP4, G_IO_IN, callback_UDPMulticast_data)) {
+			Log("Failed registration of UDPv4 socket at Gnome\n");
+			close_sockUDP();
+			return FALSE;
+		}
+		active4 = TRUE;
+	}
+
+	// IPv6 group - already joined by the previous process
+	if ((udp6 >= 0) && (addr6_multicast != NULL)) {
+		if (!prepare_group_udp6(port6_multicast, addr6_multicast)) {
+			close_sockUDP();
+			return FALSE;
+		}
+		sockUDP6 = udp6;
+		port_MCast6 = port6_multicast;
+		str_addr_MCast6 = addr6_multicast;
+		if (!put_socket_in_mainloop(sockUDP6, (void *) &number6, &chanUDP6_id,
+				&chanUDP6, G_IO_IN, callback_UDPMulticast_data)) {
+			Log("Failed registration of UDPv6 socket at Gnome\n");
+			close_sockUDP();
+			return FALSE;
+		}
+		active6 = TRUE;
+	}
+
+	// TCP server sockets
+	sockTCP = tcp;
+	listen_server_socket_tcp(sockTCP);	// Applies this process's accept options
+	portTCP = get_portnumber(sockTCP);
+	set_PortTCP(portTCP);
+	if (!register_server_socket_tcp(sockTCP, &chanTCP, &chanTCP_id, NULL)) {
+		close_sockUDP();
+		close(sockTCP);
+		sockTCP= -1;
+		if (tcp6 >= 0)
+			close(tcp6);
+		return FALSE;
+	}
+	if (tcp6 >= 0) {
+		sockTCP6 = tcp6;
+		listen_server_socket_tcp(sockTCP6);
+		portTCP6 = get_portnumber(sockTCP6);
+		if (!register_server_socket_tcp(sockTCP6, &chanTCP6, &chanTCP6_id, (void *) &number6)) {
+			close_sockUDP();
+			close(sockTCP6);
+			sockTCP6= -1;
+			close_sockTCP();
+			return FALSE;
+		}
+	} else if (!init_server_socket_tcp6_clients()) {
+		close_sockUDP();
+		close_sockTCP();
+		return FALSE;
+	}
+
+	// Query socket
+	sockUDPq = udpq;
+	portUDPq = get_portnumber(sockUDPq);
+	if (!put_socket_in_mainloop(sockUDPq, NULL, &chanUDPq_id, &chanUDPq,
+			G_IO_IN, callback_UDPUnicast_data)) {
+		Log("Failed registration of query UDPv6 socket at Gnome\n");
+		close_sockUDP();
+		close_sockTCP();
+		return FALSE;
+	}
+	return TRUE;
+}
@@ -26,6 +26,11 @@
 
 #define MESSAGE_MAX_LENGTH	9000
 
+#define ACCEPT_DEFAULT_BACKLOG	1024	// Default accept queue length of the TCP server sockets
+#define ACCEPT_DEFAULT_DEFER	3		// Default time waiting for the request before accepting (s)
+#define ACCEPT_MAX_BATCH		64		// Maximum connections accepted in one wakeup
+#define ACCEPT_RETRY_PERIOD		100		// Time accepting is paused when out of resources (ms)
+
 /* Packet type */
 #define MSG_QUERY		20
 #define MSG_HIT			10
@@ -67,6 +72,38 @@ extern GIOChannel *chanTCP; // GIO descriptor of TCP IPv4 socket
 extern guint chanTCP_id;	// GIO channel number of TCP IPV4 socket
 extern u_short portTCP;		// TCP IPv4 port
 
+extern int sockTCP6;		// TCP socket for IPv6 clients (relayed to IPv4 servers)
+extern GIOChannel *chanTCP6;// GIO descriptor of TCP socket for IPv6 clients
+extern guint chanTCP6_id;	// GIO channel number of TCP socket for IPv6 clients
+extern u_short portTCP6;	// TCP port for IPv6 clients
+
+
+// Accept statistics of the TCP server sockets
+typedef struct accept_stats {
+	unsigned long wakeups;			// Wakeups with connections to accept
+	unsigned long accepted;			// Connections accepted
+	unsigned long max_batch;		// Maximum connections accepted in one wakeup
+	unsigned long queue_peak;		// Maximum accept queue length seen
+	unsigned long overflows;		// Connections dropped by full accept queues (whole host)
+	unsigned long failures;			// accept() failures
+	unsigned long pauses;			// Times accepting was paused, out of resources
+} accept_stats;
+
+
+/**********************\
+|* Address functions  *|
+\**********************/
+
+// Write the IPv4-mapped IPv6 address of 'ipv4' in 'ipv6'
+void ipv4_to_mapped(const struct in_addr *ipv4, struct in6_addr *ipv6);
+
+// Load the set of addresses of this host, from its network interfaces and the local
+// addresses in use (local_ipv6 and local_ipv4)
+void load_local_addresses(void);
+
+// TRUE if 'addr' is an address of this host (IPv4 as IPv4-mapped)
+gboolean is_local_address(const struct in6_addr *addr);
+
 
 /*****************************************\
 |* Functions to write and read messages  *|
@@ -108,9 +145,18 @@ gboolean send_multicast(const char *buf, int n, gboolean use_IPv6);
 // Send a packet to an UDP IPv4 socket
 gboolean send_message4(struct in_addr *ip, u_short port, const char *buf, int n);
 
-// Callback to receive connections at TCP socket
+// Prepare a TCP server socket to receive connections: non-blocking, with the accept
+// queue length and the deferred accept and Fast Open options
+gboolean listen_server_socket_tcp(int sock);
+// Callback to receive connections at TCP sockets: accepts all the connections pending,
+// up to ACCEPT_MAX_BATCH per call
+//   data is NULL for the IPv4 clients' socket, and not NULL for the IPv6 clients' socket
 gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 		gpointer data);
+// Current accept statistics
+void accept_get_stats(accept_stats *st);
+// Log the accept statistics, with the accept rate since the last report
+void accept_report(void);
 
 /// Callback to receive data from UDP IPv6 unicast socket
 gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
@@ -130,7 +176,7 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 // Close all UDP sockets
 void close_sockUDP(void);
 
-// Close a TCP socket and free GIO resources
+// Close the TCP server sockets and free GIO resources
 void close_sockTCP(void);
 
 // Create IPv4 UDP multicast socket, configure it, and register its callback
@@ -139,7 +185,8 @@ gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast);
 // Create IPv6 UDP multicast socket, configure it, and register its callback
 gboolean init_socket_udp6(u_short port_multicast, const char *addr_multicast);
 
-// Create IPv6 TCP socket, configure it, and register its callback
+// Create the IPv6 TCP server sockets (for IPv4 and for IPv6 clients), configure them,
+// and register their callback
 gboolean init_server_socket_tcp6(void);
 
 // Create IPv6 TCP socket, connect it, and register its callback
@@ -152,4 +199,10 @@ int init_client_socket_tcp6(gboolean connect_S, struct in6_addr *ip,
 // addr4_multicast/addr6_multicast - struct for association to the IP Multicast address
 gboolean init_sockets(u_short port4_multicast, const char *addr4_multicast, u_short port6_multicast, const char *addr6_multicast);
 
+// Register the sockets received from another gateway process (hot restart), instead of
+// creating them; a negative descriptor means that the socket is not used (a negative tcp6
+// creates a new socket for the IPv6 clients)
+gboolean adopt_sockets(int tcp, int tcp6, int udp4, int udp6, int udpq, u_short port4_multicast,
+		const char *addr4_multicast, u_short port6_multicast, const char *addr6_multicast);
+
 #endif
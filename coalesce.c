@@ -0,0 +1,249 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * coalesce.c
+ *
+ * Download coalescing: one upstream fetch per content, shared by the sessions
+ *    that request it while the fetch is running
+ *
+ * The spool is an anonymous memory file (memfd), so the readers send it to
+ *    their clients with sendfile. A stream is reachable by its key only while
+ *    the owner is fetching and the spool holds the whole prefix of the file;
+ *    past STREAM_MAX_PREFIX bytes, late sessions fetch the file themselves and
+ *    the owner punches holes in the spool behind the slowest reader, so it
+ *    does not keep a copy of the whole file in memory. A stream is freed when
+ *    the owner and all the readers released it. Later requests are served by
+ *    the content cache, if it is on.
+\*****************************************************************************/
+
+#define _GNU_SOURCE		// memfd_create
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "coalesce.h"
+
+// Fetch shared by several sessions
+struct shared_stream {
+	char *key;						// Key (name, fhash and flen)
+	unsigned long long flen;		// File length
+	int fd;							// Spool
+	unsigned long long avail;		// Bytes in the spool
+	unsigned long long punched;		// Bytes released from the start of the spool
+	GList *readers;				// Progress of each reader (bytes sent to its client)
+	gboolean done;					// Owner finished
+	gboolean failed;				// Owner finished before the end of the file
+	int refs;						// Owner (while fetching) + readers
+	pthread_cond_t cond;			// Signaled when data is appended or the owner finishes
+};
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *streams = NULL;	// Streams being fetched, by key
+static coalesce_stats stats;
+
+
+// Free a stream without references; called with stream_mutex locked
+static void release_stream(shared_stream *ss) {
+	if (--ss->refs > 0)
+		return;
+	close(ss->fd);
+	g_list_free(ss->readers);
+	pthread_cond_destroy(&ss->cond);
+	free(ss->key);
+	free(ss);
+}
+
+
+// Make the stream unreachable by its key; called with stream_mutex locked
+static void unlink_stream(shared_stream *ss) {
+	if (g_hash_table_lookup(streams, ss->key) == ss)
+		g_hash_table_remove(streams, ss->key);
+}
+
+
+// Join the fetch of a file, or start one. Sets 'owner' to TRUE if the caller must fetch
+// the file and append it with stream_append. A reader's 'progress' (bytes sent to its client)
+// is read to release the spool behind it. Returns NULL if the file is not shared
+shared_stream *stream_attach(const char *name, uint32_t fhash, unsigned long long flen,
+		const unsigned long long *progress, gboolean *owner) {
+	char *key = (char *) malloc(strlen(name) + 32);
+	shared_stream *ss;
+
+	*owner = FALSE;
+	sprintf(key, "%s/%08x/%llu", name, fhash, flen);
+	pthread_mutex_lock(&stream_mutex);
+	if (streams == NULL)
+		streams = g_hash_table_new(g_str_hash, g_str_equal);
+	ss = (shared_stream *) g_hash_table_lookup(streams, key);
+	if (ss != NULL) {
+		// Join as a reader
+		ss->refs++;
+		ss->readers = g_list_prepend(ss->readers, (gpointer) progress);
+		stats.joined++;
+		free(key);
+	} else {
+		int fd = memfd_create("gateway-spool", MFD_CLOEXEC);
+		if (fd < 0) {
+			perror("Failed creating the spool");
+			free(key);
+		} else {
+			ss = (shared_stream *) calloc(1, sizeof(shared_stream));
+			ss->key = key;
+			ss->flen = flen;
+			ss->fd = fd;
+			ss->refs = 1;
+			pthread_cond_init(&ss->cond, NULL);
+			g_hash_table_insert(streams, ss->key, ss);
+			stats.fetches++;
+			*owner = TRUE;
+		}
+	}
+	pthread_mutex_unlock(&stream_mutex);
+	return ss;
+}
+
+
+// Mark the fetch as ended, waking up the readers; called with stream_mutex locked
+static void end_fetch(shared_stream *ss, gboolean complete) {
+	if (ss->done)
+		return;
+	ss->done = TRUE;
+	ss->failed = !complete || (ss->avail != ss->flen);
+	unlink_stream(ss);
+	pthread_cond_broadcast(&ss->cond);
+}
+
+
+// Append 'n' bytes fetched by the owner
+void stream_append(shared_stream *ss, const char *buf, int n) {
+	if ((ss == NULL) || ss->done)
+		return;
+	unsigned long long from = 0, to = 0;
+	GList *l;
+
+	// Only the owner writes, at the end of the spool: no lock needed for the write itself
+	gboolean ok = (pwrite(ss->fd, buf, n, ss->avail) == n);
+	pthread_mutex_lock(&stream_mutex);
+	if (ok) {
+		ss->avail += n;
+		pthread_cond_broadcast(&ss->cond);
+		if (ss->avail > STREAM_MAX_PREFIX) {
+			// Late sessions would need the whole prefix: the bytes all the readers sent are released
+			unlink_stream(ss);
+			to = ss->avail;
+			for (l = ss->readers; l != NULL; l = g_list_next(l))
+				to = MIN(to, __atomic_load_n((const unsigned long long *) l->data, __ATOMIC_RELAXED));
+			to -= to % STREAM_PUNCH_STEP;
+			if (to >= ss->punched + STREAM_PUNCH_STEP) {
+				from = ss->punched;
+				ss->punched = to;
+			}
+		}
+	} else
+		end_fetch(ss, FALSE);	// The readers stop; the owner carries on alone
+	pthread_mutex_unlock(&stream_mutex);
+	// The readers are past these bytes: they never read them again
+	if ((to > from) && (fallocate(ss->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) < 0))
+		perror("Failed releasing the spool");
+}
+
+
+// End of the owner's fetch; complete - all the bytes were appended. Releases the owner
+void stream_finish(shared_stream *ss, gboolean complete) {
+	if (ss == NULL)
+		return;
+	pthread_mutex_lock(&stream_mutex);
+	end_fetch(ss, complete);
+	release_stream(ss);
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+
+// Wait until the readers can read beyond 'offset'. Returns the number of bytes available
+// after 'offset', 0 at the end of the file, or -1 if the fetch failed or the gateway stopped
+long long stream_wait(shared_stream *ss, unsigned long long offset) {
+	long long n;
+
+	pthread_mutex_lock(&stream_mutex);
+	while (active && (ss->avail <= offset) && !ss->done) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += STREAM_WAIT_PERIOD * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ss->cond, &stream_mutex, &deadline);
+	}
+	if (ss->avail > offset)
+		n = ss->avail - offset;	// Data is sent even if the owner failed meanwhile
+	else if (!active || ss->failed)
+		n = -1;
+	else
+		n = 0;
+	pthread_mutex_unlock(&stream_mutex);
+	return n;
+}
+
+
+// Descriptor of the spool, to be read with pread or sendfile
+int stream_fd(shared_stream *ss) {
+	return ss->fd;
+}
+
+
+// Release a reader; progress - bytes sent to its client, as given to stream_attach
+void stream_detach(shared_stream *ss, const unsigned long long *progress) {
+	if (ss == NULL)
+		return;
+	pthread_mutex_lock(&stream_mutex);
+	stats.bytes_saved += *progress;
+	ss->readers = g_list_remove(ss->readers, progress);
+	release_stream(ss);
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+
+// Count a reader that fetches the file itself because the owner failed before sending data
+void stream_fallback(void) {
+	pthread_mutex_lock(&stream_mutex);
+	stats.fallbacks++;
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+
+// Current statistics
+void coalesce_get_stats(coalesce_stats *st) {
+	pthread_mutex_lock(&stream_mutex);
+	memcpy(st, &stats, sizeof(coalesce_stats));
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+
+// Log the statistics
+void coalesce_report(void) {
+	coalesce_stats st;
+	char tmp[200];
+
+	coalesce_get_stats(&st);
+	if (st.fetches == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Coalescing: %lu fetches shared by %lu more sessions, %lu fallbacks, "
+			"%llu KB not fetched again\n", st.fetches, st.joined, st.fallbacks, st.bytes_saved >> 10);
+	Log(tmp);
+}
@@ -0,0 +1,64 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * coalesce.h
+ *
+ * Header file of the download coalescing: concurrent requests for the same
+ *    content (filename, fhash, flen) share one upstream fetch. The first
+ *    session owns the connection to the IPv6 server and appends what it relays
+ *    to an in-memory spool; the sessions that arrive while it is running read
+ *    the spool at their own offset, so a late joiner first catches up with the
+ *    prefix already fetched.
+\*****************************************************************************/
+
+#ifndef INCL_COALESCE_H
+#define INCL_COALESCE_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+#define STREAM_WAIT_PERIOD	100		// Period checking if the gateway stopped while waiting (ms)
+#define STREAM_MAX_PREFIX	(8 << 20)	// Spool kept whole for late sessions; beyond it, it is released
+#define STREAM_PUNCH_STEP	(1 << 20)	// Spool released in steps of this size, behind the slowest reader
+
+// Fetch shared by several sessions
+typedef struct shared_stream shared_stream;
+
+// Coalescing statistics
+typedef struct coalesce_stats {
+	unsigned long fetches;			// Upstream fetches started
+	unsigned long joined;			// Sessions served by another session's fetch
+	unsigned long fallbacks;		// Readers that had to fetch the file themselves
+	unsigned long long bytes_saved;	// Bytes sent to readers (not fetched again)
+} coalesce_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Join the fetch of a file, or start one. Sets 'owner' to TRUE if the caller must fetch
+// the file and append it with stream_append. A reader's 'progress' (bytes sent to its client)
+// is read to release the spool behind it. Returns NULL if the file is not shared
+shared_stream *stream_attach(const char *name, uint32_t fhash, unsigned long long flen,
+		const unsigned long long *progress, gboolean *owner);
+// Append 'n' bytes fetched by the owner
+void stream_append(shared_stream *ss, const char *buf, int n);
+// End of the owner's fetch; complete - all the bytes were appended. Releases the owner
+void stream_finish(shared_stream *ss, gboolean complete);
+// Wait until the readers can read beyond 'offset'. Returns the number of bytes available
+// after 'offset', 0 at the end of the file, or -1 if the fetch failed or the gateway stopped
+long long stream_wait(shared_stream *ss, unsigned long long offset);
+// Descriptor of the spool, to be read with pread or sendfile
+int stream_fd(shared_stream *ss);
+// Release a reader; progress - bytes sent to its client, as given to stream_attach
+void stream_detach(shared_stream *ss, const unsigned long long *progress);
+// Count a reader that fetches the file itself because the owner failed before sending data
+void stream_fallback(void);
+// Current statistics
+void coalesce_get_stats(coalesce_stats *st);
+// Log the statistics
+void coalesce_report(void);
+
+#endif
@@ -0,0 +1,205 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * fhash.c
+ *
+ * Integrity verification of the relayed files against the hash in the Hit
+ *
+ * The hash is the sum of the file's bytes modulo 2^32, so it is computed one
+ *    block at a time, in any block size. The SIMD versions add 16 (SSE2) or
+ *    32 (AVX2) bytes per instruction with PSADBW into 64-bit lanes, which is
+ *    far faster than the relay, and the tail is added byte by byte.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FHASH_X86
+#endif
+#include "gui.h"
+#include "fhash.h"
+
+// Verification results of one server
+typedef struct fhash_server {
+	unsigned long verified;		// Files whose hash matched
+	unsigned long mismatches;	// Files whose hash did not match
+} fhash_server;
+
+typedef uint32_t (*fhash_fn)(uint32_t h, const void *buf, size_t n);
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static fhash_fn update_fn = NULL;	// Implementation selected for this processor
+static const char *update_name = "scalar";
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *servers = NULL;	// Results by server ("ip-port")
+static fhash_stats stats;
+
+
+/*********************\
+|*  Implementations  *|
+\*********************/
+
+// Portable implementation of fhash_update, used when the processor has no SIMD support
+uint32_t fhash_update_scalar(uint32_t h, const void *buf, size_t n) {
+	const unsigned char *p = (const unsigned char *) buf;
+	uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += p[i];
+		s1 += p[i + 1];
+		s2 += p[i + 2];
+		s3 += p[i + 3];
+	}
+	for (; i < n; i++)
+		s0 += p[i];
+	return h + (uint32_t) (s0 + s1 + s2 + s3);
+}
+
+#ifdef FHASH_X86
+__attribute__((target("sse2")))
+static uint32_t fhash_update_sse2(uint32_t h, const void *buf, size_t n) {
+	const unsigned char *p = (const unsigned char *) buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+	uint64_t lanes[2];
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (p + i)), zero));
+		acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (p + i + 16)), zero));
+	}
+	_mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(acc0, acc1));
+	return fhash_update_scalar(h + (uint32_t) (lanes[0] + lanes[1]), p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t fhash_update_avx2(uint32_t h, const void *buf, size_t n) {
+	const unsigned char *p = (const unsigned char *) buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	uint64_t lanes[4];
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (p + i)), zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (p + i + 32)), zero));
+	}
+	_mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+	return fhash_update_scalar(h + (uint32_t) (lanes[0] + lanes[1] + lanes[2] + lanes[3]), p + i, n - i);
+}
+#endif
+
+// Select the fastest implementation supported by the processor
+static fhash_fn select_impl(void) {
+	fhash_fn fn = fhash_update_scalar;
+#ifdef FHASH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = fhash_update_avx2;
+		update_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		fn = fhash_update_sse2;
+		update_name = "sse2";
+	}
+#endif
+	return fn;
+}
+
+
+// Add 'n' bytes to the hash 'h' of the previous bytes of a file; start with h = 0
+uint32_t fhash_update(uint32_t h, const void *buf, size_t n) {
+	if (update_fn == NULL)
+		update_fn = select_impl();	// Every thread selects the same one: no lock needed
+	return update_fn(h, buf, n);
+}
+
+// Name of the implementation selected for this processor
+const char *fhash_impl(void) {
+	if (update_fn == NULL)
+		update_fn = select_impl();
+	return update_name;
+}
+
+
+/****************\
+|*  Statistics  *|
+\****************/
+
+// Record the verification of a file sent by 'srv_list' ("ip-port", separated by spaces)
+void fhash_result(const char *srv_list, unsigned long long flen, gboolean match) {
+	const char *next, *end;
+	char key[INET6_ADDRSTRLEN + 8];
+
+	pthread_mutex_lock(&stats_mutex);
+	if (match)
+		stats.verified++;
+	else
+		stats.mismatches++;
+	stats.bytes += flen;
+	if (servers == NULL)
+		servers = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	for (next = srv_list; (next != NULL) && (*next != '\0'); next = end) {
+		while (*next == ' ')
+			next++;
+		for (end = next; (*end != ' ') && (*end != '\0'); end++)
+			;
+		if ((end == next) || (end - next >= (int) sizeof(key)))
+			break;
+		memcpy(key, next, end - next);
+		key[end - next] = '\0';
+		fhash_server *sv = (fhash_server *) g_hash_table_lookup(servers, key);
+		if (sv == NULL) {
+			sv = (fhash_server *) calloc(1, sizeof(fhash_server));
+			g_hash_table_insert(servers, strdup(key), sv);
+		}
+		if (match)
+			sv->verified++;
+		else
+			sv->mismatches++;
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+// Current statistics
+void fhash_get_stats(fhash_stats *st) {
+	pthread_mutex_lock(&stats_mutex);
+	memcpy(st, &stats, sizeof(fhash_stats));
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+// Log the results of a server that sent files with the wrong hash; g_hash_table_foreach callback
+static void report_server(gpointer key, gpointer value, gpointer data) {
+	fhash_server *sv = (fhash_server *) value;
+	char tmp[200];
+
+	if (sv->mismatches == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "  server %s: %lu mismatches in %lu files\n", (char *) key,
+			sv->mismatches, sv->mismatches + sv->verified);
+	Log(tmp);
+}
+
+// Log the statistics, including the servers that sent files with the wrong hash
+void fhash_report(void) {
+	char tmp[300];
+
+	pthread_mutex_lock(&stats_mutex);
+	if (stats.verified + stats.mismatches > 0) {
+		snprintf(tmp, sizeof(tmp), "Verification (%s): %lu files matched the Hit hash, %lu did not "
+				"(%llu MB hashed)\n", fhash_impl(), stats.verified, stats.mismatches, stats.bytes >> 20);
+		Log(tmp);
+		g_hash_table_foreach(servers, report_server, NULL);
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
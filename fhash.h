@@ -0,0 +1,46 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * fhash.h
+ *
+ * Header file of the integrity verification of the relayed files: the hash
+ *    announced in the Hit (fhash, the 32-bit sum of the file's bytes) is
+ *    computed incrementally while the file passes through the relay, with an
+ *    SSE2 or AVX2 implementation selected at run time. Mismatches are counted
+ *    per server.
+\*****************************************************************************/
+
+#ifndef INCL_FHASH_H
+#define INCL_FHASH_H
+
+#include <gtk/gtk.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Verification statistics
+typedef struct fhash_stats {
+	unsigned long verified;		// Files whose hash matched
+	unsigned long mismatches;	// Files whose hash did not match
+	unsigned long long bytes;	// Bytes hashed
+} fhash_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Add 'n' bytes to the hash 'h' of the previous bytes of a file; start with h = 0
+uint32_t fhash_update(uint32_t h, const void *buf, size_t n);
+// Portable implementation of fhash_update, used when the processor has no SIMD support
+uint32_t fhash_update_scalar(uint32_t h, const void *buf, size_t n);
+// Name of the implementation selected for this processor
+const char *fhash_impl(void);
+// Record the verification of a file sent by 'servers' ("ip-port", separated by spaces)
+void fhash_result(const char *servers, unsigned long long flen, gboolean match);
+// Current statistics
+void fhash_get_stats(fhash_stats *st);
+// Log the statistics, including the servers that sent files with the wrong hash
+void fhash_report(void);
+
+#endif
@@ -0,0 +1,421 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * groups.c
+ *
+ * Multicast group pairs
+ *
+ * Pair 0 keeps the sockets and callbacks of callbacks_socket.c, so it is also
+ *    handed over in a hot restart; the other pairs join their groups again in
+ *    the new process, on shared ports. Each of the other pairs forwards its
+ *    Queries from its own query socket, so the pair of a Hit is the socket it
+ *    arrives at; the Hits are sent to the clients from the multicast socket of
+ *    the Query's pair.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "callbacks_socket.h"
+#include "groups.h"
+
+struct group_pair;
+
+// Multicast or query socket of a pair
+typedef struct group_socket {
+	struct group_pair *pair;	// Pair of the socket
+	gboolean is_ipv6;			// IPv6 group
+	gboolean is_query;			// Query socket: forwards the pair's Queries and receives their Hits
+	int sock;					// Socket (-1 - closed)
+	GIOChannel *chan;			// GIO channel of the socket
+	guint chan_id;				// GIO channel number
+} group_socket;
+
+// Group pair
+typedef struct group_pair {
+	int id;						// Index in 'pairs'
+	char *addr4, *addr6;		// Group addresses
+	u_short port4, port6;		// Group ports
+	struct sockaddr_in6 dest4;	// IPv4 group, IPv4-mapped, reached from the query socket
+	struct sockaddr_in6 dest6;	// IPv6 group
+	struct ip_mreq imr4;		// IPv4 group membership
+	struct ipv6_mreq imr6;		// IPv6 group membership
+	group_socket s4, s6;		// Multicast sockets
+	group_socket sq;			// Query socket
+	u_short portq;				// Port of the query socket
+	group_stats stats;
+} group_pair;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+static group_pair pairs[GROUPS_MAX];	// Pair 0 uses the sockets of callbacks_socket.c
+static int n_pairs = 1;
+static char tmp_buf[300];
+
+
+// Callback of the sockets of pairs 1 and up: Queries received from the groups, and Hits
+// received at the query socket
+static gboolean callback_group_data(GIOChannel *source, GIOCondition condition, gpointer data) {
+	static char buf[MESSAGE_MAX_LENGTH];
+	group_socket *gs = (group_socket *) data;
+	struct in6_addr ipv6;
+	struct in_addr ipv4;
+	u_short port;
+	int n;
+
+	if (!active || (gs->sock < 0))
+		return FALSE;
+	if ((condition & G_IO_NVAL) || (condition & G_IO_ERR)) {
+		sprintf(tmp_buf, "Error detected in the %s socket of group pair %d - stopped\n",
+				gs->is_query ? "query" : (gs->is_ipv6 ? "IPv6" : "IPv4"), gs->pair->id);
+		Log(tmp_buf);
+		gs->chan = NULL;	// Removed by returning FALSE
+		return FALSE;
+	}
+	if (gs->is_ipv6) {
+		n = read_data_ipv6(gs->sock, buf, MESSAGE_MAX_LENGTH, &ipv6, &port);
+	} else {
+		n = read_data_ipv4(gs->sock, buf, MESSAGE_MAX_LENGTH, &ipv4, &port);
+		ipv4_to_mapped(&ipv4, &ipv6);
+	}
+	if (n <= 0) {
+		Log("Failed reading packet from multicast socket\n");
+		return TRUE;
+	}
+	if (gs->is_query) {
+		if ((unsigned char) buf[0] == MSG_HIT)
+			handle_group_Hit(buf, n, gs->pair->id, &ipv6, port, !IN6_IS_ADDR_V4MAPPED(&ipv6));
+		else {
+			sprintf(tmp_buf, "Invalid packet type (%d) in query socket of group pair %d - ignored\n",
+					(int) (unsigned char) buf[0], gs->pair->id);
+			Log(tmp_buf);
+		}
+	} else if ((unsigned char) buf[0] == MSG_QUERY)
+		handle_group_Query(buf, n, gs->pair->id, gs->is_ipv6, &ipv6, &ipv4, port);
+	else {
+		sprintf(tmp_buf, "Invalid packet type (%d) in multicast socket of group pair %d - ignored\n",
+				(int) (unsigned char) buf[0], gs->pair->id);
+		Log(tmp_buf);
+	}
+	return TRUE;
+}
+
+
+// Leave the group and close the socket
+static void close_group_socket(group_socket *gs) {
+	group_pair *p = gs->pair;
+
+	if (gs->sock < 0)
+		return;
+	if (gs->is_query)
+		;	// No group joined
+	else if (gs->is_ipv6 ? (setsockopt(gs->sock, IPPROTO_IPV6, IPV6_LEAVE_GROUP, &p->imr6, sizeof(p->imr6)) < 0) :
+			(setsockopt(gs->sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &p->imr4, sizeof(p->imr4)) < 0))
+		perror("Failed leaving a multicast group");
+	if (gs->chan != NULL)
+		remove_socket_from_mainloop(gs->sock, gs->chan_id, gs->chan);	// Closes the socket
+	else
+		close(gs->sock);
+	gs->sock = -1;
+	gs->chan = NULL;
+}
+
+
+// Open the multicast sockets of a pair, joining its groups
+static gboolean open_pair(group_pair *p) {
+	// IPv4 group
+	if (!get_IPv4(p->addr4, &p->imr4.imr_multiaddr) ||
+			!translate_ipv4_to_ipv6(p->addr4, &p->dest4.sin6_addr))
+		return FALSE;
+	p->imr4.imr_interface.s_addr = htonl(INADDR_ANY);
+	p->dest4.sin6_family = AF_INET6;
+	p->dest4.sin6_port = htons(p->port4);
+	p->s4.sock = init_socket_ipv4(SOCK_DGRAM, p->port4, TRUE);	// Share port
+	if ((p->s4.sock < 0) ||
+			(setsockopt(p->s4.sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &p->imr4, sizeof(p->imr4)) < 0)) {
+		perror("Failed association to IPv4 multicast group");
+		if (p->s4.sock >= 0)
+			close(p->s4.sock);
+		p->s4.sock = -1;
+		return FALSE;
+	}
+
+	// IPv6 group
+	if (!get_IPv6(p->addr6, &p->dest6.sin6_addr)) {
+		close_group_socket(&p->s4);
+		return FALSE;
+	}
+	p->dest6.sin6_family = AF_INET6;
+	p->dest6.sin6_port = htons(p->port6);
+	memcpy(&p->imr6.ipv6mr_multiaddr, &p->dest6.sin6_addr, sizeof(struct in6_addr));
+	p->imr6.ipv6mr_interface = 0;
+	p->s6.sock = init_socket_ipv6(SOCK_DGRAM, p->port6, TRUE);
+	if ((p->s6.sock < 0) ||
+			(setsockopt(p->s6.sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &p->imr6, sizeof(p->imr6)) < 0)) {
+		perror("Failed association to IPv6 multicast group");
+		if (p->s6.sock >= 0)
+			close(p->s6.sock);
+		p->s6.sock = -1;
+		close_group_socket(&p->s4);
+		return FALSE;
+	}
+
+	// Query socket, reaching both groups (IPv4 as IPv4-mapped)
+	p->sq.sock = init_socket_ipv6(SOCK_DGRAM, 0, FALSE);
+	if (p->sq.sock < 0) {
+		close_group_socket(&p->s4);
+		close_group_socket(&p->s6);
+		return FALSE;
+	}
+	p->portq = get_portnumber(p->sq.sock);
+
+	// Main loop
+	if (!put_socket_in_mainloop(p->s4.sock, &p->s4, &p->s4.chan_id, &p->s4.chan, G_IO_IN, callback_group_data) ||
+			!put_socket_in_mainloop(p->s6.sock, &p->s6, &p->s6.chan_id, &p->s6.chan, G_IO_IN, callback_group_data) ||
+			!put_socket_in_mainloop(p->sq.sock, &p->sq, &p->sq.chan_id, &p->sq.chan, G_IO_IN, callback_group_data)) {
+		Log("Failed registration of a group pair socket at Gnome\n");
+		close_group_socket(&p->s4);
+		close_group_socket(&p->s6);
+		close_group_socket(&p->sq);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Open the group pairs in 'spec' ("addr4 port4 addr6 port6 [max_queries]", separated by ';'),
+// after the sockets of pair 0; max_queries - default limit of pending Queries per pair (0 - none)
+// A pair that fails is left out. Returns the number of pairs, including pair 0
+int groups_init(const char *spec, long max_queries) {
+	char *copy, *item, *save = NULL;
+	char a4[INET_ADDRSTRLEN + 1], a6[INET6_ADDRSTRLEN + 1];
+	unsigned int p4, p6;
+	long max;
+
+	pthread_mutex_lock(&groups_mutex);
+	memset(&pairs[0].stats, 0, sizeof(group_stats));
+	pairs[0].stats.max_pending = (int) MAX(max_queries, 0);
+	pthread_mutex_unlock(&groups_mutex);
+	if ((spec == NULL) || (n_pairs > 1))
+		return n_pairs;
+
+	copy = strdup(spec);
+	for (item = strtok_r(copy, ";", &save); item != NULL; item = strtok_r(NULL, ";", &save)) {
+		int n = sscanf(item, "%16s %u %46s %u %ld", a4, &p4, a6, &p6, &max);
+		if (n < 4) {
+			if (strspn(item, " \t") != strlen(item)) {
+				sprintf(tmp_buf, "Invalid group pair '%.200s' - expected \"addr4 port4 addr6 port6 [max_queries]\"\n", item);
+				Log(tmp_buf);
+			}
+			continue;
+		}
+		if (n_pairs == GROUPS_MAX) {
+			Log("Too many group pairs - the rest are ignored\n");
+			break;
+		}
+
+		group_pair *p = &pairs[n_pairs];
+		memset(p, 0, sizeof(group_pair));
+		p->id = n_pairs;
+		p->addr4 = strdup(a4);
+		p->addr6 = strdup(a6);
+		p->port4 = (u_short) p4;
+		p->port6 = (u_short) p6;
+		p->s4.pair = p->s6.pair = p->sq.pair = p;
+		p->s6.is_ipv6 = p->sq.is_ipv6 = TRUE;
+		p->sq.is_query = TRUE;
+		p->s4.sock = p->s6.sock = p->sq.sock = -1;
+		p->stats.max_pending = (int) MAX((n == 5) ? max : max_queries, 0);
+		if (!open_pair(p)) {
+			sprintf(tmp_buf, "Failed joining group pair %s:%hu / [%s]:%hu - left out\n", p->addr4, p->port4,
+					p->addr6, p->port6);
+			Log(tmp_buf);
+			free(p->addr4);
+			free(p->addr6);
+			continue;
+		}
+		sprintf(tmp_buf, "Group pair %d: %s:%hu / [%s]:%hu\n", p->id, p->addr4, p->port4, p->addr6, p->port6);
+		Log(tmp_buf);
+		pthread_mutex_lock(&groups_mutex);
+		n_pairs++;
+		pthread_mutex_unlock(&groups_mutex);
+	}
+	free(copy);
+	return n_pairs;
+}
+
+
+// Leave the groups of the pairs opened by groups_init and close their sockets
+void groups_close(void) {
+	int i;
+
+	for (i = 1; i < n_pairs; i++) {
+		close_group_socket(&pairs[i].s4);
+		close_group_socket(&pairs[i].s6);
+		close_group_socket(&pairs[i].sq);
+		free(pairs[i].addr4);
+		free(pairs[i].addr6);
+	}
+	pthread_mutex_lock(&groups_mutex);
+	n_pairs = 1;
+	pthread_mutex_unlock(&groups_mutex);
+}
+
+
+// Number of group pairs, including pair 0
+int groups_count(void) {
+	return n_pairs;
+}
+
+
+// Check the limit of pending Queries of the pair, before creating a Query; counts the drop
+gboolean group_accepts_query(int group) {
+	gboolean ok;
+
+	pthread_mutex_lock(&groups_mutex);
+	group_stats *st = &pairs[group].stats;
+	st->queries++;
+	ok = (st->max_pending == 0) || (st->pending < st->max_pending);
+	if (!ok)
+		st->dropped++;
+	pthread_mutex_unlock(&groups_mutex);
+	return ok;
+}
+
+
+// Count a Query added to the Query list
+void group_query_added(int group) {
+	pthread_mutex_lock(&groups_mutex);
+	pairs[group].stats.pending++;
+	pthread_mutex_unlock(&groups_mutex);
+}
+
+
+// Count a Query removed from the Query list
+void group_query_removed(int group) {
+	pthread_mutex_lock(&groups_mutex);
+	pairs[group].stats.pending--;
+	pthread_mutex_unlock(&groups_mutex);
+}
+
+
+// Count a packet sent for the pair
+static void count_sent(int group, gboolean hit) {
+	pthread_mutex_lock(&groups_mutex);
+	if (hit)
+		pairs[group].stats.hits++;
+	else
+		pairs[group].stats.forwarded++;
+	pthread_mutex_unlock(&groups_mutex);
+}
+
+
+// Port of the query socket of the pair, which forwards its Queries
+u_short group_query_port(int group) {
+	return (group == 0) ? portUDPq : pairs[group].portq;
+}
+
+
+// Send a packet to the IPv6 or IPv4 group of the pair, from the pair's query socket
+gboolean group_multicast(int group, const char *buf, int n, gboolean use_IPv6) {
+	group_pair *p = &pairs[group];
+
+	if (group == 0) {
+		if (!send_multicast(buf, n, use_IPv6))
+			return FALSE;
+	} else if (sendto(p->sq.sock, buf, n, 0, (struct sockaddr *) (use_IPv6 ? &p->dest6 : &p->dest4),
+			sizeof(struct sockaddr_in6)) < 0) {
+		perror(use_IPv6 ? "Error sending datagram to IPv6 group" : "Error sending datagram to IPv4 group");
+		return FALSE;
+	}
+	count_sent(group, FALSE);
+	return TRUE;
+}
+
+
+// Send a reply packet to an IPv6 client, from the pair's IPv6 multicast socket
+gboolean group_reply6(int group, struct in6_addr *ip, u_short port, const char *buf, int n) {
+	struct sockaddr_in6 addr;
+
+	if (group == 0) {
+		if (!send_M6reply(ip, port, buf, n))
+			return FALSE;
+	} else {
+		memset(&addr, 0, sizeof(addr));
+		addr.sin6_family = AF_INET6;
+		addr.sin6_port = htons(port);
+		memcpy(&addr.sin6_addr, ip, sizeof(struct in6_addr));
+		if (sendto(pairs[group].s6.sock, buf, n, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			perror("send_unicast6: Error sending datagram");
+			return FALSE;
+		}
+	}
+	count_sent(group, TRUE);
+	return TRUE;
+}
+
+
+// Send a reply packet to an IPv4 client, from the pair's IPv4 multicast socket
+gboolean group_reply4(int group, struct in_addr *ip, u_short port, const char *buf, int n) {
+	struct sockaddr_in addr;
+
+	if (group == 0) {
+		if (!send_message4(ip, port, buf, n))
+			return FALSE;
+	} else {
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		memcpy(&addr.sin_addr, ip, sizeof(struct in_addr));
+		if (sendto(pairs[group].s4.sock, buf, n, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			perror("send_unicast4: Error sending datagram");
+			return FALSE;
+		}
+	}
+	count_sent(group, TRUE);
+	return TRUE;
+}
+
+
+// Current statistics of a pair
+void group_get_stats(int group, group_stats *st) {
+	pthread_mutex_lock(&groups_mutex);
+	memcpy(st, &pairs[group].stats, sizeof(group_stats));
+	pthread_mutex_unlock(&groups_mutex);
+}
+
+
+// Log the statistics of each pair
+void groups_report(void) {
+	group_stats st;
+	char limit[32];
+	int i;
+
+	if (n_pairs == 1)
+		return;		// Only the pair of the window
+	for (i = 0; i < n_pairs; i++) {
+		group_get_stats(i, &st);
+		if (st.max_pending > 0)
+			snprintf(limit, sizeof(limit), "/%d", st.max_pending);
+		else
+			limit[0] = '\0';
+		snprintf(tmp_buf, sizeof(tmp_buf), "Group pair %d (%s:%hu / [%s]:%hu): %lu Queries, %lu forwarded, "
+				"%lu Hits, %lu dropped, %d%s pending\n", i, (i == 0) ? str_addr_MCast4 : pairs[i].addr4,
+				(i == 0) ? port_MCast4 : pairs[i].port4, (i == 0) ? str_addr_MCast6 : pairs[i].addr6,
+				(i == 0) ? port_MCast6 : pairs[i].port6, st.queries, st.forwarded, st.hits, st.dropped,
+				st.pending, limit);
+		Log(tmp_buf);
+	}
+}
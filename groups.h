@@ -0,0 +1,67 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * groups.h
+ *
+ * Header file of the multicast group pairs bridged by the gateway: the pair
+ *    set in the window (pair 0, using the sockets in callbacks_socket.c) and
+ *    the pairs listed in GW_GROUPS, each with its own multicast and query
+ *    sockets. The
+ *    Query list, timers, TCP listeners and proxy threads are shared; each
+ *    pair has its own counters and limit of pending Queries.
+\*****************************************************************************/
+
+#ifndef INCL_GROUPS_H
+#define INCL_GROUPS_H
+
+#include <gtk/gtk.h>
+#include <netinet/in.h>
+
+#define GROUPS_MAX			16		// Maximum number of group pairs, including pair 0
+
+// Group pair statistics
+typedef struct group_stats {
+	unsigned long queries;		// Queries received from the pair's groups
+	unsigned long forwarded;	// Queries forwarded to the other group of the pair
+	unsigned long hits;			// Hits sent to the pair's clients
+	unsigned long dropped;		// Queries dropped by the limit
+	int pending;				// Queries in the Query list
+	int max_pending;			// Limit of pending Queries (0 - none)
+} group_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Open the group pairs in 'spec' ("addr4 port4 addr6 port6 [max_queries]", separated by ';'),
+// after the sockets of pair 0; max_queries - default limit of pending Queries per pair (0 - none)
+// A pair that fails is left out. Returns the number of pairs, including pair 0
+int groups_init(const char *spec, long max_queries);
+// Leave the groups of the pairs opened by groups_init and close their sockets
+void groups_close(void);
+// Number of group pairs, including pair 0
+int groups_count(void);
+
+// Check the limit of pending Queries of the pair, before creating a Query; counts the drop
+gboolean group_accepts_query(int group);
+// Count a Query added to or removed from the Query list
+void group_query_added(int group);
+void group_query_removed(int group);
+
+// Port of the query socket of the pair, which forwards its Queries
+u_short group_query_port(int group);
+// Send a packet to the IPv6 or IPv4 group of the pair, from the pair's query socket
+gboolean group_multicast(int group, const char *buf, int n, gboolean use_IPv6);
+// Send a reply packet to an IPv6 client, from the pair's IPv6 multicast socket
+gboolean group_reply6(int group, struct in6_addr *ip, u_short port, const char *buf, int n);
+// Send a reply packet to an IPv4 client, from the pair's IPv4 multicast socket
+gboolean group_reply4(int group, struct in_addr *ip, u_short port, const char *buf, int n);
+
+// Current statistics of a pair
+void group_get_stats(int group, group_stats *st);
+// Log the statistics of each pair
+void groups_report(void);
+
+#endif
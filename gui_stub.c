@@ -0,0 +1,110 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * gui_stub.c
+ *
+ * No-op implementation of the gui.h functions, used by the command line tools
+ *    (benchmarks, load generator) that link the gateway modules without the
+ *    Gtk+ main window. Replace gui_g3.o by gui_stub.o when linking them.
+\*****************************************************************************/
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "gui.h"
+
+// Main window - there is none
+WindowElements *main_window = NULL;
+
+// Set to TRUE to print the Log messages in stderr
+gboolean gui_stub_verbose = FALSE;
+
+
+void Log(const gchar *str) {
+	if (gui_stub_verbose && (str != NULL))
+		fputs(str, stderr);
+}
+
+gboolean GUI_add_Query(const char *fname, uint16_t seq, gboolean is_ipv6,
+		const char *ip, u_short port) {
+	return TRUE;
+}
+
+gboolean GUI_del_Query(const char *fname, uint16_t seq, gboolean is_ipv6,
+		gboolean called_from_GUI) {
+	return TRUE;
+}
+
+gboolean GUI_add_hit_to_Query(const char *fname, uint16_t seq, gboolean is_ipv6,
+		const char *hit) {
+	return TRUE;
+}
+
+gboolean GUI_get_Query_hits(const char *filename, uint16_t seq, gboolean is_ipv6,
+		const char **hits) {
+	if (hits != NULL)
+		*hits = NULL;
+	return FALSE;
+}
+
+gboolean GUI_get_Query_details(const char *filename, uint16_t seq, gboolean is_ipv6,
+		const char **str_ip, unsigned int *port, const char **hits) {
+	return FALSE;
+}
+
+gboolean GUI_add_Proxy(const char *fname, uint16_t seq) {
+	return TRUE;
+}
+
+gboolean GUI_del_Proxy(const char *fname, uint16_t seq, int sock,
+		gboolean called_from_GUI) {
+	return TRUE;
+}
+
+gboolean GUI_update_cli_details_Proxy(const char *fname, uint16_t seq, u_int sock,
+		const char *ip, u_short port) {
+	return TRUE;
+}
+
+gboolean GUI_update_serv_details_Proxy(u_int sock, const char *ip, u_short port) {
+	return TRUE;
+}
+
+gboolean GUI_update_transf_Proxy(u_int TCPsock, u_int transf) {
+	return TRUE;
+}
+
+gboolean GUI_get_selected_Proxy(const char **fname, uint16_t *seq, int *sock,
+		GtkTreeIter *iter) {
+	return FALSE;
+}
+
+gboolean get_checkbutton_Slow_state(void) {
+	return FALSE;
+}
+
+int get_PortIPv4Multicast(void) {
+	return -1;
+}
+
+int get_PortIPv6Multicast(void) {
+	return -1;
+}
+
+const gchar *get_IPv6Multicast(gboolean *ok) {
+	return NULL;
+}
+
+const gchar *get_IPv4Multicast(gboolean *ok) {
+	return NULL;
+}
+
+void set_PID(int pid) {
+}
+
+void block_entrys(gboolean block) {
+}
+
+void set_PortTCP(u_short port) {
+}
@@ -0,0 +1,804 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * hotrestart.c
+ *
+ * Hot restart: handoff of the sockets, queries and relayed sessions to a new
+ *    gateway process.
+ *
+ * The running gateway listens on a UNIX SOCK_SEQPACKET socket. A new process
+ *    connects and sends HO_HELLO; the old one stops its relays at a block
+ *    boundary and sends:
+ *      HO_SOCKETS - configuration + TCP listeners, query and multicast sockets
+ *      HO_SESSION - one per relayed session + its sock4 and sock6
+ *      HO_QUERY   - one per pending Query
+ *      HO_END
+ *    The new process registers everything, answers HO_ACK and only then starts
+ *    its relays; the old one closes its copies of the descriptors (which does
+ *    not close the connections) and finishes the sessions it did not hand over.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <memory.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "callbacks_socket.h"
+#include "proxy_thread.h"
+#include "hotrestart.h"
+#include "groups.h"
+#include "reaper.h"
+#include "affinity.h"
+
+// Message types
+#define HO_HELLO	1	// new -> old: request the handoff
+#define HO_SOCKETS	2	// old -> new: configuration and listening sockets
+#define HO_SESSION	3	// old -> new: session being relayed
+#define HO_QUERY	4	// old -> new: pending Query
+#define HO_END		5	// old -> new: end of the state
+#define HO_ACK		6	// new -> old: state taken over
+#define HO_NACK		7	// new -> old: handoff failed
+
+#define HO_MAX_FDS	5	// Maximum number of descriptors per message
+
+// Flags of HO_SOCKETS
+#define HO_HAS_UDP4	1
+#define HO_HAS_UDP6	2
+#define HO_HAS_TCP6	4	// TCP listener of the IPv6 clients
+
+
+/**********************\
+|*  Global variables  *|
+\**********************/
+
+volatile gboolean handoff_requested = FALSE;	// TRUE while the sessions are being handed over
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static int handoff_sock = -1;			// UNIX socket accepting handoff requests
+static GIOChannel *handoff_chan = NULL;	// GIO channel of handoff_sock
+static guint handoff_chan_id = 0;		// GIO channel number of handoff_sock
+static char *handoff_path = NULL;		// Path of handoff_sock
+static int handoff_conn = -1;			// Connection of the new process while the relays stop
+static guint park_timer_id = 0;			// Timer checking if the relays stopped
+static gint64 park_deadline = 0;		// Monotonic time (us) when the sessions still relaying are left out
+
+static pthread_mutex_t park_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+
+static char tmp_buf[512];
+
+
+/************************\
+|*  Message transport   *|
+\************************/
+
+// Send a message with up to HO_MAX_FDS descriptors
+static gboolean send_msg(int s, const char *buf, int len, const int *fds, int nfds) {
+	struct msghdr msg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(HO_MAX_FDS * sizeof(int))];
+
+	assert(nfds <= HO_MAX_FDS);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		struct cmsghdr *cmsg;
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	if (sendmsg(s, &msg, MSG_NOSIGNAL) != len) {
+		perror("handoff: sendmsg");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Receive a message, waiting up to 'timeout' ms; returns its length or -1
+// The received descriptors are stored in 'fds' and their number in 'nfds'
+static int recv_msg(int s, char *buf, int size, int *fds, int *nfds, int timeout) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct pollfd pfd;
+	char cbuf[CMSG_SPACE(HO_MAX_FDS * sizeof(int))];
+	struct cmsghdr *cmsg;
+	int n;
+
+	*nfds = 0;
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) <= 0) {
+		Log("handoff: timeout waiting for the other gateway process\n");
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+	if (n <= 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+			int k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds + *nfds, CMSG_DATA(cmsg), MIN(k, HO_MAX_FDS - *nfds) * sizeof(int));
+			*nfds += MIN(k, HO_MAX_FDS - *nfds);
+		}
+	}
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		Log("handoff: truncated message\n");
+		while (*nfds > 0)
+			close(fds[--(*nfds)]);
+		return -1;
+	}
+	return n;
+}
+
+// Send a message without descriptors, with only the type
+static gboolean send_type(int s, unsigned char type) {
+	uint32_t magic = HANDOFF_MAGIC, version = HANDOFF_VERSION;
+	char buf[16], *pt = buf;
+	WRITE_BUF(pt, &type, 1);
+	WRITE_BUF(pt, &magic, sizeof(magic));
+	WRITE_BUF(pt, &version, sizeof(version));
+	return send_msg(s, buf, pt - buf, NULL, 0);
+}
+
+
+/*****************************\
+|*  Query (de)serialization  *|
+\*****************************/
+
+// Write a string with its length (including '\0'); NULL is written with length 0
+static void write_string(char **pt, const char *str) {
+	uint16_t len = (str == NULL) ? 0 : strlen(str) + 1;
+	WRITE_BUF(*pt, &len, sizeof(len));
+	if (len > 0)
+		WRITE_BUF(*pt, str, len);
+}
+
+// Read a string written by write_string; returns FALSE if it is invalid
+static gboolean read_string(char **pt, char *end, const char **str) {
+	uint16_t len;
+	if (*pt + sizeof(len) > end)
+		return FALSE;
+	READ_BUF(*pt, &len, sizeof(len));
+	if (len == 0) {
+		*str = NULL;
+		return TRUE;
+	}
+	if ((*pt + len > end) || ((*pt)[len - 1] != '\0'))
+		return FALSE;
+	*str = *pt;
+	*pt += len;
+	return TRUE;
+}
+
+// Write the Query fields, including its hits
+static void write_query(char **pt, Query *q) {
+	unsigned char is_ipv6 = q->is_ipv6, state = q->state;
+	int seq = q->seq;
+	uint16_t group = q->group;
+	struct in6_addr addr;
+	int32_t remaining = 0;
+	hit_server hits[HANDOFF_MAX_HITS];
+	int32_t n_hits;
+	int i;
+
+	memset(&addr, 0, sizeof(addr));
+	if (q->is_ipv6)
+		memcpy(&addr, &q->addr.ipv6, sizeof(struct in6_addr));
+	else
+		memcpy(&addr, &q->addr.ipv4, sizeof(struct in_addr));
+	if (q->timer_deadline > 0)
+		remaining = (int32_t) MAX(1, (q->timer_deadline - g_get_monotonic_time()) / 1000);
+	n_hits = get_Query_hits(q, hits, HANDOFF_MAX_HITS);
+
+	write_string(pt, q->name);
+	WRITE_BUF(*pt, &seq, sizeof(int));
+	WRITE_BUF(*pt, &is_ipv6, 1);
+	WRITE_BUF(*pt, &addr, sizeof(addr));
+	WRITE_BUF(*pt, &q->port, sizeof(u_short));
+	WRITE_BUF(*pt, &group, sizeof(uint16_t));
+	WRITE_BUF(*pt, &state, 1);
+	WRITE_BUF(*pt, &remaining, sizeof(remaining));
+	WRITE_BUF(*pt, &q->hit_fhash, sizeof(uint32_t));
+	WRITE_BUF(*pt, &q->hit_flen, sizeof(unsigned long long));
+	WRITE_BUF(*pt, &n_hits, sizeof(n_hits));
+	for (i = 0; i < n_hits; i++) {
+		WRITE_BUF(*pt, &hits[i].addr.sin6_addr, sizeof(struct in6_addr));
+		WRITE_BUF(*pt, &hits[i].addr.sin6_port, sizeof(in_port_t));
+		WRITE_BUF(*pt, &hits[i].fhash, sizeof(uint32_t));
+		WRITE_BUF(*pt, &hits[i].flen, sizeof(unsigned long long));
+	}
+}
+
+// Read the Query fields and create it, restoring its GUI entry and timer
+static Query *read_query(char **pt, char *end) {
+	const char *name;
+	int seq;
+	unsigned char is_ipv6, state;
+	struct in6_addr addr;
+	struct in_addr ipv4;
+	u_short port;
+	uint16_t group;
+	int32_t remaining;
+	uint32_t hit_fhash;
+	unsigned long long hit_flen;
+	int32_t n_hits;
+	Query *q;
+	int i;
+
+	if (!read_string(pt, end, &name) || (name == NULL) ||
+			(*pt + sizeof(int) + 1 + sizeof(addr) + sizeof(u_short) + sizeof(group) + 1 + sizeof(remaining) +
+			sizeof(hit_fhash) + sizeof(hit_flen) + sizeof(n_hits) > end))
+		return NULL;
+	READ_BUF(*pt, &seq, sizeof(int));
+	READ_BUF(*pt, &is_ipv6, 1);
+	READ_BUF(*pt, &addr, sizeof(addr));
+	READ_BUF(*pt, &port, sizeof(u_short));
+	READ_BUF(*pt, &group, sizeof(uint16_t));
+	READ_BUF(*pt, &state, 1);
+	READ_BUF(*pt, &remaining, sizeof(remaining));
+	READ_BUF(*pt, &hit_fhash, sizeof(hit_fhash));
+	READ_BUF(*pt, &hit_flen, sizeof(hit_flen));
+	READ_BUF(*pt, &n_hits, sizeof(n_hits));
+	if ((state > S_F_TRANSF) || (n_hits < 0) || (n_hits > HANDOFF_MAX_HITS) ||
+			(*pt + n_hits * HANDOFF_HIT_SIZE > end))
+		return NULL;
+	memcpy(&ipv4, &addr, sizeof(ipv4));
+
+	q = new_Query(name, (uint16_t) seq, is_ipv6, &addr, &ipv4, port);
+	if (q == NULL)
+		return NULL;
+	q->hit_fhash = hit_fhash;
+	q->hit_flen = hit_flen;
+	// The pairs are joined before the handoff; a pair missing in this process falls back to pair 0
+	if ((group > 0) && (group < groups_count()))
+		set_Query_group(q, group);
+	GUI_add_Query(name, (uint16_t) seq, is_ipv6, is_ipv6 ? addr_ipv6(&addr) : addr_ipv4(&ipv4), port);
+	for (i = 0; i < n_hits; i++) {
+		hit_server hs;
+		char str[HIT_SERVER_STRLEN];
+
+		memset(&hs, 0, sizeof(hs));
+		hs.addr.sin6_family = AF_INET6;
+		READ_BUF(*pt, &hs.addr.sin6_addr, sizeof(struct in6_addr));
+		READ_BUF(*pt, &hs.addr.sin6_port, sizeof(in_port_t));
+		READ_BUF(*pt, &hs.fhash, sizeof(uint32_t));
+		READ_BUF(*pt, &hs.flen, sizeof(unsigned long long));
+		if (add_Query_hit(q, &hs.addr.sin6_addr, ntohs(hs.addr.sin6_port), hs.fhash, hs.flen))
+			GUI_add_hit_to_Query(name, (uint16_t) seq, is_ipv6, hit_server_str(&hs, str));
+	}
+
+	remaining = MAX(remaining, 1);
+	switch (state) {
+	case S_JITTER:
+		start_query_timer(q, remaining);
+		break;
+	case S_IDLE:
+	case S_TIMER:
+		set_query_state(q, S_IDLE);
+		start_query_timer(q, remaining);
+		break;
+	case S_HIT:
+	case S_TRY_TCP:
+		set_query_state(q, S_TRY_TCP);
+		GUI_add_Proxy(name, (uint16_t) seq);
+		start_query_timer(q, remaining);
+		break;
+	default:
+		set_query_state(q, (QueryState) state);	// Associated to a session
+	}
+	return q;
+}
+
+
+/*****************************\
+|*  Old process: send state  *|
+\*****************************/
+
+// Number of sessions relaying a file that did not stop at a block boundary yet
+// Sessions without a server connection (served locally) or feeding other sessions
+// (coalesced fetch), or reading the server ahead of the client (spooling), are not handed over
+static int count_unparked_relays(void) {
+	GList *l;
+	int n = 0;
+	pthread_mutex_lock(&park_mutex);
+	pthread_mutex_lock(&plist_mutex);
+	for (l = plist.head; l != NULL; l = g_list_next(l)) {
+		thread_state *pt = (thread_state *) l->data;
+		if ((pt->status == S_TRANSF) && !pt->parked && (pt->sock6 >= 0) && (pt->stream == NULL) &&
+				!pt->spooling)
+			n++;
+	}
+	pthread_mutex_unlock(&plist_mutex);
+	pthread_mutex_unlock(&park_mutex);
+	return n;
+}
+
+// Ask the relays to stop at a block boundary; callback_parked waits for them in the main loop
+static void park_relays(void) {
+	pthread_mutex_lock(&park_mutex);
+	handoff_requested = TRUE;
+	pthread_mutex_unlock(&park_mutex);
+	park_deadline = g_get_monotonic_time() + 1000LL * HANDOFF_PARK_TIMEOUT;
+}
+
+// Resume the relays; the ones marked as handed_off stop
+static void release_relays(void) {
+	pthread_mutex_lock(&park_mutex);
+	handoff_requested = FALSE;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_mutex);
+}
+
+// Called periodically after a handoff, until the sessions not handed over end
+static gboolean callback_drain(gpointer data) {
+	pthread_mutex_lock(&plist_mutex);
+	gboolean pending = (plist.head != NULL);
+	pthread_mutex_unlock(&plist_mutex);
+	if (pending)
+		return TRUE;	// Check again later
+	active = FALSE;
+	set_PID(0);
+	Log("All sessions handed over or finished - this gateway process can be closed\n");
+	return FALSE;
+}
+
+// Send the state to the new process connected to 'conn'; returns TRUE if it took over
+static gboolean send_state(int conn) {
+	char buf[HANDOFF_MSG_SIZE], *pt;
+	unsigned char type, flags;
+	int fds[HO_MAX_FDS], nfds, n;
+	GList *l, *parked = NULL, *sessions = NULL, *queries = NULL;
+	gboolean ok = TRUE;
+
+	// Configuration and listening sockets
+	pt = buf;
+	type = HO_SOCKETS;
+	flags = ((sockUDP4 >= 0) && (str_addr_MCast4 != NULL) ? HO_HAS_UDP4 : 0) |
+			((sockUDP6 >= 0) && (str_addr_MCast6 != NULL) ? HO_HAS_UDP6 : 0) |
+			((sockTCP6 >= 0) ? HO_HAS_TCP6 : 0);
+	WRITE_BUF(pt, &type, 1);
+	WRITE_BUF(pt, &flags, 1);
+	WRITE_BUF(pt, &port_MCast4, sizeof(u_short));
+	write_string(&pt, (flags & HO_HAS_UDP4) ? str_addr_MCast4 : NULL);
+	WRITE_BUF(pt, &port_MCast6, sizeof(u_short));
+	write_string(&pt, (flags & HO_HAS_UDP6) ? str_addr_MCast6 : NULL);
+	nfds = 0;
+	fds[nfds++] = sockTCP;
+	fds[nfds++] = sockUDPq;
+	if (flags & HO_HAS_UDP4)
+		fds[nfds++] = sockUDP4;
+	if (flags & HO_HAS_UDP6)
+		fds[nfds++] = sockUDP6;
+	if (flags & HO_HAS_TCP6)
+		fds[nfds++] = sockTCP6;
+	if (!send_msg(conn, buf, pt - buf, fds, nfds))
+		return FALSE;
+
+	// Sessions stopped at a block boundary: they stay in plist while parked
+	pthread_mutex_lock(&park_mutex);
+	pthread_mutex_lock(&plist_mutex);
+	for (l = plist.head; l != NULL; l = g_list_next(l)) {
+		thread_state *th = (thread_state *) l->data;
+		if (th->parked && (th->q != NULL) && (th->sock6 >= 0))
+			parked = g_list_prepend(parked, th);
+	}
+	pthread_mutex_unlock(&plist_mutex);
+	pthread_mutex_unlock(&park_mutex);
+	for (l = parked; ok && (l != NULL); l = g_list_next(l)) {
+		thread_state *th = (thread_state *) l->data;
+		pt = buf;
+		type = HO_SESSION;
+		WRITE_BUF(pt, &type, 1);
+		write_query(&pt, th->q);
+		WRITE_BUF(pt, &th->cli_ip, sizeof(struct in6_addr));
+		WRITE_BUF(pt, &th->cli_port, sizeof(ushort));
+		WRITE_BUF(pt, &th->flen, sizeof(unsigned long long));
+		WRITE_BUF(pt, &th->sent, sizeof(unsigned long long));
+		fds[0] = th->sock4;
+		fds[1] = th->sock6;
+		ok = send_msg(conn, buf, pt - buf, fds, 2);
+		if (ok)
+			sessions = g_list_prepend(sessions, th);
+	}
+	g_list_free(parked);
+
+	// Pending queries not associated to a session
+	for (l = qlist.head; ok && (l != NULL); l = g_list_next(l)) {
+		Query *q = (Query *) l->data;
+		if ((q->thread != NULL) || (q->state == S_CONNECT) || (q->state == S_F_TRANSF))
+			continue;
+		pt = buf;
+		type = HO_QUERY;
+		WRITE_BUF(pt, &type, 1);
+		write_query(&pt, q);
+		ok = send_msg(conn, buf, pt - buf, NULL, 0);
+		if (ok)
+			queries = g_list_prepend(queries, q);
+	}
+
+	// End and wait for the confirmation
+	if (ok)
+		ok = send_type(conn, HO_END);
+	if (ok) {
+		n = recv_msg(conn, buf, sizeof(buf), fds, &nfds, HANDOFF_ACK_TIMEOUT);
+		ok = (n > 0) && (buf[0] == HO_ACK);
+		while (nfds > 0)
+			close(fds[--nfds]);
+	}
+
+	if (ok) {
+		// The sessions handed over stop when they are released; their Queries are freed
+		// when the thread ends; the other Queries are freed now
+		for (l = sessions; l != NULL; l = g_list_next(l))
+			((thread_state *) l->data)->handed_off = TRUE;
+		for (l = queries; l != NULL; l = g_list_next(l)) {
+			stop_query_timer((Query *) l->data);
+			del_Query((Query *) l->data, FALSE);
+		}
+		sprintf(tmp_buf, "Handed over %d sessions and %d queries\n", g_list_length(sessions),
+				g_list_length(queries));
+		Log(tmp_buf);
+	}
+	g_list_free(sessions);
+	g_list_free(queries);
+	return ok;
+}
+
+static gboolean callback_parked(gpointer data);
+
+// Callback that handles handoff requests from a new gateway process
+static gboolean callback_handoff(GIOChannel *source, GIOCondition condition, gpointer data) {
+	char buf[64];
+	int fds[HO_MAX_FDS], nfds, n, conn;
+	uint32_t magic, version;
+	char *pt;
+
+	if (!(condition & G_IO_IN)) {
+		Log("Error in the hot restart socket\n");
+		return FALSE;
+	}
+	conn = accept(handoff_sock, NULL, NULL);
+	if (conn < 0) {
+		perror("handoff: accept");
+		return TRUE;
+	}
+	n = recv_msg(conn, buf, sizeof(buf), fds, &nfds, HANDOFF_ACK_TIMEOUT);
+	while (nfds > 0)
+		close(fds[--nfds]);
+	pt = buf + 1;
+	if ((n != 9) || (buf[0] != HO_HELLO)) {
+		Log("handoff: invalid request\n");
+		close(conn);
+		return TRUE;
+	}
+	READ_BUF(pt, &magic, sizeof(magic));
+	READ_BUF(pt, &version, sizeof(version));
+	if ((magic != HANDOFF_MAGIC) || (version != HANDOFF_VERSION) || !active || (handoff_conn >= 0)) {
+		Log("handoff: incompatible gateway version, gateway not active or handoff in progress\n");
+		send_type(conn, HO_NACK);
+		close(conn);
+		return TRUE;
+	}
+
+	Log("Hot restart: handing over to a new gateway process\n");
+	handoff_conn = conn;
+	park_relays();
+	park_timer_id = g_timeout_add(HANDOFF_PARK_PERIOD, callback_parked, NULL);
+	return TRUE;
+}
+
+// Timer callback that waits, without blocking the main loop, until the relays stop at a block
+// boundary or HANDOFF_PARK_TIMEOUT ends, and then hands the state over
+static gboolean callback_parked(gpointer data) {
+	if ((count_unparked_relays() > 0) && (g_get_monotonic_time() < park_deadline))
+		return TRUE;	// Check again later
+	park_timer_id = 0;
+
+	int conn = handoff_conn;
+	gboolean ok = send_state(conn);
+	release_relays();
+	close(conn);
+	handoff_conn = -1;
+	if (!ok) {
+		Log("Hot restart failed - this gateway process continues\n");
+		return FALSE;
+	}
+
+	// The new process owns the sockets now: close our copies (the sockets stay open there)
+	// and wait for the sessions that were not handed over
+	close_sockTCP();
+	close_sockUDP();
+	g_timeout_add(HANDOFF_DRAIN_PERIOD, callback_drain, NULL);
+	handoff_close(FALSE);
+	return FALSE;
+}
+
+
+/*****************************\
+|*  Handoff socket           *|
+\*****************************/
+
+// Accept handoff requests from new gateway processes at the UNIX socket 'path'
+gboolean handoff_listen(const char *path) {
+	struct sockaddr_un addr;
+
+	if ((handoff_sock >= 0) || (path == NULL))
+		return TRUE;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		Log("Hot restart socket path too long\n");
+		return FALSE;
+	}
+	handoff_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (handoff_sock < 0) {
+		perror("handoff: socket");
+		return FALSE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);	// Replaces the socket of the previous process
+	if ((bind(handoff_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+			(listen(handoff_sock, 1) < 0)) {
+		perror("handoff: bind/listen");
+		close(handoff_sock);
+		handoff_sock = -1;
+		return FALSE;
+	}
+	if (!put_socket_in_mainloop(handoff_sock, NULL, &handoff_chan_id, &handoff_chan, G_IO_IN,
+			callback_handoff)) {
+		Log("Failed registration of the hot restart socket at Gnome\n");
+		close(handoff_sock);
+		handoff_sock = -1;
+		return FALSE;
+	}
+	handoff_path = strdup(path);
+	sprintf(tmp_buf, "Hot restart socket at %s\n", path);
+	Log(tmp_buf);
+	return TRUE;
+}
+
+// Stop accepting handoff requests; remove_path - delete the socket file
+void handoff_close(gboolean remove_path) {
+	if (park_timer_id > 0) {
+		// A handoff was waiting for the relays: it is abandoned
+		g_source_remove(park_timer_id);
+		park_timer_id = 0;
+		release_relays();
+		close(handoff_conn);
+		handoff_conn = -1;
+	}
+	if (handoff_sock < 0)
+		return;
+	if (handoff_chan != NULL) {
+		remove_socket_from_mainloop(handoff_sock, handoff_chan_id, handoff_chan);
+		handoff_chan = NULL;
+	} else
+		close(handoff_sock);
+	handoff_sock = -1;
+	if (remove_path && (handoff_path != NULL))
+		unlink(handoff_path);
+	free(handoff_path);
+	handoff_path = NULL;
+}
+
+
+/*************************************\
+|*  New process: receive the state   *|
+\*************************************/
+
+// Restore a session: its Query, thread state and GUI entry; the thread starts later
+static thread_state *read_session(char **pt, char *end, int sock4, int sock6) {
+	struct sockaddr_in6 cli_addr;
+	ushort cli_port;
+	unsigned long long flen, sent;
+	Query *q = read_query(pt, end);
+
+	if ((q == NULL) || (*pt + sizeof(struct in6_addr) + sizeof(ushort) +
+			2 * sizeof(unsigned long long) > end))
+		return NULL;
+	memset(&cli_addr, 0, sizeof(cli_addr));
+	cli_addr.sin6_family = AF_INET6;
+	READ_BUF(*pt, &cli_addr.sin6_addr, sizeof(struct in6_addr));
+	READ_BUF(*pt, &cli_port, sizeof(ushort));
+	READ_BUF(*pt, &flen, sizeof(unsigned long long));
+	READ_BUF(*pt, &sent, sizeof(unsigned long long));
+	cli_addr.sin6_port = htons(cli_port);
+
+	thread_state *th = new_thread_state(sock4, &cli_addr);
+	if (th == NULL)
+		return NULL;
+	th->cli_ipv6 = q->is_ipv6;	// The client is in the Query's domain
+	update_thread_state(th, sock6, q->name, q->seq);
+	th->q = q;
+	q->thread = th;
+	th->flen = flen;
+	th->sent = sent;
+	GUI_add_Proxy(q->name, q->seq);
+	GUI_update_cli_details_Proxy(q->name, q->seq, sock4, addr_ipv6(&cli_addr.sin6_addr), cli_port);
+	if (flen > 0)
+		GUI_update_transf_Proxy(sock4, (u_int) (100 * sent / flen));
+	return th;
+}
+
+// Take over the sockets, queries and sessions of the gateway listening at 'path'
+// Returns FALSE if there is no gateway running there or the handoff failed
+gboolean handoff_receive(const char *path) {
+	struct sockaddr_un addr;
+	char buf[HANDOFF_MSG_SIZE], *pt, *end;
+	uint32_t magic = HANDOFF_MAGIC, version = HANDOFF_VERSION;
+	unsigned char type = HO_HELLO;
+	int fds[HO_MAX_FDS], nfds, n, s;
+	GList *sessions = NULL, *l;
+	gboolean adopted = FALSE, ok = FALSE;
+
+	if ((path == NULL) || (strlen(path) >= sizeof(addr.sun_path)))
+		return FALSE;
+	s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return FALSE;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(s);
+		return FALSE;	// No gateway running
+	}
+	Log("Hot restart: taking over from the running gateway\n");
+
+	pt = buf;
+	WRITE_BUF(pt, &type, 1);
+	WRITE_BUF(pt, &magic, sizeof(magic));
+	WRITE_BUF(pt, &version, sizeof(version));
+	if (!send_msg(s, buf, pt - buf, NULL, 0)) {
+		close(s);
+		return FALSE;
+	}
+
+	for (;;) {
+		n = recv_msg(s, buf, sizeof(buf), fds, &nfds, HANDOFF_ACK_TIMEOUT);
+		if (n <= 0)
+			break;
+		pt = buf + 1;
+		end = buf + n;
+		type = buf[0];
+
+		if ((type == HO_SOCKETS) && !adopted && (nfds >= 2)) {
+			unsigned char flags;
+			u_short port4, port6;
+			const char *addr4, *addr6;
+			int k = 2, udp4 = -1, udp6 = -1, tcp6 = -1;
+
+			if (pt + 1 + sizeof(u_short) > end)
+				break;
+			READ_BUF(pt, &flags, 1);
+			READ_BUF(pt, &port4, sizeof(u_short));
+			if (!read_string(&pt, end, &addr4) || (pt + sizeof(u_short) > end))
+				break;
+			READ_BUF(pt, &port6, sizeof(u_short));
+			if (!read_string(&pt, end, &addr6))
+				break;
+			if ((flags & HO_HAS_UDP4) && (k < nfds))
+				udp4 = fds[k++];
+			if ((flags & HO_HAS_UDP6) && (k < nfds))
+				udp6 = fds[k++];
+			if ((flags & HO_HAS_TCP6) && (k < nfds))
+				tcp6 = fds[k++];
+			// The addresses must outlive the message buffer
+			adopted = adopt_sockets(fds[0], tcp6, udp4, udp6, fds[1], port4,
+					(addr4 != NULL) ? strdup(addr4) : NULL, port6,
+					(addr6 != NULL) ? strdup(addr6) : NULL);
+			if (!adopted) {
+				Log("handoff: failed registering the sockets\n");
+				while (nfds > 0)
+					close(fds[--nfds]);
+				break;
+			}
+			nfds = 0;
+
+		} else if ((type == HO_SESSION) && adopted && (nfds == 2)) {
+			thread_state *th = read_session(&pt, end, fds[0], fds[1]);
+			if (th == NULL) {
+				close(fds[0]);
+				close(fds[1]);
+				break;
+			}
+			sessions = g_list_prepend(sessions, th);
+			nfds = 0;
+
+		} else if ((type == HO_QUERY) && adopted) {
+			if (read_query(&pt, end) == NULL)
+				break;
+
+		} else if ((type == HO_END) && adopted) {
+			ok = TRUE;
+			break;
+
+		} else {
+			Log("handoff: unexpected message\n");
+			break;
+		}
+		while (nfds > 0)
+			close(fds[--nfds]);
+	}
+	while (nfds > 0)
+		close(fds[--nfds]);
+
+	if (!ok || !send_type(s, HO_ACK)) {
+		send_type(s, HO_NACK);
+		close(s);
+		Log("Hot restart failed - the previous gateway process continues\n");
+		// Release what was received; the previous process keeps its own copies
+		for (l = sessions; l != NULL; l = g_list_next(l))
+			free_thread_state((thread_state *) l->data, FALSE);
+		g_list_free(sessions);
+		if (adopted)
+			close_all(FALSE);
+		return FALSE;
+	}
+	close(s);
+
+	// Start the relays only after the previous process released the sessions
+	for (l = sessions; l != NULL; l = g_list_next(l)) {
+		thread_state *th = (thread_state *) l->data;
+		int err = affinity_thread_create(&th->tid, th->sock4, proxy_resume_function, (void *) th);
+		if (err) {
+			fprintf(stderr, "Error starting thread: return code %d\n", err);
+			free_thread_state(th, FALSE);
+		} else
+			pthread_detach(th->tid);
+	}
+	sprintf(tmp_buf, "Hot restart: took over %d sessions\n", g_list_length(sessions));
+	Log(tmp_buf);
+	g_list_free(sessions);
+	return TRUE;
+}
+
+
+// Called by a relay at a block boundary while handoff_requested is TRUE: waits until the
+// handoff ends. Returns TRUE if the session was handed over (the relay must stop)
+gboolean handoff_park(thread_state *pt) {
+	gboolean handed;
+
+	reaper_hold(pt, TRUE);	// Its sockets may be passed to the new process
+	pthread_mutex_lock(&park_mutex);
+	pt->parked = TRUE;
+	pthread_cond_broadcast(&park_cond);
+	while (handoff_requested)
+		pthread_cond_wait(&park_cond, &park_mutex);
+	pt->parked = FALSE;
+	handed = pt->handed_off;
+	pthread_mutex_unlock(&park_mutex);
+	if (!handed)
+		reaper_hold(pt, FALSE);
+	return handed;
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * hotrestart.h
+ *
+ * Header file of the hot restart: a new gateway process receives the listening
+ *    and multicast sockets, the pending queries and the sessions being relayed
+ *    from the running gateway, through a UNIX socket (SCM_RIGHTS), and carries
+ *    on without resetting the client or server connections.
+\*****************************************************************************/
+
+#ifndef INCL_HOTRESTART_H
+#define INCL_HOTRESTART_H
+
+#include <gtk/gtk.h>
+#include "proxy_thread.h"
+
+#define HANDOFF_MAGIC			0x47574846	// "GWHF"
+#define HANDOFF_VERSION			5
+#define HANDOFF_MSG_SIZE		4096	// Maximum size of a handoff message
+#define HANDOFF_MAX_HITS		64		// Maximum number of hits sent for one Query
+#define HANDOFF_HIT_SIZE		(sizeof(struct in6_addr) + sizeof(in_port_t) + sizeof(uint32_t) + \
+									sizeof(unsigned long long))	// Size of each hit sent
+#define HANDOFF_PARK_TIMEOUT	2000	// Time waiting for the relays to stop at a block boundary (ms)
+#define HANDOFF_PARK_PERIOD		10		// Period checking if the relays stopped, in the main loop (ms)
+#define HANDOFF_ACK_TIMEOUT		10000	// Time waiting for the other process (ms)
+#define HANDOFF_DRAIN_PERIOD	500		// Period checking if the remaining sessions ended (ms)
+
+
+/*********************\
+|* Global variables  *|
+\*********************/
+
+extern volatile gboolean handoff_requested;	// TRUE while the sessions are being handed over
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Accept handoff requests from new gateway processes at the UNIX socket 'path'
+gboolean handoff_listen(const char *path);
+// Stop accepting handoff requests; remove_path - delete the socket file
+void handoff_close(gboolean remove_path);
+// Take over the sockets, queries and sessions of the gateway listening at 'path'
+// Returns FALSE if there is no gateway running there or the handoff failed
+gboolean handoff_receive(const char *path);
+// Called by a relay at a block boundary while handoff_requested is TRUE: waits until the
+// handoff ends. Returns TRUE if the session was handed over (the relay must stop)
+gboolean handoff_park(thread_state *pt);
+
+#endif
@@ -0,0 +1,108 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * intern.c
+ *
+ * Filename table: one reference counted copy of each filename
+ *
+ * The names are keys of a hash table; the reference counter sits just before
+ *    the characters, so releasing a name does not hash it again.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+
+// Interned name
+typedef struct interned {
+	int refs;			// References
+	char name[];		// Characters
+} interned;
+
+#define INTERNED(iname)	((interned *) ((char *) (iname) - offsetof(interned, name)))
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *names = NULL;	// Interned names (keys and values are the name)
+static intern_stats stats;
+
+
+// Get the interned copy of 'name', adding a reference to it
+const char *intern_get(const char *name) {
+	interned *in;
+	char *iname;
+
+	assert(name != NULL);
+	pthread_mutex_lock(&intern_mutex);
+	if (names == NULL)
+		names = g_hash_table_new(g_str_hash, g_str_equal);
+	iname = (char *) g_hash_table_lookup(names, name);
+	if (iname != NULL)
+		in = INTERNED(iname);
+	else {
+		size_t len = strlen(name) + 1;
+		in = (interned *) malloc(sizeof(interned) + len);
+		in->refs = 0;
+		memcpy(in->name, name, len);
+		g_hash_table_insert(names, in->name, in->name);
+		stats.names++;
+		stats.bytes += sizeof(interned) + len;
+	}
+	in->refs++;
+	stats.refs++;
+	pthread_mutex_unlock(&intern_mutex);
+	return in->name;
+}
+
+// Add a reference to an interned name
+const char *intern_ref(const char *iname) {
+	pthread_mutex_lock(&intern_mutex);
+	INTERNED(iname)->refs++;
+	stats.refs++;
+	pthread_mutex_unlock(&intern_mutex);
+	return iname;
+}
+
+// Release a reference to an interned name (NULL is ignored)
+void intern_put(const char *iname) {
+	interned *in;
+
+	if (iname == NULL)
+		return;
+	in = INTERNED(iname);
+	pthread_mutex_lock(&intern_mutex);
+	stats.refs--;
+	if (--in->refs == 0) {
+		g_hash_table_remove(names, in->name);
+		stats.names--;
+		stats.bytes -= sizeof(interned) + strlen(in->name) + 1;
+		free(in);
+	}
+	pthread_mutex_unlock(&intern_mutex);
+}
+
+// Get the interned copy of 'name' without adding a reference; NULL if it is not stored
+const char *intern_find(const char *name) {
+	const char *iname;
+
+	pthread_mutex_lock(&intern_mutex);
+	iname = (names != NULL) ? (const char *) g_hash_table_lookup(names, name) : NULL;
+	pthread_mutex_unlock(&intern_mutex);
+	return iname;
+}
+
+// Current occupancy
+void intern_get_stats(intern_stats *st) {
+	pthread_mutex_lock(&intern_mutex);
+	memcpy(st, &stats, sizeof(intern_stats));
+	pthread_mutex_unlock(&intern_mutex);
+}
@@ -0,0 +1,41 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * intern.h
+ *
+ * Header file of the filename table: each filename is stored once, shared by
+ *    all the Queries and thread states that refer to it, and freed when the
+ *    last reference is released. Two interned names are equal if and only if
+ *    the pointers are equal.
+\*****************************************************************************/
+
+#ifndef INCL_INTERN_H
+#define INCL_INTERN_H
+
+#include <gtk/gtk.h>
+
+// Table occupancy
+typedef struct intern_stats {
+	long names;			// Distinct names stored
+	long refs;			// References to them
+	size_t bytes;		// Memory used by the names
+} intern_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Get the interned copy of 'name', adding a reference to it
+const char *intern_get(const char *name);
+// Add a reference to an interned name
+const char *intern_ref(const char *iname);
+// Release a reference to an interned name (NULL is ignored)
+void intern_put(const char *iname);
+// Get the interned copy of 'name' without adding a reference; NULL if it is not stored
+const char *intern_find(const char *name);
+// Current occupancy
+void intern_get_stats(intern_stats *st);
+
+#endif
@@ -0,0 +1,865 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * loadgen.c
+ *
+ * Control-plane load generator for a live gateway. It emulates the clients of
+ *    one domain, sending Queries to their multicast group at a controlled rate
+ *    (synthetic Zipf-distributed names or a replayed pcap capture), and several
+ *    file servers in the other domain, which answer the forwarded Queries with
+ *    Hits after a configurable delay and duplicate rate. It measures the
+ *    gateway's Query forwarding latency, Hit relay latency and losses, and can
+ *    ramp up the rate in stages to find the control plane's saturation point.
+ *
+ * Build it with the objects of the gateway modules (all but main.o), replacing
+ *    gui_g3.o by gui_stub.o:
+ *    gcc -O2 -o loadgen loadgen.c $(GATEWAY_OBJS) gui_stub.o \
+ *        `pkg-config --libs gtk+-3.0` -lpthread -lm
+ *
+ * Usage: loadgen [options], run 'loadgen -h' for the list.
+\*****************************************************************************/
+
+#include <gtk/gtk.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <memory.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "callbacks_socket.h"
+
+
+#define LG_MAX_SERVERS		64		// Maximum number of emulated file servers
+#define LG_LOSS_TIMEOUT		(QUERY_TIMEOUT + 2000)	// Time after which a missing Hit is lost (ms)
+#define LG_SATURATION_LOSS	1.0		// Ramp stops when the loss exceeds this value (%)
+
+// Link types supported in pcap captures
+#define LINKTYPE_NULL		0
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+#define LINKTYPE_LINUX_SLL2	276
+
+
+// Configuration
+typedef struct lg_config {
+	gboolean from_v6;		// TRUE if the emulated clients are in the IPv6 domain
+	const char *group4;		// IPv4 multicast group
+	const char *group6;		// IPv6 multicast group
+	u_short port4;			// IPv4 multicast port
+	u_short port6;			// IPv6 multicast port
+	double rate;			// Initial Query rate (queries/s)
+	double max_rate;		// Final Query rate of the ramp (0 - no ramp)
+	double rate_step;		// Rate increment between ramp stages
+	double duration;		// Duration of each stage (s)
+	int n_names;			// Number of different file names
+	double zipf_s;			// Zipf exponent of the name popularity
+	int n_servers;			// Number of emulated file servers
+	double hit_delay;		// Mean Hit reply delay (ms)
+	double hit_jitter;		// Uniform jitter added to the Hit delay (ms)
+	double dup_rate;		// Probability that a server sends a duplicate Hit
+	double answer_rate;		// Probability that a server holds the file
+	const char *pcap;		// pcap trace to replay (NULL - synthetic load)
+	double speed;			// Replay speed factor
+	const char *out;		// JSON output file (NULL - stdout)
+} lg_config;
+
+// Information about one Query sent
+typedef struct lg_query {
+	char *key;				// "name/seq"
+	long long t_sent;		// Time when the client sent it (ns)
+	long long t_fwd;		// Time when the first server received it (ns, 0 if not yet)
+	long long t_hit_sent;	// Time when the first Hit was sent (ns, 0 if none)
+	long long t_hit_recv;	// Time when the client received the Hit (ns, 0 if not yet)
+	int hits_recv;			// Number of Hits received by the client
+	int stage;				// Ramp stage
+} lg_query;
+
+// Hit scheduled to be sent by a server
+typedef struct lg_pending {
+	long long t;			// Time to send (ns)
+	int server;				// Server index
+	struct sockaddr_storage to;	// Gateway address
+	socklen_t tolen;
+	int len;
+	char buf[MESSAGE_MAX_LENGTH];
+} lg_pending;
+
+// Latency samples
+typedef struct lg_samples {
+	double *v;
+	long n, size;
+} lg_samples;
+
+// Statistics of one ramp stage
+typedef struct lg_stage {
+	double rate;
+	long sent, forwarded, hits_sent, hits_dup, relayed, relayed_dup, lost_fwd, lost_hit;
+	double duration;
+	lg_samples fwd_lat, hit_lat, e2e_lat;
+} lg_stage;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static lg_config cfg = {
+	.from_v6 = FALSE, .group4 = "225.1.1.1", .group6 = "ff18:10:33::1",
+	.port4 = 20000, .port6 = 20000, .rate = 100, .max_rate = 0, .rate_step = 100,
+	.duration = 10, .n_names = 1000, .zipf_s = 1.0, .n_servers = 2,
+	.hit_delay = 5, .hit_jitter = 5, .dup_rate = 0, .answer_rate = 1.0,
+	.pcap = NULL, .speed = 1.0, .out = NULL
+};
+
+static int sock_cli = -1;						// Emulated client socket
+static int sock_srv[LG_MAX_SERVERS];			// Emulated server sockets
+static u_short port_cli = 0;					// Client socket port
+static struct sockaddr_storage group_cli;		// Group where the client sends Queries
+static socklen_t group_cli_len;
+
+static double *zipf_cdf = NULL;					// Cumulative name popularity
+static GHashTable *queries = NULL;				// Queries sent in the stage, by "name/seq" (index of query_order)
+static GList *query_order = NULL;				// Queries sent in the stage, by sending time (owns them)
+static lg_pending **pending = NULL;				// Heap of Hits to send
+static int n_pending = 0, size_pending = 0;
+static lg_stage *stages = NULL;					// Ramp stages
+static int n_stages = 0;
+static uint16_t next_seq = 0;
+
+
+/************************\
+|*  Auxiliary functions  *|
+\************************/
+
+// Current monotonic time in ns
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Uniform random value in [0,1)
+static double uniform(void) {
+	return random() / ((double) RAND_MAX + 1.0);
+}
+
+// Prepares the Zipf CDF over cfg.n_names names
+static void init_zipf(void) {
+	double sum = 0;
+	int i;
+	zipf_cdf = (double *) malloc(cfg.n_names * sizeof(double));
+	for (i = 0; i < cfg.n_names; i++) {
+		sum += 1.0 / pow(i + 1, cfg.zipf_s);
+		zipf_cdf[i] = sum;
+	}
+	for (i = 0; i < cfg.n_names; i++)
+		zipf_cdf[i] /= sum;
+}
+
+// Draws a name rank following the Zipf distribution
+static int zipf_rank(void) {
+	double u = uniform();
+	int lo = 0, hi = cfg.n_names - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void add_sample(lg_samples *s, double v) {
+	if (s->n == s->size) {
+		s->size = (s->size == 0) ? 1024 : 2 * s->size;
+		s->v = (double *) realloc(s->v, s->size * sizeof(double));
+	}
+	s->v[s->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x < y) ? -1 : (x > y);
+}
+
+// Returns the p-th percentile of the samples (sorts them)
+static double percentile(lg_samples *s, double p) {
+	if (s->n == 0)
+		return 0;
+	qsort(s->v, s->n, sizeof(double), cmp_double);
+	long i = (long) ceil(p / 100.0 * s->n) - 1;
+	return s->v[CLAMP(i, 0, s->n - 1)];
+}
+
+
+/*************************\
+|*  Pending Hits (heap)  *|
+\*************************/
+
+static void push_pending(lg_pending *p) {
+	int i;
+	if (n_pending == size_pending) {
+		size_pending = (size_pending == 0) ? 256 : 2 * size_pending;
+		pending = (lg_pending **) realloc(pending, size_pending * sizeof(lg_pending *));
+	}
+	for (i = n_pending++; (i > 0) && (pending[(i - 1) / 2]->t > p->t); i = (i - 1) / 2)
+		pending[i] = pending[(i - 1) / 2];
+	pending[i] = p;
+}
+
+static lg_pending *pop_pending(void) {
+	lg_pending *top = pending[0], *last = pending[--n_pending];
+	int i = 0, c;
+	while ((c = 2 * i + 1) < n_pending) {
+		if ((c + 1 < n_pending) && (pending[c + 1]->t < pending[c]->t))
+			c++;
+		if (pending[c]->t >= last->t)
+			break;
+		pending[i] = pending[c];
+		i = c;
+	}
+	if (n_pending > 0)
+		pending[i] = last;
+	return top;
+}
+
+
+/*****************\
+|*  Sockets      *|
+\*****************/
+
+// Creates a UDP socket of the given family, bound to 'port' and optionally joined to 'group'
+static int open_udp(gboolean ipv6, u_short port, const char *group) {
+	int s = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+	int on = 1, off = 0;
+	if (s < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (ipv6) {
+		struct sockaddr_in6 a;
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+		memset(&a, 0, sizeof(a));
+		a.sin6_family = AF_INET6;
+		a.sin6_port = htons(port);
+		a.sin6_addr = in6addr_any;
+		if (bind(s, (struct sockaddr *) &a, sizeof(a)) < 0) {
+			perror("bind IPv6");
+			close(s);
+			return -1;
+		}
+		if (group != NULL) {
+			struct ipv6_mreq m;
+			memset(&m, 0, sizeof(m));
+			if ((inet_pton(AF_INET6, group, &m.ipv6mr_multiaddr) != 1) ||
+					(setsockopt(s, IPPROTO_IPV6, IPV6_JOIN_GROUP, &m, sizeof(m)) < 0)) {
+				perror("Failed association to IPv6 multicast group");
+				close(s);
+				return -1;
+			}
+		}
+	} else {
+		struct sockaddr_in a;
+#ifdef IP_MULTICAST_ALL
+		// Only receive the groups joined by this socket
+		setsockopt(s, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+#endif
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_port = htons(port);
+		a.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(s, (struct sockaddr *) &a, sizeof(a)) < 0) {
+			perror("bind IPv4");
+			close(s);
+			return -1;
+		}
+		if (group != NULL) {
+			struct ip_mreq m;
+			m.imr_interface.s_addr = htonl(INADDR_ANY);
+			if ((inet_pton(AF_INET, group, &m.imr_multiaddr) != 1) ||
+					(setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &m, sizeof(m)) < 0)) {
+				perror("Failed association to IPv4 multicast group");
+				close(s);
+				return -1;
+			}
+		}
+	}
+	(void) off;
+	return s;
+}
+
+// Port number of a bound socket
+static u_short local_port(int s) {
+	struct sockaddr_storage a;
+	socklen_t len = sizeof(a);
+	if (getsockname(s, (struct sockaddr *) &a, &len) < 0)
+		return 0;
+	if (a.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *) &a)->sin6_port);
+	return ntohs(((struct sockaddr_in *) &a)->sin_port);
+}
+
+static gboolean init_sockets_lg(void) {
+	int i;
+
+	// Clients: unicast socket that sends to the group of their domain
+	sock_cli = open_udp(cfg.from_v6, 0, NULL);
+	if (sock_cli < 0)
+		return FALSE;
+	port_cli = local_port(sock_cli);
+	memset(&group_cli, 0, sizeof(group_cli));
+	if (cfg.from_v6) {
+		struct sockaddr_in6 *a = (struct sockaddr_in6 *) &group_cli;
+		int hops = 8;
+		a->sin6_family = AF_INET6;
+		a->sin6_port = htons(cfg.port6);
+		inet_pton(AF_INET6, cfg.group6, &a->sin6_addr);
+		group_cli_len = sizeof(*a);
+		setsockopt(sock_cli, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+	} else {
+		struct sockaddr_in *a = (struct sockaddr_in *) &group_cli;
+		unsigned char ttl = 8;
+		a->sin_family = AF_INET;
+		a->sin_port = htons(cfg.port4);
+		inet_pton(AF_INET, cfg.group4, &a->sin_addr);
+		group_cli_len = sizeof(*a);
+		setsockopt(sock_cli, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	}
+
+	// Servers: members of the group of the other domain
+	for (i = 0; i < cfg.n_servers; i++) {
+		sock_srv[i] = cfg.from_v6 ? open_udp(FALSE, cfg.port4, cfg.group4) :
+				open_udp(TRUE, cfg.port6, cfg.group6);
+		if (sock_srv[i] < 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+/*******************\
+|*  Query tracking  *|
+\*******************/
+
+static void free_query(gpointer data) {
+	lg_query *lq = (lg_query *) data;
+	free(lq->key);
+	free(lq);
+}
+
+// Registers a Query sent by the client
+static void track_query(const char *fname, uint16_t seq, int stage) {
+	lg_query *lq = (lg_query *) calloc(1, sizeof(lg_query));
+	char key[CNAME_LENGTH + 16];
+	snprintf(key, sizeof(key), "%s/%hu", fname, seq);
+	lq->key = strdup(key);
+	lq->t_sent = now_ns();
+	lq->stage = stage;
+	// A repeated name/seq (the sequence number wrapped) takes over the lookups; the previous
+	// Query stays in query_order, which frees it
+	g_hash_table_replace(queries, lq->key, lq);
+	query_order = g_list_prepend(query_order, lq);
+}
+
+// Forgets the Queries of the stage, after counting its losses
+static void clear_queries(void) {
+	g_hash_table_remove_all(queries);
+	g_list_free_full(query_order, free_query);
+	query_order = NULL;
+}
+
+static lg_query *find_query(const char *fname, uint16_t seq) {
+	char key[CNAME_LENGTH + 16];
+	snprintf(key, sizeof(key), "%s/%hu", fname, seq);
+	return (lg_query *) g_hash_table_lookup(queries, key);
+}
+
+// Sends one Query from the emulated client
+static void send_query(const char *buf, int len, int stage) {
+	uint16_t seq;
+	const char *fname;
+
+	if (sendto(sock_cli, buf, len, 0, (struct sockaddr *) &group_cli, group_cli_len) < 0) {
+		perror("Error sending Query");
+		return;
+	}
+	if (read_query_message((char *) buf, len, &seq, &fname)) {
+		track_query(fname, seq, stage);
+		stages[stage].sent++;
+		free((char *) fname);
+	}
+}
+
+// Sends a synthetic Query
+static void send_synthetic_query(int stage) {
+	char name[CNAME_LENGTH];
+	char buf[MESSAGE_MAX_LENGTH];
+	int len;
+
+	snprintf(name, sizeof(name), "lg_file%06d.dat", zipf_rank());
+	write_query_message(buf, &len, next_seq++, name);
+	send_query(buf, len, stage);
+}
+
+
+/*****************************\
+|*  Packet reception         *|
+\*****************************/
+
+// A server received a packet: if it is a forwarded Query, schedule the Hits
+static void server_receive(int i) {
+	char buf[MESSAGE_MAX_LENGTH];
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+	uint16_t seq;
+	const char *fname;
+	int n, copies;
+
+	n = recvfrom(sock_srv[i], buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+	if ((n <= 0) || !read_query_message(buf, n, &seq, &fname))
+		return;
+	lg_query *lq = find_query(fname, seq);
+	if (lq == NULL) {
+		free((char *) fname);
+		return;	// Not sent by this generator
+	}
+	long long t = now_ns();
+	if (lq->t_fwd == 0) {
+		lq->t_fwd = t;
+		stages[lq->stage].forwarded++;
+		add_sample(&stages[lq->stage].fwd_lat, (t - lq->t_sent) / 1e6);
+	}
+	if (uniform() >= cfg.answer_rate) {
+		free((char *) fname);
+		return;	// This server does not hold the file
+	}
+
+	copies = (uniform() < cfg.dup_rate) ? 2 : 1;
+	while (copies-- > 0) {
+		lg_pending *p = (lg_pending *) malloc(sizeof(lg_pending));
+		double delay = cfg.hit_delay + cfg.hit_jitter * uniform();
+		p->t = t + (long long) (delay * 1e6);
+		p->server = i;
+		memcpy(&p->to, &from, fromlen);
+		p->tolen = fromlen;
+		write_hit_message(p->buf, &p->len, seq, fname, 0x5a5a0000u + (seq & 0xffff),
+				1000000ULL + 1000 * (seq % 100), 30000 + i, cfg.from_v6 ? "127.0.0.1" : "::1");
+		push_pending(p);
+	}
+	free((char *) fname);
+}
+
+// Sends the Hits whose time has come
+static void send_pending_hits(void) {
+	long long t = now_ns();
+	while ((n_pending > 0) && (pending[0]->t <= t)) {
+		lg_pending *p = pop_pending();
+		uint16_t seq;
+		const char *fname, *serverIP;
+		uint32_t fhash;
+		unsigned long long flen;
+		unsigned short port;
+
+		if (sendto(sock_srv[p->server], p->buf, p->len, 0, (struct sockaddr *) &p->to,
+				p->tolen) < 0)
+			perror("Error sending Hit");
+		else if (read_hit_message(p->buf, p->len, &seq, &fname, &fhash, &flen, &port,
+				&serverIP)) {
+			lg_query *lq = find_query(fname, seq);
+			if (lq != NULL) {
+				if (lq->t_hit_sent == 0)
+					lq->t_hit_sent = now_ns();
+				else
+					stages[lq->stage].hits_dup++;
+				stages[lq->stage].hits_sent++;
+			}
+			free((char *) fname);
+			free((char *) serverIP);
+		}
+		free(p);
+	}
+}
+
+// The client received a packet: it should be a Hit relayed by the gateway
+static void client_receive(void) {
+	char buf[MESSAGE_MAX_LENGTH];
+	uint16_t seq;
+	const char *fname, *serverIP;
+	uint32_t fhash;
+	unsigned long long flen;
+	unsigned short port;
+	int n;
+
+	n = recv(sock_cli, buf, sizeof(buf), 0);
+	if ((n <= 0) || !read_hit_message(buf, n, &seq, &fname, &fhash, &flen, &port, &serverIP))
+		return;
+	lg_query *lq = find_query(fname, seq);
+	if (lq != NULL) {
+		long long t = now_ns();
+		lg_stage *st = &stages[lq->stage];
+		if (lq->hits_recv++ == 0) {
+			lq->t_hit_recv = t;
+			st->relayed++;
+			add_sample(&st->e2e_lat, (t - lq->t_sent) / 1e6);
+			if (lq->t_hit_sent > 0)
+				add_sample(&st->hit_lat, (t - lq->t_hit_sent) / 1e6);
+		} else
+			st->relayed_dup++;
+	}
+	free((char *) fname);
+	free((char *) serverIP);
+}
+
+// Waits for packets and pending Hits until 'deadline' (ns)
+static void poll_until(long long deadline) {
+	struct pollfd fds[LG_MAX_SERVERS + 1];
+	int i, n = cfg.n_servers + 1;
+
+	fds[0].fd = sock_cli;
+	fds[0].events = POLLIN;
+	for (i = 0; i < cfg.n_servers; i++) {
+		fds[i + 1].fd = sock_srv[i];
+		fds[i + 1].events = POLLIN;
+	}
+	for (;;) {
+		long long t = now_ns();
+		long long next = deadline;
+		if ((n_pending > 0) && (pending[0]->t < next))
+			next = pending[0]->t;
+		int timeout = (next > t) ? (int) ((next - t + 999999) / 1000000) : 0;
+		if (poll(fds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return;
+		}
+		if (fds[0].revents & POLLIN)
+			client_receive();
+		for (i = 0; i < cfg.n_servers; i++)
+			if (fds[i + 1].revents & POLLIN)
+				server_receive(i);
+		send_pending_hits();
+		if (now_ns() >= deadline)
+			return;
+	}
+}
+
+
+/********************\
+|*  pcap replay     *|
+\********************/
+
+typedef struct {
+	uint32_t magic;
+	uint16_t major, minor;
+	int32_t zone;
+	uint32_t sigfigs, snaplen, linktype;
+} pcap_hdr;
+
+typedef struct {
+	uint32_t sec, frac, caplen, len;
+} pcap_rec;
+
+static uint32_t swap32(uint32_t v, gboolean swap) {
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+// Returns the UDP payload of a captured frame, or NULL if it is not UDP
+static const unsigned char *udp_payload(const unsigned char *p, uint32_t len, uint32_t linktype,
+		int *plen) {
+	const unsigned char *end = p + len;
+	uint16_t ethertype = 0;
+	int ip_version;
+
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+		if (len < 14)
+			return NULL;
+		ethertype = (p[12] << 8) | p[13];
+		p += 14;
+		if ((ethertype == 0x8100) && (p + 4 <= end)) {	// VLAN tag
+			ethertype = (p[2] << 8) | p[3];
+			p += 4;
+		}
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return NULL;
+		ethertype = (p[14] << 8) | p[15];
+		p += 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return NULL;
+		ethertype = (p[0] << 8) | p[1];
+		p += 20;
+		break;
+	case LINKTYPE_NULL:
+		if (len < 4)
+			return NULL;
+		p += 4;
+		break;
+	case LINKTYPE_RAW:
+		break;
+	default:
+		return NULL;
+	}
+	(void) ethertype;
+	if (p >= end)
+		return NULL;
+	ip_version = p[0] >> 4;
+	if (ip_version == 4) {
+		int ihl = (p[0] & 0x0f) * 4;
+		if ((p + ihl + 8 > end) || (p[9] != IPPROTO_UDP))
+			return NULL;
+		p += ihl;
+	} else if (ip_version == 6) {
+		if ((p + 48 > end) || (p[6] != IPPROTO_UDP))
+			return NULL;	// Extension headers are not supported
+		p += 40;
+	} else
+		return NULL;
+	*plen = MIN((int) ((p[4] << 8) | p[5]) - 8, (int) (end - p - 8));
+	return (*plen > 0) ? p + 8 : NULL;
+}
+
+// Replays the Queries in a pcap file through the emulated client
+static gboolean replay_pcap(const char *path) {
+	FILE *f = fopen(path, "rb");
+	pcap_hdr h;
+	pcap_rec r;
+	unsigned char *frame;
+	gboolean swap, nano;
+	long long t0 = 0, first = -1;
+
+	if (f == NULL) {
+		perror("Failed opening pcap");
+		return FALSE;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1) {
+		fprintf(stderr, "Invalid pcap file\n");
+		fclose(f);
+		return FALSE;
+	}
+	swap = (h.magic == 0xd4c3b2a1) || (h.magic == 0x4d3cb2a1);
+	nano = (h.magic == 0xa1b23c4d) || (h.magic == 0x4d3cb2a1);
+	if (!swap && !nano && (h.magic != 0xa1b2c3d4)) {
+		fprintf(stderr, "Unsupported pcap format (pcapng is not supported)\n");
+		fclose(f);
+		return FALSE;
+	}
+	h.linktype = swap32(h.linktype, swap);
+	h.snaplen = swap32(h.snaplen, swap);
+	frame = (unsigned char *) malloc(MAX(h.snaplen, 65536));
+
+	stages[0].rate = 0;
+	t0 = now_ns();
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		uint32_t caplen = swap32(r.caplen, swap);
+		long long ts = (long long) swap32(r.sec, swap) * 1000000000LL +
+				(long long) swap32(r.frac, swap) * (nano ? 1 : 1000);
+		const unsigned char *payload;
+		int plen;
+
+		if ((caplen > MAX(h.snaplen, 65536)) || (fread(frame, 1, caplen, f) != caplen))
+			break;
+		payload = udp_payload(frame, caplen, h.linktype, &plen);
+		if ((payload == NULL) || (payload[0] != MSG_QUERY))
+			continue;
+		if (first < 0)
+			first = ts;
+		poll_until(t0 + (long long) ((ts - first) / cfg.speed));
+		send_query((const char *) payload, plen, 0);
+	}
+	stages[0].duration = (now_ns() - t0) / 1e9;
+	if (stages[0].duration > 0)
+		stages[0].rate = stages[0].sent / stages[0].duration;
+	free(frame);
+	fclose(f);
+	return TRUE;
+}
+
+
+/*******************\
+|*  Reporting      *|
+\*******************/
+
+// Counts the queries without forwarded Query or relayed Hit
+static void count_losses(void) {
+	GList *l;
+	for (l = query_order; l != NULL; l = g_list_next(l)) {
+		lg_query *lq = (lg_query *) l->data;
+		if (lq->t_fwd == 0)
+			stages[lq->stage].lost_fwd++;
+		else if ((lq->t_hit_sent != 0) && (lq->hits_recv == 0))
+			stages[lq->stage].lost_hit++;
+	}
+}
+
+static double loss_pct(lg_stage *st) {
+	return (st->sent > 0) ? 100.0 * (st->lost_fwd + st->lost_hit) / st->sent : 0;
+}
+
+static void write_latency(FILE *f, const char *name, lg_samples *s, gboolean last) {
+	fprintf(f, "  \"%s\": {\"n\": %ld, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+			"\"max_ms\": %.3f}%s\n", name, s->n, percentile(s, 50), percentile(s, 90),
+			percentile(s, 99), percentile(s, 100), last ? "" : ",");
+}
+
+static void write_report(FILE *f) {
+	int i;
+	fprintf(f, "{\n\"benchmark\": \"loadgen\",\n\"direction\": \"%s\",\n\"servers\": %d,\n"
+			"\"stages\": [\n", cfg.from_v6 ? "6to4" : "4to6", cfg.n_servers);
+	for (i = 0; i < n_stages; i++) {
+		lg_stage *st = &stages[i];
+		fprintf(f, " {\n  \"rate\": %.1f, \"duration_s\": %.3f, \"queries\": %ld, "
+				"\"forwarded\": %ld, \"hits_sent\": %ld, \"hits_dup_sent\": %ld,\n"
+				"  \"hits_relayed\": %ld, \"hits_relayed_dup\": %ld, \"lost_forward\": %ld, "
+				"\"lost_hit\": %ld, \"loss_pct\": %.3f,\n",
+				st->rate, st->duration, st->sent, st->forwarded, st->hits_sent, st->hits_dup,
+				st->relayed, st->relayed_dup, st->lost_fwd, st->lost_hit, loss_pct(st));
+		write_latency(f, "forward_latency", &st->fwd_lat, FALSE);
+		write_latency(f, "hit_relay_latency", &st->hit_lat, FALSE);
+		write_latency(f, "query_to_hit_latency", &st->e2e_lat, TRUE);
+		fprintf(f, " }%s\n", (i < n_stages - 1) ? "," : "");
+	}
+	fprintf(f, "]\n}\n");
+}
+
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -6            clients in the IPv6 domain (default: IPv4 clients)\n"
+			"  -a group4     IPv4 multicast group (%s)\n"
+			"  -A group6     IPv6 multicast group (%s)\n"
+			"  -p port4      IPv4 multicast port (%hu)\n"
+			"  -P port6      IPv6 multicast port (%hu)\n"
+			"  -r rate       Query rate, queries/s (%.0f)\n"
+			"  -M max_rate   ramp the rate up to max_rate, stopping at saturation\n"
+			"  -i step       rate increment between ramp stages (%.0f)\n"
+			"  -t seconds    duration of each stage (%.0f)\n"
+			"  -n names      number of file names (%d)\n"
+			"  -z s          Zipf exponent of the name popularity (%.2f)\n"
+			"  -g servers    number of emulated file servers/gateways (%d)\n"
+			"  -d ms         mean Hit reply delay (%.1f)\n"
+			"  -j ms         Hit reply jitter (%.1f)\n"
+			"  -u prob       duplicate Hit probability per server (%.2f)\n"
+			"  -w prob       probability that a server holds the file (%.2f)\n"
+			"  -R file.pcap  replay the Queries captured in file.pcap\n"
+			"  -S speed      replay speed factor (%.1f)\n"
+			"  -o file       JSON report file (stdout)\n",
+			prog, cfg.group4, cfg.group6, cfg.port4, cfg.port6, cfg.rate, cfg.rate_step,
+			cfg.duration, cfg.n_names, cfg.zipf_s, cfg.n_servers, cfg.hit_delay,
+			cfg.hit_jitter, cfg.dup_rate, cfg.answer_rate, cfg.speed);
+}
+
+
+int main(int argc, char *argv[]) {
+	int c, i;
+
+	while ((c = getopt(argc, argv, "6a:A:p:P:r:M:i:t:n:z:g:d:j:u:w:R:S:o:h")) != -1) {
+		switch (c) {
+		case '6': cfg.from_v6 = TRUE; break;
+		case 'a': cfg.group4 = optarg; break;
+		case 'A': cfg.group6 = optarg; break;
+		case 'p': cfg.port4 = (u_short) atoi(optarg); break;
+		case 'P': cfg.port6 = (u_short) atoi(optarg); break;
+		case 'r': cfg.rate = atof(optarg); break;
+		case 'M': cfg.max_rate = atof(optarg); break;
+		case 'i': cfg.rate_step = atof(optarg); break;
+		case 't': cfg.duration = atof(optarg); break;
+		case 'n': cfg.n_names = atoi(optarg); break;
+		case 'z': cfg.zipf_s = atof(optarg); break;
+		case 'g': cfg.n_servers = atoi(optarg); break;
+		case 'd': cfg.hit_delay = atof(optarg); break;
+		case 'j': cfg.hit_jitter = atof(optarg); break;
+		case 'u': cfg.dup_rate = atof(optarg); break;
+		case 'w': cfg.answer_rate = atof(optarg); break;
+		case 'R': cfg.pcap = optarg; break;
+		case 'S': cfg.speed = atof(optarg); break;
+		case 'o': cfg.out = optarg; break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if ((cfg.n_servers < 0) || (cfg.n_servers > LG_MAX_SERVERS) || (cfg.n_names <= 0) ||
+			(cfg.rate <= 0) || (cfg.speed <= 0)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	srandom((unsigned) time(NULL));
+	next_seq = (uint16_t) random();
+	init_zipf();
+	queries = g_hash_table_new(g_str_hash, g_str_equal);
+	if (!init_sockets_lg())
+		return 1;
+	fprintf(stderr, "Clients in %s on port %hu, %d servers in %s\n",
+			cfg.from_v6 ? cfg.group6 : cfg.group4, port_cli, cfg.n_servers,
+			cfg.from_v6 ? cfg.group4 : cfg.group6);
+
+	if (cfg.pcap != NULL) {
+		stages = (lg_stage *) calloc(1, sizeof(lg_stage));
+		n_stages = 1;
+		if (!replay_pcap(cfg.pcap))
+			return 1;
+		poll_until(now_ns() + LG_LOSS_TIMEOUT * 1000000LL);
+		count_losses();
+		clear_queries();
+	} else {
+		int max_stages = (cfg.max_rate > cfg.rate) ?
+				(int) ((cfg.max_rate - cfg.rate) / cfg.rate_step) + 1 : 1;
+		stages = (lg_stage *) calloc(max_stages, sizeof(lg_stage));
+		for (i = 0; i < max_stages; i++) {
+			lg_stage *st = &stages[n_stages++];
+			long long t0 = now_ns(), t_end, next;
+			long k = 0;
+
+			st->rate = cfg.rate + i * cfg.rate_step;
+			t_end = t0 + (long long) (cfg.duration * 1e9);
+			fprintf(stderr, "Stage %d: %.1f queries/s\n", i, st->rate);
+			// Constant pacing: the k-th Query is sent at t0 + k/rate
+			while ((next = t0 + (long long) (k * 1e9 / st->rate)) < t_end) {
+				poll_until(next);
+				send_synthetic_query(i);
+				k++;
+			}
+			st->duration = (now_ns() - t0) / 1e9;
+			// Wait for the late Hits before evaluating the stage
+			poll_until(now_ns() + LG_LOSS_TIMEOUT * 1000000LL);
+			count_losses();
+			clear_queries();
+			fprintf(stderr, "Stage %d: sent %ld, relayed %ld, loss %.2f%%, p99 forward %.1f ms\n",
+					i, st->sent, st->relayed, loss_pct(st), percentile(&st->fwd_lat, 99));
+			if (loss_pct(st) > LG_SATURATION_LOSS) {
+				fprintf(stderr, "Saturation reached at %.1f queries/s\n", st->rate);
+				break;
+			}
+		}
+	}
+
+	if (cfg.out != NULL) {
+		FILE *f = fopen(cfg.out, "w");
+		if (f == NULL) {
+			perror("Failed opening report file");
+			return 1;
+		}
+		write_report(f);
+		fclose(f);
+	} else
+		write_report(stdout);
+	return 0;
+}
@@ -0,0 +1,297 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * localindex.c
+ *
+ * Local content index
+ *
+ * The directory is scanned by a control-plane thread, so the main loop never
+ *    waits for the hashes: each regular file is hashed once, and hashed again
+ *    only when a later scan finds another length or modification time. The
+ *    length and time are checked again when a file is looked up and opened,
+ *    so a file changed between scans is not announced with an old hash.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "affinity.h"
+#include "cache.h"
+#include "fhash.h"
+#include "localindex.h"
+
+// File of the directory
+typedef struct local_file {
+	char *path;					// Full path
+	unsigned long long flen;	// Length when hashed
+	time_t mtime;				// Modification time when hashed
+	uint32_t fhash;				// Hash
+	gboolean seen;				// Found by the running scan
+} local_file;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t local_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *local_dir = NULL;			// Directory indexed (NULL - none)
+static GHashTable *files = NULL;		// Files of the directory, by name
+static gboolean scanning = FALSE;		// A scan thread is running
+static guint timer_id = 0;				// Rescan timer
+static local_stats stats;
+
+
+// Frees a file (hash table value destructor)
+static void free_file(gpointer data) {
+	local_file *f = (local_file *) data;
+	free(f->path);
+	free(f);
+}
+
+// Check that the file was not changed since it was hashed
+static gboolean unchanged(const local_file *f, const struct stat *st) {
+	return S_ISREG(st->st_mode) && ((unsigned long long) st->st_size == f->flen) && (st->st_mtime == f->mtime);
+}
+
+// Hash the file at 'path' (with 'len' bytes); returns FALSE if it could not be read
+static gboolean hash_file(const char *path, unsigned long long len, uint32_t *fhash) {
+	char *buf = (char *) malloc(LOCAL_READ_SIZE);
+	unsigned long long done = 0;
+	uint32_t h = 0;
+	ssize_t n = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if ((fd >= 0) && (buf != NULL)) {
+		while (active && (done < len) && ((n = read(fd, buf, LOCAL_READ_SIZE)) > 0)) {
+			h = fhash_update(h, buf, n);
+			done += n;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	*fhash = h;
+	return (done == len);
+}
+
+// Mark a file as not seen by the scan; g_hash_table_foreach callback
+static void clear_seen(gpointer key, gpointer value, gpointer data) {
+	((local_file *) value)->seen = FALSE;
+}
+
+// Remove the files not seen by the scan; g_hash_table_foreach_remove callback
+static gboolean not_seen(gpointer key, gpointer value, gpointer data) {
+	return !((local_file *) value)->seen;
+}
+
+// Scan the directory, hashing the new and changed files; runs in its own thread
+static void *scan_thread(void *ptr) {
+	char path[1024];
+	struct dirent *de;
+	struct stat st;
+	DIR *d = opendir(local_dir);
+
+	if (d == NULL) {
+		perror("Failed opening the local content directory");
+	} else {
+		pthread_mutex_lock(&local_mutex);
+		g_hash_table_foreach(files, clear_seen, NULL);
+		pthread_mutex_unlock(&local_mutex);
+		while (active && ((de = readdir(d)) != NULL)) {
+			if ((de->d_name[0] == '.') || (strlen(de->d_name) > 256))
+				continue;	// Hidden, or too long for a Query
+			snprintf(path, sizeof(path), "%s/%s", local_dir, de->d_name);
+			if ((stat(path, &st) < 0) || !S_ISREG(st.st_mode))
+				continue;
+
+			pthread_mutex_lock(&local_mutex);
+			local_file *f = (local_file *) g_hash_table_lookup(files, de->d_name);
+			gboolean known = (f != NULL) && unchanged(f, &st);
+			if (known)
+				f->seen = TRUE;
+			pthread_mutex_unlock(&local_mutex);
+			if (known)
+				continue;
+
+			// New or changed: hashed without the lock
+			uint32_t fhash;
+			if (!hash_file(path, st.st_size, &fhash))
+				continue;
+			f = (local_file *) calloc(1, sizeof(local_file));
+			if (f == NULL)
+				continue;
+			f->path = strdup(path);
+			f->flen = st.st_size;
+			f->mtime = st.st_mtime;
+			f->fhash = fhash;
+			f->seen = TRUE;
+			pthread_mutex_lock(&local_mutex);
+			g_hash_table_replace(files, strdup(de->d_name), f);
+			stats.hashed++;
+			pthread_mutex_unlock(&local_mutex);
+		}
+		closedir(d);
+	}
+
+	pthread_mutex_lock(&local_mutex);
+	if (active)
+		g_hash_table_foreach_remove(files, not_seen, NULL);	// Deleted (kept if the scan stopped early)
+	stats.scans++;
+	scanning = FALSE;
+	pthread_mutex_unlock(&local_mutex);
+	return NULL;
+}
+
+// Start a scan of the directory, unless one is running
+static void start_scan(void) {
+	pthread_t tid;
+
+	pthread_mutex_lock(&local_mutex);
+	if (!scanning) {
+		scanning = TRUE;
+		if (affinity_thread_create(&tid, -1, scan_thread, NULL) == 0)
+			pthread_detach(tid);
+		else
+			scanning = FALSE;
+	}
+	pthread_mutex_unlock(&local_mutex);
+}
+
+// Idle callback of the first scan, when the gateway is active
+static gboolean callback_first_scan(gpointer data) {
+	if (active)
+		start_scan();
+	return FALSE;	// Runs once
+}
+
+// Timer callback that scans the directory again while the gateway is active
+static gboolean callback_rescan(gpointer data) {
+	if (!active) {
+		timer_id = 0;
+		return FALSE;
+	}
+	start_scan();
+	return TRUE;
+}
+
+
+// Index the files of directory 'dir' (NULL - only the cache), in a thread, and scan it
+// periodically for changes. Called when the gateway starts
+void local_init(const char *dir) {
+	char tmp[300];
+
+	if (dir == NULL)
+		return;
+	if (local_dir == NULL) {
+		local_dir = strdup(dir);
+		files = g_hash_table_new_full(g_str_hash, g_str_equal, free, free_file);
+		snprintf(tmp, sizeof(tmp), "Local content from %s\n", dir);
+		Log(tmp);
+	} else if (strcmp(dir, local_dir) != 0) {
+		snprintf(tmp, sizeof(tmp), "Local content directory is still %s\n", local_dir);
+		Log(tmp);
+	}
+	// The first scan runs when the main loop gets back (the gateway is active then)
+	g_idle_add(callback_first_scan, NULL);
+	if (timer_id == 0)
+		timer_id = g_timeout_add(LOCAL_RESCAN_PERIOD, callback_rescan, NULL);
+}
+
+
+// Look up a file the gateway holds, in the cache ('from_cache' set) or in the directory, setting
+// its 'fhash' and 'flen'; returns FALSE if it has none
+gboolean local_lookup(const char *name, uint32_t *fhash, unsigned long long *flen, gboolean *from_cache) {
+	struct stat st;
+	gboolean found = FALSE;
+
+	*from_cache = cache_find(name, fhash, flen);
+	if (*from_cache)
+		return TRUE;
+	if (local_dir == NULL)
+		return FALSE;
+	pthread_mutex_lock(&local_mutex);
+	local_file *f = (local_file *) g_hash_table_lookup(files, name);
+	if ((f != NULL) && (stat(f->path, &st) == 0) && unchanged(f, &st)) {
+		*fhash = f->fhash;
+		*flen = f->flen;
+		found = TRUE;
+	}
+	pthread_mutex_unlock(&local_mutex);
+	return found;
+}
+
+
+// Open the file of the directory with the content (name, fhash, flen); returns a file
+// descriptor, or -1 if it is not there (or changed since it was indexed)
+int local_open(const char *name, uint32_t fhash, unsigned long long flen) {
+	struct stat st;
+	int fd = -1;
+
+	if (local_dir == NULL)
+		return -1;
+	pthread_mutex_lock(&local_mutex);
+	local_file *f = (local_file *) g_hash_table_lookup(files, name);
+	if ((f != NULL) && (f->fhash == fhash) && (f->flen == flen)) {
+		fd = open(f->path, O_RDONLY | O_CLOEXEC);
+		if ((fd >= 0) && ((fstat(fd, &st) < 0) || !unchanged(f, &st))) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&local_mutex);
+	return fd;
+}
+
+
+// Count a Query answered by the gateway; from_cache - the file is in the content cache
+void local_answered(gboolean from_cache) {
+	pthread_mutex_lock(&local_mutex);
+	stats.answered++;
+	if (from_cache)
+		stats.from_cache++;
+	pthread_mutex_unlock(&local_mutex);
+}
+
+
+// Count 'bytes' sent to a client from the directory
+void local_served(unsigned long long bytes) {
+	pthread_mutex_lock(&local_mutex);
+	stats.served++;
+	stats.bytes += bytes;
+	pthread_mutex_unlock(&local_mutex);
+}
+
+
+// Current statistics
+void local_get_stats(local_stats *st) {
+	pthread_mutex_lock(&local_mutex);
+	memcpy(st, &stats, sizeof(local_stats));
+	st->files = (files != NULL) ? g_hash_table_size(files) : 0;
+	pthread_mutex_unlock(&local_mutex);
+}
+
+
+// Log the statistics
+void local_report(void) {
+	local_stats st;
+	char tmp[250];
+
+	local_get_stats(&st);
+	if ((local_dir == NULL) && (st.answered == 0))
+		return;
+	snprintf(tmp, sizeof(tmp), "Local content: %lu Queries answered (%lu from the cache), %lu sessions served "
+			"from the directory (%llu KB), %d files indexed, %lu hashed in %lu scans\n", st.answered,
+			st.from_cache, st.served, st.bytes >> 10, st.files, st.hashed, st.scans);
+	Log(tmp);
+}
@@ -0,0 +1,56 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * localindex.h
+ *
+ * Header file of the local content index: the files the gateway can send
+ *    itself, without a server - the ones in the content cache and the ones in
+ *    an optional directory. A Query for one of them is answered at once with
+ *    a Hit pointing to the gateway, and is not forwarded to the other domain.
+\*****************************************************************************/
+
+#ifndef INCL_LOCALINDEX_H
+#define INCL_LOCALINDEX_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+#define LOCAL_RESCAN_PERIOD		60000		// Period scanning the directory for changes (ms)
+#define LOCAL_READ_SIZE			(64L << 10)	// Bytes read at a time when hashing a file
+
+// Local index statistics
+typedef struct local_stats {
+	unsigned long answered;			// Queries answered by the gateway
+	unsigned long from_cache;		// ... for files in the content cache
+	unsigned long served;			// Sessions served from the directory
+	unsigned long long bytes;		// Bytes served from the directory
+	unsigned long scans;			// Directory scans
+	unsigned long hashed;			// Files hashed by the scans
+	int files;						// Files indexed in the directory
+} local_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Index the files of directory 'dir' (NULL - only the cache), in a thread, and scan it
+// periodically for changes. Called when the gateway starts
+void local_init(const char *dir);
+// Look up a file the gateway holds, in the cache ('from_cache' set) or in the directory, setting
+// its 'fhash' and 'flen'; returns FALSE if it has none
+gboolean local_lookup(const char *name, uint32_t *fhash, unsigned long long *flen, gboolean *from_cache);
+// Open the file of the directory with the content (name, fhash, flen); returns a file
+// descriptor, or -1 if it is not there (or changed since it was indexed)
+int local_open(const char *name, uint32_t fhash, unsigned long long flen);
+// Count a Query answered by the gateway; from_cache - the file is in the content cache
+void local_answered(gboolean from_cache);
+// Count 'bytes' sent to a client from the directory
+void local_served(unsigned long long bytes);
+// Current statistics
+void local_get_stats(local_stats *st);
+// Log the statistics
+void local_report(void);
+
+#endif
@@ -0,0 +1,144 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * options.c
+ *
+ * Gateway run-time options, read from GW_* environment variables
+\*****************************************************************************/
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include "options.h"
+#include "callbacks_socket.h"
+#include "trace.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "spool.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "srpt.h"
+#include "admission.h"
+#include "warmstate.h"
+#include "reaper.h"
+
+
+gw_options options;	// Gateway options
+
+
+// Read an integer option from the environment, or return 'def'
+long get_option_long(const char *name, long def) {
+	const char *str = getenv(name);
+	char *end;
+	long v;
+
+	if ((str == NULL) || (*str == '\0'))
+		return def;
+	v = strtol(str, &end, 0);
+	// Accept the K, M and G suffixes
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; break;
+	case 'm': case 'M': v <<= 20; break;
+	case 'g': case 'G': v <<= 30; break;
+	case '\0': break;
+	default:
+		fprintf(stderr, "Invalid value '%s' in %s - using %ld\n", str, name, def);
+		return def;
+	}
+	return v;
+}
+
+// Read a boolean option from the environment, or return 'def'
+gboolean get_option_bool(const char *name, gboolean def) {
+	const char *str = getenv(name);
+
+	if ((str == NULL) || (*str == '\0'))
+		return def;
+	if (!strcasecmp(str, "1") || !strcasecmp(str, "yes") || !strcasecmp(str, "true") ||
+			!strcasecmp(str, "on"))
+		return TRUE;
+	if (!strcasecmp(str, "0") || !strcasecmp(str, "no") || !strcasecmp(str, "false") ||
+			!strcasecmp(str, "off"))
+		return FALSE;
+	fprintf(stderr, "Invalid value '%s' in %s - using %s\n", str, name, def ? "on" : "off");
+	return def;
+}
+
+// Read a string option from the environment, or return 'def'
+const char *get_option_str(const char *name, const char *def) {
+	const char *str = getenv(name);
+	return ((str == NULL) || (*str == '\0')) ? def : str;
+}
+
+
+// Read the options from the environment, using the defaults for the missing ones
+void load_options(void) {
+	// Accept path
+	options.accept_backlog = get_option_long("GW_ACCEPT_BACKLOG", ACCEPT_DEFAULT_BACKLOG);
+	options.defer_accept = get_option_long("GW_DEFER_ACCEPT", ACCEPT_DEFAULT_DEFER);
+	options.fastopen = get_option_long("GW_FASTOPEN", 0);
+	// CPU and NUMA placement
+	options.affinity = get_option_str("GW_AFFINITY", "off");
+	options.control_cpus = get_option_str("GW_CONTROL_CPUS", NULL);
+	// Tracing
+	options.trace_events = get_option_long("GW_TRACE_EVENTS", TRACE_DEFAULT_EVENTS);
+	options.trace_file = get_option_str("GW_TRACE_FILE", NULL);
+	// Relay buffer pool
+	options.pool_bytes = get_option_long("GW_POOL_BYTES", POOL_DEFAULT_BYTES);
+	options.pool_chunk = get_option_long("GW_POOL_CHUNK", POOL_DEFAULT_CHUNK);
+	options.pool_session_chunks = get_option_long("GW_POOL_SESSION_CHUNKS", POOL_DEFAULT_SESSION);
+	options.pool_hugepages = get_option_bool("GW_POOL_HUGEPAGES", TRUE);
+	// Content cache
+	options.cache_dir = get_option_str("GW_CACHE_DIR", NULL);
+	options.cache_bytes = get_option_long("GW_CACHE_BYTES", CACHE_DEFAULT_BYTES);
+	// Download coalescing
+	options.coalesce = get_option_bool("GW_COALESCE", FALSE);
+	// Segmented download
+	options.segment_min = get_option_long("GW_SEGMENT_MIN", 0);
+	options.segment_servers = get_option_long("GW_SEGMENT_SERVERS", 4);
+	// Upstream failover
+	options.failover_max = get_option_long("GW_FAILOVER_MAX", 3);
+	options.stall_timeout = get_option_long("GW_STALL_TIMEOUT", 5000);
+	// Session deadlines
+	options.header_timeout = get_option_long("GW_HEADER_TIMEOUT", REAPER_DEFAULT_HEADER);
+	options.connect_timeout = get_option_long("GW_CONNECT_TIMEOUT", REAPER_DEFAULT_CONNECT);
+	options.first_byte_timeout = get_option_long("GW_FIRST_BYTE_TIMEOUT", REAPER_DEFAULT_FIRST_BYTE);
+	options.idle_timeout = get_option_long("GW_IDLE_TIMEOUT", REAPER_DEFAULT_IDLE);
+	options.min_rate = get_option_long("GW_MIN_RATE", 0);
+	// Store-and-forward
+	options.spool = get_option_bool("GW_SPOOL", FALSE);
+	options.spool_dir = get_option_str("GW_SPOOL_DIR", SPOOL_DEFAULT_DIR);
+	options.pipeline_depth = get_option_long("GW_PIPELINE_DEPTH", PIPELINE_DEFAULT_DEPTH);
+	// Relay scheduler
+	options.sched_slots = get_option_long("GW_SCHED_SLOTS", 0);
+	options.sched_quantum = get_option_long("GW_SCHED_QUANTUM", SRPT_DEFAULT_QUANTUM);
+	options.sched_aging = get_option_long("GW_SCHED_AGING", SRPT_DEFAULT_AGING);
+	// Admission control
+	options.max_sessions = get_option_long("GW_MAX_SESSIONS", 0);
+	options.admit_queue = get_option_long("GW_ADMIT_QUEUE", ADMISSION_DEFAULT_QUEUE);
+	options.admit_wait = get_option_long("GW_ADMIT_WAIT", ADMISSION_DEFAULT_WAIT);
+	options.admit_target = get_option_long("GW_ADMIT_TARGET", 0);
+	// Pre-connect
+	options.preconnect = get_option_bool("GW_PRECONNECT", FALSE);
+	options.prefetch_bytes = get_option_long("GW_PREFETCH_BYTES", PREFETCH_DEFAULT_BYTES);
+	// Warm state
+	options.warm_file = get_option_str("GW_WARM_FILE", NULL);
+	options.warm_period = get_option_long("GW_WARM_PERIOD", WARM_DEFAULT_PERIOD);
+	options.warm_hit_ttl = get_option_long("GW_WARM_HIT_TTL", WARM_DEFAULT_HIT_TTL);
+	options.local_answer = get_option_bool("GW_LOCAL_ANSWER", TRUE);
+	options.local_dir = get_option_str("GW_LOCAL_DIR", NULL);
+	// Multicast group pairs
+	options.groups = get_option_str("GW_GROUPS", NULL);
+	options.group_max_queries = get_option_long("GW_GROUP_MAX_QUERIES", 0);
+	// Multi-process data plane
+	options.workers = get_option_long("GW_WORKERS", 0);
+	// Integrity verification
+	options.verify = get_option_bool("GW_VERIFY", FALSE);
+	// Statistics
+	options.report_period = get_option_long("GW_REPORT_PERIOD", 0);
+	// Hot restart
+	options.handoff_socket = get_option_str("GW_HANDOFF_SOCKET", NULL);
+}
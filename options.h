@@ -0,0 +1,108 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * options.h
+ *
+ * Header file of the gateway run-time options, which are not configured in the
+ *    graphical interface. They are read from GW_* environment variables when
+ *    the gateway is turned on.
+\*****************************************************************************/
+
+#ifndef INCL_OPTIONS_H
+#define INCL_OPTIONS_H
+
+#include <gtk/gtk.h>
+
+
+// Gateway options
+typedef struct gw_options {
+	// Accept path
+	long accept_backlog;		// GW_ACCEPT_BACKLOG - accept queue length of the TCP server sockets
+	long defer_accept;			// GW_DEFER_ACCEPT - time waiting for the request before accepting (s; 0 - off)
+	long fastopen;				// GW_FASTOPEN - TCP Fast Open queue length (0 - off)
+	// CPU and NUMA placement
+	const char *affinity;		// GW_AFFINITY - place the sessions on their socket's core or node (off, cpu, node)
+	const char *control_cpus;	// GW_CONTROL_CPUS - CPUs of the main loop and the other control-plane threads
+	// Tracing
+	long trace_events;			// GW_TRACE_EVENTS - size of the trace ring buffer (0 - off)
+	const char *trace_file;		// GW_TRACE_FILE - trace file written when the gateway stops
+	// Relay buffer pool
+	long pool_bytes;			// GW_POOL_BYTES - global memory budget of the relay buffers
+	long pool_chunk;			// GW_POOL_CHUNK - size of each relay buffer
+	long pool_session_chunks;	// GW_POOL_SESSION_CHUNKS - maximum number of buffers per session
+	gboolean pool_hugepages;	// GW_POOL_HUGEPAGES - back the pool with hugepages
+	// Content cache
+	const char *cache_dir;		// GW_CACHE_DIR - directory of the content cache (NULL - off)
+	long cache_bytes;			// GW_CACHE_BYTES - capacity of the content cache
+	// Download coalescing
+	gboolean coalesce;			// GW_COALESCE - share one fetch between concurrent requests for a file
+	// Segmented download
+	long segment_min;			// GW_SEGMENT_MIN - minimum file length fetched from several servers (0 - off)
+	long segment_servers;		// GW_SEGMENT_SERVERS - maximum number of servers used for one file
+	// Upstream failover
+	long failover_max;			// GW_FAILOVER_MAX - servers tried after the one relaying a file fails (0 - off)
+	long stall_timeout;			// GW_STALL_TIMEOUT - time without data from the server before it is replaced (ms; 0 - none)
+	// Session deadlines
+	long header_timeout;		// GW_HEADER_TIMEOUT - time to receive the request from the client (ms; 0 - none)
+	long connect_timeout;		// GW_CONNECT_TIMEOUT - time to connect to a server (ms; 0 - none)
+	long first_byte_timeout;	// GW_FIRST_BYTE_TIMEOUT - time from the request to the first byte sent (ms; 0 - none)
+	long idle_timeout;			// GW_IDLE_TIMEOUT - time without sending to the client (ms; 0 - none)
+	long min_rate;				// GW_MIN_RATE - minimum throughput of a transfer (bytes/s; 0 - none)
+	// Store-and-forward
+	gboolean spool;				// GW_SPOOL - read the servers ahead of the clients, releasing them early
+	const char *spool_dir;		// GW_SPOOL_DIR - directory of the spool files
+	long pipeline_depth;		// GW_PIPELINE_DEPTH - buffers read ahead by the relay reader thread (0 - serial relay)
+	// Relay scheduler
+	long sched_slots;			// GW_SCHED_SLOTS - sessions sending at a time when they compete (0 - off)
+	long sched_quantum;			// GW_SCHED_QUANTUM - bytes sent in one turn
+	long sched_aging;			// GW_SCHED_AGING - waiting time that halves a session's priority key (ms)
+	// Admission control
+	long max_sessions;			// GW_MAX_SESSIONS - sessions running at a time (0 - no limit)
+	long admit_queue;			// GW_ADMIT_QUEUE - connections waiting for a free slot
+	long admit_wait;			// GW_ADMIT_WAIT - maximum time waiting for a slot (ms)
+	long admit_target;			// GW_ADMIT_TARGET - time to the first byte that lowers the cap (ms; 0 - fixed cap)
+	// Pre-connect
+	gboolean preconnect;		// GW_PRECONNECT - connect to the server when the Hit is relayed
+	long prefetch_bytes;		// GW_PREFETCH_BYTES - bytes read before the client connects
+	// Warm state
+	const char *warm_file;		// GW_WARM_FILE - snapshot of the servers, Hits and cache index (NULL - off)
+	long warm_period;			// GW_WARM_PERIOD - period writing the snapshot (ms)
+	long warm_hit_ttl;			// GW_WARM_HIT_TTL - age of a Hit still used to answer Queries (s; 0 - never)
+	// Local content
+	gboolean local_answer;		// GW_LOCAL_ANSWER - answer Queries for files held by the gateway
+	const char *local_dir;		// GW_LOCAL_DIR - directory of files served by the gateway (NULL - none)
+	// Multicast group pairs
+	const char *groups;			// GW_GROUPS - other group pairs bridged ("addr4 port4 addr6 port6 [max]";...)
+	long group_max_queries;		// GW_GROUP_MAX_QUERIES - pending Queries per group pair (0 - no limit)
+	// Multi-process data plane
+	long workers;				// GW_WORKERS - worker processes relaying the files (0 - sessions in threads of the gateway)
+	// Integrity verification
+	gboolean verify;			// GW_VERIFY - check the relayed files against the hash in the Hit
+	// Statistics
+	long report_period;			// GW_REPORT_PERIOD - period logging the pool and cache statistics (ms; 0 - off)
+	// Hot restart
+	const char *handoff_socket;	// GW_HANDOFF_SOCKET - UNIX socket used to hand over to a new process
+} gw_options;
+
+
+/*********************\
+|* Global variables  *|
+\*********************/
+
+extern gw_options options;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Read the options from the environment, using the defaults for the missing ones
+void load_options(void);
+
+// Read an integer/boolean/string option from the environment, or return 'def'
+long get_option_long(const char *name, long def);
+gboolean get_option_bool(const char *name, gboolean def);
+const char *get_option_str(const char *name, const char *def);
+
+#endif
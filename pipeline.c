@@ -0,0 +1,289 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * pipeline.c
+ *
+ * Pipelined relay
+ *
+ * The ring has one producer (the reader thread) and one consumer (the session
+ *    thread): each side only writes its own counter, so passing a buffer
+ *    takes no lock. A side that finds the ring full (or empty) sleeps on a
+ *    condition variable, after flagging it; the other side only takes the
+ *    mutex to wake it when the flag is set. The session thread keeps the
+ *    client side of the relay (scheduler turns, cache, hash and progress), so
+ *    the bytes are accounted in order, as in the serial relay.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "buffer_pool.h"
+#include "hotrestart.h"
+#include "affinity.h"
+#include "options.h"
+#include "srpt.h"
+#include "pipeline.h"
+
+// End of a round of the relay
+typedef enum { ROUND_DONE, ROUND_FAILED, ROUND_HANDOFF } round_end;
+
+// State of the reader
+enum { READER_RUNNING, READER_DONE, READER_STOPPED };
+
+// Sides of the ring
+enum { READER, WRITER };
+
+// Buffer in the ring
+typedef struct pipe_slot {
+	char *buf;					// Relay buffer, from the pool
+	int n;						// Bytes read into it
+} pipe_slot;
+
+// Ring between the reader thread and the session thread
+typedef struct relay_pipe {
+	thread_state *pt;			// Session
+	pipe_slot *slots;			// Buffers
+	unsigned int depth;			// Number of slots
+	unsigned int head;			// Buffers passed by the reader (written by the reader only)
+	unsigned int tail;			// Buffers sent by the writer (written by the writer only)
+	unsigned long long rcvd;	// Bytes read from the server (reader only)
+	int reader_state;			// READER_RUNNING, or how it ended
+	gboolean stop;				// The writer asks the reader to stop
+	gboolean sleeping[2];		// Side sleeping on 'cond'
+	unsigned long waits[2];		// Times each side had to sleep
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} relay_pipe;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pipeline_stats stats;
+
+
+// Check if the reader may read another buffer
+static gboolean reader_ready(relay_pipe *p) {
+	return __atomic_load_n(&p->stop, __ATOMIC_SEQ_CST) ||
+			(__atomic_load_n(&p->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST) < p->depth);
+}
+
+// Check if the writer has a buffer to send, or the reader ended
+static gboolean writer_ready(relay_pipe *p) {
+	return (__atomic_load_n(&p->head, __ATOMIC_SEQ_CST) != p->tail) ||
+			(__atomic_load_n(&p->reader_state, __ATOMIC_SEQ_CST) != READER_RUNNING);
+}
+
+// Sleep until the side is ready, or for up to PIPELINE_WAIT_PERIOD
+static void pipe_wait(relay_pipe *p, int side, gboolean (*ready)(relay_pipe *)) {
+	struct timespec deadline;
+
+	pthread_mutex_lock(&p->mutex);
+	__atomic_store_n(&p->sleeping[side], TRUE, __ATOMIC_SEQ_CST);
+	if (!ready(p)) {	// Checked after the flag: the other side sees it, or this side sees its change
+		p->waits[side]++;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += PIPELINE_WAIT_PERIOD * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&p->cond, &p->mutex, &deadline);
+	}
+	__atomic_store_n(&p->sleeping[side], FALSE, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+// Wake the side, if it is sleeping
+static void pipe_wake(relay_pipe *p, int side) {
+	if (__atomic_load_n(&p->sleeping[side], __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&p->mutex);
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->mutex);
+	}
+}
+
+
+// Reader thread: reads the server into pool buffers and passes them to the writer
+static void *pipe_reader(void *ptr) {
+	relay_pipe *p = (relay_pipe *) ptr;
+	thread_state *pt = p->pt;
+	int state = READER_DONE;
+	char *buf;
+	int n;
+
+	while (p->rcvd < pt->flen) {
+		while (!reader_ready(p))
+			pipe_wait(p, READER, reader_ready);
+		if (!active || __atomic_load_n(&p->stop, __ATOMIC_SEQ_CST)) {
+			state = READER_STOPPED;
+			break;
+		}
+		// Waits for a free buffer when the pool is exhausted, without reading from the server
+		buf = pool_get(&pt->pool_chunks);
+		if (buf == NULL) {
+			state = READER_STOPPED;
+			break;
+		}
+		n = read(pt->sock6, buf, (int) MIN((unsigned long long) pool_chunk_size(), pt->flen - p->rcvd));
+		if (n <= 0) {
+			pool_put(buf, &pt->pool_chunks);
+			state = READER_STOPPED;
+			break;
+		}
+		unsigned int head = p->head;
+		p->slots[head % p->depth].buf = buf;
+		p->slots[head % p->depth].n = n;
+		p->rcvd += n;
+		__atomic_store_n(&p->head, head + 1, __ATOMIC_SEQ_CST);	// Publishes the slot
+		pipe_wake(p, WRITER);
+	}
+	__atomic_store_n(&p->reader_state, state, __ATOMIC_SEQ_CST);
+	pipe_wake(p, WRITER);
+	return NULL;
+}
+
+
+// Ask the reader to stop after the buffer it is reading
+static void stop_reader(relay_pipe *p) {
+	__atomic_store_n(&p->stop, TRUE, __ATOMIC_SEQ_CST);
+	pipe_wake(p, READER);
+}
+
+
+// Relay the rest of the file serially, when the ring could not be set up
+static round_end serial_round(thread_state *pt) {
+	if (serial_relay(pt))
+		return ROUND_HANDOFF;
+	return (pt->sent == pt->flen) ? ROUND_DONE : ROUND_FAILED;
+}
+
+
+// Relay from byte pt->sent until the end of the file, a failure, or a hot restart request
+static round_end relay_round(thread_state *pt, unsigned int depth, gboolean slow) {
+	round_end end = ROUND_DONE;
+	gboolean failed = FALSE, handoff = FALSE;
+	relay_pipe p;
+	pthread_t tid;
+
+	memset(&p, 0, sizeof(p));
+	p.pt = pt;
+	p.depth = depth;
+	p.rcvd = pt->sent;
+	p.slots = (pipe_slot *) calloc(depth, sizeof(pipe_slot));
+	if (p.slots == NULL)
+		return serial_round(pt);
+	pthread_mutex_init(&p.mutex, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	if (affinity_thread_create(&tid, pt->sock4, pipe_reader, &p) != 0) {
+		Log("ERROR - Failed starting the relay reader; relaying serially\n");
+		pthread_cond_destroy(&p.cond);
+		pthread_mutex_destroy(&p.mutex);
+		free(p.slots);
+		return serial_round(pt);
+	}
+
+	for (;;) {
+		if (p.tail == __atomic_load_n(&p.head, __ATOMIC_SEQ_CST)) {
+			if (__atomic_load_n(&p.reader_state, __ATOMIC_SEQ_CST) != READER_RUNNING) {
+				if (p.tail == __atomic_load_n(&p.head, __ATOMIC_SEQ_CST))
+					break;	// Nothing passed after the reader ended
+				continue;
+			}
+			srpt_yield(pt);		// The turn is not held while waiting for the server
+			pipe_wait(&p, WRITER, writer_ready);
+			continue;
+		}
+
+		pipe_slot *s = &p.slots[p.tail % p.depth];
+		if (!failed) {
+			// Waits for its turn, when sessions compete
+			if (!active || !srpt_gate(pt, s->n, TRUE) || !deliver_block(pt, s->buf, s->n)) {
+				failed = TRUE;
+				stop_reader(&p);
+				shutdown(pt->sock6, SHUT_RD);	// Does not wait for the server
+			} else if (slow)
+				usleep(SLOW_SLEEPTIME);
+		}
+		pool_put(s->buf, &pt->pool_chunks);
+		__atomic_store_n(&p.tail, p.tail + 1, __ATOMIC_SEQ_CST);	// Frees the slot
+		pipe_wake(&p, READER);
+
+		// Stop reading if a new gateway process is taking over the sessions; the buffers
+		// already read are sent, and the relay stops at a block boundary
+		if (!failed && !handoff && handoff_requested && (pt->stream == NULL)) {
+			handoff = TRUE;
+			stop_reader(&p);
+		}
+	}
+	pthread_join(tid, NULL);
+
+	if (failed || (!handoff && (p.reader_state == READER_STOPPED)))
+		end = ROUND_FAILED;
+	else if (handoff && (pt->sent < pt->flen))
+		end = handoff_park(pt) ? ROUND_HANDOFF : ROUND_DONE;	// Otherwise, another round
+
+	pthread_mutex_lock(&stats_mutex);
+	stats.reader_waits += p.waits[READER];
+	stats.writer_waits += p.waits[WRITER];
+	pthread_mutex_unlock(&stats_mutex);
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.mutex);
+	free(p.slots);
+	return end;
+}
+
+
+// Relay the file from the server to the client, from byte pt->sent up to pt->flen, reading the
+// server in another thread up to options.pipeline_depth buffers ahead of the client
+// Returns TRUE if the session was handed over to another gateway process (hot restart)
+gboolean pipelined_relay(thread_state *pt) {
+	gboolean slow = get_checkbutton_Slow_state();
+	// The reader waits for the pool when the session holds its cap of buffers
+	unsigned int depth = (unsigned int) CLAMP(options.pipeline_depth, 1, MAX(options.pool_session_chunks, 1));
+	unsigned long long start = pt->sent;
+	round_end end = ROUND_DONE;
+
+	while (active && (pt->sent < pt->flen) && (end == ROUND_DONE))
+		end = relay_round(pt, depth, slow);
+
+	pthread_mutex_lock(&stats_mutex);
+	stats.sessions++;
+	stats.bytes += pt->sent - start;
+	pthread_mutex_unlock(&stats_mutex);
+	return (end == ROUND_HANDOFF);
+}
+
+
+// Current statistics
+void pipeline_get_stats(pipeline_stats *st) {
+	pthread_mutex_lock(&stats_mutex);
+	memcpy(st, &stats, sizeof(pipeline_stats));
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+
+// Log the statistics
+void pipeline_report(void) {
+	pipeline_stats st;
+	char tmp[200];
+
+	pipeline_get_stats(&st);
+	if (st.sessions == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Pipelined relay: %lu sessions, %llu KB; ring full %lu times (clients slower), "
+			"empty %lu times (servers slower)\n", st.sessions, st.bytes >> 10, st.reader_waits, st.writer_waits);
+	Log(tmp);
+}
@@ -0,0 +1,46 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * pipeline.h
+ *
+ * Header file of the pipelined relay: a reader thread reads the server into
+ *    relay buffers and passes them to the session thread, which writes them
+ *    to the client, through a lock-free ring of up to GW_PIPELINE_DEPTH
+ *    buffers. Both connections are kept busy at once: the server is read
+ *    while a write to the client blocks, and the reverse.
+\*****************************************************************************/
+
+#ifndef INCL_PIPELINE_H
+#define INCL_PIPELINE_H
+
+#include <gtk/gtk.h>
+
+struct thread_state;
+
+#define PIPELINE_DEFAULT_DEPTH	0		// Default ring depth (0 - serial relay)
+#define PIPELINE_WAIT_PERIOD	100		// Period checking the gateway state while waiting (ms)
+
+// Pipelined relay statistics
+typedef struct pipeline_stats {
+	unsigned long sessions;			// Sessions relayed through a ring
+	unsigned long long bytes;		// Bytes relayed
+	unsigned long reader_waits;		// Times the reader found the ring full (client slower)
+	unsigned long writer_waits;		// Times the writer found the ring empty (server slower)
+} pipeline_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Relay the file from the server to the client, from byte pt->sent up to pt->flen, reading the
+// server in another thread up to options.pipeline_depth buffers ahead of the client
+// Returns TRUE if the session was handed over to another gateway process (hot restart)
+gboolean pipelined_relay(struct thread_state *pt);
+// Current statistics
+void pipeline_get_stats(pipeline_stats *st);
+// Log the statistics
+void pipeline_report(void);
+
+#endif
@@ -0,0 +1,288 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * prefetch.c
+ *
+ * Speculative pre-connect
+ *
+ * Each connection is opened by its own thread, which then reads the file
+ *    into the buffer, without blocking, until the buffer is full or the
+ *    connection is taken or dropped. All the fields, and the Query's pointer
+ *    to the prefetch, are protected by one mutex; the prefetch is freed by
+ *    the last of the thread and the Query to release it.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "options.h"
+#include "intern.h"
+#include "affinity.h"
+#include "prefetch.h"
+
+typedef enum { PF_CONNECTING, PF_READY, PF_FAILED } PrefetchState;
+
+// Connection opened for a Query
+typedef struct prefetch {
+	pthread_cond_t cond;		// Signalled when the connection is ready or failed
+	hit_server server;			// Server connected
+	const char *name;			// File requested (interned)
+	uint16_t seq;				// Sequence number of the Query
+	PrefetchState state;		// Connection state
+	int sock;					// Socket (-1 - none or taken)
+	unsigned long long flen;	// File length sent by the server
+	char *buf;					// First bytes of the file
+	size_t len;					// Bytes in 'buf'
+	size_t cap;					// Size of 'buf'
+	gboolean taken;				// Taken by the client's session
+	gboolean dropped;			// Dropped by the Query
+	int refs;					// References: the thread and the Query
+} prefetch;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static prefetch_stats stats;
+
+
+// Release one reference to 'pf', freeing it with the last one; called with prefetch_mutex locked
+static void prefetch_release(prefetch *pf) {
+	if (--pf->refs > 0)
+		return;
+	if ((pf->state == PF_READY) && !pf->taken)
+		stats.dropped++;
+	if (pf->sock >= 0)
+		close(pf->sock);
+	free(pf->buf);
+	intern_put(pf->name);
+	pthread_cond_destroy(&pf->cond);
+	free(pf);
+}
+
+
+// Set the send or receive ('opt') timeout of 'sock' to 'ms' (0 - none)
+static void set_timeout(int sock, int opt, long ms) {
+	struct timeval tv;
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	if (setsockopt(sock, SOL_SOCKET, opt, &tv, sizeof(tv)) < 0)
+		perror("Failed setting the prefetch timeout");
+}
+
+
+// Thread that opens the connection and reads the first bytes of the file
+static void *prefetch_function(void *ptr) {
+	prefetch *pf = (prefetch *) ptr;
+	unsigned long long flen = 0;
+	char *buf = NULL;
+	size_t cap = 0;
+	int sock;
+
+	// Connect and request the whole file
+	sock = connect_to_ipv6_server(&pf->server, options.connect_timeout);
+	if ((sock >= 0) && (options.first_byte_timeout > 0)) {
+		// A silent server does not keep the session waiting for the prefetch
+		set_timeout(sock, SO_SNDTIMEO, options.first_byte_timeout);
+		set_timeout(sock, SO_RCVTIMEO, options.first_byte_timeout);
+	}
+	if ((sock >= 0) && (!write_file_request(sock, pf->seq, pf->name, 0, 0) ||
+			(read(sock, &flen, sizeof(flen)) != sizeof(flen)))) {
+		close(sock);
+		sock = -1;
+	}
+	if ((sock >= 0) && (options.first_byte_timeout > 0)) {
+		// The session sets its own timeouts
+		set_timeout(sock, SO_SNDTIMEO, 0);
+		set_timeout(sock, SO_RCVTIMEO, 0);
+	}
+	if ((sock >= 0) && (flen > 0) && (options.prefetch_bytes > 0)) {
+		cap = (size_t) MIN(flen, (unsigned long long) options.prefetch_bytes);
+		buf = (char *) malloc(cap);
+		if (buf == NULL)
+			cap = 0;
+	}
+
+	pthread_mutex_lock(&prefetch_mutex);
+	if (sock < 0) {
+		pf->state = PF_FAILED;
+		stats.failed++;
+	} else {
+		pf->state = PF_READY;
+		pf->sock = sock;
+		pf->flen = flen;
+		pf->buf = buf;
+		pf->cap = cap;
+	}
+	pthread_cond_broadcast(&pf->cond);
+
+	// Read ahead of the client, until the buffer is full
+	while (active && (pf->state == PF_READY) && !pf->taken && !pf->dropped && (pf->len < pf->cap)) {
+		struct pollfd pfd;
+		ssize_t n;
+		int r;
+
+		pthread_mutex_unlock(&prefetch_mutex);
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, PREFETCH_POLL_PERIOD);
+		pthread_mutex_lock(&prefetch_mutex);
+		if ((r <= 0) || pf->taken || pf->dropped)
+			continue;
+		n = recv(sock, pf->buf + pf->len, pf->cap - pf->len, MSG_DONTWAIT);
+		if (n > 0) {
+			pf->len += n;
+			stats.bytes_read += n;
+		} else if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+			break;	// The session sees the end of the connection after the bytes read
+	}
+	prefetch_release(pf);
+	pthread_mutex_unlock(&prefetch_mutex);
+	return NULL;
+}
+
+
+// Connect to the first server in the Hits of 'q' and request the file, in the background,
+// reading up to options.prefetch_bytes of it; returns FALSE if it was not started
+gboolean prefetch_start(Query *q) {
+	pthread_t tid;
+	prefetch *pf;
+
+	assert(q != NULL);
+	if (q->prefetch != NULL)
+		return FALSE;
+	pf = (prefetch *) calloc(1, sizeof(prefetch));
+	if (pf == NULL)
+		return FALSE;
+	if (get_Query_hits(q, &pf->server, 1) < 1) {
+		free(pf);
+		return FALSE;
+	}
+	pthread_cond_init(&pf->cond, NULL);
+	pf->name = intern_ref(q->name);
+	pf->seq = q->seq;
+	pf->state = PF_CONNECTING;
+	pf->sock = -1;
+	pf->refs = 2;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	if (affinity_thread_create(&tid, -1, prefetch_function, pf) != 0) {
+		pthread_mutex_unlock(&prefetch_mutex);
+		perror("Failed creating the prefetch thread");
+		intern_put(pf->name);
+		pthread_cond_destroy(&pf->cond);
+		free(pf);
+		return FALSE;
+	}
+	pthread_detach(tid);
+	q->prefetch = pf;
+	stats.started++;
+	pthread_mutex_unlock(&prefetch_mutex);
+	return TRUE;
+}
+
+
+// Take over the connection opened for 'q': returns the socket, positioned after the 'len' bytes
+// returned in 'data' (freed by the caller), with the file length in 'flen' and the server
+// in 'server'; returns -1 if there is none, it failed or it is still being opened when the
+// connect and first byte timeouts end (the caller connects as usual)
+int prefetch_take(Query *q, unsigned long long *flen, char **data, size_t *len, hit_server *server) {
+	long wait = ((options.connect_timeout > 0) && (options.first_byte_timeout > 0)) ?
+			options.connect_timeout + options.first_byte_timeout : PREFETCH_MAX_WAIT;
+	struct timespec deadline;
+	prefetch *pf;
+	int sock = -1;
+
+	assert((q != NULL) && (flen != NULL) && (data != NULL) && (len != NULL) && (server != NULL));
+	pthread_mutex_lock(&prefetch_mutex);
+	pf = q->prefetch;
+	q->prefetch = NULL;
+	if (pf == NULL) {
+		pthread_mutex_unlock(&prefetch_mutex);
+		return -1;
+	}
+	// The connection is still being opened: it is faster to wait for it than to open another,
+	// unless it takes too long
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += wait / 1000;
+	deadline.tv_nsec += (wait % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	while (pf->state == PF_CONNECTING)
+		if (pthread_cond_timedwait(&pf->cond, &prefetch_mutex, &deadline) == ETIMEDOUT)
+			break;
+	if (pf->state == PF_CONNECTING)
+		stats.timeouts++;
+	if (pf->state == PF_READY) {
+		sock = pf->sock;
+		*flen = pf->flen;
+		*data = pf->buf;
+		*len = pf->len;
+		memcpy(server, &pf->server, sizeof(hit_server));
+		pf->sock = -1;
+		pf->buf = NULL;
+		pf->taken = TRUE;
+		stats.used++;
+		stats.bytes_used += pf->len;
+	}
+	prefetch_release(pf);
+	pthread_mutex_unlock(&prefetch_mutex);
+	return sock;
+}
+
+
+// Drop the connection opened for 'q', if any (the Query is being freed or does not use it)
+void prefetch_drop(Query *q) {
+	prefetch *pf;
+
+	assert(q != NULL);
+	pthread_mutex_lock(&prefetch_mutex);
+	pf = q->prefetch;
+	q->prefetch = NULL;
+	if (pf != NULL) {
+		pf->dropped = TRUE;
+		prefetch_release(pf);
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+
+// Current statistics
+void prefetch_get_stats(prefetch_stats *st) {
+	pthread_mutex_lock(&prefetch_mutex);
+	memcpy(st, &stats, sizeof(prefetch_stats));
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+
+// Log the statistics
+void prefetch_report(void) {
+	prefetch_stats st;
+	char tmp[200];
+
+	prefetch_get_stats(&st);
+	if (st.started == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Pre-connect: %lu connections opened on Hits, %lu used (%llu of %llu KB "
+			"prefetched sent), %lu dropped, %lu failed, %lu not waited for\n", st.started, st.used,
+			st.bytes_used >> 10, st.bytes_read >> 10, st.dropped, st.failed, st.timeouts);
+	Log(tmp);
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * prefetch.h
+ *
+ * Header file of the speculative pre-connect: when a Hit is relayed to the
+ *    client, the gateway connects to the server and requests the file at
+ *    once, and reads its first bytes into a bounded buffer, while waiting for
+ *    the client's connection. The proxy thread takes over the connection and
+ *    the bytes read; they are dropped if the client does not connect.
+\*****************************************************************************/
+
+#ifndef INCL_PREFETCH_H
+#define INCL_PREFETCH_H
+
+#include <gtk/gtk.h>
+
+struct Query;
+struct hit_server;
+
+#define PREFETCH_DEFAULT_BYTES	(1L << 20)	// Default number of bytes read before the client connects
+#define PREFETCH_POLL_PERIOD	100			// Poll period, checking if the prefetch was dropped (ms)
+#define PREFETCH_MAX_WAIT		2000		// Time a session waits for the connection being opened, when
+											// GW_CONNECT_TIMEOUT or GW_FIRST_BYTE_TIMEOUT is off (ms)
+
+// Pre-connect statistics
+typedef struct prefetch_stats {
+	unsigned long started;			// Connections opened when a Hit was relayed
+	unsigned long used;				// Connections taken by the client's session
+	unsigned long dropped;			// Connections dropped without a client
+	unsigned long failed;			// Connections that failed before the file length was received
+	unsigned long timeouts;			// Sessions that stopped waiting for the connection
+	unsigned long long bytes_read;	// Bytes read before the clients connected
+	unsigned long long bytes_used;	// Bytes read before the clients connected and sent to them
+} prefetch_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Connect to the first server in the Hits of 'q' and request the file, in the background,
+// reading up to options.prefetch_bytes of it; returns FALSE if it was not started
+gboolean prefetch_start(struct Query *q);
+// Take over the connection opened for 'q': returns the socket, positioned after the 'len' bytes
+// returned in 'data' (freed by the caller), with the file length in 'flen' and the server
+// in 'server'; returns -1 if there is none or it failed (the caller connects as usual)
+int prefetch_take(struct Query *q, unsigned long long *flen, char **data, size_t *len,
+		struct hit_server *server);
+// Drop the connection opened for 'q', if any (the Query is being freed or does not use it)
+void prefetch_drop(struct Query *q);
+// Current statistics
+void prefetch_get_stats(prefetch_stats *st);
+// Log the statistics
+void prefetch_report(void);
+
+#endif
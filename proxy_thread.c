@@ -5,6 +5,7 @@
  * proxy_thread.c
  *
  * Functions that implement the proxy threads, which bind IPv4 clients to IPv6 servers
+ *    and IPv6 clients to IPv4 servers
  *
  * Updated on August 26, 2022
  * @author  Luis Bernardo
@@ -16,6 +17,7 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/sendfile.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,14 +25,36 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include "sock.h"
 #include "gui.h"
 #include "callbacks.h"
 #include "callbacks_socket.h"
 #include "proxy_thread.h"
-
-
-GList *plist= NULL;			// List of active proxy threads
+#include "trace.h"
+#include "hotrestart.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "coalesce.h"
+#include "options.h"
+#include "segment.h"
+#include "spool.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "srpt.h"
+#include "admission.h"
+#include "warmstate.h"
+#include "localindex.h"
+#include "fhash.h"
+#include "slab.h"
+#include "intern.h"
+#include "reaper.h"
+
+
+GQueue plist= G_QUEUE_INIT;	// List of active proxy threads (queue keeps appends O(1))
+pthread_mutex_t plist_mutex= PTHREAD_MUTEX_INITIALIZER;	// Locks plist
+
+static slab_cache *thread_slab= NULL;	// Thread state objects
 
 /******************************************\
 |* Functions that handle the thread list  *|
@@ -39,40 +63,102 @@ GList *plist= NULL;			// List of active proxy threads
 // Create a new thread state object
 thread_state *new_thread_state(int sock4, struct sockaddr_in6 *cli_addr) {
 	assert(sock4 >= 0);
-	thread_state *pt = (thread_state *) malloc(sizeof(thread_state));
-	pt->status= INITIAL_STATE;
+	if (thread_slab == NULL)
+		thread_slab = slab_create("thread_state", sizeof(thread_state));
+	thread_state *pt = (thread_state *) slab_alloc(thread_slab);
+	char name[TRACE_NAME_LENGTH];
+	if (pt == NULL)
+		return NULL;
+	snprintf(name, sizeof(name), "th(%d)", sock4);
+	pt->trace_id = trace_new_object(TRACE_THREAD, name);
+	set_thread_status(pt, INITIAL_STATE);
 	memcpy(&pt->cli_ip, &cli_addr->sin6_addr, 16);
 	pt->cli_port= ntohs(cli_addr->sin6_port);
 	pt->sock4 = sock4;
+	pt->cli_ipv6 = FALSE;
 	pt->sock6 = -1;
 	pt->filename = NULL;
 	pt->seq= -1;
 	pt->q= NULL;
+	pt->flen= 0;
+	pt->sent= 0;
+	pt->parked= FALSE;
+	pt->pool_chunks= 0;
+	pt->fill= NULL;
+	pt->stream= NULL;
+	pt->verify= FALSE;
+	pt->spooling= FALSE;
+	pt->srpt= NULL;
+	pt->reaper= NULL;
+	pt->admitted= 0;
+	pt->first_byte= FALSE;
+	pt->client_gone= FALSE;
+	pt->fhash= 0;
+	pt->hash= 0;
+	pt->servers= NULL;
+	pt->handed_off= FALSE;
 
 	pt->self = pt;
-	plist= g_list_append(plist, pt);
+	pt->link.data = pt;
+	pthread_mutex_lock(&plist_mutex);
+	g_queue_push_tail_link(&plist, &pt->link);
+	pthread_mutex_unlock(&plist_mutex);
 
 	return pt;
 }
 
+// Change the thread status, recording the transition in the lifecycle trace
+void set_thread_status(thread_state *pt, thread_status status) {
+	pt->status = status;
+	trace_event(TRACE_THREAD, pt->trace_id, status);
+}
+
 // Update the information about the IPv6 server
 void update_thread_state(thread_state *pt, int sock6, const char *fname, u_int16_t seq) {
 	assert(pt != NULL);
 	pt->sock6 =sock6;
-	pt->filename = strdup(fname);
+	const char *old = pt->filename;
+	pt->filename = intern_get(fname);	// Shared with the Query
+	intern_put(old);
 	pt->seq= seq;
 }
 
 // Search for thread_state descriptor in plist using the filename and sequence number
+// The names are interned: they are compared by pointer
 thread_state *locate_state_in_plist(const char *filename, u_int16_t seq) {
 	assert(filename != NULL);
+	const char *iname = intern_find(filename);
 	GList *list;
-	for (list = plist; list != NULL; list = g_list_next(list)) {
+	thread_state *pt = NULL;
+	if (iname == NULL)
+		return NULL;	// No thread has this name
+	pthread_mutex_lock(&plist_mutex);
+	for (list = plist.head; list != NULL; list = g_list_next(list)) {
 		if (((thread_state *) list->data)->seq == seq)
-			if (!strcmp(filename, ((thread_state *) list->data)->filename))
-				return (thread_state *) list->data;
+			if (((thread_state *) list->data)->filename == iname) {
+				pt = (thread_state *) list->data;
+				break;
+			}
 	}
-	return NULL;
+	pthread_mutex_unlock(&plist_mutex);
+	return pt;
+}
+
+
+// Compare the hash of the file relayed with the one announced in the Hit, recording the result
+// for the servers that sent it; returns FALSE if they differ
+static gboolean verify_file(thread_state *pt) {
+	char tmp[400];
+	gboolean match = (pt->hash == pt->fhash);
+
+	fhash_result(pt->servers, pt->flen, match);
+	if (!match) {
+		snprintf(tmp, sizeof(tmp), "th(%d): '%s' from %s does not match the Hit hash (%08x instead "
+				"of %08x) - not cached\n", pt->sock4, pt->filename, (pt->servers != NULL) ?
+				pt->servers : "?", pt->hash, pt->fhash);
+		Log(tmp);
+	}
+	return match;
 }
 
 
@@ -83,9 +169,16 @@ void free_thread_state(thread_state *pt, gboolean called_from_GUI) {
 		return;
 
 	pt->self = NULL;	// It is being freed
+	trace_event(TRACE_THREAD, pt->trace_id, TRACE_END);
 
 	// Remove from proxy thread list
-	plist = g_list_remove(plist, pt);
+	pthread_mutex_lock(&plist_mutex);
+	g_queue_unlink(&plist, &pt->link);
+	pthread_mutex_unlock(&plist_mutex);
+	reaper_leave(pt);	// Before its sockets are closed
+	srpt_leave(pt);		// Its turn goes to the next session
+	if (pt->admitted > 0)
+		admission_release();	// Its slot goes to the next connection waiting
 
 	// Clear GUI table
 	GUI_del_Proxy(pt->filename, pt->seq, pt->sock4, called_from_GUI);
@@ -93,26 +186,39 @@ void free_thread_state(thread_state *pt, gboolean called_from_GUI) {
 	// Get pointer to Query
 	Query *q= pt->q;
 	if ((q == NULL) && (pt->filename != NULL))
-		q= locate_in_QueryList_IP(pt->filename, pt->seq, FALSE);
+		q= locate_in_QueryList_client(pt->filename, pt->seq, pt->cli_ipv6, &pt->cli_ip);
 	if (q != NULL) {
-		del_Query(q, called_from_GUI);
 		q->thread= NULL;
+		del_Query(q, called_from_GUI);
 	}
 
+	// Keep the copy in the content cache only if the whole file was relayed, with the right hash
+	gboolean complete = (pt->flen > 0) && (pt->sent == pt->flen);
+	if (complete && pt->verify)
+		complete = verify_file(pt);
+	cache_end(pt->fill, complete, pt->verify);	// Only verified copies answer Queries locally
+	pt->fill= NULL;
+	// End the fetch shared with other sessions
+	stream_finish(pt->stream, complete);
+	pt->stream= NULL;
+
 	// Free memory
-	if (pt->filename != NULL) {
-		free(pt->filename);
-		pt->filename= NULL;
+	intern_put(pt->filename);
+	pt->filename= NULL;
+	if (pt->servers != NULL) {
+		free(pt->servers);
+		pt->servers= NULL;
 	}
 	if (pt->sock6 != -1) {
 		close(pt->sock6);
 		pt->sock6 = -1;
 	}
-	Log("free_thread_state did not close socket IPv4\n");
-	// add the closing of socket to fileexchange IP4
-	// ????
+	if (pt->sock4 != -1) {
+		close(pt->sock4);
+		pt->sock4 = -1;
+	}
 
-	free(pt);
+	slab_free(thread_slab, pt);
 }
 
 
@@ -128,14 +234,14 @@ gboolean stop_thread(const char *filename, u_int16_t seq, gboolean called_from_G
 
 // Close all threads
 void close_all_threads(gboolean called_from_GUI) {
-	while (plist != NULL) {
-		thread_state *pt= (thread_state *)plist->data;
+	while (plist.head != NULL) {
+		thread_state *pt= (thread_state *)plist.head->data;
 		if (pt == NULL)
 			continue;
 		if ((pt->q != NULL) && (pt->q->thread != NULL))
 			pt->q->thread= NULL;
 		free_thread_state(pt, called_from_GUI);	// Clear the object and remove from the list
-		if ((plist != NULL) && (pt == plist->data)) {
+		if ((plist.head != NULL) && (pt == plist.head->data)) {
 			fprintf(stderr, "Internal error in close_all_threads()\n");
 			break;
 		}
@@ -148,36 +254,31 @@ void close_all_threads(gboolean called_from_GUI) {
 \*****************************************************************************************/
 
 
-// Create a connection to (ip,port) and return the socket TCP
-static int connect_to_ipv6_server(const char *ip, uint port) {
-	// Creates TCP socket
-	struct hostent *hp, *gethostbyname2();
-	struct sockaddr_in6 server;
+// Create a connection to the server and return the socket TCP, waiting up to 'timeout' ms for it
+// (0 - the system's limit); IPv4 servers are reached through their IPv4-mapped address
+int connect_to_ipv6_server(const hit_server *hs, long timeout) {
+	char str[HIT_SERVER_STRLEN];
+	struct timeval tv;
 	int sockTCP;
 
-	assert(ip != NULL);
-
-	/* Connect socket using the name specified in the command line. */
-	hp = gethostbyname2(ip, AF_INET6);
-	if (hp == 0) {
-		fprintf(stderr, "%s: unknown host\n", ip);
-		return -1;
-	}
-	server.sin6_family = AF_INET6;
-	server.sin6_flowinfo = 0;
-	server.sin6_port = htons(port);
-	bcopy(hp->h_addr, &server.sin6_addr, hp->h_length);
+	assert(hs != NULL);
 	// Creates TCP socket
 	sockTCP = init_socket_ipv6(SOCK_STREAM, 0, FALSE);
 	if (sockTCP < 0) {
 		Log("Failed opening IPv6 TCP socket\n");
 		return -1;
 	}
+	if (timeout > 0) {
+		// connect() gives up after the send timeout
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if (setsockopt(sockTCP, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+			perror("Failed setting the connection timeout");
+	}
 
-	if (connect(sockTCP, (struct sockaddr *) &server, sizeof(server)) < 0) {
+	if (connect(sockTCP, (struct sockaddr *) &hs->addr, sizeof(hs->addr)) < 0) {
 		perror("connecting stream socket");
-		fprintf(stderr, "Failed connecting IPv6 TCP socket to %s-%hu\n",
-				ip, port);
+		fprintf(stderr, "Failed connecting IPv6 TCP socket to %s\n", hit_server_str(hs, str));
 		close(sockTCP);
 		return -1;
 	}
@@ -185,77 +286,371 @@ static int connect_to_ipv6_server(const char *ip, uint port) {
 }
 
 
-// Connect to one file server, cycling through all hits received
-int connect_to_file_server(thread_state *state, const char *filename, u_int16_t seq) {
-	// Locate IPv6 server with file requested
-	const char *hits;
-	char hits_buf[512];
+// Write the server as text ("ip-port") in 'buf', with HIT_SERVER_STRLEN bytes; returns 'buf'
+char *hit_server_str(const hit_server *hs, char *buf) {
+	char ip[INET6_ADDRSTRLEN];
 
-	if (!GUI_get_Query_hits(filename, seq, FALSE/*IPv4*/, &hits)) {
-		// No hits available
-		return -1;
-	}
+	inet_ntop(AF_INET6, &hs->addr.sin6_addr, ip, sizeof(ip));
+	snprintf(buf, HIT_SERVER_STRLEN, "%s-%hu", ip, ntohs(hs->addr.sin6_port));
+	return buf;
+}
 
-	fprintf(stderr, "Filename='%s' Seq=%d Hits=%s\n", filename, seq, hits);
-	strncpy(hits_buf, hits, sizeof(hits_buf));
 
-	char *next = hits_buf, *pt, *ip;
-	int port;
-	int sock = -1;
-	do {
-		ip = next;
-		pt = strchr(ip, '-');
-		if (!pt) {
-			// Invalid hits format
-			return -1;
-		}
-		*pt = '\0';
-		port = strtol(pt + 1, &next, 10);
-		while ((next != NULL) && (*next==' '))
-			next++;	// Skip spaces
+// Record the server connected by the session, and show it in the GUI
+static void set_file_server(thread_state *state, const hit_server *hs) {
+	char str[HIT_SERVER_STRLEN];
 
-		printf("Trying connection to %s:%d\n", ip, port);
-		sock = connect_to_ipv6_server(ip, port);
+	hit_server_str(hs, str);
+	if (state->servers != NULL)
+		free(state->servers);
+	state->servers = strdup(str);
+	inet_ntop(AF_INET6, &hs->addr.sin6_addr, str, sizeof(str));
+	GUI_update_serv_details_Proxy(state->sock4, str, ntohs(hs->addr.sin6_port));
+}
 
-	} while ((sock < 0) && (next != NULL));
 
-	if (sock >= 0) {
-		// Update Proxy information
-		GUI_update_serv_details_Proxy(state->sock4, ip, port);
+// Connect to one file server, cycling through all hits received for the Query state->q,
+// the fastest known servers first, until the deadline of the connect phase
+int connect_to_file_server(thread_state *state) {
+	// Locate IPv6 server with file requested
+	hit_server servers[MAX_HIT_SERVERS];
+	char str[HIT_SERVER_STRLEN];
+	int i, n, sock = -1;
+
+	n = get_Query_hits(state->q, servers, MAX_HIT_SERVERS);
+	warm_rank_servers(servers, n);
+	fprintf(stderr, "Filename='%s' Seq=%d Hits=%d\n", state->q->name, state->q->seq, n);
+	reaper_enter(state, REAPER_CONNECT);
+	for (i = 0; (i < n) && (sock < 0) && (reaper_reaped(state) == REAPED_NONE); i++) {
+		printf("Trying connection to %s\n", hit_server_str(&servers[i], str));
+		sock = connect_to_ipv6_server(&servers[i], reaper_remaining(state));
+		if (sock < 0)
+			warm_server_failed(str);
 	}
+
+	if (sock >= 0)
+		set_file_server(state, &servers[i - 1]);	// Update Proxy information
 	return sock;
 }
 
 
+// Send a file request to a server; length > 0 - range request for bytes [offset, offset+length)
+gboolean write_file_request(int sock, uint16_t seq, const char *filename,
+		unsigned long long offset, unsigned long long length) {
+	char req[16 + 256 + 16], *pt = req;
+	int16_t namelen = strlen(filename), hdr_len = (length > 0) ? -namelen : namelen;
+
+	if (namelen > 256)
+		return FALSE;
+	WRITE_BUF(pt, &seq, sizeof(seq));
+	WRITE_BUF(pt, &hdr_len, sizeof(hdr_len));
+	WRITE_BUF(pt, filename, namelen);
+	if (length > 0) {
+		WRITE_BUF(pt, &offset, sizeof(offset));
+		WRITE_BUF(pt, &length, sizeof(length));
+	}
+	return write(sock, req, pt - req) == pt - req;
+}
+
+
 // Update the % transmitted on the GUI
 gboolean update_transf(thread_state *pt, int transf) {
+	if (!pt->first_byte && (pt->admitted > 0)) {
+		pt->first_byte = TRUE;
+		admission_sample(g_get_monotonic_time() - pt->admitted);
+	}
+	reaper_progress(pt);
 	if (!GUI_update_transf_Proxy(pt->sock4, transf))
 		printf("GUI update transfer failed\n");
 	return TRUE;
 }
 
 
+// Account 'n' bytes received from the server: hash them and store them in the cache and in
+// the shared fetch
+void store_block(thread_state *pt, const char *buf, int n) {
+	if (pt->verify)
+		pt->hash = fhash_update(pt->hash, buf, n);
+	cache_write(pt->fill, buf, n);
+	stream_append(pt->stream, buf, n);
+}
+
+
+// Send 'n' bytes of the file to the IPv4 client, storing them in the cache and in the shared
+// fetch, and updating the progress; returns FALSE if the client did not receive them
+gboolean deliver_block(thread_state *pt, const char *buf, int n) {
+	//forward it to fileexchange ipv4
+	if (write(pt->sock4, buf, n) != n) {
+		Log("ERROR - Not all data was forwarded to IPv4.\n");
+		pt->client_gone = TRUE;
+		return FALSE;
+	}
+	store_block(pt, buf, n);
+	pt->sent += n;
+
+	//percentage of the transfer
+	update_transf(pt, (int) (100 * pt->sent / pt->flen));
+	return TRUE;
+}
+
+
+// TRUE if 'sock' has data to read (or an end of file or error to report) within 'timeout' ms
+// (0 - without waiting, -1 - no limit)
+static gboolean sock_ready(int sock, int timeout) {
+	struct pollfd pfd = {sock, POLLIN, 0};
+
+	return poll(&pfd, 1, timeout) != 0;
+}
+
+
+// Relay the file from the IPv6 server to the IPv4 client one block at a time, from byte
+// pt->sent up to pt->flen: each block is read and then written
+// Returns TRUE if the session was handed over to another gateway process (hot restart)
+gboolean serial_relay(thread_state *pt) {
+	gboolean slow = get_checkbutton_Slow_state();	// get the slow state from the checkbox
+	char *buf;					// Data buffer borrowed from the buffer pool
+	int n= -1;
+
+	// Receive file from fileexchange ipv6 and forward it to fileexchange ipv4
+	while (active && (pt->sent < pt->flen)) {
+		// Stop at a block boundary if a new gateway process is taking over the sessions
+		if (handoff_requested && (pt->stream == NULL) && handoff_park(pt))
+			return TRUE;
+
+		// Waits for data from the server holding neither a turn nor a buffer, so a slow server
+		// does not keep them from the other sessions
+		if (!sock_ready(pt->sock6, 0)) {
+			srpt_yield(pt);
+			if (!sock_ready(pt->sock6, (options.stall_timeout > 0) ? options.stall_timeout : -1))
+				break;	// Stalled
+		}
+
+		// Waits for its turn, when sessions compete, before taking a buffer
+		if (!srpt_gate(pt, (long) pool_chunk_size(), TRUE))
+			break;
+
+		// Waits for a free buffer when the pool is exhausted, without reading from the server
+		buf = pool_get(&pt->pool_chunks);
+		if (buf == NULL)
+			break;
+
+		//received file from fileexchange ipv6
+		n = read(pt->sock6, buf, (int) MIN((unsigned long long) pool_chunk_size(), pt->flen - pt->sent));
+		if (n <= 0) {
+			pool_put(buf, &pt->pool_chunks);
+			break;
+		}
+
+		//forward it to fileexchange ipv4
+		if (!deliver_block(pt, buf, n)) {
+			pool_put(buf, &pt->pool_chunks);
+			break;
+		}
+		pool_put(buf, &pt->pool_chunks);
+
+		//to slow down the speed
+		if(slow){
+			usleep(SLOW_SLEEPTIME);
+		}
+	}
+	return FALSE;
+}
+
+
+// Make a read from the server fail after options.stall_timeout ms without data
+static void set_stall_timeout(int sock) {
+	struct timeval tv;
+
+	if (options.stall_timeout <= 0)
+		return;
+	tv.tv_sec = options.stall_timeout / 1000;
+	tv.tv_usec = (options.stall_timeout % 1000) * 1000;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+		perror("Failed setting the stall timeout");
+}
+
+
+// Replace the server that stopped sending the file (or stalled) by another one with the same
+// content, asking it for the rest with a range request: bytes [pt->sent, pt->flen)
+// Returns FALSE if no other server answered
+static gboolean failover(thread_state *pt, const char *conn_str) {
+	hit_server servers[MAX_HIT_SERVERS];
+	char str[HIT_SERVER_STRLEN];
+	char write_buf[256];
+	unsigned long long flen;
+	int i, n, sock;
+
+	if ((pt->q == NULL) || (pt->q->hit_flen == 0) || (pt->filename == NULL))
+		return FALSE;
+	if (pt->servers != NULL)
+		warm_server_failed(pt->servers);	// Tried last from now on
+	n = get_Query_hits(pt->q, servers, MAX_HIT_SERVERS);
+	warm_rank_servers(servers, n);
+	reaper_enter(pt, REAPER_CONNECT);
+	for (i = 0; active && (i < n) && (reaper_reaped(pt) == REAPED_NONE); i++) {
+		hit_server_str(&servers[i], str);
+		if ((servers[i].fhash != pt->q->hit_fhash) || (servers[i].flen != pt->q->hit_flen) ||
+				((pt->servers != NULL) && !strcmp(str, pt->servers)))
+			continue;	// Another content, or the server that failed
+		sock = connect_to_ipv6_server(&servers[i], reaper_remaining(pt));
+		if (sock < 0) {
+			warm_server_failed(str);
+			continue;
+		}
+		set_stall_timeout(sock);
+		if (!write_file_request(sock, pt->seq, pt->filename, pt->sent, pt->flen - pt->sent) ||
+				(read(sock, &flen, sizeof(flen)) != sizeof(flen)) || (flen != pt->q->hit_flen)) {
+			close(sock);
+			warm_server_failed(str);
+			continue;
+		}
+		int old = pt->sock6;
+		pt->sock6 = sock;
+		reaper_enter(pt, REAPER_TRANSFER);	// Watches the new socket before the old one is closed
+		close(old);
+		set_file_server(pt, &servers[i]);
+		sprintf(write_buf, "%sserver failed: resuming at byte %llu from %s\n", conn_str, pt->sent, str);
+		Log(write_buf);
+		return TRUE;
+	}
+	sprintf(write_buf, "%sserver failed at byte %llu, and no other server has the file\n", conn_str, pt->sent);
+	Log(write_buf);
+	return FALSE;
+}
+
+
+// Relay the file from the IPv6 server to the IPv4 client, from byte pt->sent up to pt->flen;
+// if the server fails, it goes on with the next server of the Query, up to options.failover_max
+// Returns TRUE if the session was handed over to another gateway process (hot restart)
+static gboolean relay_file(thread_state *pt, const char *conn_str) {
+	struct timeval 	tv1, tv2;	// To measure file transfer delay
+	struct timezone tz;			// Auxiliary variable
+	long diff;
+	int failovers = 0;
+
+	// Memorize the time when transmission starts
+	if (gettimeofday(&tv1, &tz))
+		Log("Error getting time\n");
+
+	set_thread_status(pt, S_TRANSF);	//THREAD status
+	if (pt->q != NULL)
+		set_query_state(pt->q, S_F_TRANSF);	//QUERY	status
+
+	if (options.spool) {
+		// Read the server at its own speed, keeping the bytes the client did not take yet
+		spooled_relay(pt, conn_str);
+	} else {
+		set_stall_timeout(pt->sock6);
+		do {
+			if (options.pipeline_depth > 0) {
+				// Read the server in another thread while the client is written
+				if (pipelined_relay(pt))
+					return TRUE;
+			} else if (serial_relay(pt))
+				return TRUE;
+			// The relay stopped early without a client failure: the server failed or stalled
+		} while (active && (pt->sent < pt->flen) && !pt->client_gone && (failovers++ < options.failover_max) &&
+				failover(pt, conn_str));
+	}
+
+	if (gettimeofday(&tv2, &tz)) {
+		g_print("%sError getting time\n", conn_str);
+		diff= 0;
+	} else
+		diff= (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+	g_print("%sproxy ended - lasted %ld usec (%llu/%llu bytes)\n", conn_str, diff, pt->sent, pt->flen);
+	return FALSE;
+}
+
+
+// Send the file held by the gateway in 'fd' (cache or local directory) to the IPv4 client, without
+// connecting to an IPv6 server
+static void serve_from_file(thread_state *pt, int fd, const char *conn_str) {
+	gboolean slow = get_checkbutton_Slow_state();
+	off_t off = 0;
+	ssize_t n;
+
+	if (!active || (write(pt->sock4, &pt->flen, sizeof(pt->flen)) != sizeof(pt->flen))) {
+		Log("ERROR: Sending length of file to IPv4.\n");
+		return;
+	}
+	set_thread_status(pt, S_TRANSF);
+	if (pt->q != NULL)
+		set_query_state(pt->q, S_F_TRANSF);
+	while (active && (pt->sent < pt->flen)) {
+		if (!srpt_gate(pt, (long) pool_chunk_size(), TRUE))
+			break;
+		n = sendfile(pt->sock4, fd, &off, MIN((unsigned long long) pool_chunk_size(), pt->flen - pt->sent));
+		if (n <= 0) {
+			Log("ERROR - Not all data was forwarded to IPv4.\n");
+			break;
+		}
+		pt->sent += n;
+		update_transf(pt, (int) (100 * pt->sent / pt->flen));
+		if (slow)
+			usleep(SLOW_SLEEPTIME);
+	}
+	g_print("%sserved by the gateway (%llu/%llu bytes)\n", conn_str, pt->sent, pt->flen);
+}
+
+
+// Send the file fetched by another session to the IPv4 client, reading the shared spool
+// Returns FALSE if that fetch failed before any data arrived: the caller fetches the file
+static gboolean serve_from_stream(thread_state *pt, shared_stream *ss, const char *conn_str) {
+	gboolean slow = get_checkbutton_Slow_state();
+	off_t off = 0;
+	long long avail;
+	ssize_t n;
+
+	if (stream_wait(ss, 0) < 0)
+		return FALSE;
+	if (!active || (write(pt->sock4, &pt->flen, sizeof(pt->flen)) != sizeof(pt->flen))) {
+		Log("ERROR: Sending length of file to IPv4.\n");
+		return TRUE;
+	}
+	set_thread_status(pt, S_TRANSF);
+	if (pt->q != NULL)
+		set_query_state(pt->q, S_F_TRANSF);
+	while (active && (pt->sent < pt->flen)) {
+		avail = stream_wait(ss, pt->sent);
+		if (avail <= 0) {
+			Log("ERROR - The shared fetch ended before the end of the file.\n");
+			break;
+		}
+		if (!srpt_gate(pt, (long) pool_chunk_size(), TRUE))
+			break;
+		n = sendfile(pt->sock4, stream_fd(ss), &off, MIN((long long) pool_chunk_size(), avail));
+		if (n <= 0) {
+			Log("ERROR - Not all data was forwarded to IPv4.\n");
+			break;
+		}
+		pt->sent += n;
+		update_transf(pt, (int) (100 * pt->sent / pt->flen));
+		if (slow)
+			usleep(SLOW_SLEEPTIME);
+	}
+	g_print("%sserved from a shared fetch (%llu/%llu bytes)\n", conn_str, pt->sent, pt->flen);
+	return TRUE;
+}
+
+
 // Function that implements the thread function:
 //		it implements all communications between client fileexchange IPv4 and server fileexchange IPv6
+//		(or, for connections to the IPv6 clients' socket, between an IPv6 client and an IPv4 server)
 //		ptr - pointer to the thread state object
 void *proxy_function(void *ptr) {
 	assert(ptr != NULL);
 	thread_state *pt= (thread_state *)ptr;
-	gboolean slow = get_checkbutton_Slow_state();	// get the slow state from the checkbox
 
 	char conn_str[20];		// Temporary buffer with the thread name
 	char write_buf[256];	// Write temporary buffer for logging
-	char buf[FILE_BUFLEN];				// Temporary data buffer for file transfer
-
-	struct timeval 	tv1, tv2; // To measure file transfer delay
-	struct timezone tz;		  // Auxiliary variable
+	char buf[FILE_BUFLEN];	// Temporary data buffer for the request
 
 	uint16_t seq;				// Request header variable - sequence number
 	int16_t namelen;			// Request header variable - namelength
-	unsigned long long flen;	//File Length -- ADICIONEI VERIFICAR SE FIZ BEM EM CRIAR UMA NOVA OU REUTILIZO A DE BAIXO
-	unsigned long long f_diff;
-	long diff;					// % of bytes received
-	int n= -1;
+	gboolean ranged;			// Range request (negative namelength)
+	unsigned long long offset= 0, length= 0;	// Range requested
+	unsigned long long flen;	// File length
 	Query *q= NULL;
 
 	sprintf(conn_str, "th(%d): ", pt->sock4);
@@ -266,10 +661,9 @@ void *proxy_function(void *ptr) {
 	}
 
 	// ############ part of TASK 10 ############
-	// Configure your socket IPv4 to define a timeout time for reading operations and
-	// to set buffers or other any configuration that maximizes throughput
-	//	e.g. SO_SNDBUF, SO_RECVBUF, timeout, etc.
-	// ???
+	// The reaper limits each phase of the session: the request header, the server connection,
+	// the first byte and the idle time during the transfer (see reaper.h)
+	reaper_enter(pt, REAPER_HEADER);
 
 	// Read seq
 	if (!active || (read(pt->sock4, &seq, sizeof(seq)) != sizeof(seq))) {
@@ -288,7 +682,10 @@ void *proxy_function(void *ptr) {
 		free_thread_state(pt, FALSE);
 		pthread_exit(NULL);
 	}
-	if (namelen > 256) {
+	ranged= (namelen < 0);
+	if (ranged)
+		namelen= -namelen;
+	if ((namelen <= 0) || (namelen > 256)) {
 		sprintf(write_buf, "%sInvalid filename's length (%d)\n", conn_str, namelen);
 		Log(write_buf);
 
@@ -296,171 +693,228 @@ void *proxy_function(void *ptr) {
 		pthread_exit(NULL);
 	}
 
-	// ############ TASK 7 ############
-	// Complete this function to implement the communication between the two fileexchanges IPv4 and IPv6,
-	//  forwarding the signaling messages and file contents, and validating the signaling contents.
-	//  You may need to add extra fields to the thread_state structure
-
-	// Read filename
-	// ???
-	// (do not forget to use an existing buffer to receive the filename)
-	//buf = (char *) malloc(namelen + 1);
-
 	// Read filename
 	if (!active || (read(pt->sock4, buf, namelen) != namelen)) {
-		sprintf(write_buf, "%sInvalid filename %s\n", conn_str, buf);
+		sprintf(write_buf, "%sInvalid filename\n", conn_str);
 		Log(write_buf);
 
 		free_thread_state(pt, FALSE);
 		pthread_exit(NULL);
 	}
+	buf[namelen]= '\0';
 
+	// Read the range
+	if (ranged && (!active || (read(pt->sock4, &offset, sizeof(offset)) != sizeof(offset)) ||
+			(read(pt->sock4, &length, sizeof(length)) != sizeof(length)) || (length == 0))) {
+		sprintf(write_buf, "%sInvalid range request\n", conn_str);
+		Log(write_buf);
+
+		free_thread_state(pt, FALSE);
+		pthread_exit(NULL);
+	}
 
 	// Update Proxy client information
-	// use GUI_update_cli_details_Proxy(filename, seq, pt->sock4, addr_ipv6(&pt->cli_ip), pt->cli_port);
 	GUI_update_cli_details_Proxy(buf, seq, pt->sock4, addr_ipv6(&pt->cli_ip), pt->cli_port);
-	Log("GUI client UPDATED\n");
+	reaper_enter(pt, REAPER_FIRST_BYTE);
 
 	// Locate the Query state associated with the connection
-	// q= locate_in_QueryList_IP(filename, seq, FALSE);
 	// and update the state on both structures to store the association - Query e Thread
-	//filename is on buf
-	q = locate_in_QueryList_IP(buf, seq, FALSE);
-	pt->status = ACTIVE4_STATE;
-
-	// Connect to fileexchange on IPv6, creating socket pt->sock6.
-	// use connect_to_file_server(pt, filename, seq);
-	pt->sock6 = connect_to_file_server(pt, buf, seq);
-	stop_query_timer(q);
-	pt->status = ACTIVE6_STATE;
-	q->state = S_CONNECT;
-	Log("Established Connection with sock6 \n");
-
-	// ############ part of TASK 10 ############
-	// Configure your socket IPv4 to define a timeout time for reading operations and
-	// to set buffers or other any configuration that maximizes throughput
-	//	e.g. SO_SNDBUF, SO_RECVBUF, timeout, etc.
-	// ???
-
-
-	// Update state
-	// update_thread_state(pt, pt->sock6, filename, seq);
-	update_thread_state(pt, pt->sock6, buf, seq);
-
-	// Send request to IPv6 filexchange
-	// ???
-	if (!active || (write(pt->sock6, &seq, sizeof(seq)) != sizeof(seq))) {
-		Log("Couldn't write seq on Socket6.\n");
+	q = locate_in_QueryList_client(buf, seq, pt->cli_ipv6, &pt->cli_ip);
+	if (q == NULL) {
+		sprintf(write_buf, "%sNo pending Query for '%s'(%hu)\n", conn_str, buf, seq);
+		Log(write_buf);
 
 		free_thread_state(pt, FALSE);
 		pthread_exit(NULL);
-		return FALSE;
-
 	}
+	pt->q = q;
+	q->thread = pt;
+	set_thread_status(pt, ACTIVE4_STATE);
+	stop_query_timer(q);
 
-	if(!active || (write(pt->sock6, &namelen, sizeof(namelen)) != sizeof(namelen))){
-		Log("Couldn't write File Length of file.\n");
+	// Serve the file from the content cache or the local directory, if the content announced in
+	// the Hit is there
+	int fd = -1;
+	gboolean cached = FALSE;
+	if (!ranged && (q->hit_flen > 0)) {
+		fd = cache_open(buf, q->hit_fhash, q->hit_flen);
+		cached = (fd >= 0);
+		if (!cached)
+			fd = local_open(buf, q->hit_fhash, q->hit_flen);
+	}
+	if (fd >= 0) {
+		update_thread_state(pt, -1, buf, seq);
+		pt->flen = q->hit_flen;
+		pt->sent = 0;
+		serve_from_file(pt, fd, conn_str);
+		close(fd);
+		if (cached)
+			cache_served(pt->sent);
+		else
+			local_served(pt->sent);
 
 		free_thread_state(pt, FALSE);
-		pthread_exit(NULL);
-		return FALSE;
+		return NULL;
 	}
-	if(!active || (write(pt->sock6, buf, namelen) != namelen)){
-		Log("Couldn't write File Name of file.\n");
 
-		free_thread_state(pt, FALSE);
-		pthread_exit(NULL);
-		return FALSE;
+	// Join a running fetch of the same content, or become the owner of a new one
+	gboolean owner = FALSE;
+	pt->sent = 0;
+	shared_stream *ss = (!ranged && options.coalesce && (q->hit_flen > 0)) ?
+			stream_attach(buf, q->hit_fhash, q->hit_flen, &pt->sent, &owner) : NULL;
+	if ((ss != NULL) && !owner) {
+		update_thread_state(pt, -1, buf, seq);
+		pt->flen = q->hit_flen;
+		gboolean served = serve_from_stream(pt, ss, conn_str);
+		stream_detach(ss, &pt->sent);
+		if (served) {
+			free_thread_state(pt, FALSE);
+			return NULL;
+		}
+		stream_fallback();
+		ss = NULL;
+	}
+	pt->stream = ss;
+
+	// Fetch a large file in ranges from several servers at once
+	if (!ranged && (options.segment_min > 0) && (q->hit_flen >= (unsigned long long) options.segment_min)) {
+		hit_server servers[MAX_HIT_SERVERS];
+		int n = get_Query_hits(q, servers, CLAMP(options.segment_servers, 1, MAX_HIT_SERVERS));
+		if (n >= 2) {
+			update_thread_state(pt, -1, buf, seq);
+			pt->flen = q->hit_flen;
+			pt->sent = 0;
+			pt->fill = cache_begin(buf, q->hit_fhash, pt->flen);
+			pt->verify = options.verify;
+			pt->fhash = q->hit_fhash;
+			set_thread_status(pt, ACTIVE6_STATE);
+			set_query_state(q, S_CONNECT);
+			prefetch_drop(q);
+			if (segmented_relay(pt, servers, n, conn_str) >= 0) {
+				free_thread_state(pt, FALSE);
+				return NULL;
+			}
+			// No server answered the range requests: fetch it from one server
+			cache_end(pt->fill, FALSE, FALSE);
+			pt->fill = NULL;
+			pt->verify = FALSE;
+		}
 	}
 
-	// Receive the file length from the IPv6 filexchange
-	// ???
-	if (!active || (read(pt->sock6, &flen, sizeof(unsigned long long)) != sizeof(unsigned long long))) {
-		sprintf(write_buf, "%sInvalid filename %s\n", conn_str, buf);
-		Log(write_buf);
+	// Take over the connection opened when the Hit was relayed, with the bytes already read
+	char *pre_data = NULL;		// File bytes read before the client connected
+	size_t pre_len = 0;
+	hit_server pre_server;
+	int sock = ranged ? -1 : prefetch_take(q, &flen, &pre_data, &pre_len, &pre_server);
+	if (sock >= 0) {
+		update_thread_state(pt, sock, buf, seq);
+		reaper_enter(pt, REAPER_FIRST_BYTE);
+		set_file_server(pt, &pre_server);
+		set_thread_status(pt, ACTIVE6_STATE);
+		set_query_state(q, S_CONNECT);
+	} else {
+		// Connect to fileexchange on IPv6, creating socket pt->sock6.
+		update_thread_state(pt, connect_to_file_server(pt), buf, seq);
+		if (pt->sock6 < 0) {
+			sprintf(write_buf, "%sFailed connecting to the file servers\n", conn_str);
+			Log(write_buf);
 
-		free_thread_state(pt, FALSE);
-		pthread_exit(NULL);
+			free_thread_state(pt, FALSE);
+			pthread_exit(NULL);
+		}
+		reaper_enter(pt, REAPER_FIRST_BYTE);
+		set_thread_status(pt, ACTIVE6_STATE);
+		set_query_state(q, S_CONNECT);
+
+		// Send request to IPv6 filexchange
+		if (!active || !write_file_request(pt->sock6, seq, buf, offset, length)) {
+			sprintf(write_buf, "%sCouldn't send the request to the IPv6 server\n", conn_str);
+			Log(write_buf);
+
+			free_thread_state(pt, FALSE);
+			pthread_exit(NULL);
+		}
+
+		// Receive the file length from the IPv6 filexchange
+		if (!active || (read(pt->sock6, &flen, sizeof(flen)) != sizeof(flen))) {
+			sprintf(write_buf, "%sDid not receive the length of %s\n", conn_str, buf);
+			Log(write_buf);
+
+			free_thread_state(pt, FALSE);
+			pthread_exit(NULL);
+		}
 	}
 
 	// Send length to IPv4 filexchange
-	// ???
 	if(!active || (write(pt->sock4, &flen, sizeof(flen)) != sizeof(flen))){
 		Log("ERROR: Sending length of file to IPv4.\n");
 
+		free(pre_data);
 		free_thread_state(pt, FALSE);
 		pthread_exit(NULL);
-		return FALSE;
 	}
 
 	// Test if file is empty
-	// ???
-
 	if(flen == 0){
 		Log("This file doesn't exist.\n");
-		return FALSE;
+
+		free(pre_data);
+		free_thread_state(pt, FALSE);
+		return NULL;
+	}
+	pt->flen = flen;
+	pt->sent = 0;
+	if (ranged) {
+		// The server sends the bytes [offset, offset+length) of the file
+		pt->sent = MIN(offset, flen);
+		pt->flen = (length > flen - pt->sent) ? flen : pt->sent + length;
+	} else if (flen == q->hit_flen) {
+		// Store a copy in the content cache and share the fetch, when the server sends the
+		// length announced in the Hit, and verify it against the hash in the Hit
+		pt->fill = cache_begin(buf, q->hit_fhash, flen);
+		pt->verify = options.verify;
+		pt->fhash = q->hit_fhash;
+	} else {
+		stream_finish(pt->stream, FALSE);	// The sessions waiting for it fetch the file themselves
+		pt->stream = NULL;
 	}
 
-	// Memorize the time when transmission starts
-	if (gettimeofday(&tv1, &tz))
-		Log("Error getting time\n");
+	// Send the bytes read before the client connected
+	gboolean delivered = (pre_len == 0) || deliver_block(pt, pre_data, (int) pre_len);
+	free(pre_data);
+	if (!delivered) {
+		free_thread_state(pt, FALSE);
+		return NULL;
+	}
 
 	// Receive file from fileexchange ipv6 and forward it to fileexchange ipv4
-	// See the file copy example in the documentation, and adapt to a socket scenario ...
-	// do { // Loop forever until end of file
-	//		n = read(pt->sock6, buf, FILE_BUFLEN);
-	//  	...
-	// 		update the % of file transmitted using: update_transf(pt, percent);
-	//					percent should be a value between 0 and 100.
-	//  	...
-	//		if (slow)
-	//			usleep(SLOW_SLEEPTIME);
-	//  } while (active && (n > 0) && ????);
-	pt->status = S_TRANSF;			//THREAD status
-	q->state = S_F_TRANSF;			//QUERY	status
-
-	u_int transf = 0;
-
-	do{
-		//received file from fileexchange ipv6
-		n = read(pt->sock6, buf, FILE_BUFLEN);
-		Log("File received from ipv6.\n");
-		f_diff += n;
+	unsigned long long first = pt->sent;
+	gint64 started = g_get_monotonic_time();
+	if (relay_file(pt, conn_str))
+		Log("Session handed over to the new gateway process\n");
+	else if ((pt->sent == pt->flen) && (pt->sent > first))
+		warm_server_result(pt->servers, pt->sent - first, g_get_monotonic_time() - started);
 
-		//forward it to fileexchange ipv4
-		if(write(pt->sock4, buf, n) != n){
-			Log("ERROR - Not all data was forwarded to IPv4.\n");
-
-			free_thread_state(pt, FALSE);
-			pthread_exit(NULL);
-			return FALSE;
-		}
-		Log("Sending file to ipv4.\n");
-
-		transf = (float) ((float)f_diff/(float)flen) * 100;
-
-		//percentage of the transfer
-		update_transf(pt, (int) transf);
-		//gboolean GUI_update_transf_Proxy(u_int TCPsock, u_int transf);
-		GUI_update_transf_Proxy(pt->sock4, transf);
-
-		//to slow down the speed
-		if(slow){
-			usleep(SLOW_SLEEPTIME);
-		}
+	// Wrap up
+	free_thread_state(pt, FALSE);
 
-	}while(active && (n > 0));
+	return NULL;
+}
 
 
-	if (gettimeofday(&tv2, &tz)) {
-		g_print("%sError getting time\n", conn_str);
-		diff= 0;
-	} else
-		diff= (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
-	g_print("%sproxy ended - lasted %ld usec\n", conn_str, diff);
+// Function that implements the thread function of a session received from another
+// gateway process (hot restart): it resumes the relay at byte pt->sent
+void *proxy_resume_function(void *ptr) {
+	assert(ptr != NULL);
+	thread_state *pt= (thread_state *)ptr;
+	char conn_str[20];
 
-	// Wrap up
+	sprintf(conn_str, "th(%d): ", pt->sock4);
+	if (active && (pt->self == pt)) {
+		reaper_enter(pt, REAPER_TRANSFER);
+		if (relay_file(pt, conn_str))
+			Log("Session handed over to the new gateway process\n");
+	}
 	free_thread_state(pt, FALSE);
-
 	return NULL;
 }
@@ -5,6 +5,7 @@
  * proxy_thread.h
  *
  * Header file of functions that implement the proxy threads, which bind IPv4 clients to IPv6 servers
+ *    and, through a second listening socket, IPv6 clients to IPv4 servers
  *
  * Updated on August 26, 2022
  * @author  Luis Bernardo
@@ -13,32 +14,75 @@
 #ifndef PROXY_THREAD_H_
 #define PROXY_THREAD_H_
 
+#include <pthread.h>
+
 #define SLOW_SLEEPTIME	500000	// Sleep time between reads and writes in slow sending
 #define FILE_BUFLEN 8000		// Buffer size used to transmit data - you can try to optimize this value ...
+#define MAX_HIT_SERVERS	16		// Maximum number of servers used for one file
+
+// File request: [seq u16][namelen i16][name]; the server answers [flen u64][file]
+// Range request: [seq u16][-namelen i16][name][offset u64][length u64]; the server answers
+//    [flen u64] followed by up to 'length' bytes starting at byte 'offset'
 
 
 // Status values of a proxy thread
 typedef enum {INITIAL_STATE, ACTIVE4_STATE ,ACTIVE6_STATE, REQUEST_IPV6, S_TRANSF } thread_status;
 
 
+// File server announced in a Hit
+typedef struct hit_server {
+	struct sockaddr_in6 addr;	// Server address (IPv4-mapped for IPv4 servers) and TCP port
+	unsigned long long flen;	// File length announced
+	uint32_t fhash;				// File hash announced
+} hit_server;
+
+#define HIT_SERVER_STRLEN	(INET6_ADDRSTRLEN + 8)	// Length of a server as text ("ip-port")
+
 // Thread state
+// Allocated from a slab; the fields are ordered by size to avoid padding
 typedef struct thread_state {
-	thread_status status;	// Status of the thread
-	int sock4;				// socket to TCP IPv4 client
-	struct in6_addr cli_ip; // IPv4 address
-	ushort cli_port;		// IPv4 port
+	GList link;				// Link in plist (data points to the thread state)
 	struct Query *q;		// Pointer to Query descriptor
-
 	pthread_t tid;			// Thread id
+	const char *filename;	// filename requested (interned)
+	struct thread_state *self;	// wealth checking self-pointer
 
-	char *filename;			// filename requested
+	// you can add more elements to this structure if you need ...
+	struct cache_fill *fill;	// Copy of the file being stored in the content cache
+	struct shared_stream *stream;	// Fetch shared with other sessions (owner only)
+	struct srpt_entry *srpt;	// Entry in the relay scheduler (NULL - not scheduled yet)
+	struct reaper_entry *reaper;	// Deadlines of the session (NULL - not watched)
+	char *servers;			// Servers that sent the file ("ip-port", separated by spaces)
+	unsigned long long flen;	// File length
+	unsigned long long sent;	// Bytes already forwarded to the client
+	gint64 admitted;		// Time the admission control started it (0 - not admitted, no slot)
+
+	struct in6_addr cli_ip; // Client address (IPv4-mapped for IPv4 clients)
+	thread_status status;	// Status of the thread
+	int sock4;				// socket to TCP IPv4 client (or IPv6 client, if cli_ipv6)
+	int sock6;				// socket to IPv6 server (or IPv4 server, if cli_ipv6)
+	uint32_t trace_id;		// Identifier in the lifecycle trace
+	int pool_chunks;		// Buffer pool chunks held by the session
+	uint32_t fhash;			// Hash announced in the Hit
+	uint32_t hash;			// Hash of the bytes relayed
+	gboolean cli_ipv6;		// Client in the IPv6 domain, relayed from an IPv4 server
+	gboolean parked;		// Relay stopped at a block boundary during a hot restart
+	gboolean handed_off;	// Session transferred to another gateway process
+	gboolean verify;		// Verify the relayed bytes against the hash announced in the Hit
+	gboolean spooling;		// Relay reading the server ahead of the client (not handed over)
+	gboolean first_byte;	// Time to the first byte accounted in the admission control
+	gboolean client_gone;	// Writing to the client failed
 	uint16_t seq;			// Sequence number
-	int sock6;				// socket to IPv6 server
+	ushort cli_port;		// Client port
+} thread_state;
 
-	// you can add more elements to this structure if you need ...
 
-	struct thread_state *self;	// wealth checking self-pointer
-} thread_state;
+/*********************\
+|* Global variables  *|
+\*********************/
+
+extern GQueue plist;	// List of active proxy threads
+extern pthread_mutex_t plist_mutex;	// Locks plist: the threads unlink themselves when they end
 
 
 /******************************************\
@@ -47,6 +91,8 @@ typedef struct thread_state {
 
 // Create a new thread state object
 thread_state *new_thread_state(int sock4, struct sockaddr_in6 *cli_addr);
+// Change the thread status, recording the transition in the lifecycle trace
+void set_thread_status(thread_state *pt, thread_status status);
 // Update the information about the IPv6 server
 void update_thread_state(thread_state *pt, int sock6, const char *fname, u_int16_t seq);
 // Search for thread_state descriptor in plist using the filename and sequence number
@@ -65,11 +111,35 @@ void close_all_threads(gboolean called_from_GUI);
 |* Functions that implement the proxy and handle the communication between IPv4 and IPv6 *|
 \*****************************************************************************************/
 
-// Connect to one file server, cycling through all hits received
-int connect_to_file_server(thread_state *state, const char *filename, u_int16_t seq);
+// Write the server as text ("ip-port") in 'buf', with HIT_SERVER_STRLEN bytes; returns 'buf'
+char *hit_server_str(const hit_server *hs, char *buf);
+// Create a connection to the server and return the socket TCP (-1 - failed), waiting up to
+// 'timeout' ms for it (0 - the system's limit)
+int connect_to_ipv6_server(const hit_server *hs, long timeout);
+// Connect to one file server, cycling through all hits received for the Query state->q
+int connect_to_file_server(thread_state *state);
+// Send a file request to a server; length > 0 - range request for bytes [offset, offset+length)
+gboolean write_file_request(int sock, uint16_t seq, const char *filename,
+		unsigned long long offset, unsigned long long length);
+// Account 'n' bytes received from the server: hash them and store them in the cache and in
+// the shared fetch
+void store_block(thread_state *pt, const char *buf, int n);
+// Send 'n' bytes of the file to the IPv4 client, storing them in the cache and in the shared
+// fetch, and updating the progress; returns FALSE if the client did not receive them
+gboolean deliver_block(thread_state *pt, const char *buf, int n);
+// Update the % transmitted on the GUI
+gboolean update_transf(thread_state *pt, int transf);
+// Relay the file from the IPv6 server to the IPv4 client one block at a time, from byte
+// pt->sent up to pt->flen: each block is read and then written
+// Returns TRUE if the session was handed over to another gateway process (hot restart)
+gboolean serial_relay(thread_state *pt);
 // Function that implements the thread function:
 //		it implements all communications between client fileexchange IPv4 and server fileexchange IPv6
+//		(or, for connections to the IPv6 clients' socket, between an IPv6 client and an IPv4 server)
 //		ptr - pointer to the thread state object
 void *proxy_function(void *ptr);
+// Thread function of a session received from another gateway process (hot restart):
+//		resumes the relay at byte pt->sent
+void *proxy_resume_function(void *ptr);
 
 #endif /* PROXY_THREAD_H_ */
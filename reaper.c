@@ -0,0 +1,427 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * reaper.c
+ *
+ * Session reaper
+ *
+ * The deadlines of all the sessions are kept in one binary heap, ordered by
+ *    time, and a single thread sleeps until the first one. Progress during the
+ *    transfer is only recorded in the session's entry, without locking: when
+ *    a transfer deadline comes, the reaper checks the last progress and moves
+ *    the deadline forward if the session is still sending. A session is
+ *    reaped by shutting down its sockets, which makes its blocked reads and
+ *    writes fail; the session thread then ends and frees it as usual.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "affinity.h"
+#include "options.h"
+#include "reaper.h"
+
+// Session watched by the reaper
+typedef struct reaper_entry {
+	thread_state *pt;				// Session
+	gint64 deadline;				// Time (us) of the next check, when in the heap
+	gint64 phase_end;				// Deadline of the header, connect or first byte phase (0 - none)
+	gint64 last_progress;			// Time of the last bytes sent (written by the session only)
+	unsigned long long bytes;		// Bytes sent to the client (written by the session only)
+	gint64 window_start;			// Start of the throughput window
+	unsigned long long window_bytes;	// Bytes sent at the start of the window
+	int index;						// Position in the heap (-1 - not in it)
+	int sock4, sock6;				// Sockets shut down if it is reaped
+	reaper_phase phase;				// Current phase
+	gboolean held;					// Waiting for the gateway: no deadlines
+	reaped_reason reason;			// Why it was reaped (REAPED_NONE - alive)
+} reaper_entry;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t reaper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond;		// Signalled when the first deadline changes
+static pthread_t reaper_tid;
+static gboolean running = FALSE;
+static reaper_entry **heap = NULL;		// Entries with a deadline, the first one at the top
+static int n_heap = 0, heap_size = 0;
+static reaper_stats stats;
+
+static const char *reason_str[REAPED_REASONS] = { "", "no request from the client", "no connection to a server",
+		"no data from the server", "idle", "below the minimum throughput" };
+
+
+// Time limit of the phase, from the options (ms; 0 - none)
+static long phase_timeout(reaper_phase phase) {
+	switch (phase) {
+	case REAPER_HEADER:		return options.header_timeout;
+	case REAPER_CONNECT:	return options.connect_timeout;
+	case REAPER_FIRST_BYTE:	return options.first_byte_timeout;
+	default:				return options.idle_timeout;
+	}
+}
+
+
+/**********************\
+|*  Heap of deadlines  *|
+\**********************/
+
+// Put the entry at position i
+static void heap_set(int i, reaper_entry *e) {
+	heap[i] = e;
+	e->index = i;
+}
+
+// Move the entry at position i up to its place
+static void heap_up(int i) {
+	reaper_entry *e = heap[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (heap[parent]->deadline <= e->deadline)
+			break;
+		heap_set(i, heap[parent]);
+		i = parent;
+	}
+	heap_set(i, e);
+}
+
+// Move the entry at position i down to its place
+static void heap_down(int i) {
+	reaper_entry *e = heap[i];
+
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= n_heap)
+			break;
+		if ((child + 1 < n_heap) && (heap[child + 1]->deadline < heap[child]->deadline))
+			child++;
+		if (e->deadline <= heap[child]->deadline)
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, e);
+}
+
+// Remove the entry from the heap, if it is there
+static void heap_remove(reaper_entry *e) {
+	int i = e->index;
+	reaper_entry *last;
+
+	if (i < 0)
+		return;
+	e->index = -1;
+	if (--n_heap == i)
+		return;
+	last = heap[n_heap];	// Fills the hole
+	heap_set(i, last);
+	heap_up(i);
+	heap_down(last->index);
+}
+
+// Set the time of the next check of the entry (0 - none), waking the reaper if it comes first;
+// called with reaper_mutex locked
+static void schedule(reaper_entry *e, gint64 deadline) {
+	if (deadline == 0) {
+		heap_remove(e);
+		return;
+	}
+	if (e->index < 0) {
+		if (n_heap == heap_size) {
+			int size = MAX(64, 2 * heap_size);
+			reaper_entry **h = (reaper_entry **) realloc(heap, size * sizeof(reaper_entry *));
+			if (h == NULL)
+				return;		// Not watched until its next phase
+			heap = h;
+			heap_size = size;
+		}
+		e->deadline = deadline;
+		heap_set(n_heap++, e);
+		heap_up(e->index);
+	} else {
+		e->deadline = deadline;
+		heap_up(e->index);
+		heap_down(e->index);
+	}
+	if (e->index == 0)
+		pthread_cond_signal(&reaper_cond);
+}
+
+
+/*************\
+|*  Reaping  *|
+\*************/
+
+// Time of the next check of the entry (0 - none)
+static gint64 next_deadline(reaper_entry *e) {
+	gint64 idle, rate;
+
+	if (e->held)
+		return 0;
+	if (e->phase != REAPER_TRANSFER)
+		return e->phase_end;
+	idle = (options.idle_timeout > 0) ?
+			__atomic_load_n(&e->last_progress, __ATOMIC_RELAXED) + 1000LL * options.idle_timeout : 0;
+	rate = (options.min_rate > 0) ? e->window_start + 1000LL * REAPER_RATE_WINDOW : 0;
+	if ((idle == 0) || (rate == 0))
+		return MAX(idle, rate);
+	return MIN(idle, rate);
+}
+
+// Check the entry whose deadline came: returns why it must be reaped, or REAPED_NONE after
+// moving its deadline forward; called with reaper_mutex locked
+static reaped_reason check_entry(reaper_entry *e, gint64 now) {
+	if (e->phase != REAPER_TRANSFER)
+		return REAPED_HEADER + (e->phase - REAPER_HEADER);
+
+	gint64 last = __atomic_load_n(&e->last_progress, __ATOMIC_RELAXED);
+	unsigned long long bytes = __atomic_load_n(&e->bytes, __ATOMIC_RELAXED);
+	if ((options.idle_timeout > 0) && (now >= last + 1000LL * options.idle_timeout))
+		return REAPED_IDLE;
+	if ((options.min_rate > 0) && (now >= e->window_start + 1000LL * REAPER_RATE_WINDOW)) {
+		if ((bytes - e->window_bytes) * 1000000ULL < (unsigned long long) options.min_rate * (now - e->window_start))
+			return REAPED_SLOW;
+		e->window_start = now;
+		e->window_bytes = bytes;
+	}
+	schedule(e, next_deadline(e));
+	return REAPED_NONE;
+}
+
+// Reaper thread: sleeps until the first deadline and reaps the sessions that missed theirs
+static void *reaper_thread(void *ptr) {
+	char tmp[200];
+
+	pthread_mutex_lock(&reaper_mutex);
+	while (running) {
+		gint64 now = g_get_monotonic_time();
+
+		if ((n_heap > 0) && (heap[0]->deadline <= now)) {
+			reaper_entry *e = heap[0];
+			reaped_reason reason = check_entry(e, now);
+			if (reason == REAPED_NONE)
+				continue;
+			heap_remove(e);
+			e->reason = reason;
+			stats.reaped[reason]++;
+			// Makes the session's blocked reads and writes fail
+			if (e->sock4 >= 0)
+				shutdown(e->sock4, SHUT_RDWR);
+			if (e->sock6 >= 0)
+				shutdown(e->sock6, SHUT_RDWR);
+			snprintf(tmp, sizeof(tmp), "th(%d): session reaped - %s\n", e->sock4, reason_str[reason]);
+			pthread_mutex_unlock(&reaper_mutex);
+			Log(tmp);
+			pthread_mutex_lock(&reaper_mutex);
+			continue;
+		}
+
+		if (n_heap == 0)
+			pthread_cond_wait(&reaper_cond, &reaper_mutex);
+		else {
+			struct timespec deadline;
+			gint64 wait = heap[0]->deadline - now;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += wait / 1000000;
+			deadline.tv_nsec += (wait % 1000000) * 1000;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&reaper_cond, &reaper_mutex, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&reaper_mutex);
+	return NULL;
+}
+
+
+/*********************\
+|*  Public functions  *|
+\*********************/
+
+// Start the reaper thread. Called when the gateway starts
+gboolean reaper_init(void) {
+	pthread_condattr_t attr;
+
+	if (running)
+		return TRUE;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);	// Same clock as the deadlines
+	pthread_cond_init(&reaper_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	running = TRUE;
+	if (affinity_thread_create(&reaper_tid, -1, reaper_thread, NULL) != 0) {
+		Log("ERROR - Failed starting the session reaper; sessions have no deadlines\n");
+		running = FALSE;
+		pthread_cond_destroy(&reaper_cond);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Stop the reaper thread, after all the sessions ended
+void reaper_close(void) {
+	if (!running)
+		return;
+	pthread_mutex_lock(&reaper_mutex);
+	running = FALSE;
+	pthread_cond_signal(&reaper_cond);
+	pthread_mutex_unlock(&reaper_mutex);
+	pthread_join(reaper_tid, NULL);
+	pthread_cond_destroy(&reaper_cond);
+}
+
+
+// Start the phase of the session, with the deadline set in the options for it (none if it is 0);
+// the sockets the session holds at the time are the ones shut down if it is reaped
+void reaper_enter(thread_state *pt, reaper_phase phase) {
+	long timeout = phase_timeout(phase);
+	gint64 now = g_get_monotonic_time();
+	reaper_entry *e;
+
+	if (!running)
+		return;
+	pthread_mutex_lock(&reaper_mutex);
+	e = pt->reaper;
+	if (e == NULL) {
+		e = (reaper_entry *) calloc(1, sizeof(reaper_entry));
+		if (e == NULL) {
+			pthread_mutex_unlock(&reaper_mutex);
+			return;		// Not watched
+		}
+		e->pt = pt;
+		e->index = -1;
+		pt->reaper = e;
+		stats.watched++;
+	}
+	if (e->reason == REAPED_NONE) {
+		e->phase = phase;
+		e->sock4 = pt->sock4;
+		e->sock6 = pt->sock6;
+		e->phase_end = ((phase != REAPER_TRANSFER) && (timeout > 0)) ? now + 1000LL * timeout : 0;
+		__atomic_store_n(&e->bytes, pt->sent, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->last_progress, now, __ATOMIC_RELAXED);
+		e->window_start = now;
+		e->window_bytes = pt->sent;
+		schedule(e, next_deadline(e));
+	}
+	pthread_mutex_unlock(&reaper_mutex);
+}
+
+
+// Record that the session sent bytes to the client (pt->sent); ends the first byte phase
+void reaper_progress(thread_state *pt) {
+	reaper_entry *e = pt->reaper;
+
+	if (e == NULL)
+		return;
+	if (e->phase != REAPER_TRANSFER) {
+		reaper_enter(pt, REAPER_TRANSFER);
+		return;
+	}
+	__atomic_store_n(&e->bytes, pt->sent, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->last_progress, g_get_monotonic_time(), __ATOMIC_RELAXED);
+}
+
+
+// Suspend (hold TRUE) the deadlines while the session waits for the gateway, not for its peers;
+// they restart, counting from the release, when it is released
+void reaper_hold(thread_state *pt, gboolean hold) {
+	reaper_entry *e = pt->reaper;
+
+	if (e == NULL)
+		return;
+	if (!hold) {
+		reaper_enter(pt, e->phase);		// Restarts the deadlines
+		pthread_mutex_lock(&reaper_mutex);
+		e->held = FALSE;
+		schedule(e, next_deadline(e));
+		pthread_mutex_unlock(&reaper_mutex);
+		return;
+	}
+	pthread_mutex_lock(&reaper_mutex);
+	e->held = TRUE;
+	heap_remove(e);
+	pthread_mutex_unlock(&reaper_mutex);
+}
+
+
+// Stop watching the session, before its sockets are closed
+void reaper_leave(thread_state *pt) {
+	reaper_entry *e = pt->reaper;
+
+	if (e == NULL)
+		return;
+	pthread_mutex_lock(&reaper_mutex);
+	heap_remove(e);
+	pt->reaper = NULL;
+	pthread_mutex_unlock(&reaper_mutex);
+	free(e);
+}
+
+
+// Reason the session was reaped (REAPED_NONE if it was not)
+reaped_reason reaper_reaped(thread_state *pt) {
+	reaped_reason reason;
+
+	if (pt->reaper == NULL)
+		return REAPED_NONE;
+	pthread_mutex_lock(&reaper_mutex);
+	reason = pt->reaper->reason;
+	pthread_mutex_unlock(&reaper_mutex);
+	return reason;
+}
+
+
+// Time left until the deadline of the current phase (ms; 0 - none, or not watched)
+long reaper_remaining(thread_state *pt) {
+	long left = 0;
+
+	if (pt->reaper == NULL)
+		return 0;
+	pthread_mutex_lock(&reaper_mutex);
+	if (pt->reaper->phase_end > 0)
+		left = (long) MAX(1, (pt->reaper->phase_end - g_get_monotonic_time()) / 1000);
+	pthread_mutex_unlock(&reaper_mutex);
+	return left;
+}
+
+
+// Current statistics
+void reaper_get_stats(reaper_stats *st) {
+	pthread_mutex_lock(&reaper_mutex);
+	memcpy(st, &stats, sizeof(reaper_stats));
+	st->pending = n_heap;
+	pthread_mutex_unlock(&reaper_mutex);
+}
+
+
+// Log the statistics
+void reaper_report(void) {
+	reaper_stats st;
+	char tmp[300];
+
+	reaper_get_stats(&st);
+	if (st.watched == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Reaper: %lu sessions, %d deadlines pending; reaped %lu waiting for the request, "
+			"%lu connecting, %lu waiting for the first byte, %lu idle, %lu below the minimum throughput\n",
+			st.watched, st.pending, st.reaped[REAPED_HEADER], st.reaped[REAPED_CONNECT],
+			st.reaped[REAPED_FIRST_BYTE], st.reaped[REAPED_IDLE], st.reaped[REAPED_SLOW]);
+	Log(tmp);
+}
@@ -0,0 +1,72 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * reaper.h
+ *
+ * Header file of the session reaper: each proxy session has a deadline for
+ *    its current phase (request header, server connection, first byte, idle
+ *    time during the transfer) and a minimum throughput. One thread keeps the
+ *    deadlines of all the sessions in a heap and stops the sessions that miss
+ *    them, shutting down their sockets, so a stalled peer does not hold a
+ *    thread, its sockets and its Query forever.
+\*****************************************************************************/
+
+#ifndef INCL_REAPER_H
+#define INCL_REAPER_H
+
+#include <gtk/gtk.h>
+
+struct thread_state;
+
+#define REAPER_DEFAULT_HEADER		5000	// Default time to receive the request header (ms)
+#define REAPER_DEFAULT_CONNECT		10000	// Default time to connect to a server (ms)
+#define REAPER_DEFAULT_FIRST_BYTE	15000	// Default time from the request to the first byte sent (ms)
+#define REAPER_DEFAULT_IDLE			30000	// Default time without sending to the client (ms)
+#define REAPER_RATE_WINDOW			10000	// Period measuring the throughput against the floor (ms)
+
+// Phases of a session, each with its own deadline
+typedef enum { REAPER_HEADER, REAPER_CONNECT, REAPER_FIRST_BYTE, REAPER_TRANSFER } reaper_phase;
+
+// Reasons to reap a session
+typedef enum { REAPED_NONE, REAPED_HEADER, REAPED_CONNECT, REAPED_FIRST_BYTE, REAPED_IDLE, REAPED_SLOW,
+	REAPED_REASONS } reaped_reason;
+
+// Reaper statistics
+typedef struct reaper_stats {
+	unsigned long watched;					// Sessions watched
+	unsigned long reaped[REAPED_REASONS];	// Sessions reaped, by reason
+	int pending;							// Deadlines in the heap
+} reaper_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Start the reaper thread. Called when the gateway starts
+gboolean reaper_init(void);
+// Stop the reaper thread, after all the sessions ended
+void reaper_close(void);
+
+// Start the phase of the session, with the deadline set in the options for it (none if it is 0);
+// the sockets the session holds at the time are the ones shut down if it is reaped
+void reaper_enter(struct thread_state *pt, reaper_phase phase);
+// Record that the session sent bytes to the client (pt->sent); ends the first byte phase
+void reaper_progress(struct thread_state *pt);
+// Suspend (hold TRUE) the deadlines while the session waits for the gateway, not for its peers;
+// they restart, counting from the release, when it is released
+void reaper_hold(struct thread_state *pt, gboolean hold);
+// Stop watching the session, before its sockets are closed
+void reaper_leave(struct thread_state *pt);
+// Reason the session was reaped (REAPED_NONE if it was not)
+reaped_reason reaper_reaped(struct thread_state *pt);
+// Time left until the deadline of the current phase (ms; 0 - none, or not watched)
+long reaper_remaining(struct thread_state *pt);
+
+// Current statistics
+void reaper_get_stats(reaper_stats *st);
+// Log the statistics
+void reaper_report(void);
+
+#endif
@@ -0,0 +1,396 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * segment.c
+ *
+ * Segmented download of a file from several IPv6 servers
+ *
+ * The proxy thread drives one non-blocking connection per server with poll.
+ *    Each connection carries one range request; the data is written at its
+ *    offset in an anonymous memory file (memfd), and the completed prefix is
+ *    sent to the client with deliver_block, as in the usual relay. Ranges are
+ *    not requested more than SEGMENT_WINDOW bytes ahead of the client, and the
+ *    part already sent is released from the memory file.
+\*****************************************************************************/
+
+#define _GNU_SOURCE		// memfd_create, fallocate
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "buffer_pool.h"
+#include "segment.h"
+#include "srpt.h"
+
+// Byte range of the file
+typedef struct seg_range {
+	unsigned long long off;		// First byte
+	unsigned long long len;		// Length
+	int owners;					// Servers fetching it
+	gboolean done;				// All bytes received
+} seg_range;
+
+// Server used by the segmented download
+typedef struct seg_server {
+	hit_server *hs;				// Address
+	int sock;					// Connection (-1 - idle)
+	gboolean connecting;		// Waiting for the connection to be established
+	unsigned long long flen;	// Length received in the answer header
+	int hdr_len;				// Bytes of the header received
+	seg_range *range;			// Range being fetched
+	unsigned long long got;		// Bytes of the range received
+	gint64 started;				// Time when the range was requested (us)
+	gint64 last_data;			// Time when data was last received (us)
+	double speed;				// Measured speed (bytes/s; 0 - unknown)
+	int failures;				// Number of failures
+	unsigned long long bytes;	// Bytes received
+	int ranges;					// Ranges completed
+} seg_server;
+
+// Segmented download state
+typedef struct seg_session {
+	thread_state *pt;
+	const char *conn_str;
+	int fd;						// Memory file with the data received
+	GQueue ranges;				// Ranges requested and not sent to the client, by offset
+	GQueue retry;				// Ranges without a server, to be requested again
+	unsigned long long next_off;	// First byte not requested yet
+	unsigned long long punched;		// Bytes released from the memory file
+	gboolean started;			// File length sent to the client
+	seg_server *srv;			// Servers
+	int n_srv;					// Number of servers
+} seg_session;
+
+
+// Close the connection of a server; the range goes back to the retry queue if nobody
+// else is fetching it. penalize - count it as a failure of the server
+static void stop_server(seg_session *s, seg_server *sv, gboolean penalize) {
+	if (sv->sock >= 0) {
+		close(sv->sock);
+		sv->sock = -1;
+	}
+	if (sv->range != NULL) {
+		seg_range *r = sv->range;
+		sv->range = NULL;
+		if ((--r->owners == 0) && !r->done)
+			g_queue_push_tail(&s->retry, r);
+	}
+	if (penalize)
+		sv->failures++;
+}
+
+
+// Request range 'r' from server 'sv', starting a non-blocking connection
+// If it fails, a range nobody else is fetching goes to the retry queue
+static void start_range(seg_session *s, seg_server *sv, seg_range *r) {
+	sv->sock = init_socket_ipv6(SOCK_STREAM, 0, FALSE);
+	if (sv->sock < 0) {
+		if (r->owners == 0)
+			g_queue_push_tail(&s->retry, r);
+		return;
+	}
+	fcntl(sv->sock, F_SETFL, fcntl(sv->sock, F_GETFL) | O_NONBLOCK);
+	if ((connect(sv->sock, (struct sockaddr *) &sv->hs->addr, sizeof(sv->hs->addr)) < 0) &&
+			(errno != EINPROGRESS)) {
+		close(sv->sock);
+		sv->sock = -1;
+		sv->failures++;
+		if (r->owners == 0)
+			g_queue_push_tail(&s->retry, r);
+		return;
+	}
+	sv->connecting = TRUE;
+	sv->range = r;
+	r->owners++;
+	sv->got = 0;
+	sv->hdr_len = 0;
+	sv->started = sv->last_data = g_get_monotonic_time();
+}
+
+
+// Size of the next range for server 'sv': the bytes it fetches in SEGMENT_RANGE_TIME
+static unsigned long long range_size(seg_server *sv) {
+	if (sv->speed <= 0)
+		return SEGMENT_FIRST_RANGE;
+	return CLAMP((unsigned long long) (sv->speed * SEGMENT_RANGE_TIME / 1000),
+			SEGMENT_MIN_RANGE, SEGMENT_MAX_RANGE);
+}
+
+
+// Give work to an idle server: a range to retry, a new range, or, at the end of the file,
+// a copy of the range that is expected to end last
+static void assign_work(seg_session *s, seg_server *sv) {
+	thread_state *pt = s->pt;
+	seg_range *r;
+	int i;
+
+	if ((sv->sock >= 0) || (sv->failures >= SEGMENT_MAX_FAILURES))
+		return;
+
+	// Range left by a failed or stalled server
+	r = (seg_range *) g_queue_pop_head(&s->retry);
+	if (r != NULL) {
+		start_range(s, sv, r);
+		return;
+	}
+
+	// New range, within the window
+	if ((s->next_off < pt->flen) && (s->next_off < pt->sent + SEGMENT_WINDOW)) {
+		unsigned long long len = MIN(range_size(sv), pt->flen - s->next_off);
+		len = MIN(len, pt->sent + SEGMENT_WINDOW - s->next_off);
+		r = (seg_range *) calloc(1, sizeof(seg_range));
+		r->off = s->next_off;
+		r->len = len;
+		g_queue_push_tail(&s->ranges, r);
+		s->next_off += len;
+		start_range(s, sv, r);
+		return;
+	}
+
+	// End of the file: fetch again the range with the longest expected remaining time,
+	// if this server is expected to finish it first
+	if (s->next_off < pt->flen)
+		return;
+	seg_server *slowest = NULL;
+	double worst = 0;
+	for (i = 0; i < s->n_srv; i++) {
+		seg_server *o = &s->srv[i];
+		if ((o->range == NULL) || (o->range->owners > 1) || o->range->done)
+			continue;
+		double remaining = (o->range->len - o->got) / MAX(o->speed, 1.0);
+		if (remaining > worst) {
+			worst = remaining;
+			slowest = o;
+		}
+	}
+	if ((slowest != NULL) && ((sv->speed <= 0) || (slowest->range->len / sv->speed < worst)))
+		start_range(s, sv, slowest->range);
+}
+
+
+// Range completed by server 'sv': update its speed and stop the other copies
+static void complete_range(seg_session *s, seg_server *sv) {
+	seg_range *r = sv->range;
+	double elapsed = MAX(g_get_monotonic_time() - sv->started, 1) / 1000000.0;
+	double speed = r->len / elapsed;
+	int i;
+
+	sv->speed = (sv->speed <= 0) ? speed : 0.7 * sv->speed + 0.3 * speed;
+	sv->ranges++;
+	r->done = TRUE;
+	stop_server(s, sv, FALSE);
+	for (i = 0; i < s->n_srv; i++)
+		if (s->srv[i].range == r)
+			stop_server(s, &s->srv[i], FALSE);
+}
+
+
+// Handle the events of the connection to server 'sv'
+// Returns FALSE if the file could not be sent to the client
+static gboolean handle_server(seg_session *s, seg_server *sv, short revents, char *buf) {
+	thread_state *pt = s->pt;
+	int err = 0, n;
+	socklen_t len = sizeof(err);
+
+	if (sv->connecting) {
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return TRUE;
+		getsockopt(sv->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err || !write_file_request(sv->sock, pt->seq, pt->filename, sv->range->off, sv->range->len)) {
+			stop_server(s, sv, TRUE);
+			return TRUE;
+		}
+		sv->connecting = FALSE;
+		return TRUE;
+	}
+	if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+		return TRUE;
+
+	// Header: length of the file
+	if (sv->hdr_len < (int) sizeof(sv->flen)) {
+		n = read(sv->sock, (char *) &sv->flen + sv->hdr_len, sizeof(sv->flen) - sv->hdr_len);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EAGAIN))
+				return TRUE;
+			stop_server(s, sv, TRUE);
+			return TRUE;
+		}
+		sv->hdr_len += n;
+		if (sv->hdr_len < (int) sizeof(sv->flen))
+			return TRUE;
+		if (sv->flen != pt->flen) {
+			// Another file, or a server without range requests
+			stop_server(s, sv, FALSE);
+			sv->failures = SEGMENT_MAX_FAILURES;
+			return TRUE;
+		}
+		if (!s->started) {
+			// First answer: the client gets the file length
+			if (write(pt->sock4, &pt->flen, sizeof(pt->flen)) != sizeof(pt->flen)) {
+				Log("ERROR: Sending length of file to IPv4.\n");
+				return FALSE;
+			}
+			s->started = TRUE;
+			set_thread_status(pt, S_TRANSF);
+			if (pt->q != NULL)
+				set_query_state(pt->q, S_F_TRANSF);
+		}
+	}
+
+	// Data
+	n = read(sv->sock, buf, (int) MIN((unsigned long long) pool_chunk_size(), sv->range->len - sv->got));
+	if (n <= 0) {
+		if ((n < 0) && (errno == EAGAIN))
+			return TRUE;
+		stop_server(s, sv, TRUE);	// Closed before the end of the range
+		return TRUE;
+	}
+	if (pwrite(s->fd, buf, n, sv->range->off + sv->got) != n) {
+		Log("ERROR - Failed storing a received range.\n");
+		return FALSE;
+	}
+	sv->got += n;
+	sv->bytes += n;
+	sv->last_data = g_get_monotonic_time();
+	if (sv->got == sv->range->len)
+		complete_range(s, sv);
+	return TRUE;
+}
+
+
+// Send the completed ranges at the head of the file to the client, while the session has
+// a turn in the relay scheduler; with 'wait', it waits for its turns
+static gboolean deliver_ranges(seg_session *s, char *buf, gboolean wait) {
+	thread_state *pt = s->pt;
+	seg_range *r;
+
+	while (((r = (seg_range *) g_queue_peek_head(&s->ranges)) != NULL) && r->done) {
+		while (pt->sent < r->off + r->len) {
+			int n = (int) MIN((unsigned long long) pool_chunk_size(), r->off + r->len - pt->sent);
+			if (!srpt_gate(pt, n, wait))
+				return !wait;	// Not its turn (the servers go on meanwhile), or stopped
+			if ((pread(s->fd, buf, n, pt->sent) != n) || !deliver_block(pt, buf, n))
+				return FALSE;
+		}
+		g_queue_pop_head(&s->ranges);
+		free(r);
+	}
+	// Release the memory already sent
+	unsigned long long upto = pt->sent & ~4095ULL;
+	if (upto > s->punched) {
+		fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, s->punched, upto - s->punched);
+		s->punched = upto;
+	}
+	return TRUE;
+}
+
+
+// Relay the file pt->flen bytes long from the 'n' servers to the IPv4 client
+// Returns -1 if no server sent the file (nothing was sent to the client: the caller may
+// fetch it the usual way), 0 if the transfer stopped, or 1 if the file was sent
+int segmented_relay(thread_state *pt, hit_server *servers, int n, const char *conn_str) {
+	seg_session s;
+	struct pollfd pfd[MAX_HIT_SERVERS];
+	int idx[MAX_HIT_SERVERS];
+	char *buf, tmp[200];
+	gboolean ok = TRUE;
+	int i, m, result;
+
+	memset(&s, 0, sizeof(s));
+	s.pt = pt;
+	s.conn_str = conn_str;
+	g_queue_init(&s.ranges);
+	g_queue_init(&s.retry);
+	s.n_srv = MIN(n, MAX_HIT_SERVERS);
+	s.srv = (seg_server *) calloc(s.n_srv, sizeof(seg_server));
+	for (i = 0; i < s.n_srv; i++) {
+		s.srv[i].hs = &servers[i];
+		s.srv[i].sock = -1;
+	}
+	s.fd = memfd_create("gateway-segments", MFD_CLOEXEC);
+	buf = (s.fd >= 0) ? pool_get(&pt->pool_chunks) : NULL;
+	if (buf == NULL) {
+		if (s.fd >= 0)
+			close(s.fd);
+		free(s.srv);
+		return -1;
+	}
+
+	while (ok && active && (pt->sent < pt->flen)) {
+		gint64 now = g_get_monotonic_time();
+
+		// Stalled servers lose their range; idle servers get a new one
+		for (i = 0, m = 0; i < s.n_srv; i++) {
+			seg_server *sv = &s.srv[i];
+			if ((sv->sock >= 0) && (now - sv->last_data > 1000LL * SEGMENT_STALL_TIMEOUT))
+				stop_server(&s, sv, TRUE);
+			assign_work(&s, sv);
+			if (sv->sock >= 0) {
+				pfd[m].fd = sv->sock;
+				pfd[m].events = sv->connecting ? POLLOUT : POLLIN;
+				pfd[m].revents = 0;
+				idx[m++] = i;
+			}
+		}
+		if (m == 0) {
+			// The window is full of ranges waiting for a turn: send them, and fetch more
+			seg_range *r = (seg_range *) g_queue_peek_head(&s.ranges);
+			if ((r != NULL) && r->done) {
+				ok = deliver_ranges(&s, buf, TRUE);
+				continue;
+			}
+			break;	// No server left
+		}
+
+		if (poll(pfd, m, SEGMENT_POLL_PERIOD) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; ok && (i < m); i++)
+			if (pfd[i].revents && (s.srv[idx[i]].sock == pfd[i].fd))	// Not stopped meanwhile
+				ok = handle_server(&s, &s.srv[idx[i]], pfd[i].revents, buf);
+		if (ok)
+			ok = deliver_ranges(&s, buf, FALSE);
+	}
+
+	result = !s.started ? -1 : (pt->sent == pt->flen) ? 1 : 0;
+	// Servers that sent part of the file, for the verification statistics
+	if (pt->servers != NULL)
+		free(pt->servers);
+	pt->servers = (char *) calloc(s.n_srv, HIT_SERVER_STRLEN);
+	for (i = 0; i < s.n_srv; i++) {
+		seg_server *sv = &s.srv[i];
+		char str[HIT_SERVER_STRLEN];
+		stop_server(&s, sv, FALSE);
+		hit_server_str(sv->hs, str);
+		if (sv->bytes > 0)
+			sprintf(pt->servers + strlen(pt->servers), "%s%s", (pt->servers[0] != '\0') ? " " : "", str);
+		snprintf(tmp, sizeof(tmp), "%s  server %s: %llu bytes in %d ranges, %.0f KB/s, %d failures\n",
+				conn_str, str, sv->bytes, sv->ranges, sv->speed / 1024, sv->failures);
+		g_print("%s", tmp);
+	}
+	while (!g_queue_is_empty(&s.ranges))
+		free(g_queue_pop_head(&s.ranges));
+	while (!g_queue_is_empty(&s.retry))
+		g_queue_pop_head(&s.retry);	// Freed above: the retry queue only references ranges
+	pool_put(buf, &pt->pool_chunks);
+	close(s.fd);
+	free(s.srv);
+	g_print("%ssegmented transfer from %d servers ended (%llu/%llu bytes)\n", conn_str, s.n_srv,
+			pt->sent, pt->flen);
+	return result;
+}
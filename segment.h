@@ -0,0 +1,41 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * segment.h
+ *
+ * Header file of the segmented download: a large file is fetched in byte
+ *    ranges from several of the IPv6 servers that answered the Query, using
+ *    the range request extension, and reassembled in order for the IPv4
+ *    client. Range sizes follow the speed measured for each server, stalled
+ *    ranges move to another server, and at the end of the file idle servers
+ *    also fetch the ranges still in progress, so a slow server does not delay
+ *    the end of the transfer.
+\*****************************************************************************/
+
+#ifndef INCL_SEGMENT_H
+#define INCL_SEGMENT_H
+
+#include <gtk/gtk.h>
+#include "proxy_thread.h"
+
+#define SEGMENT_FIRST_RANGE		(1L << 20)	// Size of the first range asked to a server
+#define SEGMENT_MIN_RANGE		(256L << 10)	// Minimum range size
+#define SEGMENT_MAX_RANGE		(16L << 20)	// Maximum range size
+#define SEGMENT_RANGE_TIME		500			// Target time to fetch a range (ms)
+#define SEGMENT_WINDOW			(64L << 20)	// Maximum data fetched ahead of the client
+#define SEGMENT_STALL_TIMEOUT	5000		// Time without data before a range moves to another server (ms)
+#define SEGMENT_MAX_FAILURES	3			// Failures before a server is no longer used
+#define SEGMENT_POLL_PERIOD		100			// Poll period, checking stalls and the gateway state (ms)
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Relay the file pt->flen bytes long from the 'n' servers to the IPv4 client
+// Returns -1 if no server sent the file (nothing was sent to the client: the caller may
+// fetch it the usual way), 0 if the transfer stopped, or 1 if the file was sent
+int segmented_relay(thread_state *pt, hit_server *servers, int n, const char *conn_str);
+
+#endif
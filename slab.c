@@ -0,0 +1,183 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * slab.c
+ *
+ * Slab allocator of fixed size objects
+ *
+ * Each slab is SLAB_SIZE bytes, aligned to SLAB_SIZE, with its header at the
+ *    start: the slab of an object is found by masking its address. The slabs
+ *    are mapped directly: an aligned malloc of SLAB_SIZE would take about twice
+ *    that from the heap. Free
+ *    objects are linked through their first bytes. Slabs with free objects
+ *    are kept in a list; a slab that becomes empty is released, except for
+ *    SLAB_SPARE of them, so a Query created and freed at a slab boundary does
+ *    not allocate a slab each time.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+#define SLAB_ALIGN	16	// Alignment of the objects
+
+// Slab header, at the start of the slab
+typedef struct slab {
+	slab_cache *cache;			// Cache of the slab
+	struct slab *prev, *next;	// List of slabs with free objects
+	void *free;					// Free objects
+	int used;					// Objects allocated
+	gboolean listed;			// In the list of slabs with free objects
+} slab;
+
+// Cache of objects of one size
+struct slab_cache {
+	const char *name;			// Name (for the error messages)
+	size_t obj_size;			// Object size, rounded to SLAB_ALIGN
+	size_t first;				// Offset of the first object
+	int objs_per_slab;			// Objects in each slab
+	slab *partial;				// Slabs with free objects
+	int empty;					// Empty slabs in the list
+	long slabs;					// Slabs allocated
+	long in_use;				// Objects allocated
+	pthread_mutex_t mutex;
+};
+
+static volatile long slabs_mapped = 0;	// Slabs mapped by all the caches
+
+
+// Create a cache of objects with 'obj_size' bytes
+slab_cache *slab_create(const char *name, size_t obj_size) {
+	slab_cache *c = (slab_cache *) calloc(1, sizeof(slab_cache));
+
+	c->name = name;
+	c->obj_size = (MAX(obj_size, sizeof(void *)) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1);
+	c->first = (sizeof(slab) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1);
+	c->objs_per_slab = (SLAB_SIZE - c->first) / c->obj_size;
+	assert(c->objs_per_slab > 0);
+	pthread_mutex_init(&c->mutex, NULL);
+	return c;
+}
+
+// Insert/remove a slab in the list of slabs with free objects; called with the mutex locked
+static void list_slab(slab_cache *c, slab *s) {
+	s->prev = NULL;
+	s->next = c->partial;
+	if (c->partial != NULL)
+		c->partial->prev = s;
+	c->partial = s;
+	s->listed = TRUE;
+}
+
+static void unlist_slab(slab_cache *c, slab *s) {
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		c->partial = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	s->listed = FALSE;
+}
+
+// Allocate a slab, with all its objects free; called with the mutex locked
+static slab *new_slab(slab_cache *c) {
+	slab *s;
+	char *obj;
+	int i;
+
+	// Map twice the size and unmap the parts before and after the aligned slab
+	char *m = (char *) mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "Failed allocating a slab of %s: %s\n", c->name, strerror(errno));
+		return NULL;
+	}
+	s = (slab *) (((uintptr_t) m + SLAB_SIZE - 1) & ~((uintptr_t) SLAB_SIZE - 1));
+	if ((char *) s > m)
+		munmap(m, (char *) s - m);
+	munmap((char *) s + SLAB_SIZE, m + SLAB_SIZE - (char *) s);
+	__sync_fetch_and_add(&slabs_mapped, 1);
+	s->cache = c;
+	s->used = 0;
+	s->free = NULL;
+	obj = (char *) s + c->first + (size_t) (c->objs_per_slab - 1) * c->obj_size;
+	for (i = 0; i < c->objs_per_slab; i++, obj -= c->obj_size) {
+		*(void **) obj = s->free;
+		s->free = obj;
+	}
+	list_slab(c, s);
+	c->slabs++;
+	c->empty++;
+	return s;
+}
+
+
+// Allocate an object (not initialized); returns NULL if there is no memory
+void *slab_alloc(slab_cache *c) {
+	slab *s;
+	void *obj;
+
+	pthread_mutex_lock(&c->mutex);
+	s = c->partial;
+	if ((s == NULL) && ((s = new_slab(c)) == NULL)) {
+		pthread_mutex_unlock(&c->mutex);
+		return NULL;
+	}
+	obj = s->free;
+	s->free = *(void **) obj;
+	if (s->used++ == 0)
+		c->empty--;
+	if (s->free == NULL)
+		unlist_slab(c, s);	// Full
+	c->in_use++;
+	pthread_mutex_unlock(&c->mutex);
+	return obj;
+}
+
+// Free an object allocated with slab_alloc
+void slab_free(slab_cache *c, void *obj) {
+	slab *s = (slab *) ((uintptr_t) obj & ~((uintptr_t) SLAB_SIZE - 1));
+
+	if (obj == NULL)
+		return;
+	assert(s->cache == c);
+	pthread_mutex_lock(&c->mutex);
+	*(void **) obj = s->free;
+	s->free = obj;
+	c->in_use--;
+	if (!s->listed)
+		list_slab(c, s);	// It was full
+	if (--s->used == 0) {
+		if (c->empty >= SLAB_SPARE) {
+			unlist_slab(c, s);
+			c->slabs--;
+			munmap(s, SLAB_SIZE);
+			__sync_fetch_and_sub(&slabs_mapped, 1);
+		} else
+			c->empty++;
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+// Current occupancy
+void slab_get_stats(slab_cache *c, slab_stats *st) {
+	pthread_mutex_lock(&c->mutex);
+	st->obj_size = c->obj_size;
+	st->objs_per_slab = c->objs_per_slab;
+	st->slabs = c->slabs;
+	st->in_use = c->in_use;
+	pthread_mutex_unlock(&c->mutex);
+}
+
+// Bytes mapped for the slabs of all the caches (not counted by the heap statistics)
+size_t slab_mapped_bytes(void) {
+	return (size_t) slabs_mapped * SLAB_SIZE;
+}
@@ -0,0 +1,49 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * slab.h
+ *
+ * Header file of the slab allocator of the fixed size objects kept in large
+ *    numbers (Query and thread_state): objects are carved from aligned 64 KiB
+ *    slabs, so they sit next to each other in memory instead of scattered
+ *    through the heap, without a malloc header each.
+\*****************************************************************************/
+
+#ifndef INCL_SLAB_H
+#define INCL_SLAB_H
+
+#include <gtk/gtk.h>
+#include <stddef.h>
+
+#define SLAB_SIZE			(64L << 10)	// Size (and alignment) of each slab
+#define SLAB_SPARE			1			// Empty slabs kept for reuse
+
+// Cache of objects of one size
+typedef struct slab_cache slab_cache;
+
+// Cache occupancy
+typedef struct slab_stats {
+	size_t obj_size;		// Object size (bytes)
+	int objs_per_slab;		// Objects in each slab
+	long slabs;				// Slabs allocated
+	long in_use;			// Objects allocated
+} slab_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Create a cache of objects with 'obj_size' bytes
+slab_cache *slab_create(const char *name, size_t obj_size);
+// Allocate an object (not initialized); returns NULL if there is no memory
+void *slab_alloc(slab_cache *c);
+// Free an object allocated with slab_alloc
+void slab_free(slab_cache *c, void *obj);
+// Current occupancy
+void slab_get_stats(slab_cache *c, slab_stats *st);
+// Bytes mapped for the slabs of all the caches (not counted by the heap statistics)
+size_t slab_mapped_bytes(void);
+
+#endif
@@ -0,0 +1,321 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * spool.c
+ *
+ * Store-and-forward relay
+ *
+ * The sockets are non-blocking and polled together: the server is read
+ *    whenever it has data, and the client is written whenever it takes more.
+ *    The bytes in between are kept in order in pool chunks, up to the cap of
+ *    the session; past that, the rest of the file goes to a temporary file
+ *    mapped in memory, sized for the whole file (sparse), and released in
+ *    SPOOL_RELEASE_BYTES steps as the client takes it.
+\*****************************************************************************/
+
+#define _GNU_SOURCE		// fallocate
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "buffer_pool.h"
+#include "options.h"
+#include "coalesce.h"
+#include "spool.h"
+#include "srpt.h"
+#include "reaper.h"
+
+#define NO_SPILL	(~0ULL)		// Spool file not used
+
+// Bytes between the server and the client
+typedef struct spool {
+	thread_state *pt;			// Session
+	GQueue chunks;				// Pool chunks with the first bytes, oldest first
+	size_t chunk_size;			// Chunk size
+	size_t head_off;			// Bytes of the first chunk already sent
+	size_t tail_len;			// Bytes stored in the last chunk
+	unsigned long long rcvd;	// Bytes received (file offset)
+	unsigned long long spill;	// File offset of the first byte in the spool file (NO_SPILL - none)
+	int fd;						// Spool file
+	char *map;					// Spool file mapped
+	size_t map_len;				// Length mapped
+	unsigned long long released;	// Spool file bytes released
+	gboolean file_failed;		// The spool file could not be created
+} spool;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static spool_stats stats;
+
+
+// Create the spool file for the bytes from offset sp->rcvd to the end of the file
+static gboolean open_spool_file(spool *sp, const char *conn_str) {
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/gateway-spool-XXXXXX",
+			(options.spool_dir != NULL) ? options.spool_dir : SPOOL_DEFAULT_DIR);
+	sp->fd = mkstemp(path);
+	if (sp->fd < 0) {
+		perror("Failed creating the spool file");
+		return FALSE;
+	}
+	unlink(path);	// Removed when closed
+	sp->map_len = sp->pt->flen - sp->rcvd;
+	if (ftruncate(sp->fd, sp->map_len) < 0) {
+		perror("Failed sizing the spool file");
+		close(sp->fd);
+		sp->fd = -1;
+		return FALSE;
+	}
+	sp->map = (char *) mmap(NULL, sp->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, 0);
+	if (sp->map == MAP_FAILED) {
+		perror("Failed mapping the spool file");
+		sp->map = NULL;
+		close(sp->fd);
+		sp->fd = -1;
+		return FALSE;
+	}
+	sp->spill = sp->rcvd;
+	g_print("%sspooling from byte %llu to a file\n", conn_str, sp->spill);
+	return TRUE;
+}
+
+// Space for the next bytes received; sets 'n' to its length. Returns NULL if the
+// spool is full (no chunk available and the spool file failed)
+static char *spool_space(spool *sp, size_t *n, const char *conn_str) {
+	if (sp->spill == NO_SPILL) {
+		char *chunk;
+		if (!g_queue_is_empty(&sp->chunks) && (sp->tail_len < sp->chunk_size)) {
+			*n = sp->chunk_size - sp->tail_len;
+			return (char *) g_queue_peek_tail(&sp->chunks) + sp->tail_len;
+		}
+		chunk = pool_try_get(&sp->pt->pool_chunks);
+		if (chunk != NULL) {
+			g_queue_push_tail(&sp->chunks, chunk);
+			sp->tail_len = 0;
+			*n = sp->chunk_size;
+			return chunk;
+		}
+		// Ring full: the rest of the file goes to the spool file
+		if (sp->file_failed)
+			return NULL;	// Wait until the client takes the bytes in the chunks
+		if (!open_spool_file(sp, conn_str)) {
+			sp->file_failed = TRUE;
+			return NULL;
+		}
+	}
+	*n = sp->pt->flen - sp->rcvd;
+	return sp->map + (sp->rcvd - sp->spill);
+}
+
+// Store 'n' bytes received in the space returned by spool_space
+static void spool_commit(spool *sp, size_t n) {
+	if (sp->spill == NO_SPILL)
+		sp->tail_len += n;
+	sp->rcvd += n;
+}
+
+// Next bytes to send to the client; sets 'n' to their length (0 - none)
+static const char *spool_data(spool *sp, size_t *n) {
+	unsigned long long sent = sp->pt->sent;
+
+	if (sent < MIN(sp->rcvd, sp->spill)) {
+		size_t filled = (g_queue_get_length(&sp->chunks) == 1) ? sp->tail_len : sp->chunk_size;
+		*n = filled - sp->head_off;
+		return (const char *) g_queue_peek_head(&sp->chunks) + sp->head_off;
+	}
+	if (sent < sp->rcvd) {
+		*n = sp->rcvd - sent;
+		return sp->map + (sent - sp->spill);
+	}
+	*n = 0;
+	return NULL;
+}
+
+// Remove 'n' bytes sent to the client
+static void spool_consume(spool *sp, size_t n) {
+	if (sp->pt->sent < sp->spill) {
+		sp->head_off += n;
+		if (g_queue_get_length(&sp->chunks) == 1) {
+			if (sp->head_off == sp->tail_len)
+				sp->head_off = sp->tail_len = 0;	// Empty: reuse the chunk
+		} else if (sp->head_off == sp->chunk_size) {
+			pool_put((char *) g_queue_pop_head(&sp->chunks), &sp->pt->pool_chunks);
+			sp->head_off = 0;
+		}
+	}
+	sp->pt->sent += n;
+	if ((sp->map != NULL) && (sp->pt->sent > sp->spill)) {
+		// Release the part of the spool file already sent
+		unsigned long long done = sp->pt->sent - sp->spill;
+		if (done - sp->released >= SPOOL_RELEASE_BYTES) {
+			unsigned long long end = done & ~((unsigned long long) SPOOL_RELEASE_BYTES - 1);
+			fallocate(sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, sp->released,
+					end - sp->released);
+			sp->released = end;
+		}
+	}
+}
+
+// Free the chunks and the spool file
+static void spool_free(spool *sp) {
+	while (!g_queue_is_empty(&sp->chunks))
+		pool_put((char *) g_queue_pop_head(&sp->chunks), &sp->pt->pool_chunks);
+	if (sp->map != NULL)
+		munmap(sp->map, sp->map_len);
+	if (sp->fd >= 0)
+		close(sp->fd);
+}
+
+
+// Relay the file from the server to the client, from byte pt->sent up to pt->flen, reading
+// the server ahead of the client; pt->sock6 is closed once the whole file is received
+// Returns TRUE if the client received the file
+gboolean spooled_relay(thread_state *pt, const char *conn_str) {
+	gboolean slow = get_checkbutton_Slow_state();
+	gint64 next_write = 0, server_done = 0;
+	gboolean server_ok = TRUE;
+	spool sp;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.pt = pt;
+	g_queue_init(&sp.chunks);
+	sp.chunk_size = pool_chunk_size();
+	sp.rcvd = pt->sent;
+	sp.spill = NO_SPILL;
+	sp.fd = -1;
+	pt->spooling = TRUE;
+	fcntl(pt->sock6, F_SETFL, fcntl(pt->sock6, F_GETFL) | O_NONBLOCK);
+	fcntl(pt->sock4, F_SETFL, fcntl(pt->sock4, F_GETFL) | O_NONBLOCK);
+
+	while (active && (pt->sent < pt->flen) && (server_ok || (pt->sent < sp.rcvd))) {
+		struct pollfd pfd[2];
+		int nfds = 0, i6 = -1, i4 = -1, timeout = SPOOL_POLL_PERIOD;
+		gint64 now = g_get_monotonic_time();
+		char *space = NULL;
+		size_t len = 0;
+
+		if ((pt->sock6 >= 0) && ((space = spool_space(&sp, &len, conn_str)) != NULL)) {
+			pfd[nfds].fd = pt->sock6;
+			pfd[nfds].events = POLLIN;
+			i6 = nfds++;
+		}
+		if (pt->sent < sp.rcvd) {
+			if (!srpt_gate(pt, 0, FALSE))
+				timeout = MIN(timeout, SPOOL_TURN_POLL);	// Waiting for its turn to send
+			else if (now >= next_write) {
+				pfd[nfds].fd = pt->sock4;
+				pfd[nfds].events = POLLOUT;
+				i4 = nfds++;
+			} else
+				timeout = MIN(timeout, (int) ((next_write - now) / 1000) + 1);
+		}
+		if (poll(pfd, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("spool poll");
+			break;
+		}
+
+		// Server side
+		if ((i6 >= 0) && (pfd[i6].revents != 0)) {
+			ssize_t n = read(pt->sock6, space, MIN(len, pt->flen - sp.rcvd));
+			if (n > 0) {
+				store_block(pt, space, n);
+				spool_commit(&sp, n);
+			}
+			if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EINTR)))
+				server_ok = FALSE;	// The client still gets the bytes received
+			if (!server_ok || (sp.rcvd == pt->flen)) {
+				// Release the server; the reaper forgets its socket before the number can be reused
+				int sock = pt->sock6;
+				pt->sock6 = -1;
+				reaper_enter(pt, REAPER_TRANSFER);
+				close(sock);
+				server_done = g_get_monotonic_time();
+				if (server_ok) {
+					stream_finish(pt->stream, TRUE);	// The other sessions need not wait for this client
+					pt->stream = NULL;
+				}
+			}
+		}
+
+		// Client side
+		if ((i4 >= 0) && (pfd[i4].revents != 0)) {
+			const char *data = spool_data(&sp, &len);
+			ssize_t n = write(pt->sock4, data, MIN(len, sp.chunk_size));
+			if (n < 0) {
+				if ((errno == EAGAIN) || (errno == EINTR))
+					continue;
+				Log("ERROR - Not all data was forwarded to IPv4.\n");
+				break;
+			}
+			spool_consume(&sp, n);
+			srpt_account(pt, n);
+			update_transf(pt, (int) (100 * pt->sent / pt->flen));
+			if (slow)
+				next_write = g_get_monotonic_time() + SLOW_SLEEPTIME;
+		}
+	}
+	if (!server_ok)
+		Log("ERROR - The server closed the connection before the end of the file.\n");
+
+	// Statistics
+	pthread_mutex_lock(&stats_mutex);
+	stats.sessions++;
+	if (sp.spill != NO_SPILL) {
+		stats.spilled++;
+		stats.bytes_spilled += sp.rcvd - sp.spill;
+	}
+	if (server_ok && (server_done > 0) && (pt->sent == pt->flen)) {
+		gint64 saved = g_get_monotonic_time() - server_done;
+		if (saved >= 1000) {
+			stats.early_closes++;
+			stats.server_ms_saved += saved / 1000;
+		}
+	}
+	pthread_mutex_unlock(&stats_mutex);
+
+	spool_free(&sp);
+	pt->spooling = FALSE;
+	return pt->sent == pt->flen;
+}
+
+
+// Current statistics
+void spool_get_stats(spool_stats *st) {
+	pthread_mutex_lock(&stats_mutex);
+	memcpy(st, &stats, sizeof(spool_stats));
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+
+// Log the statistics
+void spool_report(void) {
+	spool_stats st;
+	char tmp[200];
+
+	spool_get_stats(&st);
+	if (st.sessions == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Spooling: %lu sessions, %lu spilled %llu KB to files, %lu servers "
+			"released early (%llu s before their clients finished)\n", st.sessions, st.spilled,
+			st.bytes_spilled >> 10, st.early_closes, st.server_ms_saved / 1000);
+	Log(tmp);
+}
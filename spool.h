@@ -0,0 +1,49 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * spool.h
+ *
+ * Header file of the store-and-forward relay: the file is read from the
+ *    server as fast as it sends it, and the bytes the client did not take
+ *    yet wait in a ring of relay buffers and then in a temporary file. The
+ *    server connection is closed as soon as the whole file is received, so a
+ *    slow client does not hold a connection (and a slot) of the server.
+\*****************************************************************************/
+
+#ifndef INCL_SPOOL_H
+#define INCL_SPOOL_H
+
+#include <gtk/gtk.h>
+
+struct thread_state;
+
+#define SPOOL_DEFAULT_DIR	"/tmp"		// Default directory of the spool files
+#define SPOOL_POLL_PERIOD	100			// Poll period, checking the gateway state (ms)
+#define SPOOL_RELEASE_BYTES	(4L << 20)	// Spool file bytes released at once, after being sent
+#define SPOOL_TURN_POLL		10			// Poll period while waiting for a turn in the relay scheduler (ms)
+
+// Spooling statistics
+typedef struct spool_stats {
+	unsigned long sessions;			// Sessions relayed through a spool
+	unsigned long spilled;			// Sessions that used a spool file
+	unsigned long early_closes;		// Server connections closed before the client got the file
+	unsigned long long bytes_spilled;	// Bytes written to the spool files
+	unsigned long long server_ms_saved;	// Time the servers were released before the end of the sessions (ms)
+} spool_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Relay the file from the server to the client, from byte pt->sent up to pt->flen, reading
+// the server ahead of the client; pt->sock6 is closed once the whole file is received
+// Returns TRUE if the client received the file
+gboolean spooled_relay(struct thread_state *pt, const char *conn_str);
+// Current statistics
+void spool_get_stats(spool_stats *st);
+// Log the statistics
+void spool_report(void);
+
+#endif
@@ -0,0 +1,257 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * srpt.c
+ *
+ * Relay scheduler
+ *
+ * A session gets a turn of options.sched_quantum bytes; at the end of each
+ *    turn it goes back to the waiting sessions, and the free turns go to the
+ *    waiting sessions with the lowest priority keys. A session with a turn
+ *    counts its bytes without locking; the turns are handed over directly to
+ *    the chosen sessions, each waiting on its own condition variable.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "options.h"
+#include "srpt.h"
+#include "reaper.h"
+
+// Session in the scheduler
+typedef struct srpt_entry {
+	GList link;					// Link in 'entries' (data points to the entry)
+	thread_state *pt;			// Session
+	pthread_cond_t cond;		// Signalled when the session gets a turn
+	struct in6_addr client;		// Client address
+	int client_sessions;		// Sessions of the same client
+	gint64 since;				// Time it started waiting (0 - not waiting)
+	long quantum;				// Bytes left in its turn
+	gboolean running;			// Has a turn
+} srpt_entry;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t srpt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GQueue entries = G_QUEUE_INIT;	// Sessions in the scheduler
+static int n_running = 0;				// Sessions with a turn
+static srpt_stats stats;
+
+
+// Priority key of a waiting session: the lowest goes first
+static unsigned long long srpt_key(const srpt_entry *e, gint64 now) {
+	const thread_state *pt = e->pt;
+	unsigned long long key = (pt->flen > pt->sent) ? pt->flen - pt->sent : 0;
+	long long halvings = (options.sched_aging > 0) ? (now - e->since) / (1000LL * options.sched_aging) : 0;
+
+	key *= e->client_sessions;
+	return (halvings >= 64) ? 0 : key >> halvings;
+}
+
+
+// Give the free turns to the waiting sessions with the lowest keys; called with srpt_mutex locked
+static void dispatch(void) {
+	gint64 now = g_get_monotonic_time();
+
+	while (n_running < options.sched_slots) {
+		srpt_entry *best = NULL;
+		unsigned long long best_key = 0;
+		GList *l;
+
+		for (l = entries.head; l != NULL; l = g_list_next(l)) {
+			srpt_entry *e = (srpt_entry *) l->data;
+			if (e->since > 0) {
+				unsigned long long key = srpt_key(e, now);
+				if ((best == NULL) || (key < best_key)) {
+					best = e;
+					best_key = key;
+				}
+			}
+		}
+		if (best == NULL)
+			return;
+		// Turn handed over
+		unsigned long long waited = (now - best->since) / 1000;
+		stats.wait_ms += waited;
+		stats.max_wait_ms = MAX(stats.max_wait_ms, waited);
+		stats.turns++;
+		best->since = 0;
+		best->running = TRUE;
+		best->quantum = options.sched_quantum;
+		n_running++;
+		pthread_cond_signal(&best->cond);
+	}
+}
+
+
+// Set the number of sessions of 'client' in all its entries; called with srpt_mutex locked
+static void count_client_sessions(const struct in6_addr *client) {
+	GList *l;
+	int n = 0;
+
+	for (l = entries.head; l != NULL; l = g_list_next(l))
+		if (memcmp(&((srpt_entry *) l->data)->client, client, sizeof(struct in6_addr)) == 0)
+			n++;
+	for (l = entries.head; l != NULL; l = g_list_next(l)) {
+		srpt_entry *e = (srpt_entry *) l->data;
+		if (memcmp(&e->client, client, sizeof(struct in6_addr)) == 0)
+			e->client_sessions = MAX(n, 1);
+	}
+}
+
+
+// Add the session to the scheduler; called with srpt_mutex locked
+static srpt_entry *srpt_enter(thread_state *pt) {
+	srpt_entry *e = (srpt_entry *) calloc(1, sizeof(srpt_entry));
+
+	if (e == NULL)
+		return NULL;
+	e->pt = pt;
+	pthread_cond_init(&e->cond, NULL);
+	memcpy(&e->client, &pt->cli_ip, sizeof(struct in6_addr));
+	e->link.data = e;
+	g_queue_push_tail_link(&entries, &e->link);
+	count_client_sessions(&e->client);
+	pt->srpt = e;
+	stats.sessions++;
+	return e;
+}
+
+
+// Called before sending 'n' bytes of the session to the client: returns TRUE when the session
+// has a turn. If it has none, with 'wait' it waits for one (returns FALSE if the gateway stops
+// meanwhile); without 'wait' it is queued for one and returns FALSE
+gboolean srpt_gate(thread_state *pt, long n, gboolean wait) {
+	srpt_entry *e = pt->srpt;
+	gboolean ok;
+
+	if (options.sched_slots <= 0)
+		return TRUE;	// Off
+	// Within its turn (only this thread ends a turn)
+	if ((e != NULL) && e->running && (e->quantum > 0)) {
+		e->quantum -= n;
+		return TRUE;
+	}
+
+	pthread_mutex_lock(&srpt_mutex);
+	if ((e == NULL) && ((e = srpt_enter(pt)) == NULL)) {
+		pthread_mutex_unlock(&srpt_mutex);
+		return TRUE;	// No memory: not scheduled
+	}
+	if (e->running) {
+		// End of its turn: it competes again with the waiting sessions
+		e->running = FALSE;
+		n_running--;
+		e->since = g_get_monotonic_time();
+		dispatch();
+		if (!e->running)
+			stats.preemptions++;
+	} else if (e->since == 0) {
+		e->since = g_get_monotonic_time();
+		dispatch();
+	}
+	gboolean held = wait && active && !e->running;
+	if (held)
+		reaper_hold(pt, TRUE);	// Waiting for a turn is not a stall
+	while (wait && active && !e->running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SRPT_WAIT_PERIOD * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&e->cond, &srpt_mutex, &deadline);
+	}
+	ok = e->running;
+	if (ok)
+		e->quantum -= n;
+	pthread_mutex_unlock(&srpt_mutex);
+	if (held)
+		reaper_hold(pt, FALSE);
+	return ok;
+}
+
+
+// Count 'n' bytes sent in the session's turn, after srpt_gate(pt, 0, ...) returned TRUE
+void srpt_account(thread_state *pt, long n) {
+	if (pt->srpt != NULL)
+		pt->srpt->quantum -= n;	// The turn ends in the next srpt_gate
+}
+
+
+// End the session's turn early, when it is about to wait for its server; the next srpt_gate waits
+// for a new one
+void srpt_yield(thread_state *pt) {
+	srpt_entry *e = pt->srpt;
+
+	if ((e == NULL) || !e->running)
+		return;
+	pthread_mutex_lock(&srpt_mutex);
+	e->running = FALSE;
+	n_running--;
+	dispatch();
+	pthread_mutex_unlock(&srpt_mutex);
+}
+
+
+// Remove the session from the scheduler, giving its turn to the next one
+void srpt_leave(thread_state *pt) {
+	srpt_entry *e = pt->srpt;
+
+	if (e == NULL)
+		return;
+	pthread_mutex_lock(&srpt_mutex);
+	g_queue_unlink(&entries, &e->link);
+	count_client_sessions(&e->client);
+	if (e->running) {
+		n_running--;
+		dispatch();
+	}
+	pthread_mutex_unlock(&srpt_mutex);
+	pthread_cond_destroy(&e->cond);
+	free(e);
+	pt->srpt = NULL;
+}
+
+
+// Current statistics
+void srpt_get_stats(srpt_stats *st) {
+	GList *l;
+
+	pthread_mutex_lock(&srpt_mutex);
+	memcpy(st, &stats, sizeof(srpt_stats));
+	st->running = n_running;
+	st->waiting = 0;
+	for (l = entries.head; l != NULL; l = g_list_next(l))
+		if (((srpt_entry *) l->data)->since > 0)
+			st->waiting++;
+	pthread_mutex_unlock(&srpt_mutex);
+}
+
+
+// Log the statistics
+void srpt_report(void) {
+	srpt_stats st;
+	char tmp[200];
+
+	srpt_get_stats(&st);
+	if (st.sessions == 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "Scheduler: %lu sessions, %d sending, %d waiting, %lu turns (%lu preempted), "
+			"wait %llu ms mean, %llu ms max\n", st.sessions, st.running, st.waiting, st.turns, st.preemptions,
+			(st.turns > 0) ? st.wait_ms / st.turns : 0, st.max_wait_ms);
+	Log(tmp);
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * srpt.h
+ *
+ * Header file of the relay scheduler: when sessions compete for the relay,
+ *    a limited number of them send at a time, chosen by shortest remaining
+ *    bytes first. The remaining bytes are multiplied by the number of sessions
+ *    of the same client, so one client with many downloads does not take all
+ *    the turns, and halved for each aging period a session waits, so long
+ *    transfers are not starved.
+\*****************************************************************************/
+
+#ifndef INCL_SRPT_H
+#define INCL_SRPT_H
+
+#include <gtk/gtk.h>
+
+struct thread_state;
+
+#define SRPT_DEFAULT_QUANTUM	(256L << 10)	// Default bytes sent in one turn
+#define SRPT_DEFAULT_AGING		1000			// Default aging period (ms)
+#define SRPT_WAIT_PERIOD		100				// Period checking if the gateway stopped while waiting (ms)
+
+// Scheduler statistics
+typedef struct srpt_stats {
+	unsigned long sessions;			// Sessions scheduled
+	unsigned long turns;			// Turns given
+	unsigned long preemptions;		// Turns that went to another session at the end of a turn
+	unsigned long long wait_ms;		// Total time waiting for a turn (ms)
+	unsigned long long max_wait_ms;	// Longest wait for a turn (ms)
+	int running;					// Sessions sending now
+	int waiting;					// Sessions waiting for a turn
+} srpt_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Called before sending 'n' bytes of the session to the client: returns TRUE when the session
+// has a turn. If it has none, with 'wait' it waits for one (returns FALSE if the gateway stops
+// meanwhile); without 'wait' it is queued for one and returns FALSE
+gboolean srpt_gate(struct thread_state *pt, long n, gboolean wait);
+// Count 'n' bytes sent in the session's turn, after srpt_gate(pt, 0, ...) returned TRUE
+void srpt_account(struct thread_state *pt, long n);
+// End the session's turn early, when it is about to wait for its server; the next srpt_gate waits
+// for a new one
+void srpt_yield(struct thread_state *pt);
+// Remove the session from the scheduler, giving its turn to the next one
+void srpt_leave(struct thread_state *pt);
+// Current statistics
+void srpt_get_stats(srpt_stats *st);
+// Log the statistics
+void srpt_report(void);
+
+#endif
@@ -0,0 +1,269 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * trace.c
+ *
+ * Query and proxy thread lifecycle tracing, with Chrome/Perfetto trace export
+ *
+ * Each event takes one slot of a power of 2 ring buffer, claimed with an atomic
+ *    increment, so the GUI thread and the proxy threads record events without
+ *    locks. A slot is valid when its sequence field matches the claimed index,
+ *    which lets the exporter skip slots being overwritten.
+\*****************************************************************************/
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gui.h"
+#include "trace.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(kind, id, state)	do { \
+		if ((kind) == TRACE_QUERY) DTRACE_PROBE2(gateway, query_state, id, state); \
+		else DTRACE_PROBE2(gateway, thread_status, id, state); } while (0)
+#else
+#define TRACE_PROBE(kind, id, state)
+#endif
+
+
+// One state transition
+typedef struct trace_record {
+	uint64_t seq;			// Ring index + 1 when the slot is valid; 0 while being written
+	uint64_t ts;			// Monotonic time (ns)
+	uint32_t id;			// Object identifier
+	uint8_t kind;			// trace_kind
+	uint8_t state;			// New state
+} trace_record;
+
+// Name of a traced object
+typedef struct trace_name {
+	uint32_t id;
+	char name[TRACE_NAME_LENGTH];
+} trace_name;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static trace_record *ring = NULL;	// Ring buffer
+static trace_name *names = NULL;	// Object names, indexed by id & mask
+static uint64_t mask = 0;			// Ring size - 1
+static uint64_t head = 0;			// Next index to write
+static uint32_t last_id = 0;		// Last object identifier
+
+static const char *query_state_names[] = { "S_JITTER", "S_IDLE", "S_TIMER", "S_HIT",
+		"S_TRY_TCP", "S_CONNECT", "S_F_TRANSF" };
+static const char *thread_status_names[] = { "INITIAL_STATE", "ACTIVE4_STATE",
+		"ACTIVE6_STATE", "REQUEST_IPV6", "S_TRANSF" };
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Create the ring buffer with n_events (rounded to a power of 2); 0 turns tracing off
+void trace_init(long n_events) {
+	uint64_t size = 1;
+
+	if ((ring != NULL) || (n_events <= 0))
+		return;	// Already running (the ring is kept while the gateway is turned off/on) or off
+	while (size < (uint64_t) n_events)
+		size <<= 1;
+	ring = (trace_record *) calloc(size, sizeof(trace_record));
+	names = (trace_name *) calloc(size, sizeof(trace_name));
+	if ((ring == NULL) || (names == NULL)) {
+		free(ring);
+		free(names);
+		ring = NULL;
+		names = NULL;
+		Log("Failed allocating the trace buffer - tracing is off\n");
+		return;
+	}
+	__atomic_store_n(&mask, size - 1, __ATOMIC_RELEASE);
+}
+
+
+// Returns a new identifier for a traced object and registers its name
+uint32_t trace_new_object(trace_kind kind, const char *name) {
+	uint32_t id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+	uint64_t m = __atomic_load_n(&mask, __ATOMIC_ACQUIRE);
+
+	if ((m != 0) && (name != NULL)) {
+		trace_name *n = &names[id & m];
+		strncpy(n->name, name, TRACE_NAME_LENGTH - 1);
+		n->name[TRACE_NAME_LENGTH - 1] = '\0';
+		__atomic_store_n(&n->id, id, __ATOMIC_RELEASE);
+	}
+	return id;
+}
+
+
+// Record that object 'id' entered 'state' (a QueryState, a thread_status or TRACE_END)
+void trace_event(trace_kind kind, uint32_t id, unsigned int state) {
+	uint64_t m = __atomic_load_n(&mask, __ATOMIC_ACQUIRE);
+
+	TRACE_PROBE(kind, id, state);
+	if (m == 0)
+		return;
+	uint64_t i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	trace_record *r = &ring[i & m];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->ts = now_ns();
+	r->id = id;
+	r->kind = (uint8_t) kind;
+	r->state = (uint8_t) state;
+	__atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+
+// Name of a state
+static const char *state_name(trace_kind kind, unsigned int state) {
+	if ((kind == TRACE_QUERY) && (state < G_N_ELEMENTS(query_state_names)))
+		return query_state_names[state];
+	if ((kind == TRACE_THREAD) && (state < G_N_ELEMENTS(thread_status_names)))
+		return thread_status_names[state];
+	return "unknown";
+}
+
+// Writes a JSON string, escaping the special characters
+static void write_json_string(FILE *f, const char *str) {
+	fputc('"', f);
+	for (; *str; str++) {
+		if ((*str == '"') || (*str == '\\'))
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+// Microseconds from 'base' to 'ts'; 0 if 'ts' is earlier (a slot claimed before another may get
+// a later time)
+static double elapsed_us(uint64_t ts, uint64_t base) {
+	return (ts > base) ? (ts - base) / 1000.0 : 0.0;
+}
+
+// Writes one complete span ('X' event)
+static void write_span(FILE *f, gboolean *first, const trace_record *from, uint64_t to_ts,
+		uint64_t t0, gboolean open) {
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+			"\"ts\":%.3f,\"dur\":%.3f%s}", *first ? "" : ",",
+			state_name(from->kind, from->state), (from->kind == TRACE_QUERY) ? "query" : "thread",
+			(from->kind == TRACE_QUERY) ? 1 : 2, from->id, elapsed_us(from->ts, t0),
+			elapsed_us(to_ts, from->ts), open ? ",\"args\":{\"open\":true}" : "");
+	*first = FALSE;
+}
+
+// Writes the name of a track ('M' event)
+static void write_track_name(FILE *f, gboolean *first, const trace_record *r) {
+	uint64_t m = __atomic_load_n(&mask, __ATOMIC_ACQUIRE);
+	trace_name *n = &names[r->id & m];
+	char name[TRACE_NAME_LENGTH];
+
+	if (__atomic_load_n(&n->id, __ATOMIC_ACQUIRE) == r->id) {
+		memcpy(name, n->name, TRACE_NAME_LENGTH);
+		name[TRACE_NAME_LENGTH - 1] = '\0';
+	} else
+		snprintf(name, sizeof(name), "%s %u", (r->kind == TRACE_QUERY) ? "query" : "thread", r->id);
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":",
+			*first ? "" : ",", (r->kind == TRACE_QUERY) ? 1 : 2, r->id);
+	write_json_string(f, name);
+	fprintf(f, "}}");
+	*first = FALSE;
+}
+
+// Adds a hash table value to the list in 'data'
+static void collect_value(gpointer key, gpointer value, gpointer data) {
+	*(GList **) data = g_list_prepend(*(GList **) data, value);
+}
+
+// Table of open spans of an object's kind, and its key there
+#define OPEN_TABLE(r)	open[(r)->kind == TRACE_THREAD]
+#define OBJECT_KEY(r)	GUINT_TO_POINTER((r)->id)
+
+
+// Write the events in the ring buffer to 'path' in Chrome trace JSON format
+gboolean trace_export(const char *path) {
+	uint64_t m = __atomic_load_n(&mask, __ATOMIC_ACQUIRE);
+	uint64_t end, i, t_end;
+	GHashTable *open[2];	// Last state of each Query and thread, by OBJECT_KEY
+	gboolean first = TRUE;
+	long n_spans = 0;
+	FILE *f;
+
+	if ((m == 0) || (path == NULL))
+		return FALSE;
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror("Failed opening trace file");
+		return FALSE;
+	}
+
+	end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	t_end = now_ns();
+	i = (end > m + 1) ? end - (m + 1) : 0;
+	open[0] = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+	open[1] = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	fprintf(f, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Queries\"}},"
+			"\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"Proxy threads\"}}");
+	first = FALSE;
+
+	uint64_t t0 = 0;
+	for (; i < end; i++) {
+		trace_record r, *slot = &ring[i & m];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1)
+			continue;	// Being written or already overwritten
+		memcpy(&r, slot, sizeof(r));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1)
+			continue;
+		if (t0 == 0)
+			t0 = r.ts;
+
+		trace_record *prev = (trace_record *) g_hash_table_lookup(OPEN_TABLE(&r), OBJECT_KEY(&r));
+		if (prev != NULL) {
+			write_span(f, &first, prev, r.ts, t0, FALSE);
+			n_spans++;
+		} else
+			write_track_name(f, &first, &r);
+		if (r.state == TRACE_END) {
+			g_hash_table_remove(OPEN_TABLE(&r), OBJECT_KEY(&r));
+		} else {
+			trace_record *copy = (trace_record *) malloc(sizeof(trace_record));
+			memcpy(copy, &r, sizeof(r));
+			g_hash_table_replace(OPEN_TABLE(&r), OBJECT_KEY(&r), copy);
+		}
+	}
+
+	// Spans still open end at the export time
+	GList *values = NULL, *l;
+	g_hash_table_foreach(open[0], collect_value, &values);
+	g_hash_table_foreach(open[1], collect_value, &values);
+	for (l = values; l != NULL; l = g_list_next(l)) {
+		write_span(f, &first, (trace_record *) l->data, t_end, t0, TRUE);
+		n_spans++;
+	}
+	g_list_free(values);
+	g_hash_table_destroy(open[0]);
+	g_hash_table_destroy(open[1]);
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "Trace with %ld spans written to %s\n", n_spans, path);
+	Log(tmp);
+	return TRUE;
+}
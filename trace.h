@@ -0,0 +1,40 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * trace.h
+ *
+ * Header file of the Query and proxy thread lifecycle tracing: state transitions
+ *    are recorded in a lock-free ring buffer and exported as Chrome/Perfetto
+ *    trace JSON. When compiled with -DHAVE_SYS_SDT_H, each transition also fires
+ *    a USDT probe (provider 'gateway': query_state, thread_status).
+\*****************************************************************************/
+
+#ifndef INCL_TRACE_H
+#define INCL_TRACE_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+#define TRACE_DEFAULT_EVENTS	65536	// Default ring buffer size (events)
+#define TRACE_NAME_LENGTH		48		// Maximum length of a traced object name
+#define TRACE_END				0xff	// State recorded when an object is freed
+
+// Kind of traced object
+typedef enum { TRACE_QUERY, TRACE_THREAD } trace_kind;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Create the ring buffer with n_events (rounded to a power of 2); 0 turns tracing off
+void trace_init(long n_events);
+// Returns a new identifier for a traced object and registers its name
+uint32_t trace_new_object(trace_kind kind, const char *name);
+// Record that object 'id' entered 'state' (a QueryState, a thread_status or TRACE_END)
+void trace_event(trace_kind kind, uint32_t id, unsigned int state);
+// Write the events in the ring buffer to 'path' in Chrome trace JSON format
+gboolean trace_export(const char *path);
+
+#endif
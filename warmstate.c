@@ -0,0 +1,822 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * warmstate.c
+ *
+ * Warm state snapshot
+ *
+ * The snapshot is a header with one descriptor per section (offset, length,
+ *    number of records and CRC-32), followed by the sections, with records
+ *    aligned to 8 bytes. It is written from the main loop to a temporary file
+ *    mapped in memory, synced and renamed over the previous one, so a crash
+ *    never leaves a half-written snapshot. When the gateway starts, the file
+ *    is mapped and only its header is checked; each section is checked and
+ *    read the first time its table is used, and the mapping is released when
+ *    all of them were read. A section not read yet when a snapshot is written
+ *    (e.g. the cache index while the cache is off) is copied unchanged.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "proxy_thread.h"
+#include "options.h"
+#include "cache.h"
+#include "warmstate.h"
+
+#define WARM_MAGIC			"GWWARM"	// File signature (8 bytes with the padding)
+#define WARM_VERSION		2			// Format version; other versions are ignored
+#define WARM_NAME_LENGTH	56			// Server name field ("ip-port" and '\0', rounded up)
+#define WARM_KEY_LENGTH		512			// Hit key ("group/domain/name" and '\0')
+#define WARM_ALIGN(n)		(((n) + 7) & ~(size_t) 7)
+
+// Sections
+typedef enum { SEC_SERVERS, SEC_HITS, SEC_CACHE, SEC_SKETCH, WARM_SECTIONS } warm_section_type;
+
+// Section descriptor
+typedef struct warm_section {
+	uint64_t offset;			// Start in the file
+	uint64_t length;			// Bytes
+	uint32_t count;				// Records (SEC_SKETCH: increments since its last halving)
+	uint32_t crc;				// CRC-32 of the bytes
+} warm_section;
+
+// File header
+typedef struct warm_header {
+	char magic[8];				// WARM_MAGIC
+	uint32_t version;			// WARM_VERSION
+	uint32_t crc;				// CRC-32 of the header, with this field at 0
+	uint64_t generation;		// Snapshot number
+	int64_t saved;				// Time it was written (s since the epoch)
+	warm_section sections[WARM_SECTIONS];
+} warm_header;
+
+// Server record
+typedef struct warm_server_rec {
+	double rate;				// Transfer rate (bytes/s, moving average)
+	int64_t last;				// Time of the last result (s since the epoch)
+	uint32_t transfers;			// Transfers completed
+	uint32_t failures;			// Connections failed since the last transfer completed
+	char name[WARM_NAME_LENGTH];	// "ip-port"
+} warm_server_rec;
+
+// Server address in a Hit record
+typedef struct warm_addr {
+	struct in6_addr addr;		// Address (IPv4-mapped for IPv4 servers)
+	uint16_t port;				// TCP port (host order)
+	uint16_t pad[3];
+} warm_addr;
+
+// Hit record; followed by its key ("group/domain/name", see hit_key) and '\0'
+typedef struct warm_hit_rec {
+	uint64_t flen;				// File length
+	int64_t last;				// Time of the last Hit (s since the epoch)
+	uint32_t fhash;				// File hash
+	uint16_t n_servers;			// Servers in 'servers'
+	uint16_t name_len;			// Length of the key
+	warm_addr servers[WARM_HIT_SERVERS];
+} warm_hit_rec;
+
+// Cache index record; followed by the key and '\0'. The section starts with a 64-bit length
+// and the cache directory, with '\0'
+typedef struct warm_cache_rec {
+	uint64_t flen;				// File length
+	uint32_t id;				// File number in the cache directory
+	uint16_t key_len;			// Length of the key
+	uint8_t main_seg;			// In the main segment
+	uint8_t verified;			// Hash checked against the Hit
+} warm_cache_rec;
+
+// Server in memory
+typedef struct warm_server {
+	GList link;					// Link in server_lru (data points to the server)
+	warm_server_rec rec;
+} warm_server;
+
+// Hit in memory
+typedef struct warm_hit {
+	GList link;					// Link in hit_lru (data points to the Hit)
+	char *name;					// File name
+	warm_hit_rec rec;
+} warm_hit;
+
+// Growing buffer where a section is written
+typedef struct warm_buf {
+	uint8_t *data;
+	size_t len, size;
+	uint32_t count;				// Records
+} warm_buf;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static pthread_mutex_t warm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *snap_path = NULL;			// Snapshot file (NULL - off)
+static const uint8_t *snap = NULL;		// Previous snapshot, mapped while sections are not read
+static size_t snap_len = 0;
+static gboolean loaded[WARM_SECTIONS];	// Sections read (or missing)
+static GHashTable *servers = NULL;		// Servers, by name
+static GQueue server_lru = G_QUEUE_INIT;	// Servers, most recently used first
+static GHashTable *hits = NULL;			// Hits, by key
+static GQueue hit_lru = G_QUEUE_INIT;	// Hits, most recent first
+static guint timer_id = 0;				// Timer writing the snapshot
+static uint32_t crc_table[256];
+static warm_stats stats;
+
+
+/*********************\
+|*  Snapshot format  *|
+\*********************/
+
+// Fill the CRC-32 table (IEEE polynomial, reflected)
+static void crc_init(void) {
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+// CRC-32 of 'n' bytes
+static uint32_t crc32_buf(const void *buf, size_t n) {
+	const uint8_t *p = (const uint8_t *) buf;
+	uint32_t c = 0xFFFFFFFFU;
+
+	while (n-- > 0)
+		c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFFU;
+}
+
+// Append a record, followed by 'str' with its '\0' if not NULL, padded to 8 bytes
+static gboolean buf_append(warm_buf *b, const void *rec, size_t n, const char *str) {
+	size_t slen = (str != NULL) ? strlen(str) + 1 : 0;
+	size_t total = WARM_ALIGN(n + slen);
+
+	if (b->len + total > b->size) {
+		size_t size = MAX(2 * b->size, b->len + total + 4096);
+		uint8_t *data = (uint8_t *) realloc(b->data, size);
+		if (data == NULL)
+			return FALSE;
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, rec, n);
+	if (slen > 0)
+		memcpy(b->data + b->len + n, str, slen);
+	memset(b->data + b->len + n + slen, 0, total - n - slen);
+	b->len += total;
+	b->count++;
+	return TRUE;
+}
+
+// Header of the mapped snapshot
+static const warm_header *snap_header(void) {
+	return (const warm_header *) snap;
+}
+
+// Bytes of a section of the mapped snapshot, if its checksum is right; NULL if it is missing or
+// wrong. Called with warm_mutex locked
+static const uint8_t *section_data(warm_section_type type, uint64_t *len, uint32_t *count) {
+	const warm_section *sec;
+
+	if (snap == NULL)
+		return NULL;
+	sec = &snap_header()->sections[type];
+	if ((sec->length == 0) || (sec->offset < sizeof(warm_header)) || (sec->offset > snap_len) ||
+			(sec->length > snap_len - sec->offset) || (crc32_buf(snap + sec->offset, sec->length) != sec->crc)) {
+		if (sec->length > 0)
+			stats.bad_sections++;
+		return NULL;
+	}
+	*len = sec->length;
+	*count = sec->count;
+	return snap + sec->offset;
+}
+
+// Length of the string at 'p', with at most 'max' bytes; -1 if it is not terminated
+static long string_length(const uint8_t *p, size_t max) {
+	const uint8_t *end = (const uint8_t *) memchr(p, '\0', max);
+	return (end == NULL) ? -1 : end - p;
+}
+
+// Release the mapped snapshot once all the sections were read; called with warm_mutex locked
+static void release_snapshot(void) {
+	int i;
+
+	if (snap == NULL)
+		return;
+	for (i = 0; i < WARM_SECTIONS; i++)
+		if (!loaded[i])
+			return;
+	munmap((void *) snap, snap_len);
+	snap = NULL;
+	snap_len = 0;
+}
+
+
+/*********************\
+|*  Tables           *|
+\*********************/
+
+// Server 'name', moved to the front of the LRU list; with 'create', it is added if it is missing,
+// replacing the least recently used one if the table is full. Called with warm_mutex locked
+static warm_server *get_server(const char *name, gboolean create) {
+	warm_server *s = (warm_server *) g_hash_table_lookup(servers, name);
+
+	if (s != NULL) {
+		g_queue_unlink(&server_lru, &s->link);
+		g_queue_push_head_link(&server_lru, &s->link);
+		return s;
+	}
+	if (!create || (strlen(name) >= WARM_NAME_LENGTH))
+		return NULL;
+	if (g_hash_table_size(servers) >= WARM_MAX_SERVERS) {
+		s = (warm_server *) g_queue_peek_tail(&server_lru);
+		g_queue_unlink(&server_lru, &s->link);
+		g_hash_table_remove(servers, s->rec.name);
+	} else if ((s = (warm_server *) malloc(sizeof(warm_server))) == NULL)
+		return NULL;
+	memset(&s->rec, 0, sizeof(s->rec));
+	strcpy(s->rec.name, name);
+	s->link.data = s;
+	g_queue_push_head_link(&server_lru, &s->link);
+	g_hash_table_insert(servers, s->rec.name, s);
+	return s;
+}
+
+// Key of the Hits for the file 'name' answering the Queries from the clients of the domain 'cli_ipv6'
+// in the group pair 'group'; NULL if the name is too long
+static const char *hit_key(char *key, const char *name, gboolean cli_ipv6, int group) {
+	if (snprintf(key, WARM_KEY_LENGTH, "%d/%c/%s", group, cli_ipv6 ? '6' : '4', name) >= WARM_KEY_LENGTH)
+		return NULL;
+	return key;
+}
+
+// Hit of 'name', moved to the front of the LRU list; with 'create', it is added if it is missing,
+// replacing the least recently used one if the table is full. Called with warm_mutex locked
+static warm_hit *get_hit(const char *name, gboolean create) {
+	warm_hit *h = (warm_hit *) g_hash_table_lookup(hits, name);
+	char *copy;
+
+	if (h != NULL) {
+		g_queue_unlink(&hit_lru, &h->link);
+		g_queue_push_head_link(&hit_lru, &h->link);
+		return h;
+	}
+	if (!create || (strlen(name) > 0xFFFF) || ((copy = strdup(name)) == NULL))
+		return NULL;
+	if (g_hash_table_size(hits) >= WARM_MAX_HITS) {
+		h = (warm_hit *) g_queue_peek_tail(&hit_lru);
+		g_queue_unlink(&hit_lru, &h->link);
+		g_hash_table_remove(hits, h->name);
+		free(h->name);
+	} else if ((h = (warm_hit *) malloc(sizeof(warm_hit))) == NULL) {
+		free(copy);
+		return NULL;
+	}
+	memset(&h->rec, 0, sizeof(h->rec));
+	h->name = copy;
+	h->rec.name_len = strlen(copy);
+	h->link.data = h;
+	g_queue_push_head_link(&hit_lru, &h->link);
+	g_hash_table_insert(hits, h->name, h);
+	return h;
+}
+
+// Read the servers of the snapshot, the first time the table is used; called with warm_mutex locked
+static void load_servers(void) {
+	const uint8_t *p;
+	uint64_t len;
+	uint32_t count, i;
+
+	if (loaded[SEC_SERVERS])
+		return;
+	loaded[SEC_SERVERS] = TRUE;
+	if ((p = section_data(SEC_SERVERS, &len, &count)) != NULL) {
+		// Most recently used first: added from the last one, so they end in the same order
+		for (i = MIN(count, len / sizeof(warm_server_rec)); i > 0; i--) {
+			const warm_server_rec *r = (const warm_server_rec *) (p + (i - 1) * sizeof(warm_server_rec));
+			warm_server *s;
+			if ((string_length((const uint8_t *) r->name, WARM_NAME_LENGTH) > 0) &&
+					((s = get_server(r->name, TRUE)) != NULL)) {
+				memcpy(&s->rec, r, sizeof(warm_server_rec));
+				stats.restored++;
+			}
+		}
+	}
+	release_snapshot();
+}
+
+// Read the Hits of the snapshot, the first time the table is used; called with warm_mutex locked
+static void load_hits(void) {
+	const uint8_t *p, **recs;
+	uint64_t len, pos;
+	uint32_t count, i, n = 0;
+
+	if (loaded[SEC_HITS])
+		return;
+	loaded[SEC_HITS] = TRUE;
+	if (((p = section_data(SEC_HITS, &len, &count)) != NULL) &&
+			((recs = (const uint8_t **) malloc(MAX(count, 1) * sizeof(uint8_t *))) != NULL)) {
+		for (pos = 0; (n < count) && (pos + sizeof(warm_hit_rec) <= len); n++) {
+			// The name follows the record
+			const warm_hit_rec *r = (const warm_hit_rec *) (p + pos);
+			if (string_length(p + pos + sizeof(warm_hit_rec), len - pos - sizeof(warm_hit_rec)) != r->name_len)
+				break;	// Corrupted
+			recs[n] = p + pos;
+			pos += WARM_ALIGN(sizeof(warm_hit_rec) + r->name_len + 1);
+		}
+		// Most recent first: added from the last one
+		for (i = n; i > 0; i--) {
+			const warm_hit_rec *r = (const warm_hit_rec *) recs[i - 1];
+			warm_hit *h = get_hit((const char *) (recs[i - 1] + sizeof(warm_hit_rec)), TRUE);
+			if (h != NULL) {
+				memcpy(&h->rec, r, sizeof(warm_hit_rec));
+				h->rec.n_servers = MIN(h->rec.n_servers, WARM_HIT_SERVERS);
+				stats.restored++;
+			}
+		}
+		free(recs);
+	}
+	release_snapshot();
+}
+
+
+/*********************\
+|*  Snapshot writes  *|
+\*********************/
+
+// Write the servers table to 'b'; called with warm_mutex locked
+static void write_servers(warm_buf *b) {
+	GList *l;
+
+	for (l = server_lru.head; l != NULL; l = g_list_next(l))
+		buf_append(b, &((warm_server *) l->data)->rec, sizeof(warm_server_rec), NULL);
+}
+
+// Write the Hits table to 'b'; called with warm_mutex locked
+static void write_hits(warm_buf *b) {
+	GList *l;
+
+	for (l = hit_lru.head; l != NULL; l = g_list_next(l)) {
+		warm_hit *h = (warm_hit *) l->data;
+		buf_append(b, &h->rec, sizeof(warm_hit_rec), h->name);
+	}
+}
+
+// Write one file of the content cache index; cache_export callback
+static void write_cache_entry(const char *key, unsigned long long flen, unsigned int id, gboolean main_seg,
+		gboolean verified, void *data) {
+	warm_cache_rec r;
+
+	memset(&r, 0, sizeof(r));
+	r.flen = flen;
+	r.id = id;
+	r.key_len = (uint16_t) MIN(strlen(key), 0xFFFF);
+	r.main_seg = main_seg ? 1 : 0;
+	r.verified = verified ? 1 : 0;
+	if (strlen(key) <= 0xFFFF)
+		buf_append((warm_buf *) data, &r, sizeof(r), key);
+}
+
+// Write the content cache index to 'b': the directory, then the files; returns FALSE if the
+// cache is off. Takes the cache's mutex
+static gboolean write_cache(warm_buf *b, warm_buf *sketch_buf) {
+	warm_buf files;
+	uint64_t dir_len;
+	unsigned long additions = 0;
+	uint8_t *sketch = (uint8_t *) malloc(CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH);
+	char *dir;
+
+	memset(&files, 0, sizeof(files));
+	if ((sketch == NULL) || ((dir = cache_export(write_cache_entry, &files, sketch, &additions)) == NULL)) {
+		free(sketch);
+		return FALSE;
+	}
+	dir_len = strlen(dir);
+	buf_append(b, &dir_len, sizeof(dir_len), dir);
+	if (files.len > 0)
+		buf_append(b, files.data, files.len, NULL);
+	b->count = files.count;
+	buf_append(sketch_buf, sketch, CACHE_SKETCH_ROWS * CACHE_SKETCH_WIDTH, NULL);
+	sketch_buf->count = (uint32_t) additions;
+	free(files.data);
+	free(sketch);
+	free(dir);
+	return TRUE;
+}
+
+// Copy a section of the previous snapshot that was not read yet; called with warm_mutex locked
+static void copy_section(warm_section_type type, warm_buf *b) {
+	const uint8_t *p;
+	uint64_t len;
+	uint32_t count;
+
+	if (!loaded[type] && ((p = section_data(type, &len, &count)) != NULL)) {
+		buf_append(b, p, len, NULL);
+		b->count = count;
+	}
+}
+
+// Timer callback writing the snapshot while the gateway is active
+static gboolean callback_warm_save(gpointer data) {
+	if (!active) {
+		timer_id = 0;
+		return FALSE;
+	}
+	warm_save();
+	return TRUE;
+}
+
+
+/*********************\
+|*  Functions        *|
+\*********************/
+
+// Open the snapshot 'path' (NULL - off) and write it every 'period' ms; its sections are read
+// when first used. Called when the gateway starts; the state is kept while it is turned off/on
+void warm_init(const char *path, long period) {
+	struct stat st;
+	char tmp[400];
+	int fd, i;
+
+	if (path == NULL)
+		return;
+	if (snap_path == NULL) {
+		crc_init();
+		snap_path = strdup(path);
+		servers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+		hits = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+		for (i = 0; i < WARM_SECTIONS; i++)
+			loaded[i] = TRUE;	// Nothing to read, unless a valid snapshot is found
+
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno != ENOENT)
+				perror("Failed opening the warm state");
+		} else {
+			if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t) sizeof(warm_header))) {
+				snap_len = st.st_size;
+				snap = (const uint8_t *) mmap(NULL, snap_len, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (snap == MAP_FAILED) {
+					perror("Failed mapping the warm state");
+					snap = NULL;
+				}
+			}
+			close(fd);
+		}
+		if (snap != NULL) {
+			warm_header h;
+			memcpy(&h, snap, sizeof(h));
+			h.crc = 0;
+			if (memcmp(h.magic, WARM_MAGIC, sizeof(WARM_MAGIC)) || (h.version != WARM_VERSION) ||
+					(crc32_buf(&h, sizeof(h)) != snap_header()->crc)) {
+				snprintf(tmp, sizeof(tmp), "Warm state %s has another version or is corrupted - ignored\n", path);
+				Log(tmp);
+				munmap((void *) snap, snap_len);
+				snap = NULL;
+			} else {
+				for (i = 0; i < WARM_SECTIONS; i++)
+					loaded[i] = FALSE;
+				stats.generation = h.generation;
+				snprintf(tmp, sizeof(tmp), "Warm state %s: snapshot %llu, written %ld s ago\n", path,
+						(unsigned long long) h.generation, (long) (time(NULL) - h.saved));
+				Log(tmp);
+			}
+		}
+	}
+	if ((period > 0) && (timer_id == 0))
+		timer_id = g_timeout_add(period, callback_warm_save, NULL);
+}
+
+
+// Write the snapshot and stop the periodic writes
+void warm_close(void) {
+	if (timer_id > 0) {
+		g_source_remove(timer_id);
+		timer_id = 0;
+	}
+	warm_save();
+}
+
+
+// Write the snapshot now; returns FALSE if it failed
+gboolean warm_save(void) {
+	warm_buf sec[WARM_SECTIONS];
+	warm_header h;
+	gboolean cache_on;
+	size_t total;
+	char tmp_path[512];
+	gboolean ok = FALSE;
+	int i, fd;
+
+	if (snap_path == NULL)
+		return TRUE;
+	memset(sec, 0, sizeof(sec));
+	memset(&h, 0, sizeof(h));
+
+	// Content cache index, outside warm_mutex
+	cache_on = write_cache(&sec[SEC_CACHE], &sec[SEC_SKETCH]);
+
+	pthread_mutex_lock(&warm_mutex);
+	load_servers();
+	load_hits();
+	write_servers(&sec[SEC_SERVERS]);
+	write_hits(&sec[SEC_HITS]);
+	if (!cache_on) {
+		// The cache is off: keep the index of the previous snapshot
+		copy_section(SEC_CACHE, &sec[SEC_CACHE]);
+		copy_section(SEC_SKETCH, &sec[SEC_SKETCH]);
+	}
+	stats.generation++;
+	h.generation = stats.generation;
+	pthread_mutex_unlock(&warm_mutex);
+
+	// Layout
+	memcpy(h.magic, WARM_MAGIC, sizeof(WARM_MAGIC));
+	h.version = WARM_VERSION;
+	h.saved = time(NULL);
+	total = sizeof(warm_header);
+	for (i = 0; i < WARM_SECTIONS; i++) {
+		h.sections[i].offset = total;
+		h.sections[i].length = sec[i].len;
+		h.sections[i].count = sec[i].count;
+		h.sections[i].crc = crc32_buf(sec[i].data, sec[i].len);
+		total += sec[i].len;
+	}
+	h.crc = crc32_buf(&h, sizeof(h));
+
+	// Written to a temporary file, and renamed over the previous snapshot
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snap_path);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		perror("Failed creating the warm state");
+	else {
+		uint8_t *map = MAP_FAILED;
+		if (ftruncate(fd, total) < 0)
+			perror("Failed sizing the warm state");
+		else if ((map = (uint8_t *) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			perror("Failed mapping the warm state");
+		else {
+			memcpy(map, &h, sizeof(h));
+			for (i = 0; i < WARM_SECTIONS; i++)
+				if (sec[i].len > 0)
+					memcpy(map + h.sections[i].offset, sec[i].data, sec[i].len);
+			if (msync(map, total, MS_SYNC) < 0)
+				perror("Failed writing the warm state");
+			else
+				ok = TRUE;
+			munmap(map, total);
+		}
+		close(fd);
+		if (ok && (rename(tmp_path, snap_path) < 0)) {
+			perror("Failed replacing the warm state");
+			ok = FALSE;
+		}
+		if (!ok)
+			unlink(tmp_path);
+	}
+	for (i = 0; i < WARM_SECTIONS; i++)
+		free(sec[i].data);
+
+	pthread_mutex_lock(&warm_mutex);
+	if (ok)
+		stats.saves++;
+	pthread_mutex_unlock(&warm_mutex);
+	return ok;
+}
+
+
+// Record a transfer of 'bytes' in 'usec' from 'server' ("ip-port")
+void warm_server_result(const char *server, unsigned long long bytes, gint64 usec) {
+	warm_server *s;
+
+	if ((snap_path == NULL) || (server == NULL) || (usec <= 0))
+		return;
+	double rate = 1e6 * bytes / usec;
+	pthread_mutex_lock(&warm_mutex);
+	load_servers();
+	if ((s = get_server(server, TRUE)) != NULL) {
+		s->rec.rate = (s->rec.transfers == 0) ? rate : WARM_RATE_EWMA * rate + (1 - WARM_RATE_EWMA) * s->rec.rate;
+		s->rec.transfers++;
+		s->rec.failures = 0;
+		s->rec.last = time(NULL);
+	}
+	pthread_mutex_unlock(&warm_mutex);
+}
+
+
+// Record a failed connection to 'server' ("ip-port")
+void warm_server_failed(const char *server) {
+	warm_server *s;
+
+	if ((snap_path == NULL) || (server == NULL))
+		return;
+	pthread_mutex_lock(&warm_mutex);
+	load_servers();
+	if ((s = get_server(server, TRUE)) != NULL) {
+		s->rec.failures++;
+		s->rec.last = time(NULL);
+	}
+	pthread_mutex_unlock(&warm_mutex);
+}
+
+
+// Order the 'n' servers: the fastest known first, then the unknown, then the ones failing
+void warm_rank_servers(hit_server *list, int n) {
+	char str[HIT_SERVER_STRLEN];
+	int rank[MAX_HIT_SERVERS];		// 0 - known, 1 - unknown, 2 - failing
+	double rate[MAX_HIT_SERVERS];
+	int i, j;
+
+	if ((snap_path == NULL) || (n < 2))
+		return;
+	n = MIN(n, MAX_HIT_SERVERS);
+	pthread_mutex_lock(&warm_mutex);
+	load_servers();
+	for (i = 0; i < n; i++) {
+		warm_server *s = (warm_server *) g_hash_table_lookup(servers, hit_server_str(&list[i], str));
+		rank[i] = (s == NULL) ? 1 : (s->rec.failures > 0) ? 2 : (s->rec.transfers > 0) ? 0 : 1;
+		rate[i] = (s == NULL) ? 0 : s->rec.rate;
+	}
+	pthread_mutex_unlock(&warm_mutex);
+
+	// Stable insertion sort: the Hits that arrived first stay first among equals
+	for (i = 1; i < n; i++) {
+		hit_server hs = list[i];
+		int r = rank[i];
+		double v = rate[i];
+		for (j = i; (j > 0) && ((rank[j - 1] > r) || ((rank[j - 1] == r) && (r == 0) && (rate[j - 1] < v))); j--) {
+			list[j] = list[j - 1];
+			rank[j] = rank[j - 1];
+			rate[j] = rate[j - 1];
+		}
+		list[j] = hs;
+		rank[j] = r;
+		rate[j] = v;
+	}
+}
+
+
+// Record a Hit for the file 'name', for the Queries from the clients of the domain 'cli_ipv6' in the
+// group pair 'group' (servers as IPv4-mapped for IPv4)
+void warm_hit_add(const char *name, gboolean cli_ipv6, int group, uint32_t fhash, unsigned long long flen,
+		const struct in6_addr *ip, u_short port) {
+	char key[WARM_KEY_LENGTH];
+	warm_hit *h;
+	int i;
+
+	if ((snap_path == NULL) || (hit_key(key, name, cli_ipv6, group) == NULL))
+		return;
+	pthread_mutex_lock(&warm_mutex);
+	load_hits();
+	if ((h = get_hit(key, TRUE)) != NULL) {
+		if ((h->rec.fhash != fhash) || (h->rec.flen != flen)) {
+			// Another version of the file: the old servers are forgotten
+			h->rec.fhash = fhash;
+			h->rec.flen = flen;
+			h->rec.n_servers = 0;
+		}
+		for (i = 0; i < h->rec.n_servers; i++)
+			if ((h->rec.servers[i].port == port) && IN6_ARE_ADDR_EQUAL(&h->rec.servers[i].addr, ip))
+				break;
+		if ((i == h->rec.n_servers) && (i < WARM_HIT_SERVERS)) {
+			memset(&h->rec.servers[i], 0, sizeof(warm_addr));
+			memcpy(&h->rec.servers[i].addr, ip, sizeof(struct in6_addr));
+			h->rec.servers[i].port = port;
+			h->rec.n_servers++;
+		}
+		h->rec.last = time(NULL);
+	}
+	pthread_mutex_unlock(&warm_mutex);
+}
+
+
+// Look up a recent Hit for 'name', for a Query from a client of the domain 'cli_ipv6' in the group
+// pair 'group': fills 'fhash', 'flen' and up to 'max' servers, and returns their number (0 - none, or
+// its servers are failing)
+int warm_hit_lookup(const char *name, gboolean cli_ipv6, int group, uint32_t *fhash, unsigned long long *flen,
+		hit_server *list, int max) {
+	char str[HIT_SERVER_STRLEN], key[WARM_KEY_LENGTH];
+	warm_hit *h;
+	int i, n = 0;
+
+	if ((snap_path == NULL) || (options.warm_hit_ttl <= 0) || (hit_key(key, name, cli_ipv6, group) == NULL))
+		return 0;
+	pthread_mutex_lock(&warm_mutex);
+	load_hits();
+	load_servers();
+	h = (warm_hit *) g_hash_table_lookup(hits, key);
+	if ((h != NULL) && (time(NULL) - h->rec.last <= options.warm_hit_ttl)) {
+		*fhash = h->rec.fhash;
+		*flen = h->rec.flen;
+		for (i = 0; (i < h->rec.n_servers) && (n < max); i++) {
+			hit_server *hs = &list[n];
+			if (!IN6_IS_ADDR_V4MAPPED(&h->rec.servers[i].addr) != !cli_ipv6)
+				continue;	// Only servers of the other domain answer the client
+			memset(hs, 0, sizeof(hit_server));
+			hs->addr.sin6_family = AF_INET6;
+			hs->addr.sin6_port = htons(h->rec.servers[i].port);
+			memcpy(&hs->addr.sin6_addr, &h->rec.servers[i].addr, sizeof(struct in6_addr));
+			hs->fhash = h->rec.fhash;
+			hs->flen = h->rec.flen;
+			warm_server *s = (warm_server *) g_hash_table_lookup(servers, hit_server_str(hs, str));
+			if ((s == NULL) || (s->rec.failures == 0))
+				n++;	// Servers failing since the Hit are left out
+		}
+	}
+	pthread_mutex_unlock(&warm_mutex);
+	return n;
+}
+
+
+// Count a Query answered with a remembered Hit
+void warm_hit_used(void) {
+	pthread_mutex_lock(&warm_mutex);
+	stats.hit_answers++;
+	pthread_mutex_unlock(&warm_mutex);
+}
+
+
+// Read the content cache index saved for directory 'dir': calls 'fn' for each file, window then
+// main segment, most recently used first, and copies the frequency sketch ('len' bytes) to
+// 'sketch'. Returns the number of files
+int warm_cache_restore(const char *dir, cache_visit_fn fn, void *data, uint8_t *sketch, size_t len,
+		unsigned long *additions) {
+	const uint8_t *p;
+	uint64_t sec_len, pos, dir_len;
+	uint32_t count, n = 0;
+
+	pthread_mutex_lock(&warm_mutex);
+	if ((snap != NULL) && !loaded[SEC_CACHE]) {
+		loaded[SEC_CACHE] = TRUE;
+		loaded[SEC_SKETCH] = TRUE;
+		p = section_data(SEC_CACHE, &sec_len, &count);
+		if ((p != NULL) && (sec_len >= sizeof(uint64_t))) {
+			memcpy(&dir_len, p, sizeof(dir_len));
+			pos = WARM_ALIGN(sizeof(uint64_t) + dir_len + 1);
+			// Only the index of the same directory
+			if ((dir_len == strlen(dir)) && (pos <= sec_len) && !memcmp(p + sizeof(uint64_t), dir, dir_len + 1)) {
+				while ((n < count) && (pos + sizeof(warm_cache_rec) <= sec_len)) {
+					const warm_cache_rec *r = (const warm_cache_rec *) (p + pos);
+					const char *key = (const char *) (p + pos + sizeof(warm_cache_rec));
+					if (string_length((const uint8_t *) key, sec_len - pos - sizeof(warm_cache_rec)) != r->key_len)
+						break;	// Corrupted
+					fn(key, r->flen, r->id, r->main_seg, r->verified, data);
+					pos += WARM_ALIGN(sizeof(warm_cache_rec) + r->key_len + 1);
+					n++;
+				}
+				if ((n > 0) && ((p = section_data(SEC_SKETCH, &sec_len, &count)) != NULL) && (sec_len == len)) {
+					memcpy(sketch, p, len);
+					*additions = count;
+				}
+			}
+		}
+		stats.restored += n;
+		release_snapshot();
+	}
+	pthread_mutex_unlock(&warm_mutex);
+	return n;
+}
+
+
+// Current statistics
+void warm_get_stats(warm_stats *st) {
+	pthread_mutex_lock(&warm_mutex);
+	memcpy(st, &stats, sizeof(warm_stats));
+	st->servers = (servers != NULL) ? g_hash_table_size(servers) : 0;
+	st->hits = (hits != NULL) ? g_hash_table_size(hits) : 0;
+	pthread_mutex_unlock(&warm_mutex);
+}
+
+
+// Log the statistics
+void warm_report(void) {
+	warm_stats st;
+	char tmp[300];
+
+	if (snap_path == NULL)
+		return;
+	warm_get_stats(&st);
+	snprintf(tmp, sizeof(tmp), "Warm state: snapshot %llu (%lu written now), %d servers and %d Hits known, "
+			"%lu records restored (%lu bad sections), %lu Queries answered with a known Hit\n", st.generation,
+			st.saves, st.servers, st.hits, st.restored, st.bad_sections, st.hit_answers);
+	Log(tmp);
+}
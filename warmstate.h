@@ -0,0 +1,86 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * warmstate.h
+ *
+ * Header file of the warm state: what the gateway learned about the servers
+ *    (transfer rate and failed connections), the Hits that answered recent
+ *    Queries and the index of the content cache are written periodically to a
+ *    snapshot file, and read back when the gateway starts, so it does not
+ *    start cold after a restart. The snapshot has a format version and a
+ *    CRC-32 per section; a section that fails the check is ignored.
+\*****************************************************************************/
+
+#ifndef INCL_WARMSTATE_H
+#define INCL_WARMSTATE_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "cache.h"
+
+struct hit_server;
+
+#define WARM_DEFAULT_PERIOD		30000	// Default period writing the snapshot (ms)
+#define WARM_DEFAULT_HIT_TTL	3600	// Default time a Hit is used to answer Queries (s)
+#define WARM_MAX_SERVERS		1024	// Servers remembered
+#define WARM_MAX_HITS			4096	// Hits remembered
+#define WARM_HIT_SERVERS		4		// Servers remembered per Hit
+#define WARM_RATE_EWMA			0.3		// Weight of a new transfer in a server's rate
+
+// Warm state statistics
+typedef struct warm_stats {
+	unsigned long long generation;	// Snapshots written (also by the previous runs)
+	unsigned long saves;			// Snapshots written by this run
+	unsigned long restored;			// Records read from the snapshot
+	unsigned long bad_sections;		// Sections ignored (wrong checksum or size)
+	unsigned long hit_answers;		// Queries answered with a remembered Hit
+	int servers;					// Servers remembered
+	int hits;						// Hits remembered
+} warm_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Open the snapshot 'path' (NULL - off) and write it every 'period' ms; its sections are read
+// when first used. Called when the gateway starts; the state is kept while it is turned off/on
+void warm_init(const char *path, long period);
+// Write the snapshot and stop the periodic writes
+void warm_close(void);
+// Write the snapshot now; returns FALSE if it failed
+gboolean warm_save(void);
+
+// Record a transfer of 'bytes' in 'usec' from 'server' ("ip-port")
+void warm_server_result(const char *server, unsigned long long bytes, gint64 usec);
+// Record a failed connection to 'server' ("ip-port")
+void warm_server_failed(const char *server);
+// Order the 'n' servers: the fastest known first, then the unknown, then the ones failing
+void warm_rank_servers(struct hit_server *servers, int n);
+
+// Record a Hit for the file 'name', for the Queries from the clients of the domain 'cli_ipv6' in the
+// group pair 'group' (servers as IPv4-mapped for IPv4)
+void warm_hit_add(const char *name, gboolean cli_ipv6, int group, uint32_t fhash, unsigned long long flen,
+		const struct in6_addr *ip, u_short port);
+// Look up a recent Hit for 'name', for a Query from a client of the domain 'cli_ipv6' in the group
+// pair 'group': fills 'fhash', 'flen' and up to 'max' servers, and returns their number (0 - none, or
+// its servers are failing)
+int warm_hit_lookup(const char *name, gboolean cli_ipv6, int group, uint32_t *fhash, unsigned long long *flen,
+		struct hit_server *servers, int max);
+// Count a Query answered with a remembered Hit
+void warm_hit_used(void);
+
+// Read the content cache index saved for directory 'dir': calls 'fn' for each file, window then
+// main segment, most recently used first, and copies the frequency sketch ('len' bytes) to
+// 'sketch'. Returns the number of files
+int warm_cache_restore(const char *dir, cache_visit_fn fn, void *data, uint8_t *sketch, size_t len,
+		unsigned long *additions);
+
+// Current statistics
+void warm_get_stats(warm_stats *st);
+// Log the statistics
+void warm_report(void);
+
+#endif
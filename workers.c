@@ -0,0 +1,711 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * workers.c
+ *
+ * Multi-process data plane
+ *
+ * The session table is mapped shared before the workers are forked. Each
+ *    slot goes FREE -> FILLING -> OFFERED (control plane) -> CLAIMING ->
+ *    RELAYING -> DONE or FAILED (worker) -> FREE (control plane); every
+ *    change of state is an atomic compare-and-swap, and only the side that
+ *    moved a slot to a state writes its fields in that state. The control
+ *    plane reads the table every WORKER_POLL_PERIOD ms in the main loop: it
+ *    binds the claimed slots to their Queries and the GUI, shows the progress
+ *    and frees the ended slots.
+ *
+ * The gateway process keeps a copy of each worker's listening sockets, so a
+ *    worker that dies does not take its accept queue with it: the connections
+ *    waiting there are accepted by its replacement. The workers never call
+ *    the GUI nor Log (they write to stderr), and use none of the locks of the
+ *    control plane; their sessions are bounded by socket timeouts with the
+ *    deadlines of the session reaper.
+\*****************************************************************************/
+
+#include <pthread.h>
+#include <gtk/gtk.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "sock.h"
+#include "gui.h"
+#include "callbacks.h"
+#include "callbacks_socket.h"
+#include "proxy_thread.h"
+#include "options.h"
+#include "workers.h"
+
+#define WORKER_NAME_MAX		256		// Maximum filename in a slot
+#define WORKER_CLAIM_TRIES	100		// Retries (1 ms apart) of a claim while slots are being filled
+
+// State of a slot
+enum { SLOT_FREE, SLOT_FILLING, SLOT_OFFERED, SLOT_CLAIMING, SLOT_RELAYING, SLOT_DONE, SLOT_FAILED };
+
+// Flags of a slot kept by the control plane (not shared)
+#define SEEN_QUERY		1		// Bound to its Query and GUI line
+#define SEEN_SERVER		2		// Server shown in the GUI
+
+// Session in the shared table
+typedef struct session_slot {
+	int state;						// SLOT_* (atomic)
+	int stop;						// The control plane asks the worker to stop (atomic)
+	int server;						// Server relaying, in 'servers' (-1 - none yet) (atomic)
+	pid_t worker;					// Worker that claimed it
+	int gui_id;						// Identifier of the session in the GUI (unique while it runs)
+	int n_servers;					// Servers in the Hits
+	uint16_t seq;					// Query sequence number
+	uint16_t cli_port;				// Client port
+	uint16_t group;					// Group pair of the Query
+	gboolean cli_ipv6;				// Client in the IPv6 domain
+	struct in6_addr sender;			// Address that sent the Query (IPv4-mapped for IPv4)
+	struct in6_addr cli_ip;			// Client address (IPv4-mapped for IPv4 clients)
+	unsigned long long flen;		// End of the bytes relayed (atomic)
+	unsigned long long sent;		// Bytes sent to the client (atomic)
+	hit_server servers[MAX_HIT_SERVERS];	// Servers in the Hits, the first one first
+	char name[WORKER_NAME_MAX + 1];	// Filename
+} session_slot;
+
+// Connection accepted by a worker
+typedef struct worker_conn {
+	int sock;						// Client socket
+	gboolean cli_ipv6;				// Accepted on the IPv6 clients' socket
+	struct sockaddr_in6 addr;		// Client address
+} worker_conn;
+
+
+/*********************\
+|*  Local variables  *|
+\*********************/
+
+static gboolean running = FALSE;
+static session_slot *table = NULL;				// Shared session table
+static unsigned char flags[WORKER_TABLE_SLOTS];	// SEEN_* of each slot
+static int next_slot = 0;						// Where the next offer starts looking
+static int n_workers = 0;
+static pid_t pids[WORKERS_MAX];					// Worker processes (-1 - not running)
+static int listen4[WORKERS_MAX], listen6[WORKERS_MAX];	// Listening sockets of each worker
+static pid_t supervisor = 0;					// Gateway process
+static int worker_index = -1;					// In a worker: its index
+static workers_stats stats;
+static char tmp_buf[300];
+
+
+/*********************************\
+|*  Worker process (data plane)  *|
+\*********************************/
+
+// Set a send or receive timeout of 'ms' on the socket (0 - none)
+static void set_timeout(int sock, int opt, long ms) {
+	struct timeval tv;
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	setsockopt(sock, SOL_SOCKET, opt, &tv, sizeof(tv));
+}
+
+// Read exactly 'n' bytes; returns FALSE if the connection ended or timed out before
+static gboolean read_full(int sock, void *buf, size_t n) {
+	char *pt = (char *) buf;
+
+	while (n > 0) {
+		ssize_t r = read(sock, pt, n);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			return FALSE;
+		}
+		pt += r;
+		n -= r;
+	}
+	return TRUE;
+}
+
+// Write exactly 'n' bytes; returns FALSE if the connection failed or timed out before
+static gboolean write_full(int sock, const void *buf, size_t n) {
+	const char *pt = (const char *) buf;
+
+	while (n > 0) {
+		ssize_t w = write(sock, pt, n);
+		if (w <= 0) {
+			if ((w < 0) && (errno == EINTR))
+				continue;
+			return FALSE;
+		}
+		pt += w;
+		n -= w;
+	}
+	return TRUE;
+}
+
+// Claim the slot offered for (name, seq, cli_ipv6); when it is offered for several group pairs,
+// the one whose Query was sent from the client's address. Returns its index, or -1 if none (or
+// several) match
+static int claim_slot(const char *name, uint16_t seq, gboolean cli_ipv6, int gui_id, const worker_conn *c) {
+	int tries, i;
+
+	for (tries = 0; tries < WORKER_CLAIM_TRIES; tries++) {
+		gboolean filling = FALSE;
+		int any = -1, from = -1, n_any = 0, n_from = 0;
+
+		for (i = 0; i < WORKER_TABLE_SLOTS; i++) {
+			session_slot *s = &table[i];
+			int state = __atomic_load_n(&s->state, __ATOMIC_SEQ_CST);
+			if (state == SLOT_FILLING)
+				filling = TRUE;
+			if ((state != SLOT_OFFERED) || (s->seq != seq) || (s->cli_ipv6 != cli_ipv6) || strcmp(s->name, name))
+				continue;
+			any = i;
+			n_any++;
+			if (IN6_ARE_ADDR_EQUAL(&s->sender, &c->addr.sin6_addr)) {
+				from = i;
+				n_from++;
+			}
+		}
+		i = (n_any == 1) ? any : ((n_from == 1) ? from : -1);
+		if (i >= 0) {
+			session_slot *s = &table[i];
+			int expected = SLOT_OFFERED;
+			if (!__atomic_compare_exchange_n(&s->state, &expected, SLOT_CLAIMING, FALSE, __ATOMIC_SEQ_CST,
+					__ATOMIC_SEQ_CST))
+				continue;
+			if ((s->seq != seq) || (s->cli_ipv6 != cli_ipv6) || strcmp(s->name, name)) {
+				// Reused for another session since it was compared
+				__atomic_store_n(&s->state, SLOT_OFFERED, __ATOMIC_SEQ_CST);
+				continue;
+			}
+			s->worker = getpid();
+			s->gui_id = gui_id;
+			memcpy(&s->cli_ip, &c->addr.sin6_addr, sizeof(struct in6_addr));
+			s->cli_port = ntohs(c->addr.sin6_port);
+			__atomic_store_n(&s->server, -1, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&s->stop, FALSE, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&s->flen, 0, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&s->sent, 0, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&s->state, SLOT_RELAYING, __ATOMIC_SEQ_CST);
+			return i;
+		}
+		if (!filling)
+			break;
+		usleep(1000);	// A slot being filled may be this one
+	}
+	return -1;
+}
+
+// Connect to the first server of the slot that answers; returns the socket (-1 - none)
+static int connect_slot_server(session_slot *s) {
+	int i, sock;
+
+	for (i = 0; i < s->n_servers; i++) {
+		sock = socket(AF_INET6, SOCK_STREAM, 0);
+		if (sock < 0)
+			return -1;
+		if (options.connect_timeout > 0)
+			set_timeout(sock, SO_SNDTIMEO, options.connect_timeout);	// connect() gives up after it
+		if (connect(sock, (struct sockaddr *) &s->servers[i].addr, sizeof(s->servers[i].addr)) == 0) {
+			__atomic_store_n(&s->server, i, __ATOMIC_SEQ_CST);
+			return sock;
+		}
+		close(sock);
+	}
+	return -1;
+}
+
+// Session of a worker: reads the request, claims its slot and relays the file from the server
+static void *worker_session(void *ptr) {
+	worker_conn *c = (worker_conn *) ptr;
+	int sock4 = c->sock, sock6 = -1, slot = -1;
+	char name[WORKER_NAME_MAX + 1];
+	uint16_t seq;
+	int16_t namelen;
+	gboolean ranged, completed = FALSE;
+	unsigned long long offset = 0, length = 0, flen = 0, sent = 0, end = 0;
+	char *buf = NULL;
+
+	// Request header
+	if (options.header_timeout > 0)
+		set_timeout(sock4, SO_RCVTIMEO, options.header_timeout);
+	if (!read_full(sock4, &seq, sizeof(seq)) || !read_full(sock4, &namelen, sizeof(namelen)))
+		goto out;
+	ranged = (namelen < 0);
+	if (ranged)
+		namelen = -namelen;
+	if ((namelen <= 0) || (namelen > WORKER_NAME_MAX) || !read_full(sock4, name, namelen))
+		goto out;
+	name[namelen] = '\0';
+	if (ranged && (!read_full(sock4, &offset, sizeof(offset)) || !read_full(sock4, &length, sizeof(length)) ||
+			(length == 0)))
+		goto out;
+
+	slot = claim_slot(name, seq, c->cli_ipv6, ((worker_index + 1) << 16) | sock4, c);
+	if (slot < 0) {
+		fprintf(stderr, "worker %d: no pending Query for '%s'(%hu)\n", worker_index, name, seq);
+		goto out;
+	}
+	session_slot *s = &table[slot];
+
+	// Server
+	sock6 = connect_slot_server(s);
+	if (sock6 < 0) {
+		fprintf(stderr, "worker %d: failed connecting to the file servers of '%s'(%hu)\n", worker_index, name, seq);
+		goto out;
+	}
+	if (options.first_byte_timeout > 0)
+		set_timeout(sock6, SO_RCVTIMEO, options.first_byte_timeout);
+	if (!write_file_request(sock6, seq, name, offset, length) || !read_full(sock6, &flen, sizeof(flen)) ||
+			!write_full(sock4, &flen, sizeof(flen)))
+		goto out;
+	set_timeout(sock6, SO_RCVTIMEO, options.stall_timeout);
+	if (options.idle_timeout > 0)
+		set_timeout(sock4, SO_SNDTIMEO, options.idle_timeout);
+
+	// Relay
+	end = flen;
+	if (ranged) {
+		// The server sends the bytes [offset, offset+length) of the file
+		sent = MIN(offset, flen);
+		end = (length > flen - sent) ? flen : sent + length;
+	}
+	__atomic_store_n(&s->sent, sent, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&s->flen, end, __ATOMIC_SEQ_CST);
+	buf = (char *) malloc(WORKER_BUFLEN);
+	while ((buf != NULL) && (sent < end) && !__atomic_load_n(&s->stop, __ATOMIC_SEQ_CST)) {
+		ssize_t n = read(sock6, buf, (size_t) MIN((unsigned long long) WORKER_BUFLEN, end - sent));
+		if ((n <= 0) || !write_full(sock4, buf, n))
+			break;
+		sent += n;
+		__atomic_store_n(&s->sent, sent, __ATOMIC_SEQ_CST);
+	}
+	completed = (buf != NULL) && (sent == end);
+
+out:
+	if (slot >= 0)
+		__atomic_store_n(&table[slot].state, completed ? SLOT_DONE : SLOT_FAILED, __ATOMIC_SEQ_CST);
+	free(buf);
+	if (sock6 >= 0)
+		close(sock6);
+	close(sock4);
+	free(c);
+	return NULL;
+}
+
+// Close the descriptors inherited from the gateway process, except the worker's listening sockets
+static void close_inherited(int keep4, int keep6) {
+	int fds[1024], n = 0, i;
+	struct dirent *d;
+	DIR *dir = opendir("/proc/self/fd");
+
+	if (dir == NULL)
+		return;
+	while (((d = readdir(dir)) != NULL) && (n < 1024)) {
+		int fd = atoi(d->d_name);
+		if ((fd > 2) && (fd != keep4) && (fd != keep6) && (fd != dirfd(dir)))
+			fds[n++] = fd;
+	}
+	closedir(dir);
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+}
+
+// Main function of worker process 'id': accepts the connections of its sockets and runs a
+// thread per session, until the gateway process ends or stops it
+static void worker_main(int id) {
+	struct pollfd pfd[2];
+	pthread_attr_t attr;
+	int i;
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);	// Ends with the gateway process
+	if (getppid() != supervisor)
+		_exit(0);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	worker_index = id;
+	close_inherited(listen4[id], listen6[id]);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pfd[0].fd = listen4[id];
+	pfd[1].fd = listen6[id];
+	for (;;) {
+		pfd[0].events = pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("worker: poll failed");
+			_exit(1);
+		}
+		for (i = 0; i < 2; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			// Accepts until the queue is empty (non-blocking listening sockets)
+			for (;;) {
+				worker_conn *c = (worker_conn *) malloc(sizeof(worker_conn));
+				socklen_t len = sizeof(c->addr);
+				pthread_t tid;
+
+				if (c == NULL)
+					break;
+				c->sock = accept(pfd[i].fd, (struct sockaddr *) &c->addr, &len);
+				if (c->sock < 0) {
+					free(c);
+					break;
+				}
+				c->cli_ipv6 = (i == 1);
+				if (pthread_create(&tid, &attr, worker_session, c) != 0) {
+					close(c->sock);
+					free(c);
+				}
+			}
+		}
+	}
+}
+
+// Fork worker process 'id'; returns its pid (-1 - failed)
+static pid_t spawn_worker(int id) {
+	pid_t pid = fork();
+
+	if (pid == 0)
+		worker_main(id);	// Does not return
+	if (pid < 0)
+		perror("Failed starting a worker process");
+	return pid;
+}
+
+
+/***********************************\
+|*  Gateway process (control plane) *|
+\***********************************/
+
+// Create a listening socket of the SO_REUSEPORT group of 'port' (0 - new port); returns -1 on failure
+static int reuseport_listener(u_short port) {
+	struct sockaddr_in6 addr;
+	int v = 1, off = 0;
+	int sock = socket(AF_INET6, SOCK_STREAM, 0);
+
+	if (sock < 0) {
+		perror("Failed opening a worker listening socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	// IPv4 clients arrive as IPv4-mapped addresses, as in the single process sockets
+	if ((setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) < 0) ||
+			(setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) ||
+			(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+		perror("Failed binding a worker listening socket");
+		close(sock);
+		return -1;
+	}
+	if (!listen_server_socket_tcp(sock)) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Close the listening sockets kept for the workers
+static void close_listeners(void) {
+	int i;
+
+	for (i = 0; i < WORKERS_MAX; i++) {
+		if (listen4[i] >= 0)
+			close(listen4[i]);
+		if (listen6[i] >= 0)
+			close(listen6[i]);
+		listen4[i] = listen6[i] = -1;
+	}
+}
+
+// Replace the workers that ended, failing the sessions they were relaying
+static void check_workers(void) {
+	int i, j, status;
+	pid_t r;
+
+	for (i = 0; i < n_workers; i++) {
+		if (pids[i] > 0) {
+			status = 0;
+			r = waitpid(pids[i], &status, WNOHANG);
+			if ((r == 0) || ((r < 0) && (errno == EINTR)))
+				continue;	// Running
+			if (r < 0)	// Already reaped elsewhere: its status is lost
+				sprintf(tmp_buf, "Worker %d (pid %d) ended - replaced\n", i, (int) pids[i]);
+			else if (WIFSIGNALED(status))
+				sprintf(tmp_buf, "Worker %d (pid %d) killed by signal %d - replaced\n", i, (int) pids[i],
+						WTERMSIG(status));
+			else
+				sprintf(tmp_buf, "Worker %d (pid %d) exited with status %d - replaced\n", i, (int) pids[i],
+						WEXITSTATUS(status));
+			Log(tmp_buf);
+			for (j = 0; j < WORKER_TABLE_SLOTS; j++) {
+				int state = __atomic_load_n(&table[j].state, __ATOMIC_SEQ_CST);
+				if (((state == SLOT_CLAIMING) || (state == SLOT_RELAYING)) && (table[j].worker == pids[i]))
+					__atomic_store_n(&table[j].state, SLOT_FAILED, __ATOMIC_SEQ_CST);
+			}
+			stats.restarts++;
+		}
+		pids[i] = spawn_worker(i);	// Retried in the next poll if it fails
+	}
+}
+
+// Copy the servers of the Query to the slot, the first one first
+static void fill_servers(session_slot *s, Query *q) {
+	s->n_servers = get_Query_hits(q, s->servers, MAX_HIT_SERVERS);
+}
+
+// Timer callback that reads the session table: binds the claimed sessions to their Queries and
+// GUI lines, shows their progress and frees the ended ones
+static gboolean callback_workers(gpointer data) {
+	char str[INET6_ADDRSTRLEN];
+	int i;
+
+	if (!running)
+		return FALSE;
+	check_workers();
+	for (i = 0; i < WORKER_TABLE_SLOTS; i++) {
+		session_slot *s = &table[i];
+		int state = __atomic_load_n(&s->state, __ATOMIC_SEQ_CST), expected = state;
+		Query *q;
+
+		if ((state == SLOT_FREE) || (state == SLOT_FILLING) || (state == SLOT_CLAIMING))
+			continue;
+		q = locate_in_QueryList_group(s->name, s->seq, s->cli_ipv6, s->group);
+
+		switch (state) {
+		case SLOT_OFFERED:
+			if (q == NULL) {
+				// The Query ended before the client connected
+				__atomic_compare_exchange_n(&s->state, &expected, SLOT_FREE, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			} else if ((q->n_hits > s->n_servers) && (s->n_servers < MAX_HIT_SERVERS) &&
+					__atomic_compare_exchange_n(&s->state, &expected, SLOT_FILLING, FALSE, __ATOMIC_SEQ_CST,
+					__ATOMIC_SEQ_CST)) {
+				// Hits received after the one relayed
+				fill_servers(s, q);
+				__atomic_store_n(&s->state, SLOT_OFFERED, __ATOMIC_SEQ_CST);
+			}
+			break;
+
+		case SLOT_RELAYING:
+			if ((q != NULL) && !(flags[i] & SEEN_QUERY)) {
+				// The client connected
+				flags[i] |= SEEN_QUERY;
+				stop_query_timer(q);
+				set_query_state(q, S_F_TRANSF);
+				GUI_update_cli_details_Proxy(s->name, s->seq, s->gui_id, addr_ipv6(&s->cli_ip), s->cli_port);
+			} else if ((q == NULL) && (flags[i] & SEEN_QUERY)) {
+				__atomic_store_n(&s->stop, TRUE, __ATOMIC_SEQ_CST);	// The Query was stopped
+				break;
+			}
+			int server = __atomic_load_n(&s->server, __ATOMIC_SEQ_CST);
+			if ((server >= 0) && !(flags[i] & SEEN_SERVER)) {
+				flags[i] |= SEEN_SERVER;
+				inet_ntop(AF_INET6, &s->servers[server].addr.sin6_addr, str, sizeof(str));
+				GUI_update_serv_details_Proxy(s->gui_id, str, ntohs(s->servers[server].addr.sin6_port));
+			}
+			unsigned long long flen = __atomic_load_n(&s->flen, __ATOMIC_SEQ_CST);
+			if (flen > 0)
+				GUI_update_transf_Proxy(s->gui_id, (int) (100 * __atomic_load_n(&s->sent, __ATOMIC_SEQ_CST) / flen));
+			break;
+
+		case SLOT_DONE:
+		case SLOT_FAILED:
+			stats.sessions++;
+			if (state == SLOT_FAILED)
+				stats.failed++;
+			stats.bytes += __atomic_load_n(&s->sent, __ATOMIC_SEQ_CST);
+			GUI_del_Proxy(s->name, s->seq, s->gui_id, FALSE);
+			if (q != NULL) {
+				// Ended before the poll bound it: the Query still waits for the connection
+				if (!(flags[i] & SEEN_QUERY))
+					stop_query_timer(q);
+				del_Query(q, FALSE);
+			}
+			flags[i] = 0;
+			__atomic_store_n(&s->state, SLOT_FREE, __ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+	return TRUE;
+}
+
+
+// Replace the TCP server sockets by a SO_REUSEPORT group and start 'n' worker processes,
+// each accepting on its own sockets. Returns FALSE (and keeps the single-process mode) if
+// they could not be started
+gboolean workers_start(int n) {
+	u_short port4 = 0, port6 = 0;
+	int i;
+
+	if (running)
+		return TRUE;
+	n = MIN(n, WORKERS_MAX);
+	if (n <= 0)
+		return FALSE;
+	memset(listen4, -1, sizeof(listen4));
+	memset(listen6, -1, sizeof(listen6));
+	table = (session_slot *) mmap(NULL, WORKER_TABLE_SLOTS * sizeof(session_slot), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		perror("Failed mapping the session table");
+		table = NULL;
+		return FALSE;
+	}
+
+	// One socket of each group per worker, on new ports: the current sockets have no SO_REUSEPORT
+	for (i = 0; i < n; i++) {
+		listen4[i] = reuseport_listener(port4);
+		listen6[i] = reuseport_listener(port6);
+		if ((listen4[i] < 0) || (listen6[i] < 0)) {
+			Log("Failed creating the listening sockets of the workers - single process data plane\n");
+			close_listeners();
+			munmap(table, WORKER_TABLE_SLOTS * sizeof(session_slot));
+			table = NULL;
+			return FALSE;
+		}
+		port4 = get_portnumber(listen4[0]);
+		port6 = get_portnumber(listen6[0]);
+	}
+	close_sockTCP();
+	portTCP = port4;
+	portTCP6 = port6;
+	set_PortTCP(portTCP);
+
+	memset(flags, 0, sizeof(flags));
+	memset(&stats, 0, sizeof(stats));
+	supervisor = getpid();
+	n_workers = n;
+	for (i = 0; i < n; i++)
+		pids[i] = spawn_worker(i);
+	running = TRUE;
+	g_timeout_add(WORKER_POLL_PERIOD, callback_workers, NULL);
+	sprintf(tmp_buf, "Data plane: %d worker processes; TCP port %hu, and %hu for IPv6 clients\n", n, portTCP,
+			portTCP6);
+	Log(tmp_buf);
+	return TRUE;
+}
+
+
+// Stop the worker processes, aborting their sessions, and free the session table
+// called_from_GUI - use TRUE if called from a GUI event; FALSE otherwise
+void workers_stop(gboolean called_from_GUI) {
+	int i;
+
+	if (!running)
+		return;
+	running = FALSE;	// Stops the poll
+	for (i = 0; i < n_workers; i++)
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	for (i = 0; i < n_workers; i++)
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	n_workers = 0;
+	close_listeners();
+	for (i = 0; i < WORKER_TABLE_SLOTS; i++) {
+		int state = table[i].state;
+		if ((state >= SLOT_CLAIMING) && (table[i].gui_id != 0))
+			GUI_del_Proxy(table[i].name, table[i].seq, table[i].gui_id, called_from_GUI);
+	}
+	munmap(table, WORKER_TABLE_SLOTS * sizeof(session_slot));
+	table = NULL;
+}
+
+
+// TRUE while the sessions are relayed by worker processes
+gboolean workers_running(void) {
+	return running;
+}
+
+
+// Offer the session of the Query, whose Hit is being relayed, to the workers; returns FALSE if
+// the table is full
+gboolean workers_offer(Query *q) {
+	int i;
+
+	if (strlen(q->name) > WORKER_NAME_MAX)
+		return FALSE;
+	for (i = 0; i < WORKER_TABLE_SLOTS; i++) {
+		int n = (next_slot + i) % WORKER_TABLE_SLOTS, expected = SLOT_FREE;
+		session_slot *s = &table[n];
+		if (!__atomic_compare_exchange_n(&s->state, &expected, SLOT_FILLING, FALSE, __ATOMIC_SEQ_CST,
+				__ATOMIC_SEQ_CST))
+			continue;
+		strcpy(s->name, q->name);
+		s->seq = q->seq;
+		s->cli_ipv6 = q->is_ipv6;
+		s->group = q->group;
+		get_Query_sender(q, &s->sender);
+		s->gui_id = 0;
+		fill_servers(s, q);
+		flags[n] = 0;
+		__atomic_store_n(&s->state, SLOT_OFFERED, __ATOMIC_SEQ_CST);
+		next_slot = (n + 1) % WORKER_TABLE_SLOTS;
+		stats.offered++;
+		return TRUE;
+	}
+	Log("ERROR - The session table of the workers is full\n");
+	return FALSE;
+}
+
+
+// Ask the worker relaying (filename, seq) to stop; returns FALSE if no worker is relaying it
+gboolean workers_stop_session(const char *filename, uint16_t seq) {
+	int i;
+
+	if (!running)
+		return FALSE;
+	for (i = 0; i < WORKER_TABLE_SLOTS; i++) {
+		session_slot *s = &table[i];
+		if ((__atomic_load_n(&s->state, __ATOMIC_SEQ_CST) == SLOT_RELAYING) && (s->seq == seq) &&
+				!strcmp(s->name, filename)) {
+			__atomic_store_n(&s->stop, TRUE, __ATOMIC_SEQ_CST);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+// Current statistics
+void workers_get_stats(workers_stats *st) {
+	int i;
+
+	memcpy(st, &stats, sizeof(workers_stats));
+	st->workers = 0;
+	st->slots = 0;
+	if (!running)
+		return;
+	for (i = 0; i < n_workers; i++)
+		if (pids[i] > 0)
+			st->workers++;
+	for (i = 0; i < WORKER_TABLE_SLOTS; i++)
+		if (__atomic_load_n(&table[i].state, __ATOMIC_SEQ_CST) != SLOT_FREE)
+			st->slots++;
+}
+
+
+// Log the statistics
+void workers_report(void) {
+	workers_stats st;
+	char tmp[250];
+
+	workers_get_stats(&st);
+	if ((st.offered == 0) && (st.workers == 0))
+		return;
+	snprintf(tmp, sizeof(tmp), "Workers: %d running, %lu replaced; %lu Hits offered, %lu sessions (%lu failed), "
+			"%llu KB; %d/%d table slots in use\n", st.workers, st.restarts, st.offered, st.sessions, st.failed,
+			st.bytes >> 10, st.slots, WORKER_TABLE_SLOTS);
+	Log(tmp);
+}
@@ -0,0 +1,65 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC - FCT NOVA  2022/2023
+ *
+ * workers.h
+ *
+ * Header file of the multi-process data plane: with GW_WORKERS, the gateway
+ *    process keeps the control plane (multicast, Queries, timers, GUI) and
+ *    pre-forks worker processes that accept the TCP connections, each on its
+ *    own socket of a SO_REUSEPORT group, and relay the files. A Hit relayed to
+ *    a client is offered in a session table in shared memory, keyed by
+ *    (filename, seq, client domain); the worker that accepts the connection
+ *    claims it there and publishes its progress. A crashed worker only takes
+ *    its own sessions down, and is replaced.
+\*****************************************************************************/
+
+#ifndef INCL_WORKERS_H
+#define INCL_WORKERS_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+struct Query;
+
+#define WORKERS_MAX				64		// Maximum number of worker processes
+#define WORKER_TABLE_SLOTS		1024	// Sessions offered or running at a time
+#define WORKER_POLL_PERIOD		100		// Period reading the session table in the main loop (ms)
+#define WORKER_BUFLEN			(64L << 10)	// Relay buffer of a worker session
+
+// Worker statistics
+typedef struct workers_stats {
+	int workers;					// Worker processes running
+	unsigned long restarts;			// Workers replaced after ending unexpectedly
+	unsigned long offered;			// Hits offered to the workers
+	unsigned long sessions;			// Sessions ended
+	unsigned long failed;			// ... before the end of the file
+	unsigned long long bytes;		// Bytes sent to the clients
+	int slots;						// Slots in use
+} workers_stats;
+
+
+/*************\
+|* Functions *|
+\*************/
+
+// Replace the TCP server sockets by a SO_REUSEPORT group and start 'n' worker processes,
+// each accepting on its own sockets. Returns FALSE (and keeps the single-process mode) if
+// they could not be started
+gboolean workers_start(int n);
+// Stop the worker processes, aborting their sessions, and free the session table
+// called_from_GUI - use TRUE if called from a GUI event; FALSE otherwise
+void workers_stop(gboolean called_from_GUI);
+// TRUE while the sessions are relayed by worker processes
+gboolean workers_running(void);
+// Offer the session of the Query, whose Hit is being relayed, to the workers; returns FALSE if
+// the table is full
+gboolean workers_offer(struct Query *q);
+// Ask the worker relaying (filename, seq) to stop; returns FALSE if no worker is relaying it
+gboolean workers_stop_session(const char *filename, uint16_t seq);
+// Current statistics
+void workers_get_stats(workers_stats *st);
+// Log the statistics
+void workers_report(void);
+
+#endif